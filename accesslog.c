@@ -0,0 +1,129 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "accesslog.h"
+#include "listener.h"
+
+static void access_log_write(int fd, const char *data, int len) {
+    while(len > 0) {
+        int wr = write(fd, data, len);
+        if(wr < 0) {
+            if(errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        data += wr;
+        len -= wr;
+    }
+}
+
+// Format records and write them in large batches, nothing here runs on the request path
+static void *access_log_thread(void *arg) {
+    struct ACCESS_LOG *log = arg;
+    struct timespec interval = {.tv_sec = 0, .tv_nsec = ACCESS_LOG_FLUSH_MS * 1000000};
+    time_t time_sec = 0;
+    char time_str[32] = {0};
+    uint64_t reported = 0;
+
+    while(1) {
+        int stop = __atomic_load_n(&log->stop, __ATOMIC_ACQUIRE);
+        uint64_t head = __atomic_load_n(&log->head, __ATOMIC_ACQUIRE);
+        int len = 0;
+
+        while(log->tail != head) {
+            if(len > ACCESS_LOG_BUFFER_SIZE - ACCESS_LOG_LINE_SIZE) {
+                access_log_write(log->fd, log->buffer, len);
+                len = 0;
+            }
+
+            struct ACCESS_LOG_RECORD *rec = &log->records[log->tail & (ACCESS_LOG_RING_SIZE - 1)];
+            if(rec->time.tv_sec != time_sec) {
+                struct tm tm;
+                time_sec = rec->time.tv_sec;
+                localtime_r(&time_sec, &tm);
+                strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &tm);
+            }
+
+            char addr[LISTENER_ADDRSTRLEN];
+            int port;
+            listener_address_str((struct sockaddr *)&rec->addr, addr, &port);
+            len += snprintf(log->buffer + len, ACCESS_LOG_LINE_SIZE, "%i> [%s] %s \"%s %s\" %i %lu %u.%03ums\n", log->pid, time_str, addr,
+                rec->method[0] ? rec->method : "-", rec->path[0] ? rec->path : "-", rec->status, (unsigned long)rec->bytes,
+                rec->duration_us / 1000, rec->duration_us % 1000);
+
+            __atomic_store_n(&log->tail, log->tail + 1, __ATOMIC_RELEASE);
+        }
+
+        uint64_t dropped = __atomic_load_n(&log->dropped, __ATOMIC_RELAXED);
+        if(dropped != reported) {
+            len += snprintf(log->buffer + len, ACCESS_LOG_LINE_SIZE, "%i> %lu access log records dropped\n", log->pid, (unsigned long)(dropped - reported));
+            reported = dropped;
+        }
+
+        if(len) {
+            access_log_write(log->fd, log->buffer, len);
+        }
+        if(stop) {
+            break;
+        }
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+int access_log_start(struct ACCESS_LOG *log, int fd) {
+    if(log == NULL || fd < 0) {
+        return ACCESS_LOG_PARAM_ERROR;
+    }
+
+    memset(log, 0, sizeof(struct ACCESS_LOG));
+    log->records = calloc(ACCESS_LOG_RING_SIZE, sizeof(struct ACCESS_LOG_RECORD));
+    log->buffer = malloc(ACCESS_LOG_BUFFER_SIZE);
+    if(log->records == NULL || log->buffer == NULL) {
+        free(log->records);
+        free(log->buffer);
+        log->records = NULL;
+        return ACCESS_LOG_MALLOC_ERROR;
+    }
+    log->fd = fd;
+    log->pid = getpid();
+
+    if(pthread_create(&log->thread, NULL, access_log_thread, log) != 0) {
+        free(log->records);
+        free(log->buffer);
+        log->records = NULL;
+        return ACCESS_LOG_THREAD_ERROR;
+    }
+    return ACCESS_LOG_OK;
+}
+
+struct ACCESS_LOG_RECORD *access_log_reserve(struct ACCESS_LOG *log) {
+    if(log->records == NULL) {
+        return NULL;
+    }
+    if(log->head - __atomic_load_n(&log->tail, __ATOMIC_ACQUIRE) == ACCESS_LOG_RING_SIZE) {
+        __atomic_fetch_add(&log->dropped, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    return &log->records[log->head & (ACCESS_LOG_RING_SIZE - 1)];
+}
+
+void access_log_commit(struct ACCESS_LOG *log) {
+    __atomic_store_n(&log->head, log->head + 1, __ATOMIC_RELEASE);
+}
+
+void access_log_stop(struct ACCESS_LOG *log) {
+    if(log->records == NULL) {
+        return;
+    }
+    __atomic_store_n(&log->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(log->thread, NULL);
+    free(log->records);
+    free(log->buffer);
+    log->records = NULL;
+}
@@ -0,0 +1,61 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _ACCESSLOG_H
+#define _ACCESSLOG_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define ACCESS_LOG_RING_SIZE    8192
+#define ACCESS_LOG_PATH_SIZE    128
+#define ACCESS_LOG_BUFFER_SIZE  (64 << 10)
+#define ACCESS_LOG_FLUSH_MS     25
+#define ACCESS_LOG_LINE_SIZE    512
+
+#define ACCESS_LOG_PARAM_ERROR   -1
+#define ACCESS_LOG_MALLOC_ERROR  -2
+#define ACCESS_LOG_THREAD_ERROR  -3
+#define ACCESS_LOG_OK             0
+
+struct ACCESS_LOG_RECORD {
+    struct timespec time;
+    uint64_t started_us;
+    uint32_t duration_us;
+    // Response code, or negative request error if nothing was sent
+    int32_t status;
+    uint64_t bytes;
+    char method[8];
+    struct sockaddr_in6 addr;
+    char path[ACCESS_LOG_PATH_SIZE];
+};
+
+// Single producer (worker), single consumer (flush thread) ring of records
+struct ACCESS_LOG {
+    struct ACCESS_LOG_RECORD *records;
+    char *buffer;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t dropped;
+    int fd;
+    int pid;
+    int stop;
+    pthread_t thread;
+};
+
+// Allocate ring and start thread writing records to 'fd'
+// Return error code
+int access_log_start(struct ACCESS_LOG *log, int fd);
+
+// Get free record to fill, counts a drop if the ring is full
+// Return record or NULL
+struct ACCESS_LOG_RECORD *access_log_reserve(struct ACCESS_LOG *log);
+
+// Publish record returned by access_log_reserve()
+void access_log_commit(struct ACCESS_LOG *log);
+
+// Flush remaining records and stop thread
+void access_log_stop(struct ACCESS_LOG *log);
+
+#endif
@@ -0,0 +1,186 @@
+#!/bin/sh
+# Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+# End-to-end benchmark: start tinyhttp on a generated document root and run load scenarios.
+# Prints one JSON line per scenario to stdout and to $BENCH_OUTPUT if set.
+#
+# Environment: PORT, DURATION (seconds per scenario), CONNECTIONS, WORKERS, RATE (open loop rps),
+# CONNECTIONS_IDLE (idle keep-alive connections, needs file descriptor limit above it)
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+SERVER=${SERVER:-$BENCH_DIR/../tinyhttp}
+LOAD=${LOAD:-$BENCH_DIR/httpload}
+PAGELOAD=${PAGELOAD:-$BENCH_DIR/pageload}
+IDLECONN=${IDLECONN:-$BENCH_DIR/idleconn}
+PORT=${PORT:-9990}
+DURATION=${DURATION:-5}
+CONNECTIONS=${CONNECTIONS:-64}
+WORKERS=${WORKERS:-$(nproc)}
+RATE=${RATE:-10000}
+CONNECTIONS_IDLE=${CONNECTIONS_IDLE:-100000}
+
+ROOT=$(mktemp -d /tmp/tinyhttp-bench.XXXXXX)
+SOCKET=$ROOT/tinyhttp.sock
+SERVER_PID=
+
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        server_stop
+    fi
+    rm -rf "$ROOT"
+}
+trap cleanup EXIT INT TERM
+
+# Document root mirroring the routes of tinyhttp.conf
+mkdir -p "$ROOT/www/json" "$ROOT/www/html" "$ROOT/www/cgi"
+head -c 1024 /dev/zero | tr '\0' 'x' > "$ROOT/www/index.html"
+echo '{"bench": true}' > "$ROOT/www/json/file.json"
+head -c 4096 /dev/zero | tr '\0' 'y' > "$ROOT/www/html/page.html"
+head -c 65536 /dev/zero | tr '\0' 'z' > "$ROOT/www/html/large.html"
+# Page with 50 small assets for page load scenarios
+for i in $(seq 0 49); do
+    head -c 8192 /dev/zero | tr '\0' 'c' > "$ROOT/www/html/asset$i.css"
+done
+cat > "$ROOT/www/cgi/hello.sh" <<'CGI'
+#!/bin/sh
+echo "hello $QUERY_STRING"
+CGI
+chmod +x "$ROOT/www/cgi/hello.sh"
+
+# config_write <file> [extra options...]
+config_write() {
+    file=$1
+    shift
+    {
+        echo "listen 127.0.0.1:$PORT"
+        echo "listen unix:$SOCKET"
+        for option in "$@"; do
+            echo "$option"
+        done
+        echo "/                   text/html           index.html"
+        echo "/json/file.json     application/json    json/file.json"
+        echo "/html/              text/html           \$"
+        echo "/cgi/               text/plain          fastcgi"
+    } > "$file"
+}
+
+server_start() {
+    "$SERVER" -r "$ROOT/www" -c "$1" -w "$WORKERS" > "$ROOT/server.log" 2>&1 &
+    SERVER_PID=$!
+    for i in 1 2 3 4 5 6 7 8 9 10; do
+        "$LOAD" -p "$PORT" -c 1 -N 1 -d 1 > /dev/null 2>&1 && return 0
+        sleep 0.2
+    done
+    echo "tinyhttp did not start, see log:" >&2
+    cat "$ROOT/server.log" >&2
+    exit 1
+}
+
+server_stop() {
+    kill -QUIT "$SERVER_PID" 2>/dev/null
+    wait "$SERVER_PID" 2>/dev/null
+    SERVER_PID=
+}
+
+# run <name> [httpload options...]
+run() {
+    name=$1
+    shift
+    result=$("$LOAD" -n "$name" -d "$DURATION" "$@")
+    echo "$result"
+    if [ -n "$BENCH_OUTPUT" ]; then
+        echo "$result" >> "$BENCH_OUTPUT"
+    fi
+}
+
+# run_page <name> [pageload options...]
+run_page() {
+    name=$1
+    shift
+    result=$("$PAGELOAD" -n "$name" -d "$DURATION" "$@")
+    echo "$result"
+    if [ -n "$BENCH_OUTPUT" ]; then
+        echo "$result" >> "$BENCH_OUTPUT"
+    fi
+}
+
+# run_idle <name> [idleconn options...]
+run_idle() {
+    name=$1
+    shift
+    result=$("$IDLECONN" -n "$name" -P "$SERVER_PID" "$@")
+    echo "$result"
+    if [ -n "$BENCH_OUTPUT" ]; then
+        echo "$result" >> "$BENCH_OUTPUT"
+    fi
+}
+
+config_write "$ROOT/default.conf"
+server_start "$ROOT/default.conf"
+
+run exact_keepalive        -p "$PORT" -c "$CONNECTIONS" -U /
+run exact_json             -p "$PORT" -c "$CONNECTIONS" -U /json/file.json
+run wildcard_4k            -p "$PORT" -c "$CONNECTIONS" -U /html/page.html
+run wildcard_64k           -p "$PORT" -c "$CONNECTIONS" -U /html/large.html
+run exact_close            -p "$PORT" -c "$CONNECTIONS" -k 0 -U /
+run exact_pipeline16       -p "$PORT" -c "$CONNECTIONS" -P 16 -U /
+run exact_open_loop        -p "$PORT" -c "$CONNECTIONS" -R "$RATE" -U /
+run fastcgi                -p "$PORT" -c 4 -U "/cgi/hello.sh?bench=1"
+run unix_exact_keepalive   -u "$SOCKET" -c "$CONNECTIONS" -U /
+run unix_exact_close       -u "$SOCKET" -c "$CONNECTIONS" -k 0 -U /
+
+server_stop
+
+# Every socket option alone, scenario names start with the option. Compare p50 and p99 with
+# exact_keepalive, wildcard_64k and exact_close of the default config above
+for option in "tcp_nodelay on" "tcp_defer_accept 1" "tcp_fastopen 256" "tcp_notsent_lowat 16384" \
+        "listen_backlog 128" "so_sndbuf 262144" "so_rcvbuf 262144"; do
+    option_name=${option%% *}
+    config_write "$ROOT/$option_name.conf" "$option"
+    server_start "$ROOT/$option_name.conf"
+
+    run "${option_name}_exact_keepalive"  -p "$PORT" -c "$CONNECTIONS" -U /
+    run "${option_name}_wildcard_64k"     -p "$PORT" -c "$CONNECTIONS" -U /html/large.html
+    run "${option_name}_exact_close"      -p "$PORT" -c "$CONNECTIONS" -k 0 -U /
+
+    server_stop
+done
+
+# Same static scenarios with the latency options combined
+config_write "$ROOT/tuned.conf" "tcp_nodelay on" "tcp_defer_accept 1" "tcp_fastopen 256" "tcp_notsent_lowat 16384"
+server_start "$ROOT/tuned.conf"
+
+run tuned_exact_keepalive  -p "$PORT" -c "$CONNECTIONS" -U /
+run tuned_wildcard_64k     -p "$PORT" -c "$CONNECTIONS" -U /html/large.html
+run tuned_exact_close      -p "$PORT" -c "$CONNECTIONS" -k 0 -U /
+
+server_stop
+
+# Workers pinned to CPUs with connections steered to the worker on the receiving CPU,
+# compare p99 with exact_keepalive and exact_close
+config_write "$ROOT/steer.conf" "cpu_affinity steer"
+server_start "$ROOT/steer.conf"
+
+run steer_exact_keepalive  -p "$PORT" -c "$CONNECTIONS" -U /
+run steer_exact_close      -p "$PORT" -c "$CONNECTIONS" -k 0 -U /
+
+server_stop
+
+# Page with 50 assets on fresh connections: HTTP/1.1 over 6 connections against HTTP/2 over one,
+# compare connections_per_load and page load percentiles
+config_write "$ROOT/http2.conf" "http2 on"
+server_start "$ROOT/http2.conf"
+
+run_page pageload_http1  -p "$PORT" -U /html/page.html -A "/html/asset%i.css" -a 50
+run_page pageload_h2c    -p "$PORT" -U /html/page.html -A "/html/asset%i.css" -a 50 -2
+
+server_stop
+
+# Idle keep-alive connections after one request each, rss_per_connection_bytes is what workers
+# keep for every one of them
+config_write "$ROOT/idle.conf" "worker_connections $((CONNECTIONS_IDLE + 1024))"
+server_start "$ROOT/idle.conf"
+
+run_idle idle_keepalive  -p "$PORT" -c "$CONNECTIONS_IDLE" -U /
+
+server_stop
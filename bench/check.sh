@@ -0,0 +1,102 @@
+#!/bin/sh
+# Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+# End-to-end checks of request bodies: start tinyhttp with a proxy route in front of an upstream
+# echoing bodies back and send requests with curl. Prints one line per check, exits 1 on failure.
+#
+# Environment: PORT, UPSTREAM_PORT. Needs curl with HTTP/2 and python3
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+SERVER=${SERVER:-$BENCH_DIR/../tinyhttp}
+PORT=${PORT:-9980}
+UPSTREAM_PORT=${UPSTREAM_PORT:-9981}
+
+ROOT=$(mktemp -d /tmp/tinyhttp-check.XXXXXX)
+SERVER_PID=
+UPSTREAM_PID=
+FAILED=0
+
+cleanup() {
+    if [ -n "$SERVER_PID" ]; then
+        kill -QUIT "$SERVER_PID" 2>/dev/null
+        wait "$SERVER_PID" 2>/dev/null
+    fi
+    if [ -n "$UPSTREAM_PID" ]; then
+        kill "$UPSTREAM_PID" 2>/dev/null
+        wait "$UPSTREAM_PID" 2>/dev/null
+    fi
+    rm -rf "$ROOT"
+}
+trap cleanup EXIT INT TERM
+
+# Upstream answers "<method> <body length> <body>"
+cat > "$ROOT/upstream.py" <<'UPSTREAM'
+import http.server, sys
+
+class Echo(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def echo(self):
+        body = self.rfile.read(int(self.headers.get("Content-Length", 0)))
+        out = b"%s %d " % (self.command.encode(), len(body)) + body
+        self.send_response(200)
+        self.send_header("Content-Type", "text/plain")
+        self.send_header("Content-Length", str(len(out)))
+        self.end_headers()
+        self.wfile.write(out)
+
+    do_GET = do_POST = echo
+
+    def log_message(self, *args):
+        pass
+
+http.server.ThreadingHTTPServer(("127.0.0.1", int(sys.argv[1])), Echo).serve_forever()
+UPSTREAM
+python3 "$ROOT/upstream.py" "$UPSTREAM_PORT" 2> "$ROOT/upstream.log" &
+UPSTREAM_PID=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    curl -s -o /dev/null "http://127.0.0.1:$UPSTREAM_PORT/" && break
+    sleep 0.2
+done
+
+mkdir -p "$ROOT/www"
+cat > "$ROOT/check.conf" <<CONFIG
+listen 127.0.0.1:$PORT
+http2 on
+/api/ text/plain proxy
+upstream /api/ 127.0.0.1:$UPSTREAM_PORT
+CONFIG
+"$SERVER" -r "$ROOT/www" -c "$ROOT/check.conf" -w 1 > "$ROOT/server.log" 2>&1 &
+SERVER_PID=$!
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    curl -s -o /dev/null "http://127.0.0.1:$PORT/api/" && break
+    sleep 0.2
+done
+
+# check <name> <expected output> [curl options...]
+check() {
+    name=$1
+    expected=$2
+    shift 2
+    result=$(curl -s --max-time 5 "$@")
+    if [ "$result" = "$expected" ]; then
+        echo "ok    $name"
+    else
+        echo "FAIL  $name: expected '$(echo "$expected" | cut -c1-40)', got '$(echo "$result" | cut -c1-40)'"
+        FAILED=1
+    fi
+}
+
+URL=http://127.0.0.1:$PORT/api/echo
+head -c 3000 /dev/zero | tr '\0' 'b' > "$ROOT/body3k"
+head -c 5000 /dev/zero | tr '\0' 'b' > "$ROOT/body5k"
+
+check http1_post           "POST 5 hello"  -d hello "$URL"
+check h2c_get              "GET 0 "        --http2-prior-knowledge "$URL"
+check h2c_post             "POST 5 hello"  --http2-prior-knowledge -d hello "$URL"
+check h2c_post_3k          "POST 3000 $(cat "$ROOT/body3k")" --http2-prior-knowledge --data-binary @"$ROOT/body3k" "$URL"
+# Body larger than receive buffer is refused as in HTTP/1.1
+check h2c_post_too_large   "400"           --http2-prior-knowledge --data-binary @"$ROOT/body5k" -o /dev/null -w "%{http_code}" "$URL"
+
+exit $FAILED
@@ -0,0 +1,117 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "client.h"
+
+void client_hist_add(struct CLIENT_HIST *hist, uint64_t ns) {
+    unsigned int bucket;
+    if(ns < CLIENT_HIST_SUB_BUCKETS) {
+        bucket = ns;
+    }
+    else {
+        unsigned int e = 63 - __builtin_clzll(ns);
+        bucket = CLIENT_HIST_SUB_BUCKETS * (e - CLIENT_HIST_SUB_BITS + 1) + ((ns >> (e - CLIENT_HIST_SUB_BITS)) & (CLIENT_HIST_SUB_BUCKETS - 1));
+    }
+    ++hist->buckets[bucket];
+    if(ns > hist->max) {
+        hist->max = ns;
+    }
+}
+
+// Upper bound of bucket in nanoseconds
+static uint64_t client_hist_bound(unsigned int bucket) {
+    if(bucket < CLIENT_HIST_SUB_BUCKETS) {
+        return bucket + 1;
+    }
+    unsigned int e = bucket / CLIENT_HIST_SUB_BUCKETS + CLIENT_HIST_SUB_BITS - 1;
+    unsigned int sub = bucket % CLIENT_HIST_SUB_BUCKETS;
+    return (uint64_t)(CLIENT_HIST_SUB_BUCKETS + sub + 1) << (e - CLIENT_HIST_SUB_BITS);
+}
+
+uint64_t client_hist_percentile(struct CLIENT_HIST *hist, double p) {
+    uint64_t total = 0;
+    for(int i = 0; i != CLIENT_HIST_BUCKETS; ++i) {
+        total += hist->buckets[i];
+    }
+    if(total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = total * p / 100.0;
+    uint64_t seen = 0;
+    for(int i = 0; i != CLIENT_HIST_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if(seen > rank) {
+            uint64_t bound = client_hist_bound(i);
+            return bound < hist->max ? bound : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+void client_hist_print(struct CLIENT_HIST *hist, FILE *f) {
+    fprintf(f, "\"p50_us\":%.1f,\"p99_us\":%.1f,\"p999_us\":%.1f,\"max_us\":%.1f", client_hist_percentile(hist, 50) / 1e3,
+        client_hist_percentile(hist, 99) / 1e3, client_hist_percentile(hist, 99.9) / 1e3, hist->max / 1e3);
+}
+
+void client_reader_reset(struct CLIENT_READER *reader) {
+    reader->in_len = 0;
+    reader->body_left = -1;
+    reader->status = 0;
+}
+
+int client_parse(struct CLIENT_READER *reader, void (*done)(void *ctx, int status), void *ctx) {
+    char *data = reader->in;
+    int len = reader->in_len;
+
+    while(len > 0) {
+        if(reader->body_left > 0) {
+            int n = len < reader->body_left ? len : reader->body_left;
+            data += n;
+            len -= n;
+            reader->body_left -= n;
+            if(reader->body_left == 0) {
+                done(ctx, reader->status);
+                reader->body_left = -1;
+            }
+            continue;
+        }
+
+        char *end = memmem(data, len, "\r\n\r\n", 4);
+        if(end == NULL) {
+            if(len == CLIENT_READ_BUFFER_SIZE) {
+                return CLIENT_PROTOCOL_ERROR;
+            }
+            break;
+        }
+        if(len < 12 || memcmp(data, "HTTP/1.", 7) != 0) {
+            return CLIENT_PROTOCOL_ERROR;
+        }
+        reader->status = atoi(data + 9);
+
+        long content_length = 0;
+        for(char *pt = data; (pt = memchr(pt, '\n', end - pt)) != NULL;) {
+            ++pt;
+            if(end - pt > 15 && strncasecmp(pt, "Content-Length:", 15) == 0) {
+                content_length = strtol(pt + 15, NULL, 10);
+                break;
+            }
+        }
+
+        len -= end + 4 - data;
+        data = end + 4;
+        if(content_length == 0) {
+            done(ctx, reader->status);
+        }
+        else {
+            reader->body_left = content_length;
+        }
+    }
+
+    memmove(reader->in, data, len);
+    reader->in_len = len;
+    return CLIENT_OK;
+}
@@ -0,0 +1,51 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+// Response parsing and latency histogram shared by benchmark clients
+
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define CLIENT_READ_BUFFER_SIZE  (16 << 10)
+
+// Log-linear histogram: 16 sub-buckets per power of two of nanoseconds
+#define CLIENT_HIST_SUB_BITS     4
+#define CLIENT_HIST_SUB_BUCKETS  (1 << CLIENT_HIST_SUB_BITS)
+#define CLIENT_HIST_BUCKETS      (64 * CLIENT_HIST_SUB_BUCKETS)
+
+#define CLIENT_PROTOCOL_ERROR  -1
+#define CLIENT_OK               0
+
+struct CLIENT_HIST {
+    uint64_t buckets[CLIENT_HIST_BUCKETS];
+    uint64_t max;
+};
+
+struct CLIENT_READER {
+    char in[CLIENT_READ_BUFFER_SIZE];
+    int in_len;
+    // Body bytes of current response still to skip, -1 while reading headers
+    long body_left;
+    int status;
+};
+
+// Add latency of one response
+void client_hist_add(struct CLIENT_HIST *hist, uint64_t ns);
+
+// Get latency at percentile 'p'
+// Return upper bound of its bucket in nanoseconds
+uint64_t client_hist_percentile(struct CLIENT_HIST *hist, double p);
+
+// Print p50, p99, p999 and max latency as JSON fields in microseconds
+void client_hist_print(struct CLIENT_HIST *hist, FILE *f);
+
+// Reset reader for a new connection
+void client_reader_reset(struct CLIENT_READER *reader);
+
+// Parse responses buffered in 'reader->in', 'done' is called with the status of every complete one
+// Return error code
+int client_parse(struct CLIENT_READER *reader, void (*done)(void *ctx, int status), void *ctx);
+
+#endif
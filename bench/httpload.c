@@ -0,0 +1,429 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+// HTTP/1.1 load generator for tinyhttp benchmarks.
+// Closed loop: every connection keeps 'pipeline' requests in flight.
+// Open loop (-R): requests are scheduled at fixed rate and latency is measured from the
+// scheduled time, so a stalled server is not hidden by the generator waiting for it.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "client.h"
+
+#define MAX_PIPELINE      64
+#define MAX_EVENTS        256
+#define QUEUE_SIZE        (1 << 20)
+
+struct CONN {
+    int fd;
+    int connected;
+    // Send times of requests in flight, oldest first
+    uint64_t sent[MAX_PIPELINE];
+    int head;
+    int inflight;
+    char out[MAX_PIPELINE * 512];
+    int out_len;
+    int out_sent;
+    struct CLIENT_READER reader;
+};
+
+struct OPTIONS {
+    const char *name;
+    const char *host;
+    int port;
+    const char *unix_path;
+    const char *path;
+    int connections;
+    int pipeline;
+    int keepalive;
+    double duration;
+    double rate;
+    long requests;
+};
+
+static struct OPTIONS opts = {
+    .name = "httpload",
+    .host = "127.0.0.1",
+    .port = 9000,
+    .path = "/",
+    .connections = 16,
+    .pipeline = 1,
+    .keepalive = 1,
+    .duration = 5
+};
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static char request[512];
+static int request_len;
+static int epollfd;
+
+static struct CLIENT_HIST hist;
+static uint64_t done = 0;
+static uint64_t errors = 0;
+static uint64_t non2xx = 0;
+// Time of the current event loop iteration
+static uint64_t loop_now = 0;
+
+// Open loop schedule of requests waiting for a free connection
+static uint64_t *queue;
+static uint64_t queue_head = 0;
+static uint64_t queue_tail = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int resolve(void) {
+    memset(&server_addr, 0, sizeof(server_addr));
+    if(opts.unix_path) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&server_addr;
+        if(strlen(opts.unix_path) >= sizeof(un->sun_path)) {
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, opts.unix_path);
+        server_addr_len = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    char port[8];
+    snprintf(port, sizeof(port), "%i", opts.port);
+    if(getaddrinfo(opts.host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int conn_open(struct CONN *c) {
+    c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(c->fd < 0) {
+        return -1;
+    }
+    if(server_addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    c->connected = 0;
+    c->head = 0;
+    c->inflight = 0;
+    c->out_len = 0;
+    c->out_sent = 0;
+    client_reader_reset(&c->reader);
+
+    if(connect(c->fd, (struct sockaddr *)&server_addr, server_addr_len) != 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return 0;
+}
+
+static void conn_close(struct CONN *c) {
+    if(c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+// Queue request sent (or scheduled) at 'ts'
+static void conn_request(struct CONN *c, uint64_t ts) {
+    c->sent[(c->head + c->inflight) % MAX_PIPELINE] = ts;
+    ++c->inflight;
+    memcpy(c->out + c->out_len, request, request_len);
+    c->out_len += request_len;
+}
+
+static int conn_flush(struct CONN *c) {
+    while(c->out_sent != c->out_len) {
+        int wr = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if(wr < 0) {
+            if(errno == EAGAIN) {
+                struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+                epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+                return 0;
+            }
+            return -1;
+        }
+        c->out_sent += wr;
+    }
+    c->out_len = 0;
+    c->out_sent = 0;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+static void conn_response(void *ctx, int status) {
+    struct CONN *c = ctx;
+    client_hist_add(&hist, loop_now - c->sent[c->head]);
+    c->head = (c->head + 1) % MAX_PIPELINE;
+    --c->inflight;
+    ++done;
+    if(status < 200 || status > 299) {
+        ++non2xx;
+    }
+}
+
+static void usage(char *argv0) {
+    printf("Usage: %s [options]\n", argv0);
+    printf("  -n name   : scenario name in results\n");
+    printf("  -H host   : server host (127.0.0.1)\n");
+    printf("  -p port   : server port (9000)\n");
+    printf("  -u path   : connect to Unix domain socket instead\n");
+    printf("  -U path   : request path (/)\n");
+    printf("  -c num    : connections (16)\n");
+    printf("  -P num    : pipelined requests per connection (1)\n");
+    printf("  -k 0|1    : keep-alive (1), without it every request opens a new connection\n");
+    printf("  -d sec    : duration (5)\n");
+    printf("  -R rps    : open loop at fixed total request rate\n");
+    printf("  -N num    : stop after num responses\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "n:H:p:u:U:c:P:k:d:R:N:h")) > 0) {
+        switch(opt) {
+            case 'n':
+                opts.name = optarg;
+                break;
+            case 'H':
+                opts.host = optarg;
+                break;
+            case 'p':
+                opts.port = atoi(optarg);
+                break;
+            case 'u':
+                opts.unix_path = optarg;
+                break;
+            case 'U':
+                opts.path = optarg;
+                break;
+            case 'c':
+                opts.connections = atoi(optarg);
+                break;
+            case 'P':
+                opts.pipeline = atoi(optarg);
+                break;
+            case 'k':
+                opts.keepalive = atoi(optarg);
+                break;
+            case 'd':
+                opts.duration = atof(optarg);
+                break;
+            case 'R':
+                opts.rate = atof(optarg);
+                break;
+            case 'N':
+                opts.requests = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(opts.connections <= 0 || opts.pipeline <= 0 || opts.pipeline > MAX_PIPELINE) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(opts.keepalive == 0) {
+        opts.pipeline = 1;
+    }
+
+    if(resolve() != 0) {
+        fprintf(stderr, "Can't resolve server address\n");
+        return 1;
+    }
+    request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", opts.path,
+        opts.unix_path ? "localhost" : opts.host, opts.keepalive ? "" : "Connection: close\r\n");
+
+    struct rlimit rl = {.rlim_cur = opts.connections + 64, .rlim_max = opts.connections + 64};
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < opts.connections + 64) {
+        rl.rlim_cur = rl.rlim_max < opts.connections + 64 ? rl.rlim_max : opts.connections + 64;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    struct CONN *conns = calloc(opts.connections, sizeof(struct CONN));
+    queue = malloc(QUEUE_SIZE * sizeof(uint64_t));
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(conns == NULL || queue == NULL || epollfd < 0) {
+        fprintf(stderr, "Can't allocate connections\n");
+        return 1;
+    }
+
+    uint64_t started = now_ns();
+    for(int i = 0; i != opts.connections; ++i) {
+        if(conn_open(&conns[i]) != 0) {
+            ++errors;
+        }
+        if(opts.rate == 0) {
+            for(int j = 0; j != opts.pipeline; ++j) {
+                conn_request(&conns[i], started);
+            }
+        }
+    }
+
+    uint64_t finish = started + opts.duration * 1e9;
+    uint64_t interval = opts.rate > 0 ? 1e9 / opts.rate : 0;
+    uint64_t next = started;
+    int rr = 0;
+    struct epoll_event events[MAX_EVENTS];
+
+    while(1) {
+        uint64_t now = now_ns();
+        if(now >= finish || (opts.requests && done >= opts.requests)) {
+            break;
+        }
+
+        // Open loop: schedule requests due by now and hand them to connections with free pipeline slots
+        if(interval) {
+            for(; next <= now; next += interval) {
+                if(queue_tail - queue_head == QUEUE_SIZE) {
+                    ++errors;
+                    continue;
+                }
+                queue[queue_tail++ % QUEUE_SIZE] = next;
+            }
+            for(int i = 0; i != opts.connections && queue_head != queue_tail; ++i) {
+                struct CONN *c = &conns[(rr + i) % opts.connections];
+                if(c->fd < 0 || c->inflight >= opts.pipeline || (opts.keepalive == 0 && c->inflight)) {
+                    continue;
+                }
+                int had_output = c->out_len;
+                while(c->inflight < opts.pipeline && queue_head != queue_tail) {
+                    conn_request(c, queue[queue_head++ % QUEUE_SIZE]);
+                }
+                if(c->connected && had_output == 0 && conn_flush(c) != 0) {
+                    ++errors;
+                    conn_close(c);
+                }
+            }
+            rr = (rr + 1) % opts.connections;
+        }
+
+        // Open loop sleeps exactly until the next scheduled request
+        struct timespec timeout = {.tv_nsec = 100000000};
+        if(interval) {
+            uint64_t wait = next > now ? next - now : 0;
+            timeout.tv_sec = wait / 1000000000;
+            timeout.tv_nsec = wait % 1000000000;
+        }
+        int nfds = epoll_pwait2(epollfd, events, MAX_EVENTS, &timeout, NULL);
+        now = now_ns();
+        loop_now = now;
+
+        for(int i = 0; i < nfds; ++i) {
+            struct CONN *c = events[i].data.ptr;
+            if(c->fd < 0) {
+                continue;
+            }
+
+            if(events[i].events & EPOLLOUT) {
+                if(c->connected == 0) {
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                    if(err) {
+                        ++errors;
+                        conn_close(c);
+                        continue;
+                    }
+                    c->connected = 1;
+                }
+                if(conn_flush(c) != 0) {
+                    ++errors;
+                    conn_close(c);
+                    continue;
+                }
+            }
+
+            if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                int rd = recv(c->fd, c->reader.in + c->reader.in_len, CLIENT_READ_BUFFER_SIZE - c->reader.in_len, 0);
+                if(rd < 0 && errno == EAGAIN) {
+                    continue;
+                }
+                if(rd <= 0) {
+                    // Server closed connection, requests in flight are lost
+                    errors += c->inflight;
+                    c->inflight = 0;
+                    conn_close(c);
+                }
+                else {
+                    c->reader.in_len += rd;
+                    int before = done;
+                    if(client_parse(&c->reader, conn_response, c) != CLIENT_OK) {
+                        ++errors;
+                        conn_close(c);
+                    }
+                    else if(opts.rate == 0 && opts.keepalive) {
+                        // Closed loop: replace every completed request
+                        for(int j = done - before; j > 0; --j) {
+                            conn_request(c, now);
+                        }
+                        if(c->out_len && conn_flush(c) != 0) {
+                            ++errors;
+                            conn_close(c);
+                        }
+                    }
+                    else if(opts.keepalive == 0 && c->inflight == 0) {
+                        conn_close(c);
+                    }
+                }
+            }
+
+            // Reopen closed connection, without keep-alive that happens after every response
+            if(c->fd < 0 && now < finish) {
+                if(conn_open(c) != 0) {
+                    ++errors;
+                    continue;
+                }
+                if(opts.rate == 0) {
+                    conn_request(c, now);
+                }
+            }
+        }
+    }
+
+    double elapsed = (now_ns() - started) / 1e9;
+    printf("{\"scenario\":\"%s\",\"connections\":%i,\"pipeline\":%i,\"keepalive\":%i,\"rate\":%.0f,"
+        "\"duration\":%.2f,\"requests\":%lu,\"errors\":%lu,\"non2xx\":%lu,\"rps\":%.0f,",
+        opts.name, opts.connections, opts.pipeline, opts.keepalive, opts.rate, elapsed,
+        (unsigned long)done, (unsigned long)errors, (unsigned long)non2xx, done / elapsed);
+    client_hist_print(&hist, stdout);
+    printf("}\n");
+
+    for(int i = 0; i != opts.connections; ++i) {
+        conn_close(&conns[i]);
+    }
+    free(conns);
+    free(queue);
+    close(epollfd);
+    return done ? 0 : 1;
+}
@@ -0,0 +1,396 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+// Idle connection footprint of tinyhttp.
+// Opens many keep-alive connections, sends one request on each and leaves them idle, then
+// reports how much resident memory the workers of the server gained per connection.
+// Loopback source addresses are rotated, so the number of connections is not limited by
+// ephemeral ports of a single address pair.
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "client.h"
+
+#define MAX_EVENTS          256
+// Connections of one loopback source address, below the default ephemeral port range
+#define SOURCE_CONNECTIONS  25000
+// Descriptors left for reading /proc and for epoll
+#define FD_RESERVE          16
+
+#define STATE_CONNECTING  0
+#define STATE_READING     1
+#define STATE_IDLE        2
+#define STATE_FAILED      3
+
+// Only connections with a request in flight have a reader, idle ones keep the socket
+struct CONN {
+    int fd;
+    int state;
+    struct CLIENT_READER *reader;
+};
+
+struct OPTIONS {
+    const char *name;
+    const char *host;
+    int port;
+    const char *path;
+    int connections;
+    int inflight;
+    int request;
+    int sources;
+    int pid;
+    double hold;
+    double timeout;
+};
+
+static struct OPTIONS opts = {
+    .name = "idleconn",
+    .host = "127.0.0.1",
+    .port = 9000,
+    .path = "/",
+    .connections = 10000,
+    .inflight = 512,
+    .request = 1,
+    .timeout = 60
+};
+
+static struct sockaddr_in server_addr;
+static char request[512];
+static int request_len;
+static int epollfd;
+
+static uint64_t idle = 0;
+static uint64_t errors = 0;
+static uint64_t non2xx = 0;
+static int pending = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Get resident memory of process
+// Return kilobytes or 0 if process is gone
+static long rss_kb(int pid) {
+    char path[64];
+    char line[256];
+    snprintf(path, sizeof(path), "/proc/%i/status", pid);
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        return 0;
+    }
+    long rss = 0;
+    while(fgets(line, sizeof(line), f)) {
+        if(strncmp(line, "VmRSS:", 6) == 0) {
+            rss = atol(line + 6);
+            break;
+        }
+    }
+    fclose(f);
+    return rss;
+}
+
+// Sum resident memory of workers forked by server 'pid', or of the server itself without them
+// Return kilobytes
+static long server_rss_kb(int pid) {
+    long rss = 0;
+    int workers = 0;
+    DIR *dir = opendir("/proc");
+    struct dirent *entry;
+    while(dir && (entry = readdir(dir))) {
+        char path[300];
+        char stat[512];
+        int child = atoi(entry->d_name);
+        if(child <= 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/%i/stat", child);
+        FILE *f = fopen(path, "r");
+        if(f == NULL) {
+            continue;
+        }
+        int ppid = 0;
+        // Command name may contain spaces, fields after it start behind the last ')'
+        if(fgets(stat, sizeof(stat), f)) {
+            char *end = strrchr(stat, ')');
+            if(end) {
+                sscanf(end + 1, " %*c %i", &ppid);
+            }
+        }
+        fclose(f);
+        if(ppid == pid) {
+            rss += rss_kb(child);
+            ++workers;
+        }
+    }
+    if(dir) {
+        closedir(dir);
+    }
+    return workers ? rss : rss_kb(pid);
+}
+
+static int conn_open(struct CONN *c, int index) {
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(c->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if(opts.sources > 1) {
+        // Port is chosen by connect() for the whole address tuple, not reserved by bind()
+        struct sockaddr_in source = {.sin_family = AF_INET};
+        source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + index % opts.sources);
+        setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+        if(bind(c->fd, (struct sockaddr *)&source, sizeof(source)) != 0) {
+            close(c->fd);
+            c->fd = -1;
+            return -1;
+        }
+    }
+    if(connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) != 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    if(opts.request) {
+        c->reader = malloc(sizeof(struct CLIENT_READER));
+        if(c->reader == NULL) {
+            close(c->fd);
+            c->fd = -1;
+            return -1;
+        }
+        client_reader_reset(c->reader);
+    }
+    c->state = STATE_CONNECTING;
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+    ++pending;
+    return 0;
+}
+
+// Connection is done with its request, it stays open or has failed
+static void conn_settle(struct CONN *c, int state) {
+    free(c->reader);
+    c->reader = NULL;
+    c->state = state;
+    --pending;
+    if(state == STATE_IDLE) {
+        struct epoll_event ev = {.events = 0, .data.ptr = c};
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+        ++idle;
+    }
+    else {
+        close(c->fd);
+        c->fd = -1;
+        ++errors;
+    }
+}
+
+static void conn_response(void *ctx, int status) {
+    struct CONN *c = ctx;
+    if(status < 200 || status > 299) {
+        ++non2xx;
+    }
+    c->state = STATE_IDLE;
+}
+
+static void conn_event(struct CONN *c, uint32_t events) {
+    if(c->state == STATE_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err) {
+            conn_settle(c, STATE_FAILED);
+            return;
+        }
+        if(opts.request == 0) {
+            conn_settle(c, STATE_IDLE);
+            return;
+        }
+        // Request is small enough for an empty socket buffer
+        if(send(c->fd, request, request_len, MSG_NOSIGNAL) != request_len) {
+            conn_settle(c, STATE_FAILED);
+            return;
+        }
+        c->state = STATE_READING;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+        return;
+    }
+
+    if(c->state == STATE_READING && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        struct CLIENT_READER *reader = c->reader;
+        int rd = recv(c->fd, reader->in + reader->in_len, CLIENT_READ_BUFFER_SIZE - reader->in_len, 0);
+        if(rd < 0 && errno == EAGAIN) {
+            return;
+        }
+        if(rd <= 0) {
+            conn_settle(c, STATE_FAILED);
+            return;
+        }
+        reader->in_len += rd;
+        if(client_parse(reader, conn_response, c) != CLIENT_OK) {
+            conn_settle(c, STATE_FAILED);
+        }
+        else if(c->state == STATE_IDLE) {
+            conn_settle(c, STATE_IDLE);
+        }
+    }
+}
+
+static void usage(char *argv0) {
+    printf("Usage: %s [options]\n", argv0);
+    printf("  -n name   : scenario name in results\n");
+    printf("  -H host   : server IPv4 address (127.0.0.1)\n");
+    printf("  -p port   : server port (9000)\n");
+    printf("  -U path   : request path (/)\n");
+    printf("  -c num    : connections (10000)\n");
+    printf("  -i num    : connections being opened at once (512)\n");
+    printf("  -r 0|1    : send one request on every connection before it goes idle (1)\n");
+    printf("  -s num    : loopback source addresses 127.0.0.1 and up, one per %i connections by default\n", SOURCE_CONNECTIONS);
+    printf("  -P pid    : server process, resident memory of its workers is measured\n");
+    printf("  -w sec    : keep connections idle for sec seconds before closing them (0)\n");
+    printf("  -t sec    : give up opening connections after sec seconds (60)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "n:H:p:U:c:i:r:s:P:w:t:h")) > 0) {
+        switch(opt) {
+            case 'n':
+                opts.name = optarg;
+                break;
+            case 'H':
+                opts.host = optarg;
+                break;
+            case 'p':
+                opts.port = atoi(optarg);
+                break;
+            case 'U':
+                opts.path = optarg;
+                break;
+            case 'c':
+                opts.connections = atoi(optarg);
+                break;
+            case 'i':
+                opts.inflight = atoi(optarg);
+                break;
+            case 'r':
+                opts.request = atoi(optarg);
+                break;
+            case 's':
+                opts.sources = atoi(optarg);
+                break;
+            case 'P':
+                opts.pid = atoi(optarg);
+                break;
+            case 'w':
+                opts.hold = atof(optarg);
+                break;
+            case 't':
+                opts.timeout = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(opts.connections <= 0 || opts.inflight <= 0 || opts.pid <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(opts.port);
+    if(inet_pton(AF_INET, opts.host, &server_addr.sin_addr) != 1) {
+        fprintf(stderr, "Can't parse server address\n");
+        return 1;
+    }
+    // Other source addresses exist only on loopback
+    if(opts.sources == 0) {
+        opts.sources = (ntohl(server_addr.sin_addr.s_addr) >> 24) == 127 ? opts.connections / SOURCE_CONNECTIONS + 1 : 1;
+    }
+    request_len = snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", opts.path, opts.host);
+
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && (rlim_t)opts.connections + FD_RESERVE > rl.rlim_cur) {
+        fprintf(stderr, "File descriptor limit %lu allows only %lu connections\n", (unsigned long)rl.rlim_cur, (unsigned long)(rl.rlim_cur - FD_RESERVE));
+        opts.connections = rl.rlim_cur - FD_RESERVE;
+    }
+
+    struct CONN *conns = calloc(opts.connections, sizeof(struct CONN));
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(conns == NULL || epollfd < 0) {
+        fprintf(stderr, "Can't allocate connections\n");
+        return 1;
+    }
+
+    long rss_before = server_rss_kb(opts.pid);
+    uint64_t started = now_ns();
+    uint64_t deadline = started + opts.timeout * 1e9;
+    int next = 0;
+    struct epoll_event events[MAX_EVENTS];
+
+    while((next != opts.connections || pending) && now_ns() < deadline) {
+        // Keep a bounded number of handshakes in flight, so the accept queue doesn't overflow
+        while(next != opts.connections && pending < opts.inflight) {
+            conns[next].fd = -1;
+            if(conn_open(&conns[next], next) != 0) {
+                ++errors;
+                if(errno == EMFILE || errno == ENFILE) {
+                    fprintf(stderr, "Out of file descriptors after %i connections\n", next);
+                    next = opts.connections;
+                    break;
+                }
+            }
+            ++next;
+        }
+        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, 100);
+        for(int i = 0; i < nfds; ++i) {
+            conn_event(events[i].data.ptr, events[i].events);
+        }
+    }
+    double elapsed = (now_ns() - started) / 1e9;
+    errors += pending;
+
+    // Let the server finish with the last requests before measuring
+    sleep(1);
+    long rss_after = server_rss_kb(opts.pid);
+    long per_connection = idle ? (rss_after - rss_before) * 1024 / (long)idle : 0;
+
+    printf("{\"scenario\":\"%s\",\"connections\":%i,\"idle\":%lu,\"errors\":%lu,\"non2xx\":%lu,\"request\":%i,"
+        "\"open_seconds\":%.2f,\"rss_before_kb\":%ld,\"rss_after_kb\":%ld,\"rss_per_connection_bytes\":%ld}\n",
+        opts.name, opts.connections, (unsigned long)idle, (unsigned long)errors, (unsigned long)non2xx, opts.request,
+        elapsed, rss_before, rss_after, per_connection);
+    fflush(stdout);
+
+    if(opts.hold > 0) {
+        usleep(opts.hold * 1e6);
+    }
+    for(int i = 0; i != next; ++i) {
+        if(conns[i].fd >= 0) {
+            close(conns[i].fd);
+        }
+        free(conns[i].reader);
+    }
+    free(conns);
+    close(epollfd);
+    return idle ? 0 : 1;
+}
@@ -0,0 +1,349 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+// CPU cost of request parsing, routing and map operations on in-memory data.
+// Corpus files are raw request streams, requests are split with http_request_length().
+// Reports ns, instructions and heap allocations per operation as JSON lines.
+// Allocations are counted by wrapping malloc/realloc, see Makefile.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../map.h"
+#include "../http.h"
+
+#define MAX_REQUESTS      100000
+#define MAX_BODY          4096
+#define SCRATCH_SIZE      (64 << 10)
+#define MIN_DURATION_NS   200000000ull
+
+static uint64_t allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    ++allocations;
+    return __real_malloc(size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    ++allocations;
+    return __real_realloc(ptr, size);
+}
+
+struct CORPUS {
+    const char *name;
+    char *data;
+    int count;
+    int offsets[MAX_REQUESTS];
+    int lengths[MAX_REQUESTS];
+};
+
+struct RESULT {
+    uint64_t ops;
+    uint64_t ns;
+    uint64_t instructions;
+    uint64_t allocations;
+};
+
+static int instructions_fd = -1;
+static struct MAP routes = {.objects = NULL, .length = 0};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Open user space instruction counter, not available in every container
+static void instructions_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    instructions_fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t instructions_read(void) {
+    uint64_t count = 0;
+    if(instructions_fd >= 0 && read(instructions_fd, &count, sizeof(count)) != sizeof(count)) {
+        count = 0;
+    }
+    return count;
+}
+
+static void result_start(struct RESULT *r) {
+    r->ns = now_ns();
+    r->instructions = instructions_read();
+    r->allocations = allocations;
+}
+
+static void result_stop(struct RESULT *r, uint64_t ops) {
+    r->ns = now_ns() - r->ns;
+    r->instructions = instructions_read() - r->instructions;
+    r->allocations = allocations - r->allocations;
+    r->ops = ops;
+}
+
+static void result_print(const char *bench, const char *subject, struct RESULT *r) {
+    printf("{\"bench\":\"%s\",\"subject\":\"%s\",\"ops\":%lu,\"ns_per_op\":%.1f,", bench, subject,
+        (unsigned long)r->ops, (double)r->ns / r->ops);
+    if(instructions_fd >= 0) {
+        printf("\"instructions_per_op\":%.1f,", (double)r->instructions / r->ops);
+    }
+    else {
+        printf("\"instructions_per_op\":null,");
+    }
+    printf("\"allocs_per_op\":%.2f}\n", (double)r->allocations / r->ops);
+}
+
+static int corpus_load(struct CORPUS *corpus, const char *path) {
+    FILE *f = fopen(path, "rb");
+    if(f == NULL) {
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    corpus->data = malloc(size + 1);
+    if(corpus->data == NULL || fread(corpus->data, 1, size, f) != size) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    const char *name = strrchr(path, '/');
+    corpus->name = name ? name + 1 : path;
+    corpus->count = 0;
+    for(long offset = 0; offset < size && corpus->count != MAX_REQUESTS;) {
+        int len = http_request_length(corpus->data + offset, size - offset, MAX_BODY);
+        if(len <= 0 || len > SCRATCH_SIZE) {
+            break;
+        }
+        corpus->offsets[corpus->count] = offset;
+        corpus->lengths[corpus->count] = len;
+        ++corpus->count;
+        offset += len;
+    }
+    return corpus->count ? 0 : -1;
+}
+
+// Load routes the same way tinyhttp does and pad them with synthetic ones up to 'count'
+static void routes_load(const char *path, int count) {
+    char spath[128], stype[128], sact[128];
+    char buff[512];
+    FILE *f = fopen(path, "r");
+    while(f && fgets(buff, sizeof(buff), f)) {
+        if(buff[0] != '/' || sscanf(buff, "%s %s %s\n", spath, stype, sact) != 3) {
+            continue;
+        }
+        struct CONFIG_PATH route = {.content_type = strdup(stype), .action = strdup(sact)};
+        map_add(&routes, spath, strlen(spath), &route, sizeof(route));
+    }
+    if(f) {
+        fclose(f);
+    }
+
+    for(int i = 0; routes.count < count; ++i) {
+        struct CONFIG_PATH route = {.content_type = "text/html", .action = "$"};
+        int len = snprintf(spath, sizeof(spath), "/section%i/", i);
+        map_add(&routes, spath, len, &route, sizeof(route));
+    }
+}
+
+// Parse every request of the corpus, the buffer is copied first because parsing modifies it
+static void bench_parse(struct CORPUS *corpus, int lookup, int route) {
+    static char scratch[SCRATCH_SIZE];
+    struct RESULT r;
+    uint64_t ops = 0, errors = 0;
+    uint64_t deadline = now_ns() + MIN_DURATION_NS;
+
+    result_start(&r);
+    do {
+        for(int i = 0; i != corpus->count; ++i) {
+            memcpy(scratch, corpus->data + corpus->offsets[i], corpus->lengths[i]);
+            request_t req;
+            struct MAP headers = {.objects = NULL, .length = 0};
+            if(http_parse(scratch, corpus->lengths[i], &req, &headers) < 0) {
+                ++errors;
+                continue;
+            }
+            if(lookup) {
+                const char *value;
+                http_header(&req, HTTP_HEADER_CONNECTION, &value);
+                http_header(&req, HTTP_HEADER_CONTENT_TYPE, &value);
+            }
+            if(route) {
+                struct CONFIG_PATH config_path;
+                http_route(&routes, req.path, &config_path);
+            }
+            map_destroy(&headers);
+        }
+        ops += corpus->count;
+    }while(now_ns() < deadline);
+    result_stop(&r, ops);
+
+    if(errors) {
+        fprintf(stderr, "%s: %lu requests failed to parse\n", corpus->name, (unsigned long)errors);
+    }
+    result_print(route ? "request" : "parse", corpus->name, &r);
+}
+
+// Route request paths of the corpus without parsing
+static void bench_route(struct CORPUS *corpus) {
+    static char scratch[SCRATCH_SIZE];
+    char **paths = malloc(corpus->count * sizeof(char *));
+    int count = 0;
+    for(int i = 0; i != corpus->count; ++i) {
+        memcpy(scratch, corpus->data + corpus->offsets[i], corpus->lengths[i]);
+        request_t req;
+        struct MAP headers = {.objects = NULL, .length = 0};
+        if(http_parse(scratch, corpus->lengths[i], &req, &headers) >= 0) {
+            paths[count++] = strdup(req.path);
+            map_destroy(&headers);
+        }
+    }
+
+    struct RESULT r;
+    uint64_t ops = 0, found = 0;
+    uint64_t deadline = now_ns() + MIN_DURATION_NS;
+    result_start(&r);
+    do {
+        for(int i = 0; i != count; ++i) {
+            struct CONFIG_PATH config_path;
+            found += http_route(&routes, paths[i], &config_path) != ROUTE_NOT_FOUND;
+        }
+        ops += count;
+    }while(now_ns() < deadline);
+    result_stop(&r, ops);
+
+    char subject[160];
+    snprintf(subject, sizeof(subject), "%s/%u_routes", corpus->name, routes.count);
+    result_print("route", subject, &r);
+
+    for(int i = 0; i != count; ++i) {
+        free(paths[i]);
+    }
+    free(paths);
+}
+
+// map_add, map_get and iteration over 'count' keys shaped like header names
+static void bench_map(int count) {
+    char (*keys)[32] = malloc(count * sizeof(*keys));
+    int *lens = malloc(count * sizeof(int));
+    for(int i = 0; i != count; ++i) {
+        lens[i] = snprintf(keys[i], sizeof(keys[i]), "X-Header-Name-%i", i);
+    }
+    const char value[] = "text/html,application/xhtml+xml";
+
+    struct RESULT add, get, iterate;
+    memset(&add, 0, sizeof(add));
+    memset(&get, 0, sizeof(get));
+    memset(&iterate, 0, sizeof(iterate));
+    uint64_t rounds = 0;
+    uint64_t deadline = now_ns() + MIN_DURATION_NS;
+    do {
+        struct MAP map = {.objects = NULL, .length = 0};
+        struct RESULT r;
+
+        result_start(&r);
+        for(int i = 0; i != count; ++i) {
+            map_add(&map, keys[i], lens[i], value, sizeof(value));
+        }
+        result_stop(&r, 0);
+        add.ns += r.ns;
+        add.instructions += r.instructions;
+        add.allocations += r.allocations;
+
+        char out[64];
+        result_start(&r);
+        for(int i = 0; i != count; ++i) {
+            map_get(&map, keys[i], lens[i], out, sizeof(out));
+        }
+        result_stop(&r, 0);
+        get.ns += r.ns;
+        get.instructions += r.instructions;
+        get.allocations += r.allocations;
+
+        int seen = 0;
+        result_start(&r);
+        if(map_get_objects_start(&map) == MAP_OK) {
+            while(map_get_objects_next(&map)) {
+                ++seen;
+            }
+        }
+        result_stop(&r, 0);
+        iterate.ns += r.ns;
+        iterate.instructions += r.instructions;
+        iterate.allocations += r.allocations;
+
+        map_destroy(&map);
+        ++rounds;
+    }while(now_ns() < deadline);
+
+    char subject[32];
+    snprintf(subject, sizeof(subject), "%i_keys", count);
+    add.ops = get.ops = iterate.ops = rounds * count;
+    result_print("map_add", subject, &add);
+    result_print("map_get", subject, &get);
+    result_print("map_iterate", subject, &iterate);
+
+    free(keys);
+    free(lens);
+}
+
+static void usage(char *argv0) {
+    printf("Usage: %s [-c config] [-r routes] corpus...\n", argv0);
+    printf("  -c config : routes from tinyhttp config file (tinyhttp.conf)\n");
+    printf("  -r num    : pad routes with synthetic ones up to num (50)\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *config_path = "tinyhttp.conf";
+    int routes_count = 50;
+    int opt;
+    while((opt = getopt(argc, argv, "c:r:h")) > 0) {
+        switch(opt) {
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'r':
+                routes_count = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    instructions_open();
+    routes_load(config_path, routes_count);
+
+    for(int i = optind; i < argc; ++i) {
+        struct CORPUS *corpus = malloc(sizeof(struct CORPUS));
+        if(corpus == NULL || corpus_load(corpus, argv[i]) != 0) {
+            fprintf(stderr, "Can't load corpus %s\n", argv[i]);
+            return 1;
+        }
+        bench_parse(corpus, 0, 0);
+        bench_route(corpus);
+        bench_parse(corpus, 1, 1);
+        free(corpus->data);
+        free(corpus);
+    }
+
+    int sizes[] = {8, 16, 32, 64, 256};
+    for(int i = 0; i != sizeof(sizes) / sizeof(int); ++i) {
+        bench_map(sizes[i]);
+    }
+    return 0;
+}
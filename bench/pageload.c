@@ -0,0 +1,489 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+// Page load benchmark for tinyhttp: a page followed by its assets, loaded on fresh connections
+// the way browsers do. HTTP/1.1 uses up to 6 connections with one request in flight on each,
+// HTTP/2 (-2, prior knowledge) sends all asset requests at once on a single connection.
+// Page load time is measured from the first connect to the end of the last asset.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "client.h"
+#include "../h2.h"
+
+#define MAX_CONNECTIONS  6
+#define MAX_ASSETS       1024
+#define MAX_HEADERS      32
+#define REQUEST_SIZE     512
+
+struct CONN {
+    int fd;
+    int connected;
+    // Asset being loaded, -1 for the page, -2 when idle
+    int asset;
+    char out[REQUEST_SIZE * 4];
+    int out_len;
+    int out_sent;
+    struct CLIENT_READER reader;
+};
+
+struct OPTIONS {
+    const char *name;
+    const char *host;
+    int port;
+    const char *page;
+    const char *asset;
+    int assets;
+    int connections;
+    int http2;
+    double duration;
+    long loads;
+};
+
+static struct OPTIONS opts = {
+    .name = "pageload",
+    .host = "127.0.0.1",
+    .port = 9000,
+    .page = "/html/page.html",
+    .asset = "/html/asset%i.css",
+    .assets = 50,
+    .connections = MAX_CONNECTIONS,
+    .duration = 5
+};
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static struct CLIENT_HIST hist;
+static uint64_t errors = 0;
+static uint64_t non2xx = 0;
+static uint64_t connections_total = 0;
+
+// State of the current page load
+static int next_asset;
+static int responses;
+static int page_done;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int resolve(void) {
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    char port[8];
+    snprintf(port, sizeof(port), "%i", opts.port);
+    if(getaddrinfo(opts.host, port, &hints, &res) != 0) {
+        return -1;
+    }
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+static int conn_open(struct CONN *c) {
+    c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(c->fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->connected = 0;
+    c->asset = -2;
+    c->out_len = 0;
+    c->out_sent = 0;
+    client_reader_reset(&c->reader);
+    if(connect(c->fd, (struct sockaddr *)&server_addr, server_addr_len) != 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+    ++connections_total;
+    return 0;
+}
+
+static void conn_close(struct CONN *c) {
+    if(c->fd >= 0) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static int conn_flush(struct CONN *c) {
+    while(c->connected && c->out_sent != c->out_len) {
+        int wr = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if(wr < 0) {
+            return errno == EAGAIN ? 0 : -1;
+        }
+        c->out_sent += wr;
+    }
+    if(c->out_sent == c->out_len) {
+        c->out_len = 0;
+        c->out_sent = 0;
+    }
+    return 0;
+}
+
+static void asset_path(char *path, int asset) {
+    if(asset < 0) {
+        snprintf(path, REQUEST_SIZE / 2, "%s", opts.page);
+    }
+    else {
+        snprintf(path, REQUEST_SIZE / 2, opts.asset, asset);
+    }
+}
+
+// HTTP/1.1 request of page or asset, one in flight per connection
+static void http1_request(struct CONN *c, int asset) {
+    char path[REQUEST_SIZE / 2];
+    asset_path(path, asset);
+    c->asset = asset;
+    c->out_len = snprintf(c->out, sizeof(c->out), "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, opts.host);
+    c->out_sent = 0;
+}
+
+static void http1_response(void *ctx, int status) {
+    struct CONN *c = ctx;
+    if(status < 200 || status > 299) {
+        ++non2xx;
+    }
+    if(c->asset == -1) {
+        page_done = 1;
+    }
+    c->asset = -2;
+    ++responses;
+}
+
+// Load page on one connection, then assets on up to 'connections' of them
+// Return 0 if every response came
+static int http1_load(struct CONN *conns) {
+    int opened = 1;
+    if(conn_open(&conns[0]) != 0) {
+        return -1;
+    }
+    http1_request(&conns[0], -1);
+
+    while(responses != opts.assets + 1) {
+        // Assets are known once the page is there, browsers open more connections for them
+        if(page_done) {
+            for(int i = 0; i != opts.connections && next_asset != opts.assets; ++i) {
+                if(i >= opened) {
+                    if(conn_open(&conns[i]) != 0) {
+                        return -1;
+                    }
+                    opened = i + 1;
+                }
+                if(conns[i].asset == -2) {
+                    http1_request(&conns[i], next_asset++);
+                }
+            }
+        }
+
+        struct pollfd fds[MAX_CONNECTIONS];
+        for(int i = 0; i != opened; ++i) {
+            fds[i].fd = conns[i].fd;
+            fds[i].events = POLLIN | (conns[i].connected == 0 || conns[i].out_len ? POLLOUT : 0);
+            fds[i].revents = 0;
+        }
+        if(poll(fds, opened, 1000) <= 0) {
+            return -1;
+        }
+        for(int i = 0; i != opened; ++i) {
+            struct CONN *c = &conns[i];
+            if(fds[i].revents & POLLOUT) {
+                c->connected = 1;
+                if(conn_flush(c) != 0) {
+                    return -1;
+                }
+            }
+            if(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                int rd = recv(c->fd, c->reader.in + c->reader.in_len, CLIENT_READ_BUFFER_SIZE - c->reader.in_len, 0);
+                if(rd <= 0) {
+                    if(rd < 0 && errno == EAGAIN) {
+                        continue;
+                    }
+                    return -1;
+                }
+                c->reader.in_len += rd;
+                if(client_parse(&c->reader, http1_response, c) != CLIENT_OK) {
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Append frame to connection output
+static uint8_t *h2_append(struct CONN *c, unsigned int len, uint8_t type, uint8_t flags, uint32_t stream) {
+    uint8_t *out = (uint8_t *)c->out + c->out_len;
+    h2_frame_header(out, len, type, flags, stream);
+    c->out_len += H2_FRAME_HEADER + len;
+    return out + H2_FRAME_HEADER;
+}
+
+static void h2_put32(uint8_t *out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static int h2_request(struct CONN *c, struct HPACK *encoder, uint32_t stream, int asset) {
+    char path[REQUEST_SIZE / 2];
+    asset_path(path, asset);
+    if(c->out_len + H2_FRAME_HEADER + REQUEST_SIZE > (int)sizeof(c->out) && conn_flush(c) != 0) {
+        return -1;
+    }
+    if(c->out_len + H2_FRAME_HEADER + REQUEST_SIZE > (int)sizeof(c->out)) {
+        // Socket buffer is full, wait for it
+        struct pollfd fd = {.fd = c->fd, .events = POLLOUT};
+        if(poll(&fd, 1, 1000) <= 0) {
+            return -1;
+        }
+        c->connected = 1;
+        if(conn_flush(c) != 0 || c->out_len) {
+            return -1;
+        }
+    }
+    uint8_t block[REQUEST_SIZE];
+    int n = hpack_encode_start(encoder, block, sizeof(block));
+    n += hpack_encode(encoder, block + n, sizeof(block) - n, ":method", 7, "GET", 3, 1);
+    n += hpack_encode(encoder, block + n, sizeof(block) - n, ":scheme", 7, "http", 4, 1);
+    n += hpack_encode(encoder, block + n, sizeof(block) - n, ":authority", 10, opts.host, strlen(opts.host), 1);
+    n += hpack_encode(encoder, block + n, sizeof(block) - n, ":path", 5, path, strlen(path), 0);
+    memcpy(h2_append(c, n, H2_HEADERS, H2_FLAG_END_HEADERS | H2_FLAG_END_STREAM, stream), block, n);
+    return 0;
+}
+
+// Load page, then all assets at once as streams of one connection
+// Return 0 if every response came
+static int h2_load(struct CONN *c, struct HPACK *encoder, struct HPACK *decoder, uint8_t *in) {
+    if(conn_open(c) != 0) {
+        return -1;
+    }
+    // Windows are opened wide, so flow control doesn't limit the transfer
+    memcpy(c->out, H2_PREFACE, H2_PREFACE_LEN);
+    c->out_len = H2_PREFACE_LEN;
+    uint8_t *payload = h2_append(c, 6, H2_SETTINGS, 0, 0);
+    payload[0] = 0;
+    payload[1] = H2_SETTINGS_INITIAL_WINDOW_SIZE;
+    h2_put32(payload + 2, H2_MAX_WINDOW);
+    h2_put32(h2_append(c, 4, H2_WINDOW_UPDATE, 0, 0), H2_MAX_WINDOW - H2_DEFAULT_WINDOW);
+    h2_request(c, encoder, 1, -1);
+
+    int in_len = 0;
+    uint32_t received = 0;
+    while(responses != opts.assets + 1) {
+        if(page_done && next_asset != opts.assets) {
+            while(next_asset != opts.assets) {
+                if(h2_request(c, encoder, 3 + 2 * next_asset, next_asset) != 0) {
+                    return -1;
+                }
+                ++next_asset;
+            }
+        }
+
+        struct pollfd fd = {.fd = c->fd, .events = POLLIN | (c->connected == 0 || c->out_len ? POLLOUT : 0)};
+        if(poll(&fd, 1, 1000) <= 0) {
+            return -1;
+        }
+        if(fd.revents & POLLOUT) {
+            c->connected = 1;
+            if(conn_flush(c) != 0) {
+                return -1;
+            }
+        }
+        if((fd.revents & (POLLIN | POLLHUP | POLLERR)) == 0) {
+            continue;
+        }
+        int rd = recv(c->fd, in + in_len, H2_FRAME_SIZE + H2_FRAME_HEADER - in_len, 0);
+        if(rd <= 0) {
+            if(rd < 0 && errno == EAGAIN) {
+                continue;
+            }
+            return -1;
+        }
+        in_len += rd;
+
+        uint8_t *data = in;
+        while(in_len >= H2_FRAME_HEADER) {
+            struct H2_FRAME frame;
+            h2_frame_parse(data, &frame);
+            if(frame.len > H2_FRAME_SIZE) {
+                return -1;
+            }
+            if(in_len < H2_FRAME_HEADER + (int)frame.len) {
+                break;
+            }
+            uint8_t *payload = data + H2_FRAME_HEADER;
+            if(frame.type == H2_HEADERS) {
+                struct HPACK_HEADER headers[MAX_HEADERS];
+                char buffer[CLIENT_READ_BUFFER_SIZE];
+                int count = hpack_decode(decoder, payload, frame.len, headers, MAX_HEADERS, buffer, sizeof(buffer));
+                if(count <= 0 || headers[0].name_len != 7 || memcmp(headers[0].name, ":status", 7) != 0) {
+                    return -1;
+                }
+                if(headers[0].value[0] != '2') {
+                    ++non2xx;
+                }
+            }
+            else if(frame.type == H2_DATA) {
+                received += frame.len;
+            }
+            else if(frame.type == H2_SETTINGS && (frame.flags & H2_FLAG_ACK) == 0) {
+                h2_append(c, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+            }
+            else if(frame.type == H2_RST_STREAM || frame.type == H2_GOAWAY) {
+                return -1;
+            }
+            if((frame.type == H2_HEADERS || frame.type == H2_DATA) && (frame.flags & H2_FLAG_END_STREAM)) {
+                if(frame.stream == 1) {
+                    page_done = 1;
+                }
+                ++responses;
+            }
+            data += H2_FRAME_HEADER + frame.len;
+            in_len -= H2_FRAME_HEADER + frame.len;
+        }
+        memmove(in, data, in_len);
+
+        if(received >= H2_MAX_WINDOW / 2) {
+            h2_put32(h2_append(c, 4, H2_WINDOW_UPDATE, 0, 0), received);
+            received = 0;
+        }
+        if(c->out_len && conn_flush(c) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void usage(char *argv0) {
+    printf("Usage: %s [options]\n", argv0);
+    printf("  -n name   : scenario name in results\n");
+    printf("  -H host   : server host (127.0.0.1)\n");
+    printf("  -p port   : server port (9000)\n");
+    printf("  -U path   : page path (/html/page.html)\n");
+    printf("  -A format : asset path with %%i for asset number (/html/asset%%i.css)\n");
+    printf("  -a num    : assets (50)\n");
+    printf("  -c num    : HTTP/1.1 connections (6)\n");
+    printf("  -2        : HTTP/2 with prior knowledge\n");
+    printf("  -d sec    : duration (5)\n");
+    printf("  -N num    : stop after num page loads\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "n:H:p:U:A:a:c:2d:N:h")) > 0) {
+        switch(opt) {
+            case 'n':
+                opts.name = optarg;
+                break;
+            case 'H':
+                opts.host = optarg;
+                break;
+            case 'p':
+                opts.port = atoi(optarg);
+                break;
+            case 'U':
+                opts.page = optarg;
+                break;
+            case 'A':
+                opts.asset = optarg;
+                break;
+            case 'a':
+                opts.assets = atoi(optarg);
+                break;
+            case 'c':
+                opts.connections = atoi(optarg);
+                break;
+            case '2':
+                opts.http2 = 1;
+                break;
+            case 'd':
+                opts.duration = atof(optarg);
+                break;
+            case 'N':
+                opts.loads = atol(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(opts.connections <= 0 || opts.connections > MAX_CONNECTIONS || opts.assets < 0 || opts.assets > MAX_ASSETS) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(opts.http2) {
+        opts.connections = 1;
+    }
+    if(resolve() != 0) {
+        fprintf(stderr, "Can't resolve server address\n");
+        return 1;
+    }
+
+    struct CONN *conns = calloc(MAX_CONNECTIONS, sizeof(struct CONN));
+    struct HPACK *hpack = calloc(2, sizeof(struct HPACK));
+    uint8_t *in = malloc(H2_FRAME_SIZE + H2_FRAME_HEADER);
+    if(conns == NULL || hpack == NULL || in == NULL) {
+        fprintf(stderr, "Can't allocate connections\n");
+        return 1;
+    }
+
+    uint64_t loads = 0;
+    uint64_t started = now_ns();
+    uint64_t finish = started + opts.duration * 1e9;
+    while(now_ns() < finish && (opts.loads == 0 || loads + errors < opts.loads)) {
+        for(int i = 0; i != MAX_CONNECTIONS; ++i) {
+            conns[i].fd = -1;
+        }
+        next_asset = 0;
+        responses = 0;
+        page_done = 0;
+
+        // Every load starts cold, with new connections and empty HPACK tables
+        hpack_init(&hpack[0]);
+        hpack_init(&hpack[1]);
+        uint64_t load_started = now_ns();
+        int ret = opts.http2 ? h2_load(&conns[0], &hpack[0], &hpack[1], in) : http1_load(conns);
+        if(ret == 0) {
+            client_hist_add(&hist, now_ns() - load_started);
+            ++loads;
+        }
+        else {
+            ++errors;
+        }
+        for(int i = 0; i != MAX_CONNECTIONS; ++i) {
+            conn_close(&conns[i]);
+        }
+        hpack_free(&hpack[0]);
+        hpack_free(&hpack[1]);
+    }
+
+    double elapsed = (now_ns() - started) / 1e9;
+    printf("{\"scenario\":\"%s\",\"protocol\":\"%s\",\"assets\":%i,\"duration\":%.2f,\"loads\":%lu,\"errors\":%lu,\"non2xx\":%lu,"
+        "\"connections_per_load\":%.2f,\"loads_per_sec\":%.1f,",
+        opts.name, opts.http2 ? "h2c" : "http/1.1", opts.assets, elapsed, (unsigned long)loads, (unsigned long)errors,
+        (unsigned long)non2xx, loads + errors ? (double)connections_total / (loads + errors) : 0, loads / elapsed);
+    client_hist_print(&hist, stdout);
+    printf("}\n");
+
+    free(conns);
+    free(hpack);
+    free(in);
+    return loads ? 0 : 1;
+}
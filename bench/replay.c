@@ -0,0 +1,500 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+// Replay request traces written by tinyhttp (trace_file option) against a server.
+// Every traced connection is reopened and its received bytes are sent again at the
+// original time offsets divided by speed. Latency of each request is measured from its
+// scheduled send time, as in httpload open loop mode.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../map.h"
+#include "../http.h"
+#include "../trace.h"
+#include "client.h"
+
+#define MAX_EVENTS        256
+#define MAX_REQUEST_SIZE  (1 << 20)
+#define DRAIN_TIMEOUT_NS  5000000000ull
+
+struct EVENT {
+    uint64_t time_ns;
+    // Position in trace, keeps order of events with equal time
+    uint64_t index;
+    int conn;
+    uint16_t type;
+    uint32_t length;
+    const char *data;
+};
+
+struct RCONN {
+    int fd;
+    int connected;
+    int closing;
+    char *out;
+    unsigned int out_len;
+    unsigned int out_sent;
+    unsigned int out_size;
+    // Sent bytes not yet forming a complete request
+    char *pending;
+    unsigned int pending_len;
+    unsigned int pending_size;
+    // Scheduled times of requests waiting for response, from sent_head
+    uint64_t *sent;
+    unsigned int sent_head;
+    unsigned int sent_count;
+    unsigned int sent_size;
+    struct CLIENT_READER *reader;
+};
+
+static const char *host = "127.0.0.1";
+static int port = 9000;
+static const char *unix_path = NULL;
+static double speed = 1;
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static int epollfd;
+
+static struct EVENT *events = NULL;
+static uint64_t events_count = 0;
+static uint64_t events_size = 0;
+static struct RCONN *conns = NULL;
+static int conns_count = 0;
+
+static struct CLIENT_HIST hist;
+static uint64_t requests = 0;
+static uint64_t responses = 0;
+static uint64_t errors = 0;
+static uint64_t non2xx = 0;
+static uint64_t inflight = 0;
+static uint64_t max_lag = 0;
+static uint64_t loop_now = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int resolve(void) {
+    memset(&server_addr, 0, sizeof(server_addr));
+    if(unix_path) {
+        struct sockaddr_un *un = (struct sockaddr_un *)&server_addr;
+        if(strlen(unix_path) >= sizeof(un->sun_path)) {
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, unix_path);
+        server_addr_len = sizeof(struct sockaddr_un);
+        return 0;
+    }
+
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+    struct addrinfo *res;
+    char port_str[8];
+    snprintf(port_str, sizeof(port_str), "%i", port);
+    if(getaddrinfo(host, port_str, &hints, &res) != 0) {
+        return -1;
+    }
+    memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+    server_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+// Grow 'buffer' of 'size' bytes to hold at least 'need' bytes
+static int reserve(void *buffer, unsigned int *size, unsigned int need, unsigned int item) {
+    if(need <= *size) {
+        return 0;
+    }
+    unsigned int new_size = *size ? *size : 16;
+    while(new_size < need) {
+        new_size <<= 1;
+    }
+    void *ptr = realloc(*(void **)buffer, (size_t)new_size * item);
+    if(ptr == NULL) {
+        return -1;
+    }
+    *(void **)buffer = ptr;
+    *size = new_size;
+    return 0;
+}
+
+// Read trace file, map connections of every worker to replay connections
+static int trace_load(const char *path, struct MAP *ids) {
+    FILE *f = fopen(path, "rb");
+    if(f == NULL) {
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(size);
+    if(data == NULL || fread(data, 1, size, f) != size || size < TRACE_MAGIC_SIZE || memcmp(data, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+        fclose(f);
+        free(data);
+        return -1;
+    }
+    fclose(f);
+
+    long offset = TRACE_MAGIC_SIZE;
+    while(offset + sizeof(struct TRACE_RECORD) <= size) {
+        struct TRACE_RECORD rec;
+        memcpy(&rec, data + offset, sizeof(rec));
+        offset += sizeof(rec);
+        if(offset + rec.length > size) {
+            break;
+        }
+
+        uint64_t key = (uint64_t)rec.pid << 32 | rec.conn;
+        int conn;
+        if(map_get(ids, &key, sizeof(key), &conn, sizeof(conn)) != sizeof(conn)) {
+            conn = conns_count++;
+            map_add(ids, &key, sizeof(key), &conn, sizeof(conn));
+        }
+
+        if(events_count == events_size) {
+            events_size = events_size ? events_size << 1 : 1024;
+            events = realloc(events, events_size * sizeof(struct EVENT));
+            if(events == NULL) {
+                return -1;
+            }
+        }
+        struct EVENT *ev = &events[events_count];
+        ev->time_ns = rec.time_ns;
+        ev->index = events_count++;
+        ev->conn = conn;
+        ev->type = rec.type;
+        ev->length = rec.length;
+        ev->data = data + offset;
+        offset += rec.length;
+    }
+    return 0;
+}
+
+static int event_compare(const void *a, const void *b) {
+    const struct EVENT *ea = a, *eb = b;
+    if(ea->time_ns != eb->time_ns) {
+        return ea->time_ns < eb->time_ns ? -1 : 1;
+    }
+    return ea->index < eb->index ? -1 : 1;
+}
+
+static void conn_close(struct RCONN *c) {
+    if(c->fd >= 0) {
+        close(c->fd);
+    }
+    errors += c->sent_count;
+    inflight -= c->sent_count;
+    free(c->out);
+    free(c->pending);
+    free(c->sent);
+    free(c->reader);
+    memset(c, 0, sizeof(struct RCONN));
+    c->fd = -1;
+}
+
+static void conn_open(struct RCONN *c) {
+    c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    c->reader = malloc(sizeof(struct CLIENT_READER));
+    if(c->fd < 0 || c->reader == NULL) {
+        ++errors;
+        conn_close(c);
+        return;
+    }
+    client_reader_reset(c->reader);
+    if(server_addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if(connect(c->fd, (struct sockaddr *)&server_addr, server_addr_len) != 0 && errno != EINPROGRESS) {
+        ++errors;
+        conn_close(c);
+        return;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static int conn_flush(struct RCONN *c) {
+    while(c->out_sent != c->out_len) {
+        int wr = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent, MSG_NOSIGNAL);
+        if(wr < 0) {
+            if(errno == EAGAIN) {
+                struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+                epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+                return 0;
+            }
+            return -1;
+        }
+        c->out_sent += wr;
+    }
+    c->out_len = 0;
+    c->out_sent = 0;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+    return 0;
+}
+
+// Queue received bytes of traced connection and count requests completed by them
+static void conn_data(struct RCONN *c, const char *data, unsigned int length, uint64_t scheduled) {
+    if(reserve(&c->out, &c->out_size, c->out_len + length, 1) != 0 ||
+        reserve(&c->pending, &c->pending_size, c->pending_len + length, 1) != 0) {
+        ++errors;
+        conn_close(c);
+        return;
+    }
+    memcpy(c->out + c->out_len, data, length);
+    c->out_len += length;
+    memcpy(c->pending + c->pending_len, data, length);
+    c->pending_len += length;
+
+    unsigned int offset = 0;
+    while(offset < c->pending_len) {
+        int len = http_request_length(c->pending + offset, c->pending_len - offset, MAX_REQUEST_SIZE);
+        if(len == 0) {
+            break;
+        }
+        if(len < 0) {
+            // Server answers invalid request once and closes connection
+            len = c->pending_len - offset;
+        }
+        // Move answered entries out before growing the queue
+        if(c->sent_head && c->sent_head + c->sent_count == c->sent_size) {
+            memmove(c->sent, c->sent + c->sent_head, c->sent_count * sizeof(uint64_t));
+            c->sent_head = 0;
+        }
+        if(reserve(&c->sent, &c->sent_size, c->sent_head + c->sent_count + 1, sizeof(uint64_t)) != 0) {
+            break;
+        }
+        c->sent[c->sent_head + c->sent_count] = scheduled;
+        ++c->sent_count;
+        ++requests;
+        ++inflight;
+        offset += len;
+    }
+    memmove(c->pending, c->pending + offset, c->pending_len - offset);
+    c->pending_len -= offset;
+
+    if(c->connected && c->out_len == length && conn_flush(c) != 0) {
+        ++errors;
+        conn_close(c);
+    }
+}
+
+static void conn_response(void *ctx, int status) {
+    struct RCONN *c = ctx;
+    if(c->sent_count == 0) {
+        return;
+    }
+    client_hist_add(&hist, loop_now - c->sent[c->sent_head]);
+    ++c->sent_head;
+    if(--c->sent_count == 0) {
+        c->sent_head = 0;
+    }
+    --inflight;
+    ++responses;
+    if(status < 200 || status > 299) {
+        ++non2xx;
+    }
+}
+
+static void event_dispatch(struct EVENT *ev, uint64_t scheduled) {
+    struct RCONN *c = &conns[ev->conn];
+    switch(ev->type) {
+        case TRACE_OPEN:
+            conn_open(c);
+            break;
+        case TRACE_DATA:
+            if(c->fd >= 0) {
+                conn_data(c, ev->data, ev->length, scheduled);
+            }
+            break;
+        case TRACE_CLOSE:
+            c->closing = 1;
+            if(c->fd >= 0 && c->sent_count == 0 && c->out_len == 0) {
+                conn_close(c);
+            }
+            break;
+    }
+}
+
+static void usage(char *argv0) {
+    printf("Usage: %s [options] trace...\n", argv0);
+    printf("  -H host   : server host (127.0.0.1)\n");
+    printf("  -p port   : server port (9000)\n");
+    printf("  -u path   : connect to Unix domain socket instead\n");
+    printf("  -s speed  : replay speed, 2 sends twice as fast as captured (1)\n");
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while((opt = getopt(argc, argv, "H:p:u:s:h")) > 0) {
+        switch(opt) {
+            case 'H':
+                host = optarg;
+                break;
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'u':
+                unix_path = optarg;
+                break;
+            case 's':
+                speed = atof(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind == argc || speed <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if(resolve() != 0) {
+        fprintf(stderr, "Can't resolve server address\n");
+        return 1;
+    }
+
+    struct MAP ids = {.objects = NULL, .length = 0};
+    for(int i = optind; i < argc; ++i) {
+        if(trace_load(argv[i], &ids) != 0) {
+            fprintf(stderr, "Can't read trace %s\n", argv[i]);
+            return 1;
+        }
+    }
+    map_destroy(&ids);
+    if(events_count == 0) {
+        fprintf(stderr, "Trace is empty\n");
+        return 1;
+    }
+    qsort(events, events_count, sizeof(struct EVENT), event_compare);
+
+    struct rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    conns = calloc(conns_count, sizeof(struct RCONN));
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(conns == NULL || epollfd < 0) {
+        fprintf(stderr, "Can't allocate connections\n");
+        return 1;
+    }
+    for(int i = 0; i != conns_count; ++i) {
+        conns[i].fd = -1;
+    }
+
+    uint64_t first = events[0].time_ns;
+    uint64_t started = now_ns();
+    uint64_t next = 0;
+    uint64_t drain_deadline = 0;
+    struct epoll_event ready[MAX_EVENTS];
+
+    while(1) {
+        uint64_t now = now_ns();
+        loop_now = now;
+        while(next != events_count) {
+            uint64_t due = started + (events[next].time_ns - first) / speed;
+            if(due > now) {
+                break;
+            }
+            if(now - due > max_lag) {
+                max_lag = now - due;
+            }
+            event_dispatch(&events[next++], due);
+        }
+
+        if(next == events_count) {
+            if(drain_deadline == 0) {
+                drain_deadline = now + DRAIN_TIMEOUT_NS;
+            }
+            if(inflight == 0 || now >= drain_deadline) {
+                break;
+            }
+        }
+
+        struct timespec timeout = {.tv_nsec = 100000000};
+        if(next != events_count) {
+            uint64_t due = started + (events[next].time_ns - first) / speed;
+            uint64_t wait = due > now ? due - now : 0;
+            timeout.tv_sec = wait / 1000000000;
+            timeout.tv_nsec = wait % 1000000000;
+        }
+        int nfds = epoll_pwait2(epollfd, ready, MAX_EVENTS, &timeout, NULL);
+        loop_now = now_ns();
+
+        for(int i = 0; i < nfds; ++i) {
+            struct RCONN *c = ready[i].data.ptr;
+            if(c->fd < 0) {
+                continue;
+            }
+
+            if(ready[i].events & EPOLLOUT) {
+                if(c->connected == 0) {
+                    int err = 0;
+                    socklen_t len = sizeof(err);
+                    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+                    if(err) {
+                        ++errors;
+                        conn_close(c);
+                        continue;
+                    }
+                    c->connected = 1;
+                }
+                if(conn_flush(c) != 0) {
+                    conn_close(c);
+                    continue;
+                }
+            }
+
+            if(ready[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                struct CLIENT_READER *reader = c->reader;
+                int rd = recv(c->fd, reader->in + reader->in_len, CLIENT_READ_BUFFER_SIZE - reader->in_len, 0);
+                if(rd < 0 && errno == EAGAIN) {
+                    continue;
+                }
+                if(rd <= 0) {
+                    conn_close(c);
+                    continue;
+                }
+                reader->in_len += rd;
+                if(client_parse(reader, conn_response, c) != CLIENT_OK) {
+                    conn_close(c);
+                    continue;
+                }
+                if(c->closing && c->sent_count == 0 && c->out_len == 0) {
+                    conn_close(c);
+                }
+            }
+        }
+    }
+
+    double elapsed = (now_ns() - started) / 1e9;
+    printf("{\"trace\":\"%s\",\"speed\":%.2f,\"connections\":%i,\"requests\":%lu,\"responses\":%lu,\"errors\":%lu,"
+        "\"non2xx\":%lu,\"duration\":%.2f,\"rps\":%.0f,\"max_lag_us\":%.1f,", argv[optind], speed, conns_count,
+        (unsigned long)requests, (unsigned long)responses, (unsigned long)(errors + inflight), (unsigned long)non2xx,
+        elapsed, responses / elapsed, max_lag / 1e3);
+    client_hist_print(&hist, stdout);
+    printf("}\n");
+
+    for(int i = 0; i != conns_count; ++i) {
+        conn_close(&conns[i]);
+    }
+    return responses ? 0 : 1;
+}
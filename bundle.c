@@ -0,0 +1,98 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bundle.h"
+
+// FNV-1a
+uint64_t bundle_hash(const char *path, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for(size_t i = 0; i != len; ++i) {
+        hash = (hash ^ (uint8_t)path[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static int bundle_block_valid(const struct BUNDLE *bundle, const struct BUNDLE_BLOCK *block) {
+    return block->offset <= bundle->size && block->len <= bundle->size - block->offset;
+}
+
+int bundle_open(struct BUNDLE *bundle, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return BUNDLE_OPEN_ERROR;
+    }
+    struct stat st;
+    if(fstat(fd, &st) != 0 || st.st_size < sizeof(struct BUNDLE_FILE_HEADER)) {
+        close(fd);
+        return BUNDLE_FORMAT_ERROR;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(data == MAP_FAILED) {
+        return BUNDLE_MMAP_ERROR;
+    }
+
+    bundle->data = data;
+    bundle->size = st.st_size;
+    const struct BUNDLE_FILE_HEADER *header = data;
+    struct BUNDLE_BLOCK index = {.offset = header->index, .len = (uint64_t)header->count * sizeof(struct BUNDLE_ENTRY)};
+    if(memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 || header->version != BUNDLE_VERSION ||
+            header->size != st.st_size || index.offset % sizeof(uint64_t) || !bundle_block_valid(bundle, &index)) {
+        bundle_close(bundle);
+        return BUNDLE_FORMAT_ERROR;
+    }
+    bundle->entries = (const struct BUNDLE_ENTRY *)(bundle->data + index.offset);
+    bundle->count = header->count;
+
+    // Validate once, so lookups don't check bounds
+    for(uint32_t i = 0; i != bundle->count; ++i) {
+        const struct BUNDLE_ENTRY *entry = &bundle->entries[i];
+        int valid = bundle_block_valid(bundle, &entry->path) && bundle_block_valid(bundle, &entry->etag) && bundle_block_valid(bundle, &entry->not_modified);
+        for(int v = 0; v != BUNDLE_VARIANTS; ++v) {
+            valid = valid && bundle_block_valid(bundle, &entry->headers[v]) && bundle_block_valid(bundle, &entry->bodies[v]);
+        }
+        if(!valid || entry->headers[BUNDLE_IDENTITY].len == 0 || (i && entry->hash < bundle->entries[i - 1].hash)) {
+            bundle_close(bundle);
+            return BUNDLE_FORMAT_ERROR;
+        }
+    }
+    return BUNDLE_OK;
+}
+
+const struct BUNDLE_ENTRY *bundle_find(const struct BUNDLE *bundle, const char *path, size_t len) {
+    if(bundle->count == 0) {
+        return NULL;
+    }
+    uint64_t hash = bundle_hash(path, len);
+
+    // Lower bound without branches on comparison result
+    const struct BUNDLE_ENTRY *base = bundle->entries;
+    uint32_t n = bundle->count;
+    while(n > 1) {
+        uint32_t half = n / 2;
+        base = base[half - 1].hash < hash ? base + half : base;
+        n -= half;
+    }
+    base += base->hash < hash;
+
+    const struct BUNDLE_ENTRY *end = bundle->entries + bundle->count;
+    for(; base != end && base->hash == hash; ++base) {
+        if(base->path.len == len && memcmp(bundle->data + base->path.offset, path, len) == 0) {
+            return base;
+        }
+    }
+    return NULL;
+}
+
+void bundle_close(struct BUNDLE *bundle) {
+    if(bundle->data) {
+        munmap((void *)bundle->data, bundle->size);
+    }
+    bundle->data = NULL;
+    bundle->entries = NULL;
+    bundle->count = 0;
+}
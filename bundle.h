@@ -0,0 +1,72 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _BUNDLE_H
+#define _BUNDLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Site packed by tinyhttp-pack: file header, page aligned bodies, strings with paths and
+// precomputed response headers, and index of entries sorted by path hash
+#define BUNDLE_MAGIC    "TINYPACK"
+#define BUNDLE_VERSION  1
+#define BUNDLE_ALIGN    4096
+
+#define BUNDLE_IDENTITY  0
+#define BUNDLE_GZIP      1
+#define BUNDLE_VARIANTS  2
+
+#define BUNDLE_OPEN_ERROR    -1
+#define BUNDLE_FORMAT_ERROR  -2
+#define BUNDLE_MMAP_ERROR    -3
+#define BUNDLE_OK             0
+
+// Offset and length of data in bundle
+struct BUNDLE_BLOCK {
+    uint64_t offset;
+    uint64_t len;
+};
+
+struct BUNDLE_FILE_HEADER {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    // Array of count entries
+    uint64_t index;
+    uint64_t size;
+};
+
+struct BUNDLE_ENTRY {
+    uint64_t hash;
+    struct BUNDLE_BLOCK path;
+    // Quoted ETag
+    struct BUNDLE_BLOCK etag;
+    // Status line and headers without Connection and final CRLF, length 0 if variant is absent
+    struct BUNDLE_BLOCK headers[BUNDLE_VARIANTS];
+    struct BUNDLE_BLOCK bodies[BUNDLE_VARIANTS];
+    // 304 response in the same form
+    struct BUNDLE_BLOCK not_modified;
+};
+
+struct BUNDLE {
+    const char *data;
+    size_t size;
+    const struct BUNDLE_ENTRY *entries;
+    uint32_t count;
+};
+
+// Hash of request path
+// Return hash
+uint64_t bundle_hash(const char *path, size_t len);
+
+// Map bundle file 'path' read only, must be called before fork to share mapping
+// Return error code
+int bundle_open(struct BUNDLE *bundle, const char *path);
+
+// Find entry of request path
+// Return entry or NULL
+const struct BUNDLE_ENTRY *bundle_find(const struct BUNDLE *bundle, const char *path, size_t len);
+
+void bundle_close(struct BUNDLE *bundle);
+
+#endif
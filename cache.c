@@ -0,0 +1,225 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "cache.h"
+
+#define CACHE_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define CACHE_STORE(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+
+// Calculate FNV-1a hash
+static uint32_t cache_hash(const char *key, int len) {
+    uint32_t hash = 2166136261u;
+    while(len--) {
+        hash = (hash ^ (uint8_t)*key++) * 16777619u;
+    }
+    return hash;
+}
+
+static struct CACHE_SLOT *cache_set(struct CACHE *cache, uint32_t hash) {
+    return &cache->slots[(hash % cache->sets) * CACHE_WAYS];
+}
+
+static int cache_match(struct CACHE_SLOT *slot, uint32_t hash, const char *key, int key_len) {
+    return CACHE_LOAD(slot->hash) == hash && CACHE_LOAD(slot->key_len) == key_len && memcmp(slot->key, key, key_len) == 0;
+}
+
+int cache_init(struct CACHE *cache) {
+    if(cache->size == 0) {
+        cache->size = CACHE_DEFAULT_SIZE;
+    }
+    cache->sets = cache->size / (sizeof(struct CACHE_SLOT) * CACHE_WAYS);
+    if(cache->sets == 0) {
+        cache->sets = 1;
+    }
+
+    size_t size = (size_t)cache->sets * CACHE_WAYS * sizeof(struct CACHE_SLOT);
+    cache->slots = mmap(NULL, size + CACHE_FLIGHTS * sizeof(struct CACHE_FLIGHT), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(cache->slots == MAP_FAILED) {
+        cache->slots = NULL;
+        return CACHE_MALLOC_ERROR;
+    }
+    cache->flights = (struct CACHE_FLIGHT *)((char *)cache->slots + size);
+    return CACHE_OK;
+}
+
+int cache_vary(struct CACHE *cache, const char *name) {
+    if(cache->vary_count == CACHE_MAX_VARY || strlen(name) >= CACHE_VARY_SIZE) {
+        return CACHE_PARAM_ERROR;
+    }
+    strcpy(cache->vary[cache->vary_count++], name);
+    return CACHE_OK;
+}
+
+int cache_key(struct CACHE *cache, char *key, request_t *req, struct MAP *headers) {
+    const http_method_t *method = &http_methods[req->method];
+    int path_len = strlen(req->path);
+    int query_len = req->query ? strlen(req->query) : 0;
+    if(method->len + path_len + 1 + query_len > CACHE_KEY_SIZE) {
+        return CACHE_KEY_ERROR;
+    }
+
+    int len = 0;
+    memcpy(key, method->name, method->len);
+    len += method->len;
+    memcpy(key + len, req->path, path_len);
+    len += path_len;
+    key[len++] = '?';
+    memcpy(key + len, req->query, query_len);
+    len += query_len;
+
+    for(int i = 0; i != cache->vary_count; ++i) {
+        if(len == CACHE_KEY_SIZE) {
+            return CACHE_KEY_ERROR;
+        }
+        key[len++] = '\n';
+        int value_len = http_header_get(req, headers, cache->vary[i], strlen(cache->vary[i]), key + len, CACHE_KEY_SIZE - len);
+        if(value_len == MAP_VALUE_ERROR) {
+            return CACHE_KEY_ERROR;
+        }
+        if(value_len > 0) {
+            len += value_len;
+        }
+    }
+    return len;
+}
+
+int cache_get(struct CACHE *cache, const char *key, int key_len, uint64_t now, struct CACHE_ENTRY *entry) {
+    if(cache->slots == NULL) {
+        return CACHE_MISS;
+    }
+    uint32_t hash = cache_hash(key, key_len);
+    struct CACHE_SLOT *set = cache_set(cache, hash);
+
+    for(int i = 0; i != CACHE_WAYS; ++i) {
+        struct CACHE_SLOT *slot = &set[i];
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if((seq & 1) || !cache_match(slot, hash, key, key_len)) {
+            continue;
+        }
+
+        uint64_t fresh_until = CACHE_LOAD(slot->fresh_until);
+        uint64_t stale_until = CACHE_LOAD(slot->stale_until);
+        entry->body_len = CACHE_LOAD(slot->body_len);
+        memcpy(entry->content_type, slot->content_type, CACHE_TYPE_SIZE);
+        memcpy(entry->body, slot->body, entry->body_len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        // Slot was rewritten while copying
+        if(CACHE_LOAD(slot->seq) != seq) {
+            return CACHE_MISS;
+        }
+        entry->content_type[CACHE_TYPE_SIZE - 1] = 0;
+
+        if(now < fresh_until) {
+            CACHE_STORE(slot->used, now);
+            return CACHE_FRESH;
+        }
+        if(now >= stale_until) {
+            return CACHE_MISS;
+        }
+
+        // Stale: the first request refreshes it, the rest are served stale meanwhile
+        CACHE_STORE(slot->used, now);
+        uint64_t revalidating = CACHE_LOAD(slot->revalidating_until);
+        if(revalidating > now || !__atomic_compare_exchange_n(&slot->revalidating_until, &revalidating,
+            now + CACHE_REVALIDATE_US, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return CACHE_STALE;
+        }
+        return CACHE_REFRESH;
+    }
+    return CACHE_MISS;
+}
+
+int cache_put(struct CACHE *cache, const char *key, int key_len, const char *body, unsigned int body_len,
+    const char *content_type, unsigned int ttl, uint64_t now) {
+    if(cache->slots == NULL || key_len > CACHE_KEY_SIZE || body_len > CACHE_BODY_SIZE) {
+        return CACHE_PARAM_ERROR;
+    }
+    uint32_t hash = cache_hash(key, key_len);
+    struct CACHE_SLOT *set = cache_set(cache, hash);
+
+    // Same key, else empty slot, else least recently used one
+    struct CACHE_SLOT *slot = NULL;
+    for(int i = 0; i != CACHE_WAYS; ++i) {
+        if(cache_match(&set[i], hash, key, key_len)) {
+            slot = &set[i];
+            break;
+        }
+        if(slot == NULL || CACHE_LOAD(set[i].used) < CACHE_LOAD(slot->used)) {
+            slot = &set[i];
+        }
+    }
+
+    // Another worker writes this slot, its response is as good as ours
+    uint32_t seq = CACHE_LOAD(slot->seq);
+    if((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        return CACHE_OK;
+    }
+
+    CACHE_STORE(slot->hash, hash);
+    CACHE_STORE(slot->key_len, key_len);
+    CACHE_STORE(slot->body_len, body_len);
+    CACHE_STORE(slot->fresh_until, now + ttl * 1000000ull);
+    CACHE_STORE(slot->stale_until, now + (ttl + cache->stale) * 1000000ull);
+    CACHE_STORE(slot->revalidating_until, 0);
+    CACHE_STORE(slot->used, now);
+    strncpy(slot->content_type, content_type, CACHE_TYPE_SIZE - 1);
+    memcpy(slot->key, key, key_len);
+    memcpy(slot->body, body, body_len);
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    return CACHE_OK;
+}
+
+void cache_release(struct CACHE *cache, const char *key, int key_len) {
+    if(cache->slots == NULL) {
+        return;
+    }
+    uint32_t hash = cache_hash(key, key_len);
+    struct CACHE_SLOT *set = cache_set(cache, hash);
+    for(int i = 0; i != CACHE_WAYS; ++i) {
+        if(cache_match(&set[i], hash, key, key_len)) {
+            CACHE_STORE(set[i].revalidating_until, 0);
+            return;
+        }
+    }
+}
+
+int cache_claim(struct CACHE *cache, const char *key, int key_len, uint64_t now, uint64_t until) {
+    if(cache->flights == NULL) {
+        return 1;
+    }
+    uint32_t hash = cache_hash(key, key_len);
+    for(int i = 0; i != CACHE_FLIGHT_PROBES; ++i) {
+        struct CACHE_FLIGHT *flight = &cache->flights[(hash + i) % CACHE_FLIGHTS];
+        uint64_t flight_until = CACHE_LOAD(flight->until);
+        if(flight_until > now) {
+            if(CACHE_LOAD(flight->hash) == hash) {
+                return 0;
+            }
+            continue;
+        }
+        if(__atomic_compare_exchange_n(&flight->until, &flight_until, until, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            CACHE_STORE(flight->hash, hash);
+            CACHE_STORE(flight->pid, getpid());
+            return 1;
+        }
+    }
+    // Every probe is taken, run without coalescing
+    return 1;
+}
+
+void cache_unclaim(struct CACHE *cache, const char *key, int key_len) {
+    if(cache->flights == NULL) {
+        return;
+    }
+    uint32_t hash = cache_hash(key, key_len);
+    for(int i = 0; i != CACHE_FLIGHT_PROBES; ++i) {
+        struct CACHE_FLIGHT *flight = &cache->flights[(hash + i) % CACHE_FLIGHTS];
+        if(CACHE_LOAD(flight->hash) == hash && CACHE_LOAD(flight->pid) == getpid()) {
+            CACHE_STORE(flight->until, 0);
+            return;
+        }
+    }
+}
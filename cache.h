@@ -0,0 +1,111 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "map.h"
+#include "http.h"
+
+// Responses are kept in fixed slots of a shared segment, so all workers see them.
+// Slot index is picked by key hash from a set of CACHE_WAYS, the least recently used
+// slot of the set is replaced
+#define CACHE_KEY_SIZE       256
+#define CACHE_BODY_SIZE      4096
+#define CACHE_TYPE_SIZE      64
+#define CACHE_WAYS           4
+#define CACHE_MAX_VARY       4
+#define CACHE_VARY_SIZE      64
+#define CACHE_DEFAULT_SIZE   (16 << 20)
+// Stale entry is served by others while one request refreshes it for up to this long
+#define CACHE_REVALIDATE_US  10000000
+// Keys being filled after a miss, a worker waits for another one instead of running the same CGI
+#define CACHE_FLIGHTS        1024
+#define CACHE_FLIGHT_PROBES  4
+
+#define CACHE_MISS        0
+#define CACHE_FRESH       1
+#define CACHE_STALE       2
+#define CACHE_REFRESH     3
+
+#define CACHE_PARAM_ERROR   -1
+#define CACHE_MALLOC_ERROR  -2
+#define CACHE_KEY_ERROR     -3
+#define CACHE_OK             0
+
+struct CACHE_SLOT {
+    // Odd while slot is written
+    uint32_t seq;
+    uint32_t hash;
+    // CLOCK_MONOTONIC microseconds
+    uint64_t fresh_until;
+    uint64_t stale_until;
+    uint64_t revalidating_until;
+    uint64_t used;
+    uint16_t key_len;
+    uint16_t body_len;
+    char content_type[CACHE_TYPE_SIZE];
+    char key[CACHE_KEY_SIZE];
+    char body[CACHE_BODY_SIZE];
+};
+
+struct CACHE_FLIGHT {
+    uint32_t hash;
+    int32_t pid;
+    // CLOCK_MONOTONIC microseconds, the claim is abandoned after it
+    uint64_t until;
+};
+
+struct CACHE {
+    struct CACHE_SLOT *slots;
+    struct CACHE_FLIGHT *flights;
+    unsigned int sets;
+    size_t size;
+    // Seconds a stale entry may still be served while it is refreshed
+    unsigned int stale;
+    // Request headers that are part of the key
+    char vary[CACHE_MAX_VARY][CACHE_VARY_SIZE];
+    int vary_count;
+};
+
+// Copy of a cached response
+struct CACHE_ENTRY {
+    char content_type[CACHE_TYPE_SIZE];
+    char body[CACHE_BODY_SIZE];
+    unsigned int body_len;
+};
+
+// Map shared segment of 'cache->size' bytes, must be called before fork
+// Return error code
+int cache_init(struct CACHE *cache);
+
+// Add request header 'name' into cache key
+// Return error code
+int cache_vary(struct CACHE *cache, const char *name);
+
+// Build key of request from method, path, query and vary headers
+// Return key length or CACHE_KEY_ERROR if it doesn't fit into CACHE_KEY_SIZE
+int cache_key(struct CACHE *cache, char *key, request_t *req, struct MAP *headers);
+
+// Look up 'key' and copy response into 'entry'. The first request that finds an entry stale
+// claims its refresh and gets CACHE_REFRESH, the rest get CACHE_STALE meanwhile
+// Return CACHE_FRESH, CACHE_STALE, CACHE_REFRESH or CACHE_MISS
+int cache_get(struct CACHE *cache, const char *key, int key_len, uint64_t now, struct CACHE_ENTRY *entry);
+
+// Store response for 'ttl' seconds, it may be served stale for cache->stale seconds after that
+// Return error code
+int cache_put(struct CACHE *cache, const char *key, int key_len, const char *body, unsigned int body_len,
+    const char *content_type, unsigned int ttl, uint64_t now);
+
+// Drop refresh claim of 'key' after failed refresh so the next request retries it
+void cache_release(struct CACHE *cache, const char *key, int key_len);
+
+// Claim filling of missing 'key' until 'until', others wait for the response to appear in cache
+// Return 1 if the caller should run the request, 0 if another process fills it
+int cache_claim(struct CACHE *cache, const char *key, int key_len, uint64_t now, uint64_t until);
+
+// Drop fill claim of 'key' taken by this process
+void cache_unclaim(struct CACHE *cache, const char *key, int key_len);
+
+#endif
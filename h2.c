@@ -0,0 +1,578 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <stdlib.h>
+#include <string.h>
+#include "h2.h"
+
+struct HPACK_STATIC {
+    const char *name;
+    unsigned int name_len;
+    const char *value;
+    unsigned int value_len;
+};
+
+static const struct HPACK_STATIC hpack_static[HPACK_STATIC_COUNT] = {
+    {":authority", 10, "", 0},
+    {":method", 7, "GET", 3},
+    {":method", 7, "POST", 4},
+    {":path", 5, "/", 1},
+    {":path", 5, "/index.html", 11},
+    {":scheme", 7, "http", 4},
+    {":scheme", 7, "https", 5},
+    {":status", 7, "200", 3},
+    {":status", 7, "204", 3},
+    {":status", 7, "206", 3},
+    {":status", 7, "304", 3},
+    {":status", 7, "400", 3},
+    {":status", 7, "404", 3},
+    {":status", 7, "500", 3},
+    {"accept-charset", 14, "", 0},
+    {"accept-encoding", 15, "gzip, deflate", 13},
+    {"accept-language", 15, "", 0},
+    {"accept-ranges", 13, "", 0},
+    {"accept", 6, "", 0},
+    {"access-control-allow-origin", 27, "", 0},
+    {"age", 3, "", 0},
+    {"allow", 5, "", 0},
+    {"authorization", 13, "", 0},
+    {"cache-control", 13, "", 0},
+    {"content-disposition", 19, "", 0},
+    {"content-encoding", 16, "", 0},
+    {"content-language", 16, "", 0},
+    {"content-length", 14, "", 0},
+    {"content-location", 16, "", 0},
+    {"content-range", 13, "", 0},
+    {"content-type", 12, "", 0},
+    {"cookie", 6, "", 0},
+    {"date", 4, "", 0},
+    {"etag", 4, "", 0},
+    {"expect", 6, "", 0},
+    {"expires", 7, "", 0},
+    {"from", 4, "", 0},
+    {"host", 4, "", 0},
+    {"if-match", 8, "", 0},
+    {"if-modified-since", 17, "", 0},
+    {"if-none-match", 13, "", 0},
+    {"if-range", 8, "", 0},
+    {"if-unmodified-since", 19, "", 0},
+    {"last-modified", 13, "", 0},
+    {"link", 4, "", 0},
+    {"location", 8, "", 0},
+    {"max-forwards", 12, "", 0},
+    {"proxy-authenticate", 18, "", 0},
+    {"proxy-authorization", 19, "", 0},
+    {"range", 5, "", 0},
+    {"referer", 7, "", 0},
+    {"refresh", 7, "", 0},
+    {"retry-after", 11, "", 0},
+    {"server", 6, "", 0},
+    {"set-cookie", 10, "", 0},
+    {"strict-transport-security", 25, "", 0},
+    {"transfer-encoding", 17, "", 0},
+    {"user-agent", 10, "", 0},
+    {"vary", 4, "", 0},
+    {"via", 3, "", 0},
+    {"www-authenticate", 16, "", 0},
+};
+
+// Code lengths of canonical Huffman code, symbol 256 is EOS
+static const uint8_t hpack_huffman_bits[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30
+};
+
+#define HPACK_HUFFMAN_MAX_BITS  30
+
+// Codes and decoding tables derived from code lengths
+static uint32_t hpack_huffman_codes[257];
+static uint32_t hpack_huffman_first[HPACK_HUFFMAN_MAX_BITS + 1];
+static uint16_t hpack_huffman_count[HPACK_HUFFMAN_MAX_BITS + 1];
+static uint16_t hpack_huffman_offset[HPACK_HUFFMAN_MAX_BITS + 1];
+static uint16_t hpack_huffman_symbols[257];
+static int hpack_huffman_ready = 0;
+
+static void hpack_huffman_init(void) {
+    for(int sym = 0; sym != 257; ++sym) {
+        ++hpack_huffman_count[hpack_huffman_bits[sym]];
+    }
+    uint32_t code = 0;
+    uint16_t offset = 0;
+    for(int len = 1; len <= HPACK_HUFFMAN_MAX_BITS; ++len) {
+        hpack_huffman_first[len] = code;
+        hpack_huffman_offset[len] = offset;
+        code = (code + hpack_huffman_count[len]) << 1;
+        offset += hpack_huffman_count[len];
+    }
+    // Symbols of one length get consecutive codes in symbol order
+    uint16_t fill[HPACK_HUFFMAN_MAX_BITS + 1] = {0};
+    for(int sym = 0; sym != 257; ++sym) {
+        int len = hpack_huffman_bits[sym];
+        hpack_huffman_codes[sym] = hpack_huffman_first[len] + fill[len];
+        hpack_huffman_symbols[hpack_huffman_offset[len] + fill[len]++] = sym;
+    }
+    hpack_huffman_ready = 1;
+}
+
+// Return decoded length or HPACK_ERROR
+static int hpack_huffman_decode(const uint8_t *in, unsigned int len, char *out, unsigned int size) {
+    uint64_t bits = 0;
+    int count = 0;
+    unsigned int n = 0;
+    for(unsigned int i = 0; i != len; ++i) {
+        bits = (bits << 8) | in[i];
+        count += 8;
+        while(count >= 5) {
+            int found = 0;
+            for(int l = 5; l <= count && l <= HPACK_HUFFMAN_MAX_BITS; ++l) {
+                uint32_t code = (bits >> (count - l)) & ((1u << l) - 1);
+                if(code - hpack_huffman_first[l] < hpack_huffman_count[l]) {
+                    int sym = hpack_huffman_symbols[hpack_huffman_offset[l] + code - hpack_huffman_first[l]];
+                    if(sym == 256 || n == size) {
+                        return HPACK_ERROR;
+                    }
+                    out[n++] = sym;
+                    count -= l;
+                    bits &= (1ull << count) - 1;
+                    found = 1;
+                    break;
+                }
+            }
+            if(!found) {
+                if(count >= HPACK_HUFFMAN_MAX_BITS) {
+                    return HPACK_ERROR;
+                }
+                break;
+            }
+        }
+    }
+    // Padding is a prefix of EOS, all ones and shorter than a byte
+    if(count >= 8 || bits != (1ull << count) - 1) {
+        return HPACK_ERROR;
+    }
+    return n;
+}
+
+// Return number of bytes or HPACK_SPACE_ERROR
+static int hpack_huffman_encode(const char *in, unsigned int len, uint8_t *out, unsigned int size) {
+    uint64_t bits = 0;
+    int count = 0;
+    unsigned int n = 0;
+    for(unsigned int i = 0; i != len; ++i) {
+        uint8_t sym = in[i];
+        bits = (bits << hpack_huffman_bits[sym]) | hpack_huffman_codes[sym];
+        count += hpack_huffman_bits[sym];
+        while(count >= 8) {
+            if(n == size) {
+                return HPACK_SPACE_ERROR;
+            }
+            count -= 8;
+            out[n++] = bits >> count;
+        }
+    }
+    if(count) {
+        if(n == size) {
+            return HPACK_SPACE_ERROR;
+        }
+        out[n++] = (bits << (8 - count)) | (0xff >> count);
+    }
+    return n;
+}
+
+static unsigned int hpack_huffman_length(const char *in, unsigned int len) {
+    unsigned int bits = 0;
+    for(unsigned int i = 0; i != len; ++i) {
+        bits += hpack_huffman_bits[(uint8_t)in[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+// Return number of bytes read or HPACK_ERROR
+static int hpack_int_decode(const uint8_t *in, unsigned int len, int prefix, uint32_t *value) {
+    if(len == 0) {
+        return HPACK_ERROR;
+    }
+    uint32_t max = (1u << prefix) - 1;
+    *value = in[0] & max;
+    if(*value != max) {
+        return 1;
+    }
+    for(unsigned int i = 1, shift = 0; i != len && shift <= 21; ++i, shift += 7) {
+        *value += (uint32_t)(in[i] & 0x7f) << shift;
+        if((in[i] & 0x80) == 0) {
+            return i + 1;
+        }
+    }
+    return HPACK_ERROR;
+}
+
+// Write integer with 'prefix' bits into first byte that already holds 'flags'
+// Return number of bytes or HPACK_SPACE_ERROR
+static int hpack_int_encode(uint8_t *out, unsigned int size, int prefix, uint8_t flags, uint32_t value) {
+    uint32_t max = (1u << prefix) - 1;
+    if(size == 0) {
+        return HPACK_SPACE_ERROR;
+    }
+    if(value < max) {
+        out[0] = flags | value;
+        return 1;
+    }
+    out[0] = flags | max;
+    value -= max;
+    unsigned int n = 1;
+    for(; value >= 0x80; value >>= 7) {
+        if(n == size) {
+            return HPACK_SPACE_ERROR;
+        }
+        out[n++] = (value & 0x7f) | 0x80;
+    }
+    if(n == size) {
+        return HPACK_SPACE_ERROR;
+    }
+    out[n++] = value;
+    return n;
+}
+
+// Return number of bytes or HPACK_SPACE_ERROR
+static int hpack_string_encode(uint8_t *out, unsigned int size, const char *str, unsigned int len) {
+    unsigned int huffman = hpack_huffman_length(str, len);
+    int n = hpack_int_encode(out, size, 7, huffman < len ? 0x80 : 0, huffman < len ? huffman : len);
+    if(n < 0 || n + (huffman < len ? huffman : len) > size) {
+        return HPACK_SPACE_ERROR;
+    }
+    if(huffman < len) {
+        return n + hpack_huffman_encode(str, len, out + n, size - n);
+    }
+    memcpy(out + n, str, len);
+    return n + len;
+}
+
+// Read string into 'out', 'len' is set to its length
+// Return number of bytes read or HPACK_ERROR
+static int hpack_string_decode(const uint8_t *in, unsigned int in_len, char *out, unsigned int size, unsigned int *len) {
+    uint32_t str_len;
+    int n = hpack_int_decode(in, in_len, 7, &str_len);
+    if(n < 0 || str_len > in_len - n) {
+        return HPACK_ERROR;
+    }
+    if(in[0] & 0x80) {
+        int decoded = hpack_huffman_decode(in + n, str_len, out, size);
+        if(decoded < 0) {
+            return HPACK_ERROR;
+        }
+        *len = decoded;
+    }
+    else {
+        if(str_len > size) {
+            return HPACK_ERROR;
+        }
+        memcpy(out, in + n, str_len);
+        *len = str_len;
+    }
+    return n + str_len;
+}
+
+static void hpack_evict(struct HPACK *hpack) {
+    struct HPACK_ENTRY *entry = &hpack->entries[(hpack->first + hpack->count - 1) % HPACK_MAX_ENTRIES];
+    hpack->size -= entry->name_len + entry->value_len + HPACK_ENTRY_OVERHEAD;
+    free(entry->data);
+    entry->data = NULL;
+    --hpack->count;
+}
+
+// Insert entry, evicting the oldest ones
+// Return 0 or HPACK_MEMORY_ERROR
+static int hpack_add(struct HPACK *hpack, const char *name, unsigned int name_len, const char *value, unsigned int value_len) {
+    unsigned int size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    // Entry larger than the table empties it
+    if(size > hpack->max_size) {
+        while(hpack->count) {
+            hpack_evict(hpack);
+        }
+        return 0;
+    }
+    char *data = malloc(name_len + value_len ? name_len + value_len : 1);
+    if(data == NULL) {
+        return HPACK_MEMORY_ERROR;
+    }
+    while(hpack->count && hpack->size + size > hpack->max_size) {
+        hpack_evict(hpack);
+    }
+    memcpy(data, name, name_len);
+    memcpy(data + name_len, value, value_len);
+    hpack->first = (hpack->first + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    hpack->entries[hpack->first] = (struct HPACK_ENTRY){.data = data, .name_len = name_len, .value_len = value_len};
+    ++hpack->count;
+    hpack->size += size;
+    return 0;
+}
+
+// Find entry by index of combined static and dynamic tables
+// Return 0 if index is out of both
+static int hpack_get(struct HPACK *hpack, uint32_t index, const char **name, unsigned int *name_len, const char **value, unsigned int *value_len) {
+    if(index == 0) {
+        return 0;
+    }
+    if(index <= HPACK_STATIC_COUNT) {
+        const struct HPACK_STATIC *entry = &hpack_static[index - 1];
+        *name = entry->name;
+        *name_len = entry->name_len;
+        *value = entry->value;
+        *value_len = entry->value_len;
+        return 1;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if(index >= hpack->count) {
+        return 0;
+    }
+    const struct HPACK_ENTRY *entry = &hpack->entries[(hpack->first + index) % HPACK_MAX_ENTRIES];
+    *name = entry->data;
+    *name_len = entry->name_len;
+    *value = entry->data + entry->name_len;
+    *value_len = entry->value_len;
+    return 1;
+}
+
+void hpack_init(struct HPACK *hpack) {
+    if(!hpack_huffman_ready) {
+        hpack_huffman_init();
+    }
+    memset(hpack, 0, sizeof(struct HPACK));
+    hpack->max_size = HPACK_TABLE_SIZE;
+}
+
+void hpack_free(struct HPACK *hpack) {
+    while(hpack->count) {
+        hpack_evict(hpack);
+    }
+}
+
+int hpack_decode(struct HPACK *hpack, const uint8_t *block, unsigned int len, struct HPACK_HEADER *headers, int max_headers, char *buffer, unsigned int size) {
+    int count = 0;
+    unsigned int used = 0;
+    unsigned int pos = 0;
+    while(pos != len) {
+        uint8_t byte = block[pos];
+        uint32_t index;
+        int n;
+        if((byte & 0xe0) == 0x20) {
+            // Table size update, up to the size announced in settings
+            n = hpack_int_decode(block + pos, len - pos, 5, &index);
+            if(n < 0 || index > HPACK_TABLE_SIZE || count) {
+                return HPACK_ERROR;
+            }
+            hpack->max_size = index;
+            while(hpack->size > hpack->max_size) {
+                hpack_evict(hpack);
+            }
+            pos += n;
+            continue;
+        }
+        if(count == max_headers) {
+            return HPACK_SPACE_ERROR;
+        }
+
+        struct HPACK_HEADER *header = &headers[count];
+        const char *name, *value;
+        unsigned int name_len, value_len;
+        if(byte & 0x80) {
+            n = hpack_int_decode(block + pos, len - pos, 7, &index);
+            if(n < 0 || !hpack_get(hpack, index, &name, &name_len, &value, &value_len)) {
+                return HPACK_ERROR;
+            }
+            pos += n;
+            if(name_len + value_len > size - used) {
+                return HPACK_SPACE_ERROR;
+            }
+            // Copied, entry may be evicted by a later one of the same block
+            header->name = memcpy(buffer + used, name, name_len);
+            header->value = memcpy(buffer + used + name_len, value, value_len);
+            header->name_len = name_len;
+            header->value_len = value_len;
+            used += name_len + value_len;
+            ++count;
+            continue;
+        }
+
+        // Literal with incremental indexing, without indexing or never indexed
+        int incremental = (byte & 0xc0) == 0x40;
+        n = hpack_int_decode(block + pos, len - pos, incremental ? 6 : 4, &index);
+        if(n < 0) {
+            return HPACK_ERROR;
+        }
+        pos += n;
+        if(index) {
+            if(!hpack_get(hpack, index, &name, &name_len, &value, &value_len)) {
+                return HPACK_ERROR;
+            }
+            if(name_len > size - used) {
+                return HPACK_SPACE_ERROR;
+            }
+            header->name = memcpy(buffer + used, name, name_len);
+            header->name_len = name_len;
+        }
+        else {
+            header->name = buffer + used;
+            n = hpack_string_decode(block + pos, len - pos, buffer + used, size - used, &header->name_len);
+            if(n < 0) {
+                return HPACK_ERROR;
+            }
+            pos += n;
+        }
+        used += header->name_len;
+        header->value = buffer + used;
+        n = hpack_string_decode(block + pos, len - pos, buffer + used, size - used, &header->value_len);
+        if(n < 0) {
+            return HPACK_ERROR;
+        }
+        pos += n;
+        used += header->value_len;
+        // Peer has added the entry, without it every later index would point to wrong one
+        if(incremental && hpack_add(hpack, header->name, header->name_len, header->value, header->value_len) != 0) {
+            return HPACK_MEMORY_ERROR;
+        }
+        ++count;
+    }
+    return count;
+}
+
+void hpack_resize(struct HPACK *hpack, unsigned int max_size) {
+    if(max_size > HPACK_TABLE_SIZE) {
+        max_size = HPACK_TABLE_SIZE;
+    }
+    if(max_size == hpack->max_size) {
+        return;
+    }
+    if(!hpack->resized || max_size < hpack->resized_min) {
+        hpack->resized_min = max_size;
+    }
+    hpack->resized = 1;
+    hpack->max_size = max_size;
+    while(hpack->size > hpack->max_size) {
+        hpack_evict(hpack);
+    }
+}
+
+int hpack_encode_start(struct HPACK *hpack, uint8_t *out, unsigned int size) {
+    if(!hpack->resized) {
+        return 0;
+    }
+    int n = 0;
+    if(hpack->resized_min < hpack->max_size) {
+        n = hpack_int_encode(out, size, 5, 0x20, hpack->resized_min);
+        if(n < 0) {
+            return n;
+        }
+    }
+    int m = hpack_int_encode(out + n, size - n, 5, 0x20, hpack->max_size);
+    if(m < 0) {
+        return m;
+    }
+    hpack->resized = 0;
+    return n + m;
+}
+
+int hpack_encode(struct HPACK *hpack, uint8_t *out, unsigned int size, const char *name, unsigned int name_len, const char *value, unsigned int value_len, int indexed) {
+    uint32_t name_index = 0;
+    for(uint32_t i = 0; i != HPACK_STATIC_COUNT; ++i) {
+        const struct HPACK_STATIC *entry = &hpack_static[i];
+        if(entry->name_len != name_len || memcmp(entry->name, name, name_len) != 0) {
+            continue;
+        }
+        if(entry->value_len == value_len && memcmp(entry->value, value, value_len) == 0) {
+            return hpack_int_encode(out, size, 7, 0x80, i + 1);
+        }
+        if(name_index == 0) {
+            name_index = i + 1;
+        }
+    }
+    for(uint32_t i = 0; i != hpack->count; ++i) {
+        const struct HPACK_ENTRY *entry = &hpack->entries[(hpack->first + i) % HPACK_MAX_ENTRIES];
+        if(entry->name_len != name_len || memcmp(entry->data, name, name_len) != 0) {
+            continue;
+        }
+        if(entry->value_len == value_len && memcmp(entry->data + name_len, value, value_len) == 0) {
+            return hpack_int_encode(out, size, 7, 0x80, HPACK_STATIC_COUNT + 1 + i);
+        }
+        if(name_index == 0) {
+            name_index = HPACK_STATIC_COUNT + 1 + i;
+        }
+    }
+
+    int n = hpack_int_encode(out, size, indexed ? 6 : 4, indexed ? 0x40 : 0, name_index);
+    if(n < 0) {
+        return n;
+    }
+    if(name_index == 0) {
+        int m = hpack_string_encode(out + n, size - n, name, name_len);
+        if(m < 0) {
+            return m;
+        }
+        n += m;
+    }
+    int m = hpack_string_encode(out + n, size - n, value, value_len);
+    if(m < 0) {
+        return m;
+    }
+    // Peer would index what our table lacks, the field is written again without indexing
+    if(indexed && hpack_add(hpack, name, name_len, value, value_len) != 0) {
+        return hpack_encode(hpack, out, size, name, name_len, value, value_len, 0);
+    }
+    return n + m;
+}
+
+void h2_frame_header(uint8_t *out, unsigned int len, uint8_t type, uint8_t flags, uint32_t stream) {
+    out[0] = len >> 16;
+    out[1] = len >> 8;
+    out[2] = len;
+    out[3] = type;
+    out[4] = flags;
+    out[5] = (stream >> 24) & 0x7f;
+    out[6] = stream >> 16;
+    out[7] = stream >> 8;
+    out[8] = stream;
+}
+
+void h2_frame_parse(const uint8_t *data, struct H2_FRAME *frame) {
+    frame->len = (data[0] << 16) | (data[1] << 8) | data[2];
+    frame->type = data[3];
+    frame->flags = data[4];
+    frame->stream = ((uint32_t)(data[5] & 0x7f) << 24) | (data[6] << 16) | (data[7] << 8) | data[8];
+}
+
+int h2_base64url(const char *in, unsigned int len, uint8_t *out, unsigned int size) {
+    uint32_t bits = 0;
+    int count = 0;
+    unsigned int n = 0;
+    for(unsigned int i = 0; i != len && in[i] != '='; ++i) {
+        char c = in[i];
+        int v = c >= 'A' && c <= 'Z' ? c - 'A' : c >= 'a' && c <= 'z' ? c - 'a' + 26 : c >= '0' && c <= '9' ? c - '0' + 52 : c == '-' ? 62 : c == '_' ? 63 : -1;
+        if(v < 0) {
+            return -1;
+        }
+        bits = (bits << 6) | v;
+        count += 6;
+        if(count >= 8) {
+            if(n == size) {
+                return -1;
+            }
+            count -= 8;
+            out[n++] = bits >> count;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,129 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _H2_H
+#define _H2_H
+
+#include <stdint.h>
+
+// HTTP/2 frames and HPACK header compression. Streams and flow control windows are kept by
+// the server, this module only encodes and decodes
+#define H2_PREFACE         "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN     24
+#define H2_FRAME_HEADER    9
+// Largest frame payload accepted by every peer
+#define H2_FRAME_SIZE      16384
+#define H2_DEFAULT_WINDOW  65535
+#define H2_MAX_WINDOW      0x7fffffff
+
+#define H2_DATA           0
+#define H2_HEADERS        1
+#define H2_PRIORITY       2
+#define H2_RST_STREAM     3
+#define H2_SETTINGS       4
+#define H2_PUSH_PROMISE   5
+#define H2_PING           6
+#define H2_GOAWAY         7
+#define H2_WINDOW_UPDATE  8
+#define H2_CONTINUATION   9
+
+#define H2_FLAG_END_STREAM   0x01
+#define H2_FLAG_ACK          0x01
+#define H2_FLAG_END_HEADERS  0x04
+#define H2_FLAG_PADDED       0x08
+#define H2_FLAG_PRIORITY     0x20
+
+#define H2_SETTINGS_HEADER_TABLE_SIZE       1
+#define H2_SETTINGS_ENABLE_PUSH             2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS  3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE     4
+#define H2_SETTINGS_MAX_FRAME_SIZE          5
+#define H2_SETTINGS_MAX_HEADER_LIST_SIZE    6
+
+#define H2_NO_ERROR             0
+#define H2_PROTOCOL_ERROR       1
+#define H2_INTERNAL_ERROR       2
+#define H2_FLOW_CONTROL_ERROR   3
+#define H2_STREAM_CLOSED        5
+#define H2_FRAME_SIZE_ERROR     6
+#define H2_REFUSED_STREAM       7
+#define H2_CANCEL               8
+#define H2_COMPRESSION_ERROR    9
+
+// Dynamic table size of both directions, larger peer settings are not used
+#define HPACK_TABLE_SIZE      4096
+#define HPACK_ENTRY_OVERHEAD  32
+#define HPACK_MAX_ENTRIES     (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STATIC_COUNT    61
+
+#define HPACK_ERROR         -1
+#define HPACK_SPACE_ERROR   -2
+#define HPACK_MEMORY_ERROR  -3
+
+struct H2_FRAME {
+    uint32_t len;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream;
+};
+
+struct HPACK_ENTRY {
+    // Name followed by value
+    char *data;
+    unsigned int name_len;
+    unsigned int value_len;
+};
+
+// Dynamic table of one direction, the newest entry has the lowest index
+struct HPACK {
+    struct HPACK_ENTRY entries[HPACK_MAX_ENTRIES];
+    unsigned int first;
+    unsigned int count;
+    // Sum of entry sizes and its limit
+    unsigned int size;
+    unsigned int max_size;
+    // Encoder announces limit changes at the start of the next block, smallest one first
+    int resized;
+    unsigned int resized_min;
+};
+
+struct HPACK_HEADER {
+    const char *name;
+    unsigned int name_len;
+    const char *value;
+    unsigned int value_len;
+};
+
+// Start with empty table of HPACK_TABLE_SIZE
+void hpack_init(struct HPACK *hpack);
+
+// Free entries of dynamic table
+void hpack_free(struct HPACK *hpack);
+
+// Decode header block, names and values are copied into 'buffer' of 'size' bytes
+// Return number of headers, HPACK_ERROR if block is malformed, HPACK_MEMORY_ERROR if table is
+// out of sync with the peer one or HPACK_SPACE_ERROR
+int hpack_decode(struct HPACK *hpack, const uint8_t *block, unsigned int len, struct HPACK_HEADER *headers, int max_headers, char *buffer, unsigned int size);
+
+// Apply SETTINGS_HEADER_TABLE_SIZE of peer to encoder table
+void hpack_resize(struct HPACK *hpack, unsigned int max_size);
+
+// Start header block with pending table size updates
+// Return number of bytes written or HPACK_SPACE_ERROR
+int hpack_encode_start(struct HPACK *hpack, uint8_t *out, unsigned int size);
+
+// Append header with lower case name to block, 'indexed' adds it to dynamic table if there is
+// memory for it, otherwise header is written without indexing
+// Return number of bytes written or HPACK_SPACE_ERROR
+int hpack_encode(struct HPACK *hpack, uint8_t *out, unsigned int size, const char *name, unsigned int name_len, const char *value, unsigned int value_len, int indexed);
+
+// Write frame header into 'out'
+void h2_frame_header(uint8_t *out, unsigned int len, uint8_t type, uint8_t flags, uint32_t stream);
+
+// Read frame header from 'data' of at least H2_FRAME_HEADER bytes
+void h2_frame_parse(const uint8_t *data, struct H2_FRAME *frame);
+
+// Decode base64url value of HTTP2-Settings header
+// Return length of decoded settings or -1
+int h2_base64url(const char *in, unsigned int len, uint8_t *out, unsigned int size);
+
+#endif
@@ -0,0 +1,173 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+// Build step generating perfect hash lookups of request method and header names.
+// Usage: hashgen names.list out.h out.c
+// List lines are "method NAME" with NAME from enum METHODS of http.h, matched case sensitive,
+// or "header Name", matched case insensitive, which get ids HTTP_HEADER_NAME in out.h.
+// Names are hashed with FNV-1a over lower case letters, the hash is multiplied by a seed
+// found here and its top bits index a table without collisions.
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASHGEN_MAX_NAMES  64
+#define HASHGEN_NAME_SIZE  64
+#define HASHGEN_MAX_SEEDS  10000000
+
+struct HASHGEN_SET {
+    const char *kind;
+    char names[HASHGEN_MAX_NAMES][HASHGEN_NAME_SIZE];
+    int count;
+    uint32_t seed;
+    int bits;
+    int table[1 << 10];
+};
+
+// Must match the lookup emitted below
+static uint32_t hashgen_hash(const char *name, int len) {
+    uint32_t hash = 0x811c9dc5;
+    for(int i = 0; i != len; ++i) {
+        hash = (hash ^ (uint8_t)(name[i] | 0x20)) * 0x01000193;
+    }
+    return hash;
+}
+
+// Find seed and smallest table of at least twice the names without collisions
+// Return 0 on success
+static int hashgen_search(struct HASHGEN_SET *set) {
+    for(set->bits = 1; (1 << set->bits) < set->count * 2; ++set->bits);
+    for(; set->bits <= 10; ++set->bits) {
+        for(uint32_t seed = 1; seed < HASHGEN_MAX_SEEDS; seed += 2) {
+            int size = 1 << set->bits;
+            int i;
+            for(i = 0; i != size; ++i) {
+                set->table[i] = -1;
+            }
+            for(i = 0; i != set->count; ++i) {
+                uint32_t slot = (hashgen_hash(set->names[i], strlen(set->names[i])) * seed) >> (32 - set->bits);
+                if(set->table[slot] >= 0) {
+                    break;
+                }
+                set->table[slot] = i;
+            }
+            if(i == set->count) {
+                set->seed = seed;
+                return 0;
+            }
+        }
+    }
+    return -1;
+}
+
+// Header id symbol: HTTP_HEADER_ and upper case name with '-' replaced by '_'
+static void hashgen_symbol(const char *name, char *symbol) {
+    char *pt = stpcpy(symbol, "HTTP_HEADER_");
+    for(; *name; ++name) {
+        *pt++ = *name == '-' ? '_' : toupper((unsigned char)*name);
+    }
+    *pt = 0;
+}
+
+static void hashgen_table(FILE *c, struct HASHGEN_SET *set, const char *prefix) {
+    char symbol[HASHGEN_NAME_SIZE + 16];
+    fprintf(c, "static const http_name_t %s_table[%i] = {\n", prefix, 1 << set->bits);
+    for(int i = 0; i != 1 << set->bits; ++i) {
+        int n = set->table[i];
+        if(n < 0) {
+            fprintf(c, "    {\"\", 0, -1},\n");
+            continue;
+        }
+        if(strcmp(set->kind, "header") == 0) {
+            hashgen_symbol(set->names[n], symbol);
+        }
+        else {
+            strcpy(symbol, set->names[n]);
+        }
+        fprintf(c, "    {\"%s\", %zu, %s},\n", set->names[n], strlen(set->names[n]), symbol);
+    }
+    fprintf(c, "};\n\n");
+}
+
+static void hashgen_lookup(FILE *c, struct HASHGEN_SET *set, const char *prefix, const char *compare) {
+    fprintf(c, "int %s_lookup(const char *name, unsigned int len) {\n", prefix);
+    fprintf(c, "    uint32_t hash = 0x811c9dc5;\n");
+    fprintf(c, "    for(unsigned int i = 0; i != len; ++i) {\n");
+    fprintf(c, "        hash = (hash ^ (uint8_t)(name[i] | 0x20)) * 0x01000193;\n");
+    fprintf(c, "    }\n");
+    fprintf(c, "    const http_name_t *entry = &%s_table[(hash * %uu) >> %i];\n", prefix, set->seed, 32 - set->bits);
+    fprintf(c, "    return entry->len == len && %s(entry->name, name, len) == 0 ? entry->id : -1;\n", compare);
+    fprintf(c, "}\n\n");
+}
+
+int main(int argc, char *argv[]) {
+    if(argc != 4) {
+        fprintf(stderr, "Usage: %s names.list out.h out.c\n", argv[0]);
+        return 1;
+    }
+    FILE *list = fopen(argv[1], "r");
+    if(list == NULL) {
+        fprintf(stderr, "Can't open %s\n", argv[1]);
+        return 1;
+    }
+
+    static struct HASHGEN_SET methods = {.kind = "method"}, headers = {.kind = "header"};
+    char line[256], kind[16], name[HASHGEN_NAME_SIZE];
+    while(fgets(line, sizeof(line), list)) {
+        if(line[0] == '#' || sscanf(line, "%15s %63s", kind, name) != 2) {
+            continue;
+        }
+        struct HASHGEN_SET *set = strcmp(kind, "method") == 0 ? &methods : strcmp(kind, "header") == 0 ? &headers : NULL;
+        if(set == NULL || set->count == HASHGEN_MAX_NAMES) {
+            fprintf(stderr, "Unknown kind or too many names: %s", line);
+            return 1;
+        }
+        strcpy(set->names[set->count++], name);
+    }
+    fclose(list);
+
+    if(hashgen_search(&methods) != 0 || hashgen_search(&headers) != 0) {
+        fprintf(stderr, "No perfect hash found\n");
+        return 1;
+    }
+
+    FILE *h = fopen(argv[2], "w");
+    FILE *c = fopen(argv[3], "w");
+    if(h == NULL || c == NULL) {
+        fprintf(stderr, "Can't create output files\n");
+        return 1;
+    }
+
+    char symbol[HASHGEN_NAME_SIZE + 16];
+    fprintf(h, "// Generated by hashgen from %s, do not edit\n\n", argv[1]);
+    fprintf(h, "#ifndef _HTTP_NAMES_H\n#define _HTTP_NAMES_H\n\n");
+    fprintf(h, "enum HTTP_HEADERS {\n");
+    for(int i = 0; i != headers.count; ++i) {
+        hashgen_symbol(headers.names[i], symbol);
+        fprintf(h, "    %s,\n", symbol);
+    }
+    fprintf(h, "    HTTP_HEADERS_COUNT\n};\n\n");
+    fprintf(h, "// Names of known headers by id\nextern const char *http_header_names[HTTP_HEADERS_COUNT];\n\n");
+    fprintf(h, "// Find method by name, case sensitive\n// Return enum METHODS value or -1\n");
+    fprintf(h, "int http_method_lookup(const char *name, unsigned int len);\n\n");
+    fprintf(h, "// Find known header by name, case insensitive\n// Return enum HTTP_HEADERS value or -1\n");
+    fprintf(h, "int http_header_lookup(const char *name, unsigned int len);\n\n#endif\n");
+
+    fprintf(c, "// Generated by hashgen from %s, do not edit\n\n", argv[1]);
+    fprintf(c, "#include <stdint.h>\n#include <string.h>\n#include <strings.h>\n#include \"http.h\"\n\n");
+    fprintf(c, "typedef struct {\n    const char *name;\n    uint8_t len;\n    int8_t id;\n} http_name_t;\n\n");
+    fprintf(c, "const char *http_header_names[HTTP_HEADERS_COUNT] = {\n");
+    for(int i = 0; i != headers.count; ++i) {
+        fprintf(c, "    \"%s\",\n", headers.names[i]);
+    }
+    fprintf(c, "};\n\n");
+    hashgen_table(c, &methods, "http_method");
+    hashgen_table(c, &headers, "http_header");
+    hashgen_lookup(c, &methods, "http_method", "memcmp");
+    hashgen_lookup(c, &headers, "http_header", "strncasecmp");
+
+    fclose(h);
+    return fclose(c) == 0 ? 0 : 1;
+}
@@ -0,0 +1,180 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+
+const http_method_t http_methods[] = {
+    {"GET ", 4, GET},
+    {"POST ", 5, POST},
+    {"HEAD ", 5, HEAD},
+    {"OPTIONS ", 8, OPTIONS},
+    {"PUT ", 4, PUT},
+    {"DELETE ", 7, DELETE}
+};
+const int http_methods_count = sizeof(http_methods) / sizeof(http_method_t);
+
+int http_request_length(const char *data, int length, int max_body) {
+    const char *end = memmem(data, length, "\r\n\r\n", 4);
+    if(end == NULL) {
+        return 0;
+    }
+
+    int header_length = end - data + 4;
+    for(const char *pt = data; (pt = memchr(pt, '\n', end - pt)) != NULL;) {
+        ++pt;
+        if(end - pt > 15 && strncasecmp(pt, "Content-Length:", 15) == 0) {
+            long body_length = strtol(pt + 15, NULL, 10);
+            if(body_length < 0 || body_length > max_body) {
+                return REQUEST_INVALID;
+            }
+            return header_length + body_length <= length ? header_length + body_length : 0;
+        }
+    }
+    return header_length;
+}
+
+int http_parse(char *data, int length, request_t *req, struct MAP *headers) {
+    char *start = data;
+    if(data == NULL || length == 0) {
+        return REQUEST_EMPTY;
+    }
+    if(length < sizeof(http_methods[0].name)) {
+        return REQUEST_INVALID;
+    }
+
+    // Longest method with space fits into http_methods[0].name
+    char *tmp = memchr(data, ' ', sizeof(http_methods[0].name));
+    int method = tmp ? http_method_lookup(data, tmp - data) : -1;
+    if(method < 0) {
+        return REQUEST_METHOD_UNSUPPORTED;
+    }
+    req->method = method;
+    req->headers_present = 0;
+    length -= tmp - data + 1;
+    data = tmp + 1;
+
+    tmp = memchr(data, ' ', length);
+    if(tmp == NULL || tmp == data || *data != '/') {
+        return REQUEST_INVALID_PATH;
+    }
+    req->path = data;
+    *tmp = 0;
+    length -= tmp - data + 1;
+    data = tmp + 1;
+
+    req->query = memchr(req->path, '?', tmp - req->path);
+    if(req->query) {
+        *req->query = 0;
+        ++req->query;
+    }
+
+    if(length == 0) {
+        return REQUEST_PROTOCOL_UNSUPPORTED;
+    }
+
+    tmp = memchr(data, '\r', length);
+    if(tmp == NULL) {
+        return REQUEST_PROTOCOL_UNSUPPORTED;
+    }
+    req->version = data;
+    *tmp = 0;
+    length -= tmp - data + 2;
+    data = tmp + 2;
+
+    if(*(uint64_t *)req->version != HTTP11_SIGNATURE) {
+        return REQUEST_PROTOCOL_UNSUPPORTED;
+    }
+
+    if(length < 2) {
+        return REQUEST_INVALID;
+    }
+
+    while(length > 2) {
+        // Empty line ends headers, the rest is body
+        if(data[0] == '\r' && data[1] == '\n') {
+            data += 2;
+            length -= 2;
+            break;
+        }
+
+        char *key;
+        int key_len;
+        char *val;
+
+        val = memchr(data, ':', length);
+        if(val == NULL) {
+            map_destroy(headers);
+            return REQUEST_INVALID_HEADERS;
+        }
+        key = data;
+        key_len = val - data;
+        length -= key_len + 1;
+        data += key_len + 1;
+
+        if(data[0] != ' ') {
+            map_destroy(headers);
+            return REQUEST_INVALID_HEADERS;
+        }
+        ++data;
+        --length;
+
+        tmp = memchr(data, '\r', length);
+        int value_len = tmp ? tmp - data : length;
+        int id = http_header_lookup(key, key_len);
+        if(id >= 0) {
+            req->headers[id].value = data;
+            req->headers[id].len = value_len;
+            req->headers_present |= 1ull << id;
+        }
+        else {
+            map_add(headers, key, key_len, data, value_len);
+        }
+        if(tmp == NULL) {
+            data += length;
+            break;
+        }
+        length -= value_len + 2;
+        data += value_len + 2;
+    }
+
+    return data - start;
+}
+
+int http_header(const request_t *req, int id, const char **value) {
+    if((req->headers_present & (1ull << id)) == 0) {
+        return -1;
+    }
+    *value = req->headers[id].value;
+    return req->headers[id].len;
+}
+
+int http_header_get(const request_t *req, struct MAP *headers, const char *name, unsigned int len, void *value, unsigned int size) {
+    int id = http_header_lookup(name, len);
+    if(id < 0) {
+        return map_get(headers, name, len, value, size);
+    }
+    const char *known;
+    int known_len = http_header(req, id, &known);
+    if(known_len < 0) {
+        return MAP_KEY_ERROR;
+    }
+    if(known_len > size) {
+        return MAP_VALUE_ERROR;
+    }
+    memcpy(value, known, known_len);
+    return known_len;
+}
+
+int http_route(struct MAP *routes, const char *path, struct CONFIG_PATH *route) {
+    if(map_get(routes, path, strlen(path), route, sizeof(struct CONFIG_PATH)) > 0) {
+        return ROUTE_EXACT;
+    }
+    if(map_get(routes, path, strrchr(path, '/') - path + 1, route, sizeof(struct CONFIG_PATH)) > 0) {
+        return ROUTE_DIRECTORY;
+    }
+    return ROUTE_NOT_FOUND;
+}
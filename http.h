@@ -0,0 +1,104 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _HTTP_H
+#define _HTTP_H
+
+#include <stdint.h>
+#include "map.h"
+#include "http_names.h"
+
+#define HTTP11_SIGNATURE 0x312e312F50545448
+
+#define REQUEST_CLOSE                  1
+// Response is sent later, may be combined with REQUEST_CLOSE
+#define REQUEST_PENDING                2
+// Client asked to switch to HTTP/2, response goes to stream 1
+#define REQUEST_UPGRADE                4
+#define REQUEST_EMPTY                 -1
+#define REQUEST_INVALID               -2
+#define REQUEST_INVALID_PATH          -3
+#define REQUEST_UNSUPPORTED           -4
+#define REQUEST_INVALID_HEADERS       -5
+#define REQUEST_METHOD_UNSUPPORTED    -6
+#define REQUEST_PROTOCOL_UNSUPPORTED  -7
+
+#define ROUTE_NOT_FOUND  0
+#define ROUTE_EXACT      1
+#define ROUTE_DIRECTORY  2
+
+typedef struct {
+    char name[10];
+    uint8_t len;
+    uint8_t key;
+} http_method_t;
+
+enum METHODS {
+    GET,
+    POST,
+    HEAD,
+    OPTIONS,
+    PUT,
+    DELETE
+};
+
+extern const http_method_t http_methods[];
+extern const int http_methods_count;
+
+typedef struct {
+    const char *value;
+    unsigned int len;
+} http_header_t;
+
+typedef struct {
+    uint8_t method;
+    char *path;
+    char *query;
+    char *version;
+    // Known headers by enum HTTP_HEADERS, slot is valid if its bit is set
+    uint64_t headers_present;
+    http_header_t headers[HTTP_HEADERS_COUNT];
+} request_t;
+
+struct CGI_LIMITS;
+struct RATELIMIT_RULE;
+struct PRELOADED;
+struct UPSTREAM;
+
+struct CONFIG_PATH {
+    char *content_type;
+    char *action;
+    // Seconds to cache CGI responses, 0 disables cache
+    unsigned int cache_ttl;
+    // CGI concurrency of the route, NULL if only worker limits apply
+    struct CGI_LIMITS *cgi;
+    // Request rate of one client on the route, NULL if only global limit applies
+    struct RATELIMIT_RULE *ratelimit;
+    // Response of exact file route rendered at startup, NULL if file is read per request
+    struct PRELOADED *preloaded;
+    // Servers of proxy route, NULL for other actions
+    struct UPSTREAM *upstream;
+};
+
+// Get length of the first complete request in 'data', body may be up to 'max_body' bytes
+// Return request length, 0 if request is incomplete, or error code
+int http_request_length(const char *data, int length, int max_body);
+
+// Parse request line and headers of complete request. 'data' is modified in place and
+// 'req' points into it, known headers are kept in 'req' slots pointing into 'data',
+// other headers are copied into 'headers' which is destroyed on error
+// Return length of request line and headers, the body follows, or error code
+int http_parse(char *data, int length, request_t *req, struct MAP *headers);
+
+// Get value of known header 'id', it is not null terminated
+// Return value length or -1 if header is absent
+int http_header(const request_t *req, int id, const char **value);
+
+// Copy value of header 'name', known or kept in 'headers', into 'value' of 'size' bytes
+// Return value length, MAP_VALUE_ERROR if it doesn't fit, or other negative value if absent
+int http_header_get(const request_t *req, struct MAP *headers, const char *name, unsigned int len, void *value, unsigned int size);
+
+// Find route for 'path' in 'routes': exact path first, then its directory
+// Return ROUTE_EXACT, ROUTE_DIRECTORY or ROUTE_NOT_FOUND
+int http_route(struct MAP *routes, const char *path, struct CONFIG_PATH *route);
+
+#endif
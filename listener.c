@@ -0,0 +1,359 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include "listener.h"
+
+int listener_resolve(const char *address, struct sockaddr_storage *ss, socklen_t *len) {
+    memset(ss, 0, sizeof(struct sockaddr_storage));
+    const char *str = address;
+
+    if(strncmp(str, LISTENER_UNIX_PREFIX, sizeof(LISTENER_UNIX_PREFIX) - 1) == 0) {
+        struct sockaddr_un *un = (struct sockaddr_un *)ss;
+        str += sizeof(LISTENER_UNIX_PREFIX) - 1;
+        if(*str == 0 || strlen(str) >= sizeof(un->sun_path)) {
+            return LISTENER_ADDRESS_ERROR;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, str);
+        *len = sizeof(struct sockaddr_un);
+        return LISTENER_OK;
+    }
+
+    char *end;
+    const char *colon = strrchr(str, ':');
+    long port = strtol(colon ? colon + 1 : str, &end, 10);
+    if(*end || port <= 0 || port > 65535) {
+        return LISTENER_ADDRESS_ERROR;
+    }
+
+    char host[INET6_ADDRSTRLEN];
+    int host_len = colon ? colon - str : 0;
+    if(host_len >= sizeof(host)) {
+        return LISTENER_ADDRESS_ERROR;
+    }
+
+    if(str[0] == '[') {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+        if(host_len < 3 || str[host_len - 1] != ']') {
+            return LISTENER_ADDRESS_ERROR;
+        }
+        memcpy(host, str + 1, host_len - 2);
+        host[host_len - 2] = 0;
+        if(inet_pton(AF_INET6, host, &in6->sin6_addr) != 1) {
+            return LISTENER_ADDRESS_ERROR;
+        }
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        *len = sizeof(struct sockaddr_in6);
+        return LISTENER_OK;
+    }
+
+    struct sockaddr_in *in = (struct sockaddr_in *)ss;
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    in->sin_addr.s_addr = INADDR_ANY;
+    *len = sizeof(struct sockaddr_in);
+    if(host_len == 0 || (host_len == 1 && str[0] == '*')) {
+        return LISTENER_OK;
+    }
+    memcpy(host, str, host_len);
+    host[host_len] = 0;
+    return inet_pton(AF_INET, host, &in->sin_addr) == 1 ? LISTENER_OK : LISTENER_ADDRESS_ERROR;
+}
+
+int listener_option(struct LISTENER_OPTIONS *opts, const char *name, const char *value, const char *param) {
+    if(opts == NULL || name == NULL || value == NULL) {
+        return LISTENER_OPTION_ERROR;
+    }
+
+    if(strcmp(name, "listen") == 0) {
+        if(opts->addresses_count == LISTENER_MAX_ADDRESSES) {
+            return LISTENER_OPTION_ERROR;
+        }
+
+        // TLS flag is kept apart from the socket parameter
+        char param_buff[32];
+        int tls = 0;
+        if(param && strlen(param) < sizeof(param_buff)) {
+            strcpy(param_buff, param);
+            char *flag = strrchr(param_buff, ',');
+            flag = flag ? flag + 1 : param_buff;
+            if(strcmp(flag, "tls") == 0) {
+                tls = 1;
+                // Cut "tls" with its comma
+                *(flag == param_buff ? flag : flag - 1) = 0;
+                param = param_buff[0] ? param_buff : NULL;
+            }
+        }
+
+        struct LISTENER_ADDRESS addr = {.address = (char *)value, .param = (char *)param, .tls = tls};
+        struct sockaddr_storage ss;
+        socklen_t len;
+        if(listener_resolve(addr.address, &ss, &len) != LISTENER_OK) {
+            return LISTENER_ADDRESS_ERROR;
+        }
+        if(param) {
+            char *end;
+            if(ss.ss_family == AF_UNIX && (strtol(param, &end, 8) <= 0 || *end)) {
+                return LISTENER_VALUE_ERROR;
+            }
+            if(ss.ss_family == AF_INET6 && strcmp(param, "v6only") != 0 && strcmp(param, "dualstack") != 0) {
+                return LISTENER_VALUE_ERROR;
+            }
+            if(ss.ss_family == AF_INET) {
+                return LISTENER_VALUE_ERROR;
+            }
+        }
+
+        addr.address = strdup(value);
+        addr.param = param ? strdup(param) : NULL;
+        if(addr.address == NULL || (param && addr.param == NULL)) {
+            free(addr.address);
+            free(addr.param);
+            return LISTENER_OPTION_ERROR;
+        }
+        opts->addresses[opts->addresses_count++] = addr;
+        return LISTENER_OK;
+    }
+
+    int val;
+    char *end;
+    if(strcmp(value, "on") == 0) {
+        val = 1;
+    }
+    else if(strcmp(value, "off") == 0) {
+        val = 0;
+    }
+    else {
+        val = strtol(value, &end, 10);
+        if(end == value || *end || val < 0) {
+            return LISTENER_VALUE_ERROR;
+        }
+    }
+
+    if(strcmp(name, "listen_backlog") == 0) {
+        opts->backlog = val;
+    }
+    else if(strcmp(name, "tcp_nodelay") == 0) {
+        opts->nodelay = val;
+    }
+    else if(strcmp(name, "tcp_defer_accept") == 0) {
+        opts->defer_accept = val;
+    }
+    else if(strcmp(name, "tcp_fastopen") == 0) {
+        opts->fastopen = val;
+    }
+    else if(strcmp(name, "so_sndbuf") == 0) {
+        opts->sndbuf = val;
+    }
+    else if(strcmp(name, "so_rcvbuf") == 0) {
+        opts->rcvbuf = val;
+    }
+    else if(strcmp(name, "tcp_notsent_lowat") == 0) {
+        opts->notsent_lowat = val;
+    }
+    else {
+        return LISTENER_OPTION_ERROR;
+    }
+    return LISTENER_OK;
+}
+
+int listener_setup(int sock, struct LISTENER_OPTIONS *opts) {
+    int domain;
+    socklen_t len = sizeof(domain);
+    if(getsockopt(sock, SOL_SOCKET, SO_DOMAIN, &domain, &len) != 0) {
+        return LISTENER_SOCKET_ERROR;
+    }
+
+    // Buffer sizes are inherited by accepted sockets and must be set before listen() for window scaling
+    if(opts->sndbuf && setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &opts->sndbuf, sizeof(int)) != 0) {
+        perror("setsockopt(..., SO_SNDBUF, ...) error");
+    }
+    if(opts->rcvbuf && setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf, sizeof(int)) != 0) {
+        perror("setsockopt(..., SO_RCVBUF, ...) error");
+    }
+    // Wake workers only when request data has arrived
+    if(domain != AF_UNIX && opts->defer_accept && setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opts->defer_accept, sizeof(int)) != 0) {
+        perror("setsockopt(..., TCP_DEFER_ACCEPT, ...) error");
+    }
+    if(domain != AF_UNIX && opts->fastopen && setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &opts->fastopen, sizeof(int)) != 0) {
+        perror("setsockopt(..., TCP_FASTOPEN, ...) error");
+    }
+
+    // All workers are woken by a new connection, the ones losing the race must not block in accept()
+    int flags = fcntl(sock, F_GETFL, 0);
+    if(flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return LISTENER_SOCKET_ERROR;
+    }
+
+    if(listen(sock, opts->backlog ? opts->backlog : SOMAXCONN) != 0) {
+        return LISTENER_LISTEN_ERROR;
+    }
+    return LISTENER_OK;
+}
+
+int listener_create(struct LISTENER_ADDRESS *addr, struct LISTENER_OPTIONS *opts) {
+    struct sockaddr_storage ss;
+    socklen_t len;
+    if(listener_resolve(addr->address, &ss, &len) != LISTENER_OK) {
+        return LISTENER_ADDRESS_ERROR;
+    }
+
+    int sock = socket(ss.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock == -1) {
+        return LISTENER_SOCKET_ERROR;
+    }
+
+    char *path = ((struct sockaddr_un *)&ss)->sun_path;
+    if(ss.ss_family == AF_INET6) {
+        int v6only = addr->param && strcmp(addr->param, "v6only") == 0;
+        if(setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) != 0) {
+            close(sock);
+            return LISTENER_SOCKET_ERROR;
+        }
+    }
+    if(ss.ss_family != AF_UNIX) {
+        // Allow restart while connections closed by server are in TIME_WAIT
+        int reuse = 1;
+        if(setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0) {
+            close(sock);
+            return LISTENER_SOCKET_ERROR;
+        }
+        if(opts->reuseport && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) != 0) {
+            close(sock);
+            return LISTENER_SOCKET_ERROR;
+        }
+    }
+    else {
+        // Remove stale socket left by previous run
+        struct stat st;
+        if(lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+            unlink(path);
+        }
+    }
+
+    if(bind(sock, (struct sockaddr *)&ss, len) == -1) {
+        close(sock);
+        return LISTENER_BIND_ERROR;
+    }
+
+    if(ss.ss_family == AF_UNIX && addr->param && chmod(path, strtol(addr->param, NULL, 8)) != 0) {
+        close(sock);
+        return LISTENER_BIND_ERROR;
+    }
+
+    int ret = listener_setup(sock, opts);
+    if(ret != LISTENER_OK) {
+        close(sock);
+        return ret;
+    }
+    return sock;
+}
+
+int listener_steer(int *group, int count, const int *cpus) {
+    // A = CPU; compare it with each CPU and return its index. Other CPUs get index out of
+    // range, kernel then picks member by hash
+    struct sock_filter code[BPF_MAXINSNS];
+    int len = 0;
+    if(count <= 0 || 2 * count + 2 > BPF_MAXINSNS) {
+        return LISTENER_VALUE_ERROR;
+    }
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for(int i = 0; i != count; ++i) {
+        code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+        code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+    struct sock_fprog prog = {.len = len, .filter = code};
+    if(setsockopt(group[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == 0) {
+        return LISTENER_OK;
+    }
+
+    // Without the program newer kernels still prefer member with matching incoming CPU
+    perror("setsockopt(..., SO_ATTACH_REUSEPORT_CBPF, ...) error");
+    for(int i = 0; i != count; ++i) {
+        if(setsockopt(group[i], SOL_SOCKET, SO_INCOMING_CPU, &cpus[i], sizeof(int)) != 0) {
+            return LISTENER_OPTION_ERROR;
+        }
+    }
+    return LISTENER_OK;
+}
+
+int listener_match(int sock, struct LISTENER_ADDRESS *addr) {
+    struct sockaddr_storage ss, bound;
+    socklen_t len, bound_len = sizeof(bound);
+    if(listener_resolve(addr->address, &ss, &len) != LISTENER_OK) {
+        return 0;
+    }
+    memset(&bound, 0, sizeof(bound));
+    if(getsockname(sock, (struct sockaddr *)&bound, &bound_len) != 0 || bound.ss_family != ss.ss_family) {
+        return 0;
+    }
+
+    switch(ss.ss_family) {
+        case AF_INET:
+            return ((struct sockaddr_in *)&ss)->sin_port == ((struct sockaddr_in *)&bound)->sin_port &&
+                ((struct sockaddr_in *)&ss)->sin_addr.s_addr == ((struct sockaddr_in *)&bound)->sin_addr.s_addr;
+        case AF_INET6:
+            return ((struct sockaddr_in6 *)&ss)->sin6_port == ((struct sockaddr_in6 *)&bound)->sin6_port &&
+                memcmp(&((struct sockaddr_in6 *)&ss)->sin6_addr, &((struct sockaddr_in6 *)&bound)->sin6_addr, sizeof(struct in6_addr)) == 0;
+        case AF_UNIX:
+            return strcmp(((struct sockaddr_un *)&ss)->sun_path, ((struct sockaddr_un *)&bound)->sun_path) == 0;
+    }
+    return 0;
+}
+
+char *listener_address_str(const struct sockaddr *addr, char *str, int *port) {
+    *port = 0;
+    switch(addr->sa_family) {
+        case AF_INET:
+            inet_ntop(AF_INET, &((struct sockaddr_in *)addr)->sin_addr, str, LISTENER_ADDRSTRLEN);
+            *port = ntohs(((struct sockaddr_in *)addr)->sin_port);
+            break;
+        case AF_INET6: {
+            const struct in6_addr *in6 = &((struct sockaddr_in6 *)addr)->sin6_addr;
+            // Show IPv4 clients of dual-stack listener as plain IPv4
+            if(IN6_IS_ADDR_V4MAPPED(in6)) {
+                inet_ntop(AF_INET, &in6->s6_addr[12], str, LISTENER_ADDRSTRLEN);
+            }
+            else {
+                inet_ntop(AF_INET6, in6, str, LISTENER_ADDRSTRLEN);
+            }
+            *port = ntohs(((struct sockaddr_in6 *)addr)->sin6_port);
+            break;
+        }
+        case AF_UNIX:
+            // Path may fill sun_path without terminating NUL
+            snprintf(str, LISTENER_ADDRSTRLEN, LISTENER_UNIX_PREFIX"%.*s", (int)sizeof(((struct sockaddr_un *)addr)->sun_path), ((struct sockaddr_un *)addr)->sun_path);
+            break;
+        default:
+            strcpy(str, "-");
+    }
+    return str;
+}
+
+int listener_accepted(int sock, int family, struct LISTENER_OPTIONS *opts) {
+    int ret = LISTENER_OK;
+    if(family == AF_UNIX) {
+        return ret;
+    }
+    if(opts->nodelay && setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opts->nodelay, sizeof(int)) != 0) {
+        ret = LISTENER_OPTION_ERROR;
+    }
+    // Limit amount of unsent data queued in the kernel
+    if(opts->notsent_lowat && setsockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opts->notsent_lowat, sizeof(int)) != 0) {
+        ret = LISTENER_OPTION_ERROR;
+    }
+    return ret;
+}
@@ -0,0 +1,79 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _LISTENER_H
+#define _LISTENER_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LISTENER_MAX_ADDRESSES  16
+#define LISTENER_UNIX_PREFIX    "unix:"
+// Formatted address, "unix:" with the whole socket path is longer than any IP address
+#define LISTENER_ADDRSTRLEN     (sizeof(LISTENER_UNIX_PREFIX) + sizeof(((struct sockaddr_un *)0)->sun_path))
+
+#define LISTENER_SOCKET_ERROR  -1
+#define LISTENER_BIND_ERROR    -2
+#define LISTENER_LISTEN_ERROR  -3
+#define LISTENER_OPTION_ERROR  -4
+#define LISTENER_VALUE_ERROR   -5
+#define LISTENER_ADDRESS_ERROR -6
+#define LISTENER_OK             0
+
+// "unix:/path" with optional octal mode, "[ipv6]:port" with optional "v6only", "ipv4:port" or "*:port".
+// Parameter may end with "tls", alone or after comma as in "v6only,tls"
+struct LISTENER_ADDRESS {
+    char *address;
+    char *param;
+    // Connections are TLS, the server does handshakes
+    int tls;
+};
+
+// Socket tuning. Zero means kernel default
+struct LISTENER_OPTIONS {
+    struct LISTENER_ADDRESS addresses[LISTENER_MAX_ADDRESSES];
+    int addresses_count;
+    int backlog;
+    int nodelay;
+    int defer_accept;
+    int fastopen;
+    int sndbuf;
+    int rcvbuf;
+    int notsent_lowat;
+    // Sockets of one address form SO_REUSEPORT group, set by server for CPU steering
+    int reuseport;
+};
+
+// Set option 'name' from config file value 'value' and optional 'param'
+// Return error code
+int listener_option(struct LISTENER_OPTIONS *opts, const char *name, const char *value, const char *param);
+
+// Parse address in listener format into socket address, "*" host is any address
+// Return error code
+int listener_resolve(const char *address, struct sockaddr_storage *ss, socklen_t *len);
+
+// Create listening socket bound to 'addr'
+// Return socket or error code
+int listener_create(struct LISTENER_ADDRESS *addr, struct LISTENER_OPTIONS *opts);
+
+// Route new connections of reuseport group to member 'i' when they are received on CPU 'cpus[i]'
+// Return error code
+int listener_steer(int *group, int count, const int *cpus);
+
+// Check if listening socket 'sock' is bound to 'addr'
+// Return 1 if it is, 0 otherwise
+int listener_match(int sock, struct LISTENER_ADDRESS *addr);
+
+// Apply listener options to already listening socket, e.g. inherited one
+// Return error code
+int listener_setup(int sock, struct LISTENER_OPTIONS *opts);
+
+// Apply per connection options to accepted socket
+// Return error code
+int listener_accepted(int sock, int family, struct LISTENER_OPTIONS *opts);
+
+// Format address of any supported family into 'str' and store its port into 'port'
+// Return 'str'
+char *listener_address_str(const struct sockaddr *addr, char *str, int *port);
+
+#endif
@@ -0,0 +1,399 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "master.h"
+
+struct WORKER_LOAD *worker_load = NULL;
+int worker_slot = -1;
+static struct WORKER_LOAD *worker_loads = NULL;
+
+static volatile sig_atomic_t sig_child = 0;
+static volatile sig_atomic_t sig_quit = 0;
+static volatile sig_atomic_t sig_term = 0;
+static volatile sig_atomic_t sig_upgrade = 0;
+static volatile sig_atomic_t sig_alarm = 0;
+
+static sigset_t master_sigmask;
+
+static void master_signal(int sig) {
+    switch(sig) {
+        case SIGCHLD:
+            sig_child = 1;
+            break;
+        case SIGQUIT:
+            sig_quit = 1;
+            break;
+        case SIGTERM:
+        case SIGINT:
+            sig_term = 1;
+            break;
+        case SIGUSR2:
+            sig_upgrade = 1;
+            break;
+        case SIGALRM:
+            sig_alarm = 1;
+            break;
+    }
+}
+
+int master_inherit_listeners(int *fds, int max) {
+    char *env = getenv(MASTER_LISTENERS_ENV);
+    if(env == NULL) {
+        return 0;
+    }
+
+    int count = 0;
+    char *end;
+    while(*env && count != max) {
+        long fd = strtol(env, &end, 10);
+        if(end == env) {
+            break;
+        }
+
+        int listening = 0;
+        socklen_t len = sizeof(listening);
+        if(fd >= 0 && getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 && listening) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            fds[count++] = fd;
+        }
+        env = *end == ';' ? end + 1 : end;
+    }
+
+    unsetenv(MASTER_LISTENERS_ENV);
+    return count;
+}
+
+static uint64_t master_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void master_signal_reset(void) {
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGUSR2, SIG_DFL);
+    signal(SIGALRM, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &master_sigmask, NULL);
+}
+
+// Start worker in slot 'n'
+static pid_t master_spawn(struct MASTER *master, int n) {
+    struct MASTER_WORKER *w = &master->workers[n];
+    worker_loads[n].busy_us = 0;
+    w->busy_us = 0;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid < 0) {
+        perror("fork() error");
+        w->state = WORKER_WAITING;
+        w->respawn_at = master_now() + MASTER_BACKOFF_MAX_MS;
+        return pid;
+    }
+    if(pid != 0) {
+        w->pid = pid;
+        w->state = WORKER_RUNNING;
+        w->started = master_now();
+        return pid;
+    }
+
+    master_signal_reset();
+    worker_load = &worker_loads[n];
+    worker_slot = n;
+    exit(master->worker(master->listeners, master->listeners_count));
+}
+
+static int master_alive(struct MASTER *master) {
+    int alive = 0;
+    for(int i = 0; i != master->workers_max; ++i) {
+        alive += master->workers[i].pid > 0;
+    }
+    return alive;
+}
+
+static void master_kill(struct MASTER *master, int sig) {
+    for(int i = 0; i != master->workers_max; ++i) {
+        if(master->workers[i].pid > 0) {
+            kill(master->workers[i].pid, sig);
+        }
+    }
+}
+
+// Sum of accept queue lengths of all TCP listeners
+static unsigned int master_backlog(struct MASTER *master) {
+    unsigned int backlog = 0;
+    for(int i = 0; i != master->listeners_count; ++i) {
+        struct tcp_info info;
+        socklen_t len = sizeof(info);
+        if(getsockopt(master->listeners[i], IPPROTO_TCP, TCP_INFO, &info, &len) == 0) {
+            backlog += info.tcpi_unacked;
+        }
+    }
+    return backlog;
+}
+
+// Add or retire one worker depending on event loop utilization and accept queue depth
+static void master_scale(struct MASTER *master, uint64_t elapsed) {
+    static unsigned int idle_samples = 0;
+
+    uint64_t load = 0;
+    int running = 0;
+    for(int i = 0; i != master->workers_max; ++i) {
+        struct MASTER_WORKER *w = &master->workers[i];
+        if(w->state != WORKER_RUNNING) {
+            continue;
+        }
+        uint64_t busy = __atomic_load_n(&worker_loads[i].busy_us, __ATOMIC_RELAXED);
+        load += (busy - w->busy_us) * 100 / (elapsed * 1000);
+        w->busy_us = busy;
+        ++running;
+    }
+    if(running == 0) {
+        return;
+    }
+    load /= running;
+
+    unsigned int backlog = master_backlog(master);
+    if((load >= MASTER_SCALE_UP_LOAD || backlog > 0) && master->workers_count < master->workers_max) {
+        idle_samples = 0;
+        for(int i = 0; i != master->workers_max; ++i) {
+            if(master->workers[i].state == WORKER_FREE) {
+                master->workers[i].failures = 0;
+                master_spawn(master, i);
+                ++master->workers_count;
+                printf("Load %i%%, backlog %u: scaled up to %i workers\n", (int)load, backlog, master->workers_count);
+                break;
+            }
+        }
+    }
+    else if(load <= MASTER_SCALE_DOWN_LOAD && backlog == 0 && master->workers_count > master->workers_min) {
+        if(++idle_samples < MASTER_SCALE_DOWN_SAMPLES) {
+            return;
+        }
+        idle_samples = 0;
+        for(int i = master->workers_max - 1; i >= 0; --i) {
+            if(master->workers[i].state == WORKER_RUNNING) {
+                kill(master->workers[i].pid, SIGQUIT);
+                master->workers[i].state = WORKER_RETIRING;
+                --master->workers_count;
+                printf("Load %i%%: scaled down to %i workers\n", (int)load, master->workers_count);
+                break;
+            }
+        }
+    }
+    else {
+        idle_samples = 0;
+    }
+}
+
+// Exec new binary with the same arguments and pass it listening sockets
+static pid_t master_upgrade(struct MASTER *master) {
+    char env[MASTER_MAX_LISTENERS * 12];
+    char *pt = env;
+    for(int i = 0; i != master->listeners_count; ++i) {
+        pt += sprintf(pt, i ? ";%i" : "%i", master->listeners[i]);
+    }
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if(pid != 0) {
+        return pid;
+    }
+
+    char parent[16];
+    snprintf(parent, sizeof(parent), "%i", getppid());
+    if(setenv(MASTER_LISTENERS_ENV, env, 1) != 0 || setenv(MASTER_PARENT_ENV, parent, 1) != 0) {
+        _exit(1);
+    }
+    for(int i = 0; i != master->listeners_count; ++i) {
+        fcntl(master->listeners[i], F_SETFD, 0);
+    }
+
+    master_signal_reset();
+    execvp(master->argv[0], master->argv);
+    perror("execvp() error");
+    _exit(1);
+}
+
+int master_run(struct MASTER *master) {
+    if(master == NULL || master->worker == NULL || master->workers_min <= 0) {
+        return MASTER_PARAM_ERROR;
+    }
+    if(master->workers_max < master->workers_min) {
+        master->workers_max = master->workers_min;
+    }
+
+    master->workers = calloc(master->workers_max, sizeof(struct MASTER_WORKER));
+    if(master->workers == NULL) {
+        return MASTER_MALLOC_ERROR;
+    }
+
+    worker_loads = mmap(NULL, master->workers_max * sizeof(struct WORKER_LOAD), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(worker_loads == MAP_FAILED) {
+        free(master->workers);
+        return MASTER_MALLOC_ERROR;
+    }
+
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigaddset(&set, SIGQUIT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGUSR2);
+    sigaddset(&set, SIGALRM);
+    sigprocmask(SIG_BLOCK, &set, &master_sigmask);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = master_signal;
+    sigaction(SIGCHLD, &sa, NULL);
+    sigaction(SIGQUIT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGALRM, &sa, NULL);
+
+    printf("Master process %i started\n", getpid());
+
+    for(int i = 0; i != master->workers_min; ++i) {
+        master_spawn(master, i);
+    }
+    if(master_alive(master) == 0) {
+        munmap(worker_loads, master->workers_max * sizeof(struct WORKER_LOAD));
+        free(master->workers);
+        return MASTER_FORK_ERROR;
+    }
+    master->workers_count = master->workers_min;
+
+    // Started by the old master during binary upgrade: let it drain and exit
+    char *parent = getenv(MASTER_PARENT_ENV);
+    if(parent) {
+        if(atoi(parent) == getppid()) {
+            kill(getppid(), SIGQUIT);
+        }
+        unsetenv(MASTER_PARENT_ENV);
+    }
+
+    struct itimerval timer = {
+        .it_interval = {.tv_sec = 0, .tv_usec = MASTER_TICK_MS * 1000},
+        .it_value = {.tv_sec = 0, .tv_usec = MASTER_TICK_MS * 1000}
+    };
+    setitimer(ITIMER_REAL, &timer, NULL);
+
+    int quitting = 0;
+    pid_t upgrade_pid = 0;
+    uint64_t quit_at = 0;
+    uint64_t scaled_at = master_now();
+    while(quitting == 0 || master_alive(master)) {
+        sigsuspend(&master_sigmask);
+        uint64_t now = master_now();
+
+        if(sig_child) {
+            sig_child = 0;
+
+            int status;
+            pid_t pid;
+            while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                if(pid == upgrade_pid) {
+                    printf("New binary %i exited, upgrade failed\n", pid);
+                    upgrade_pid = 0;
+                    continue;
+                }
+                for(int i = 0; i != master->workers_max; ++i) {
+                    struct MASTER_WORKER *w = &master->workers[i];
+                    if(w->pid != pid) {
+                        continue;
+                    }
+                    w->pid = 0;
+                    if(quitting || w->state == WORKER_RETIRING) {
+                        w->state = WORKER_FREE;
+                        break;
+                    }
+
+                    // Crashed worker: respawn it, backing off if it keeps crashing
+                    w->failures = now - w->started < MASTER_STABLE_MS ? w->failures + 1 : 0;
+                    uint64_t delay = MASTER_BACKOFF_MIN_MS << (w->failures < 8 ? w->failures : 8);
+                    w->respawn_at = now + (delay < MASTER_BACKOFF_MAX_MS ? delay : MASTER_BACKOFF_MAX_MS);
+                    w->state = WORKER_WAITING;
+                    if(WIFSIGNALED(status)) {
+                        printf("Worker process %i killed by signal %i, respawn in %lu ms\n", pid, WTERMSIG(status), (unsigned long)(w->respawn_at - now));
+                    }
+                    else {
+                        printf("Worker process %i exited with code %i, respawn in %lu ms\n", pid, WEXITSTATUS(status), (unsigned long)(w->respawn_at - now));
+                    }
+                    break;
+                }
+            }
+        }
+
+        if(sig_upgrade) {
+            sig_upgrade = 0;
+            if(upgrade_pid == 0 && quitting == 0) {
+                upgrade_pid = master_upgrade(master);
+                if(upgrade_pid < 0) {
+                    perror("fork() error");
+                    upgrade_pid = 0;
+                }
+                else {
+                    printf("Binary upgrade started, new master %i\n", upgrade_pid);
+                }
+            }
+        }
+
+        if((sig_quit || sig_term) && quitting == 0) {
+            // Workers stop accepting, finish in-flight requests and exit
+            quitting = 1;
+            quit_at = now + (master->drain_timeout + 1) * 1000;
+            master_kill(master, sig_quit ? SIGQUIT : SIGTERM);
+            for(int i = 0; i != master->listeners_count; ++i) {
+                close(master->listeners[i]);
+            }
+        }
+
+        if(sig_alarm) {
+            sig_alarm = 0;
+            if(quitting) {
+                if(quit_at && now >= quit_at) {
+                    master_kill(master, SIGKILL);
+                    quit_at = 0;
+                }
+                continue;
+            }
+
+            for(int i = 0; i != master->workers_max; ++i) {
+                struct MASTER_WORKER *w = &master->workers[i];
+                if(w->state == WORKER_WAITING && now >= w->respawn_at) {
+                    master_spawn(master, i);
+                }
+            }
+
+            if(master->workers_max > master->workers_min && now - scaled_at >= MASTER_SCALE_INTERVAL_MS) {
+                master_scale(master, now - scaled_at);
+                scaled_at = now;
+            }
+        }
+    }
+
+    munmap(worker_loads, master->workers_max * sizeof(struct WORKER_LOAD));
+    free(master->workers);
+    master->workers = NULL;
+    printf("Master process %i stopped\n", getpid());
+    return 0;
+}
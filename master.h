@@ -0,0 +1,76 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _MASTER_H
+#define _MASTER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MASTER_LISTENERS_ENV  "TINYHTTP_LISTENERS"
+#define MASTER_PARENT_ENV     "TINYHTTP_PARENT"
+// Reuseport groups add a socket per worker
+#define MASTER_MAX_LISTENERS  256
+
+#define MASTER_TICK_MS         100
+#define MASTER_BACKOFF_MIN_MS  100
+#define MASTER_BACKOFF_MAX_MS  10000
+#define MASTER_STABLE_MS       5000
+
+#define MASTER_SCALE_INTERVAL_MS  1000
+#define MASTER_SCALE_UP_LOAD      75
+#define MASTER_SCALE_DOWN_LOAD    25
+#define MASTER_SCALE_DOWN_SAMPLES 10
+
+#define MASTER_PARAM_ERROR   -1
+#define MASTER_MALLOC_ERROR  -2
+#define MASTER_FORK_ERROR    -3
+#define MASTER_ENV_ERROR     -4
+#define MASTER_OK             0
+
+#define WORKER_FREE      0
+#define WORKER_RUNNING   1
+#define WORKER_RETIRING  2
+#define WORKER_WAITING   3
+
+// Written by the worker, read by the master. Lives in shared memory
+struct WORKER_LOAD {
+    uint64_t busy_us;
+};
+
+struct MASTER_WORKER {
+    pid_t pid;
+    uint8_t state;
+    unsigned int failures;
+    uint64_t started;
+    uint64_t respawn_at;
+    uint64_t busy_us;
+};
+
+struct MASTER {
+    char **argv;
+    int *listeners;
+    int listeners_count;
+    struct MASTER_WORKER *workers;
+    // Running workers count, scaled between 'workers_min' and 'workers_max'
+    int workers_count;
+    int workers_min;
+    int workers_max;
+    int drain_timeout;
+    // Worker entry point, called in every forked worker process
+    int (*worker)(int *listeners, int listeners_count);
+};
+
+// Load slot of the current worker process, NULL in the master
+extern struct WORKER_LOAD *worker_load;
+// Slot index of the current worker process, -1 in the master
+extern int worker_slot;
+
+// Get listening sockets passed by the previous master during binary upgrade
+// Return count of sockets stored into 'fds', 0 if nothing was inherited
+int master_inherit_listeners(int *fds, int max);
+
+// Start workers, respawn crashed ones and scale their count until shutdown
+// Return exit code
+int master_run(struct MASTER *master);
+
+#endif
@@ -0,0 +1,167 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "metrics.h"
+
+static struct METRICS metrics_local;
+struct METRICS *metrics = &metrics_local;
+
+static struct METRICS *metrics_slots = NULL;
+static int metrics_slots_count = 0;
+
+static const char *metrics_phases[METRICS_PHASES] = {"parse", "route", "file", "cgi", "queue"};
+
+int metrics_init(int slots) {
+    if(slots <= 0) {
+        return METRICS_PARAM_ERROR;
+    }
+
+    metrics_slots = mmap(NULL, slots * sizeof(struct METRICS), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(metrics_slots == MAP_FAILED) {
+        metrics_slots = NULL;
+        return METRICS_MALLOC_ERROR;
+    }
+    metrics_slots_count = slots;
+    return METRICS_OK;
+}
+
+int metrics_attach(int slot) {
+    if(metrics_slots == NULL || slot < 0 || slot >= metrics_slots_count) {
+        return METRICS_PARAM_ERROR;
+    }
+    metrics = &metrics_slots[slot];
+    // Connections of crashed worker in this slot are gone
+    __atomic_store_n(&metrics->connections, 0, __ATOMIC_RELAXED);
+    return METRICS_OK;
+}
+
+// Largest value counted in histogram bucket in microseconds, Prometheus "le" is inclusive
+static uint64_t metrics_bucket_bound(unsigned int bucket) {
+    if(bucket < METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+    unsigned int e = bucket / METRICS_SUB_BUCKETS + 1;
+    unsigned int sub = bucket % METRICS_SUB_BUCKETS;
+    return ((uint64_t)(METRICS_SUB_BUCKETS + sub + 1) << (e - 2)) - 1;
+}
+
+#define METRICS_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+int metrics_render(char *buffer, int size, const int *codes, int codes_count) {
+    struct METRICS *slots = metrics_slots ? metrics_slots : &metrics_local;
+    int slots_count = metrics_slots ? metrics_slots_count : 1;
+    static struct METRICS sum;
+
+    memset(&sum, 0, sizeof(sum));
+    for(int i = 0; i != slots_count; ++i) {
+        struct METRICS *m = &slots[i];
+        for(int j = 0; j != METRICS_STATUS_MAX; ++j) {
+            sum.status[j] += METRICS_LOAD(m->status[j]);
+        }
+        sum.request_errors += METRICS_LOAD(m->request_errors);
+        sum.bytes_in += METRICS_LOAD(m->bytes_in);
+        sum.bytes_out += METRICS_LOAD(m->bytes_out);
+        sum.connections += METRICS_LOAD(m->connections);
+        sum.cgi_spawns += METRICS_LOAD(m->cgi_spawns);
+        sum.cgi_timeouts += METRICS_LOAD(m->cgi_timeouts);
+        sum.cache_hits += METRICS_LOAD(m->cache_hits);
+        sum.cgi_coalesced += METRICS_LOAD(m->cgi_coalesced);
+        sum.cgi_rejected += METRICS_LOAD(m->cgi_rejected);
+        sum.overload_shed += METRICS_LOAD(m->overload_shed);
+        sum.overload_pauses += METRICS_LOAD(m->overload_pauses);
+        sum.ratelimited += METRICS_LOAD(m->ratelimited);
+        sum.cpu_misses += METRICS_LOAD(m->cpu_misses);
+        sum.tls_handshakes += METRICS_LOAD(m->tls_handshakes);
+        sum.tls_resumed += METRICS_LOAD(m->tls_resumed);
+        sum.tls_offloaded += METRICS_LOAD(m->tls_offloaded);
+        sum.h2_connections += METRICS_LOAD(m->h2_connections);
+        sum.h2_streams += METRICS_LOAD(m->h2_streams);
+        sum.proxy_requests += METRICS_LOAD(m->proxy_requests);
+        sum.upstream_connects += METRICS_LOAD(m->upstream_connects);
+        sum.upstream_reused += METRICS_LOAD(m->upstream_reused);
+        sum.upstream_failures += METRICS_LOAD(m->upstream_failures);
+        sum.upstream_ejections += METRICS_LOAD(m->upstream_ejections);
+        for(int p = 0; p != METRICS_PHASES; ++p) {
+            for(int b = 0; b != METRICS_BUCKETS; ++b) {
+                sum.phases[p].buckets[b] += METRICS_LOAD(m->phases[p].buckets[b]);
+            }
+            sum.phases[p].count += METRICS_LOAD(m->phases[p].count);
+            sum.phases[p].sum_us += METRICS_LOAD(m->phases[p].sum_us);
+        }
+    }
+
+    int len = 0;
+#define METRICS_PRINT(...) if(len < size) len += snprintf(buffer + len, size - len, __VA_ARGS__)
+
+    METRICS_PRINT("# HELP tinyhttp_requests_total Requests by response code\n# TYPE tinyhttp_requests_total counter\n");
+    for(int i = 0; i != codes_count && i != METRICS_STATUS_MAX; ++i) {
+        METRICS_PRINT("tinyhttp_requests_total{code=\"%i\"} %lu\n", codes[i], (unsigned long)sum.status[i]);
+    }
+    METRICS_PRINT("# HELP tinyhttp_request_errors_total Requests rejected without response\n# TYPE tinyhttp_request_errors_total counter\n");
+    METRICS_PRINT("tinyhttp_request_errors_total %lu\n", (unsigned long)sum.request_errors);
+    METRICS_PRINT("# HELP tinyhttp_received_bytes_total Bytes received from clients\n# TYPE tinyhttp_received_bytes_total counter\n");
+    METRICS_PRINT("tinyhttp_received_bytes_total %lu\n", (unsigned long)sum.bytes_in);
+    METRICS_PRINT("# HELP tinyhttp_sent_bytes_total Bytes sent to clients\n# TYPE tinyhttp_sent_bytes_total counter\n");
+    METRICS_PRINT("tinyhttp_sent_bytes_total %lu\n", (unsigned long)sum.bytes_out);
+    METRICS_PRINT("# HELP tinyhttp_connections Open client connections\n# TYPE tinyhttp_connections gauge\n");
+    METRICS_PRINT("tinyhttp_connections %lu\n", (unsigned long)sum.connections);
+    METRICS_PRINT("# HELP tinyhttp_cgi_spawns_total CGI processes started\n# TYPE tinyhttp_cgi_spawns_total counter\n");
+    METRICS_PRINT("tinyhttp_cgi_spawns_total %lu\n", (unsigned long)sum.cgi_spawns);
+    METRICS_PRINT("# HELP tinyhttp_cgi_timeouts_total CGI processes killed on timeout\n# TYPE tinyhttp_cgi_timeouts_total counter\n");
+    METRICS_PRINT("tinyhttp_cgi_timeouts_total %lu\n", (unsigned long)sum.cgi_timeouts);
+    METRICS_PRINT("# HELP tinyhttp_cache_hits_total Responses served from cache\n# TYPE tinyhttp_cache_hits_total counter\n");
+    METRICS_PRINT("tinyhttp_cache_hits_total %lu\n", (unsigned long)sum.cache_hits);
+    METRICS_PRINT("# HELP tinyhttp_cgi_coalesced_total Requests served by CGI process of another request\n# TYPE tinyhttp_cgi_coalesced_total counter\n");
+    METRICS_PRINT("tinyhttp_cgi_coalesced_total %lu\n", (unsigned long)sum.cgi_coalesced);
+    METRICS_PRINT("# HELP tinyhttp_cgi_rejected_total CGI requests rejected with 503 on full queue or queue timeout\n# TYPE tinyhttp_cgi_rejected_total counter\n");
+    METRICS_PRINT("tinyhttp_cgi_rejected_total %lu\n", (unsigned long)sum.cgi_rejected);
+    METRICS_PRINT("# HELP tinyhttp_overload_shed_total Requests rejected with 503 on standing queue\n# TYPE tinyhttp_overload_shed_total counter\n");
+    METRICS_PRINT("tinyhttp_overload_shed_total %lu\n", (unsigned long)sum.overload_shed);
+    METRICS_PRINT("# HELP tinyhttp_overload_pauses_total Times accepting was paused on standing queue\n# TYPE tinyhttp_overload_pauses_total counter\n");
+    METRICS_PRINT("tinyhttp_overload_pauses_total %lu\n", (unsigned long)sum.overload_pauses);
+    METRICS_PRINT("# HELP tinyhttp_ratelimited_total Requests and connections of clients over their limits\n# TYPE tinyhttp_ratelimited_total counter\n");
+    METRICS_PRINT("tinyhttp_ratelimited_total %lu\n", (unsigned long)sum.ratelimited);
+    METRICS_PRINT("# HELP tinyhttp_cpu_misses_total Connections accepted on other CPU than received them, with cpu_affinity steer\n# TYPE tinyhttp_cpu_misses_total counter\n");
+    METRICS_PRINT("tinyhttp_cpu_misses_total %lu\n", (unsigned long)sum.cpu_misses);
+    METRICS_PRINT("# HELP tinyhttp_tls_handshakes_total Completed TLS handshakes\n# TYPE tinyhttp_tls_handshakes_total counter\n");
+    METRICS_PRINT("tinyhttp_tls_handshakes_total %lu\n", (unsigned long)sum.tls_handshakes);
+    METRICS_PRINT("# HELP tinyhttp_tls_resumed_total TLS handshakes resumed from session tickets\n# TYPE tinyhttp_tls_resumed_total counter\n");
+    METRICS_PRINT("tinyhttp_tls_resumed_total %lu\n", (unsigned long)sum.tls_resumed);
+    METRICS_PRINT("# HELP tinyhttp_tls_offloaded_total TLS connections handed to kernel TLS in both directions\n# TYPE tinyhttp_tls_offloaded_total counter\n");
+    METRICS_PRINT("tinyhttp_tls_offloaded_total %lu\n", (unsigned long)sum.tls_offloaded);
+    METRICS_PRINT("# HELP tinyhttp_h2_connections_total Connections switched to HTTP/2\n# TYPE tinyhttp_h2_connections_total counter\n");
+    METRICS_PRINT("tinyhttp_h2_connections_total %lu\n", (unsigned long)sum.h2_connections);
+    METRICS_PRINT("# HELP tinyhttp_h2_streams_total HTTP/2 requests\n# TYPE tinyhttp_h2_streams_total counter\n");
+    METRICS_PRINT("tinyhttp_h2_streams_total %lu\n", (unsigned long)sum.h2_streams);
+    METRICS_PRINT("# HELP tinyhttp_proxy_requests_total Requests passed to upstream servers\n# TYPE tinyhttp_proxy_requests_total counter\n");
+    METRICS_PRINT("tinyhttp_proxy_requests_total %lu\n", (unsigned long)sum.proxy_requests);
+    METRICS_PRINT("# HELP tinyhttp_upstream_connects_total Connections opened to upstream servers\n# TYPE tinyhttp_upstream_connects_total counter\n");
+    METRICS_PRINT("tinyhttp_upstream_connects_total %lu\n", (unsigned long)sum.upstream_connects);
+    METRICS_PRINT("# HELP tinyhttp_upstream_reused_total Proxied requests sent over idle keep-alive connections\n# TYPE tinyhttp_upstream_reused_total counter\n");
+    METRICS_PRINT("tinyhttp_upstream_reused_total %lu\n", (unsigned long)sum.upstream_reused);
+    METRICS_PRINT("# HELP tinyhttp_upstream_failures_total Failed connects, timeouts and broken responses of upstream servers\n# TYPE tinyhttp_upstream_failures_total counter\n");
+    METRICS_PRINT("tinyhttp_upstream_failures_total %lu\n", (unsigned long)sum.upstream_failures);
+    METRICS_PRINT("# HELP tinyhttp_upstream_ejections_total Upstream servers taken out of balancing after failures\n# TYPE tinyhttp_upstream_ejections_total counter\n");
+    METRICS_PRINT("tinyhttp_upstream_ejections_total %lu\n", (unsigned long)sum.upstream_ejections);
+
+    METRICS_PRINT("# HELP tinyhttp_phase_duration_seconds Time spent in request phases\n# TYPE tinyhttp_phase_duration_seconds histogram\n");
+    for(int p = 0; p != METRICS_PHASES; ++p) {
+        uint64_t cumulative = 0;
+        // Last bucket also holds all larger values, only +Inf bounds it
+        for(int b = 0; b != METRICS_BUCKETS - 1; ++b) {
+            cumulative += sum.phases[p].buckets[b];
+            uint64_t bound = metrics_bucket_bound(b);
+            METRICS_PRINT("tinyhttp_phase_duration_seconds_bucket{phase=\"%s\",le=\"%lu.%06lu\"} %lu\n", metrics_phases[p],
+                (unsigned long)(bound / 1000000), (unsigned long)(bound % 1000000), (unsigned long)cumulative);
+        }
+        METRICS_PRINT("tinyhttp_phase_duration_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", metrics_phases[p], (unsigned long)sum.phases[p].count);
+        METRICS_PRINT("tinyhttp_phase_duration_seconds_sum{phase=\"%s\"} %lu.%06lu\n", metrics_phases[p],
+            (unsigned long)(sum.phases[p].sum_us / 1000000), (unsigned long)(sum.phases[p].sum_us % 1000000));
+        METRICS_PRINT("tinyhttp_phase_duration_seconds_count{phase=\"%s\"} %lu\n", metrics_phases[p], (unsigned long)sum.phases[p].count);
+    }
+
+#undef METRICS_PRINT
+    return len < size ? len : size;
+}
@@ -0,0 +1,98 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_STATUS_MAX   16
+// 4 sub-buckets per power of two of microseconds, up to ~67 seconds
+#define METRICS_SUB_BUCKETS  4
+#define METRICS_BUCKETS      104
+#define METRICS_BUFFER_SIZE  (64 << 10)
+
+#define METRICS_PHASE_PARSE  0
+#define METRICS_PHASE_ROUTE  1
+#define METRICS_PHASE_FILE   2
+#define METRICS_PHASE_CGI    3
+#define METRICS_PHASE_QUEUE  4
+#define METRICS_PHASES       5
+
+#define METRICS_MALLOC_ERROR  -1
+#define METRICS_PARAM_ERROR   -2
+#define METRICS_OK             0
+
+struct METRICS_HISTOGRAM {
+    uint64_t buckets[METRICS_BUCKETS];
+    uint64_t count;
+    uint64_t sum_us;
+};
+
+// Counters of one worker. Written only by that worker, read by any
+struct METRICS {
+    uint64_t status[METRICS_STATUS_MAX];
+    uint64_t request_errors;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t connections;
+    uint64_t cgi_spawns;
+    uint64_t cgi_timeouts;
+    uint64_t cache_hits;
+    uint64_t cgi_coalesced;
+    uint64_t cgi_rejected;
+    uint64_t overload_shed;
+    uint64_t overload_pauses;
+    uint64_t ratelimited;
+    uint64_t cpu_misses;
+    uint64_t tls_handshakes;
+    uint64_t tls_resumed;
+    uint64_t tls_offloaded;
+    uint64_t h2_connections;
+    uint64_t h2_streams;
+    uint64_t proxy_requests;
+    uint64_t upstream_connects;
+    uint64_t upstream_reused;
+    uint64_t upstream_failures;
+    uint64_t upstream_ejections;
+    struct METRICS_HISTOGRAM phases[METRICS_PHASES];
+} __attribute__((aligned(64)));
+
+// Slot of the current worker
+extern struct METRICS *metrics;
+
+// Map shared segment with 'slots' worker slots, must be called before fork
+// Return error code
+int metrics_init(int slots);
+
+// Use slot 'slot' for counters of the current process
+// Return error code
+int metrics_attach(int slot);
+
+// Render sum of all slots in Prometheus text format. 'codes' are HTTP codes of status counters
+// Return length of text in 'buffer'
+int metrics_render(char *buffer, int size, const int *codes, int codes_count);
+
+// Counter has single writer, so no atomic read-modify-write is needed
+static inline void metrics_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void metrics_observe(int phase, uint64_t us) {
+    struct METRICS_HISTOGRAM *h = &metrics->phases[phase];
+    unsigned int bucket;
+    if(us < METRICS_SUB_BUCKETS) {
+        bucket = us;
+    }
+    else {
+        unsigned int e = 63 - __builtin_clzll(us);
+        bucket = METRICS_SUB_BUCKETS * (e - 1) + ((us >> (e - 2)) & (METRICS_SUB_BUCKETS - 1));
+        if(bucket >= METRICS_BUCKETS) {
+            bucket = METRICS_BUCKETS - 1;
+        }
+    }
+    metrics_add(&h->buckets[bucket], 1);
+    metrics_add(&h->count, 1);
+    metrics_add(&h->sum_us, us);
+}
+
+#endif
@@ -0,0 +1,31 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include "overload.h"
+
+void overload_init(struct OVERLOAD *overload, int target_ms, int interval_ms, uint64_t now) {
+    overload->target_us = target_ms * 1000ull;
+    overload->interval_us = interval_ms * 1000ull;
+    overload->below = now;
+    overload->sampled = now;
+    overload->active = 0;
+}
+
+int overload_sample(struct OVERLOAD *overload, uint64_t sojourn, uint64_t now) {
+    overload->sampled = now;
+    if(sojourn < overload->target_us) {
+        overload->below = now;
+    }
+    overload->active = now - overload->below > overload->interval_us;
+
+    // Short queue is allowed to absorb bursts, standing one is kept at target
+    uint64_t limit = overload->active ? overload->target_us : overload->interval_us;
+    return sojourn > limit ? OVERLOAD_SHED : OVERLOAD_SERVE;
+}
+
+int overload_check(struct OVERLOAD *overload, uint64_t now) {
+    if(overload->active && now - overload->sampled > overload->interval_us) {
+        overload->active = 0;
+        overload->below = now;
+    }
+    return overload->active;
+}
@@ -0,0 +1,37 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _OVERLOAD_H
+#define _OVERLOAD_H
+
+#include <stdint.h>
+
+// CoDel style admission control. Requests may wait in queue up to an interval normally,
+// but once none of them got through faster than target for a whole interval the queue is
+// standing, and requests that waited longer than target are shed until one gets through
+#define OVERLOAD_DEFAULT_INTERVAL_MS  100
+
+#define OVERLOAD_SERVE  0
+#define OVERLOAD_SHED   1
+
+struct OVERLOAD {
+    uint64_t target_us;
+    uint64_t interval_us;
+    // CLOCK_MONOTONIC microseconds of the last request under target and of the last measured one
+    uint64_t below;
+    uint64_t sampled;
+    // Queue is standing
+    int active;
+};
+
+// Start with empty queue at 'now'
+void overload_init(struct OVERLOAD *overload, int target_ms, int interval_ms, uint64_t now);
+
+// Account request that waited 'sojourn' microseconds before handling
+// Return OVERLOAD_SHED if it should be rejected, OVERLOAD_SERVE otherwise
+int overload_sample(struct OVERLOAD *overload, uint64_t sojourn, uint64_t now);
+
+// Leave overload when no request was measured for an interval, the queue has drained
+// Return 1 while the queue is standing
+int overload_check(struct OVERLOAD *overload, uint64_t now);
+
+#endif
@@ -0,0 +1,387 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+// tinyhttp-pack packs files served by static routes of tinyhttp config into one bundle.
+// Exact routes get their file, routes ending with '/' get regular files of the directory,
+// the same files tinyhttp would serve for them. fastcgi and status routes are not packed.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/limits.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "map.h"
+#include "bundle.h"
+
+#define SERVER_NAME "tinyhttp"
+
+// Smaller bodies are not compressed, and compressed variant must save at least 10%
+#define PACK_GZIP_MIN  256
+
+struct PACK {
+    FILE *out;
+    uint64_t offset;
+    int gzip;
+    // Strings are written after bodies, their offsets are relative until then
+    char *strings;
+    size_t strings_len;
+    size_t strings_size;
+    struct BUNDLE_ENTRY *entries;
+    uint32_t count;
+    uint32_t size;
+    // Packed request paths, exact routes win over directory ones
+    struct MAP paths;
+    uint64_t bytes;
+    uint32_t compressed;
+};
+
+static int pack_string(struct PACK *pack, const char *data, size_t len, struct BUNDLE_BLOCK *block) {
+    if(pack->strings_len + len > pack->strings_size) {
+        size_t size = pack->strings_size ? pack->strings_size : 1 << 16;
+        while(size < pack->strings_len + len) {
+            size <<= 1;
+        }
+        char *strings = realloc(pack->strings, size);
+        if(strings == NULL) {
+            return -1;
+        }
+        pack->strings = strings;
+        pack->strings_size = size;
+    }
+    memcpy(pack->strings + pack->strings_len, data, len);
+    block->offset = pack->strings_len;
+    block->len = len;
+    pack->strings_len += len;
+    return 0;
+}
+
+// Write 'len' zero bytes
+static int pack_pad(struct PACK *pack, uint64_t len) {
+    static const char zeros[BUNDLE_ALIGN];
+    while(len) {
+        size_t n = len < sizeof(zeros) ? len : sizeof(zeros);
+        if(fwrite(zeros, 1, n, pack->out) != n) {
+            return -1;
+        }
+        pack->offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Write body at page aligned offset, so it can be sent straight from the mapping
+static int pack_body(struct PACK *pack, const char *data, size_t len, struct BUNDLE_BLOCK *block) {
+    if(pack_pad(pack, (BUNDLE_ALIGN - pack->offset % BUNDLE_ALIGN) % BUNDLE_ALIGN) != 0) {
+        return -1;
+    }
+    if(len && fwrite(data, 1, len, pack->out) != len) {
+        return -1;
+    }
+    block->offset = pack->offset;
+    block->len = len;
+    pack->offset += len;
+    pack->bytes += len;
+    return 0;
+}
+
+// Compress 'data' to gzip format
+// Return length of compressed data or 0 if it is not worth it
+static size_t pack_gzip(const char *data, size_t len, char **out) {
+    z_stream z;
+    memset(&z, 0, sizeof(z));
+    if(len < PACK_GZIP_MIN || deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    size_t size = deflateBound(&z, len);
+    *out = malloc(size);
+    if(*out == NULL) {
+        deflateEnd(&z);
+        return 0;
+    }
+    z.next_in = (Bytef *)data;
+    z.avail_in = len;
+    z.next_out = (Bytef *)*out;
+    z.avail_out = size;
+    int r = deflate(&z, Z_FINISH);
+    size_t compressed = z.total_out;
+    deflateEnd(&z);
+    if(r != Z_STREAM_END || compressed > len - len / 10) {
+        free(*out);
+        *out = NULL;
+        return 0;
+    }
+    return compressed;
+}
+
+// Add file 'file_path' served for request path 'path', paths packed before are skipped
+// Return 0 on success
+static int pack_file(struct PACK *pack, const char *path, const char *file_path, const char *content_type) {
+    size_t path_len = strlen(path);
+    char seen = 1;
+    if(map_get(&pack->paths, path, path_len, &seen, sizeof(seen)) > 0) {
+        return 0;
+    }
+
+    int fd = open(file_path, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Can't open %s: %s\n", file_path, strerror(errno));
+        if(fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    char *data = malloc(st.st_size ? st.st_size : 1);
+    if(data == NULL || read(fd, data, st.st_size) != st.st_size) {
+        fprintf(stderr, "Can't read %s\n", file_path);
+        free(data);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if(pack->count == pack->size) {
+        uint32_t size = pack->size ? pack->size * 2 : 256;
+        struct BUNDLE_ENTRY *entries = realloc(pack->entries, size * sizeof(struct BUNDLE_ENTRY));
+        if(entries == NULL) {
+            free(data);
+            return -1;
+        }
+        pack->entries = entries;
+        pack->size = size;
+    }
+    struct BUNDLE_ENTRY *entry = &pack->entries[pack->count];
+    memset(entry, 0, sizeof(struct BUNDLE_ENTRY));
+    entry->hash = bundle_hash(path, path_len);
+
+    char etag[48];
+    int etag_len = snprintf(etag, sizeof(etag), "\"%016llx-%llx\"", (unsigned long long)bundle_hash(data, st.st_size), (unsigned long long)st.st_size);
+
+    char *gzip = NULL;
+    size_t gzip_len = pack->gzip ? pack_gzip(data, st.st_size, &gzip) : 0;
+
+    char headers[1024];
+    int r = 0;
+    if(pack_string(pack, path, path_len, &entry->path) != 0 || pack_string(pack, etag, etag_len, &entry->etag) != 0 ||
+            pack_body(pack, data, st.st_size, &entry->bodies[BUNDLE_IDENTITY]) != 0) {
+        r = -1;
+    }
+    if(r == 0) {
+        int len = snprintf(headers, sizeof(headers), "HTTP/1.1 200 OK\r\n\
+Server: %s\r\n\
+Content-Length: %lli\r\n\
+Content-Type: %s\r\n\
+ETag: %s\r\n%s", SERVER_NAME, (long long)st.st_size, content_type, etag, gzip_len ? "Vary: Accept-Encoding\r\n" : "");
+        r = pack_string(pack, headers, len, &entry->headers[BUNDLE_IDENTITY]);
+    }
+    if(r == 0 && gzip_len) {
+        int len = snprintf(headers, sizeof(headers), "HTTP/1.1 200 OK\r\n\
+Server: %s\r\n\
+Content-Length: %zu\r\n\
+Content-Type: %s\r\n\
+Content-Encoding: gzip\r\n\
+ETag: %s\r\n\
+Vary: Accept-Encoding\r\n", SERVER_NAME, gzip_len, content_type, etag);
+        r = pack_string(pack, headers, len, &entry->headers[BUNDLE_GZIP]);
+        r = r == 0 ? pack_body(pack, gzip, gzip_len, &entry->bodies[BUNDLE_GZIP]) : r;
+        ++pack->compressed;
+    }
+    if(r == 0) {
+        int len = snprintf(headers, sizeof(headers), "HTTP/1.1 304 Not Modified\r\n\
+Server: %s\r\n\
+ETag: %s\r\n", SERVER_NAME, etag);
+        r = pack_string(pack, headers, len, &entry->not_modified);
+    }
+    free(gzip);
+    free(data);
+    if(r != 0) {
+        fprintf(stderr, "Can't pack %s\n", file_path);
+        return -1;
+    }
+
+    ++pack->count;
+    return map_add(&pack->paths, path, path_len, &seen, sizeof(seen)) == MAP_OK ? 0 : -1;
+}
+
+// Add regular files of 'dir' served by directory route 'path'
+// Return 0 on success
+static int pack_directory(struct PACK *pack, const char *path, const char *dir, const char *content_type) {
+    DIR *d = opendir(dir);
+    if(d == NULL) {
+        fprintf(stderr, "Can't open directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    struct dirent *de;
+    int r = 0;
+    while(r == 0 && (de = readdir(d))) {
+        char file_path[PATH_MAX], request_path[PATH_MAX];
+        struct stat st;
+        if(snprintf(file_path, sizeof(file_path), "%s%s", dir, de->d_name) >= sizeof(file_path) ||
+                snprintf(request_path, sizeof(request_path), "%s%s", path, de->d_name) >= sizeof(request_path)) {
+            continue;
+        }
+        if(stat(file_path, &st) != 0 || !S_ISREG(st.st_mode)) {
+            continue;
+        }
+        r = pack_file(pack, request_path, file_path, content_type);
+    }
+    closedir(d);
+    return r;
+}
+
+static int pack_entry_compare(const void *a, const void *b) {
+    uint64_t x = ((const struct BUNDLE_ENTRY *)a)->hash, y = ((const struct BUNDLE_ENTRY *)b)->hash;
+    return x < y ? -1 : x > y;
+}
+
+// Write strings and index after bodies, then the file header
+// Return 0 on success
+static int pack_finish(struct PACK *pack) {
+    if(pack_pad(pack, (sizeof(uint64_t) - pack->offset % sizeof(uint64_t)) % sizeof(uint64_t)) != 0) {
+        return -1;
+    }
+    uint64_t strings = pack->offset;
+    if(pack->strings_len && fwrite(pack->strings, 1, pack->strings_len, pack->out) != pack->strings_len) {
+        return -1;
+    }
+    pack->offset += pack->strings_len;
+    if(pack_pad(pack, (sizeof(uint64_t) - pack->offset % sizeof(uint64_t)) % sizeof(uint64_t)) != 0) {
+        return -1;
+    }
+
+    for(uint32_t i = 0; i != pack->count; ++i) {
+        struct BUNDLE_ENTRY *entry = &pack->entries[i];
+        entry->path.offset += strings;
+        entry->etag.offset += strings;
+        entry->not_modified.offset += strings;
+        for(int v = 0; v != BUNDLE_VARIANTS; ++v) {
+            if(entry->headers[v].len) {
+                entry->headers[v].offset += strings;
+            }
+        }
+    }
+    qsort(pack->entries, pack->count, sizeof(struct BUNDLE_ENTRY), pack_entry_compare);
+
+    struct BUNDLE_FILE_HEADER header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.count = pack->count;
+    header.index = pack->offset;
+    header.size = pack->offset + (uint64_t)pack->count * sizeof(struct BUNDLE_ENTRY);
+    if(pack->count && fwrite(pack->entries, sizeof(struct BUNDLE_ENTRY), pack->count, pack->out) != pack->count) {
+        return -1;
+    }
+    if(fseek(pack->out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, pack->out) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Pack routes of config file 'config' like get_config() of tinyhttp reads them
+// Return 0 on success
+static int pack_config(struct PACK *pack, const char *config, const char *root) {
+    FILE *f = fopen(config, "r");
+    if(f == NULL) {
+        fprintf(stderr, "Can't open config %s\n", config);
+        return -1;
+    }
+
+    char spath[128], stype[128], sact[128];
+    char buff[512];
+    int r = 0;
+    // Exact routes first, they take precedence over directories
+    for(int pass = 0; r == 0 && pass != 2; ++pass) {
+        rewind(f);
+        while(r == 0 && fgets(buff, sizeof(buff), f)) {
+            if(buff[0] != '/' || sscanf(buff, "%s %s %s\n", spath, stype, sact) != 3) {
+                continue;
+            }
+            if(strcmp(sact, "fastcgi") == 0 || strcmp(sact, "status") == 0) {
+                continue;
+            }
+
+            char file_path[PATH_MAX];
+            if(pass == 0 && sact[0] != '$') {
+                r = snprintf(file_path, sizeof(file_path), "%s%s", root, sact) < sizeof(file_path) ? pack_file(pack, spath, file_path, stype) : -1;
+            }
+            else if(pass == 1 && spath[strlen(spath) - 1] == '/') {
+                r = snprintf(file_path, sizeof(file_path), "%s%s", root, spath + 1) < sizeof(file_path) ? pack_directory(pack, spath, file_path, stype) : -1;
+            }
+        }
+    }
+    fclose(f);
+    return r;
+}
+
+static void usage(char *argv0) {
+    printf("Usage: %s -r root [-c config] [-z] -o bundle\n", argv0);
+    printf("  -r path   : document root, as -r of tinyhttp\n");
+    printf("  -c config : config with routes (tinyhttp.conf)\n");
+    printf("  -z        : add gzip variants of compressible files\n");
+    printf("  -o path   : output bundle, replaced atomically\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *config = "tinyhttp.conf";
+    const char *output = NULL;
+    char root[PATH_MAX] = {0};
+    struct PACK pack;
+    memset(&pack, 0, sizeof(pack));
+
+    int opt;
+    while((opt = getopt(argc, argv, "r:c:zo:h")) > 0) {
+        switch(opt) {
+            case 'r':
+                // Routes are appended without leading slash, like in tinyhttp
+                snprintf(root, sizeof(root) - 1, "%s", optarg);
+                if(root[0] && root[strlen(root) - 1] != '/') {
+                    strcat(root, "/");
+                }
+                break;
+            case 'c':
+                config = optarg;
+                break;
+            case 'z':
+                pack.gzip = 1;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(root[0] == 0 || output == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", output);
+    pack.out = fopen(tmp, "wb");
+    if(pack.out == NULL) {
+        fprintf(stderr, "Can't create %s\n", tmp);
+        return 1;
+    }
+    // Room for file header, written last
+    int r = pack_pad(&pack, sizeof(struct BUNDLE_FILE_HEADER));
+    r = r == 0 ? pack_config(&pack, config, root) : r;
+    r = r == 0 ? pack_finish(&pack) : r;
+    if(fclose(pack.out) != 0 || r != 0 || rename(tmp, output) != 0) {
+        fprintf(stderr, "Can't write %s\n", output);
+        unlink(tmp);
+        return 1;
+    }
+
+    printf("%u files, %llu bytes, %u gzip variants\n", pack.count, (unsigned long long)pack.bytes, pack.compressed);
+    map_destroy(&pack.paths);
+    free(pack.entries);
+    free(pack.strings);
+    return 0;
+}
@@ -0,0 +1,26 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _PROBES_H
+#define _PROBES_H
+
+// USDT probes of provider "tinyhttp". A probe is a single nop until a tracer attaches,
+// e.g. bpftrace -e 'usdt:./tinyhttp:tinyhttp:request__done { @[str(arg2)] = hist(arg1); }'
+// Without <sys/sdt.h> (systemtap-sdt-dev) they compile to nothing
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBES_ENABLED 1
+#endif
+#endif
+
+#ifdef PROBES_ENABLED
+#define PROBE1(name, a)           DTRACE_PROBE1(tinyhttp, name, a)
+#define PROBE2(name, a, b)        DTRACE_PROBE2(tinyhttp, name, a, b)
+#define PROBE3(name, a, b, c)     DTRACE_PROBE3(tinyhttp, name, a, b, c)
+#else
+#define PROBE1(name, a)           do {} while(0)
+#define PROBE2(name, a, b)        do {} while(0)
+#define PROBE3(name, a, b, c)     do {} while(0)
+#endif
+
+#endif
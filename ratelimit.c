@@ -0,0 +1,195 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <string.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include "ratelimit.h"
+
+#define RATELIMIT_LOAD(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define RATELIMIT_STORE(x, v) __atomic_store_n(&(x), v, __ATOMIC_RELAXED)
+#define RATELIMIT_TOKENS_MASK ((1ull << RATELIMIT_TOKEN_BITS) - 1)
+// Connections of entry that is being taken over by another key
+#define RATELIMIT_CLAIMED     UINT32_MAX
+
+// Finalizer of splitmix64
+static uint64_t ratelimit_mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+// Find entry of 'key', a free or stale entry is taken over when 'create' is set
+// Return entry or NULL
+static struct RATELIMIT_ENTRY *ratelimit_entry(struct RATELIMIT *ratelimit, uint64_t key, uint32_t now, int create) {
+    unsigned int mask = ratelimit->size - 1;
+    struct RATELIMIT_ENTRY *victim = NULL;
+    for(unsigned int i = 0; i != RATELIMIT_PROBES; ++i) {
+        struct RATELIMIT_ENTRY *entry = &ratelimit->entries[(key + i) & mask];
+        uint64_t entry_key = RATELIMIT_LOAD(entry->key);
+        if(entry_key == key) {
+            return entry;
+        }
+        if(!create) {
+            continue;
+        }
+        if(entry_key == 0) {
+            if(__atomic_compare_exchange_n(&entry->key, &entry_key, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                RATELIMIT_STORE(entry->used, now);
+                return entry;
+            }
+            // Someone else took it, maybe for the same key
+            if(entry_key == key) {
+                return entry;
+            }
+            continue;
+        }
+        // Only entries without connections can be replaced, their counters must stay valid
+        if(RATELIMIT_LOAD(entry->connections) == 0 && (victim == NULL || RATELIMIT_LOAD(entry->used) < RATELIMIT_LOAD(victim->used))) {
+            victim = entry;
+        }
+    }
+    if(victim == NULL) {
+        return NULL;
+    }
+
+    // Victim is claimed before its key changes, so no connection is counted on the old key
+    // meanwhile and then lost when the counter is reset
+    uint32_t idle = 0;
+    if(!__atomic_compare_exchange_n(&victim->connections, &idle, RATELIMIT_CLAIMED, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    uint64_t victim_key = RATELIMIT_LOAD(victim->key);
+    if(!__atomic_compare_exchange_n(&victim->key, &victim_key, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&victim->connections, 0, __ATOMIC_RELEASE);
+        return NULL;
+    }
+    RATELIMIT_STORE(victim->bucket, 0);
+    RATELIMIT_STORE(victim->used, now);
+    __atomic_store_n(&victim->connections, 0, __ATOMIC_RELEASE);
+    return victim;
+}
+
+int ratelimit_init(struct RATELIMIT *ratelimit, unsigned int size) {
+    if(size == 0 || size > (1u << 31)) {
+        return RATELIMIT_PARAM_ERROR;
+    }
+    ratelimit->size = 1;
+    while(ratelimit->size < size) {
+        ratelimit->size <<= 1;
+    }
+    ratelimit->entries = mmap(NULL, (size_t)ratelimit->size * sizeof(struct RATELIMIT_ENTRY), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(ratelimit->entries == MAP_FAILED) {
+        ratelimit->entries = NULL;
+        return RATELIMIT_MALLOC_ERROR;
+    }
+    return RATELIMIT_OK;
+}
+
+uint64_t ratelimit_key(const struct sockaddr *addr, uint32_t id) {
+    uint64_t hi, lo;
+    if(addr->sa_family == AF_INET) {
+        hi = 0;
+        lo = ((const struct sockaddr_in *)addr)->sin_addr.s_addr;
+    }
+    else if(addr->sa_family == AF_INET6) {
+        const uint8_t *a = ((const struct sockaddr_in6 *)addr)->sin6_addr.s6_addr;
+        memcpy(&hi, a, 8);
+        memcpy(&lo, a + 8, 8);
+        // IPv4 mapped address is the same client as plain IPv4
+        if(hi == 0 && (lo & 0xffffffffull) == 0xffff0000ull) {
+            lo >>= 32;
+        }
+    }
+    else {
+        return 0;
+    }
+    uint64_t key = ratelimit_mix(hi ^ ratelimit_mix(lo ^ ((uint64_t)id << 32)));
+    return key ? key : 1;
+}
+
+int ratelimit_request(struct RATELIMIT *ratelimit, uint64_t key, struct RATELIMIT_RULE *rule, uint64_t now) {
+    struct RATELIMIT_ENTRY *entry = ratelimit_entry(ratelimit, key, now / 1000, 1);
+    if(entry == NULL) {
+        // Table is full of connected clients, don't limit the rest
+        return 1;
+    }
+    RATELIMIT_STORE(entry->used, now / 1000);
+
+    uint64_t burst = rule->burst ? rule->burst : rule->rate;
+    uint64_t capacity = (burst < RATELIMIT_MAX_BURST ? burst : RATELIMIT_MAX_BURST) * 1000ull;
+    uint64_t bucket = RATELIMIT_LOAD(entry->bucket);
+    uint64_t next;
+    do {
+        uint64_t tokens = capacity;
+        if(bucket) {
+            // Rate per second is milli-tokens per millisecond
+            uint64_t last = bucket >> RATELIMIT_TOKEN_BITS;
+            tokens = (bucket & RATELIMIT_TOKENS_MASK) + (now > last ? now - last : 0) * rule->rate;
+            if(tokens > capacity) {
+                tokens = capacity;
+            }
+        }
+        if(tokens < 1000) {
+            return 0;
+        }
+        next = (now << RATELIMIT_TOKEN_BITS) | (tokens - 1000);
+    }while(!__atomic_compare_exchange_n(&entry->bucket, &bucket, next, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    return 1;
+}
+
+// Decrement connections of entry unless they are 0 or entry is claimed
+// Return 1 if decremented
+static int ratelimit_release(struct RATELIMIT_ENTRY *entry) {
+    uint32_t connections = RATELIMIT_LOAD(entry->connections);
+    while(connections && connections != RATELIMIT_CLAIMED) {
+        if(__atomic_compare_exchange_n(&entry->connections, &connections, connections - 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int ratelimit_connect(struct RATELIMIT *ratelimit, uint64_t key, unsigned int limit, uint64_t now) {
+    if(key == 0) {
+        return RATELIMIT_UNCOUNTED;
+    }
+    // Entry may be taken over between lookup and counting, then it is looked up again
+    for(unsigned int attempt = 0; attempt != RATELIMIT_PROBES; ++attempt) {
+        struct RATELIMIT_ENTRY *entry = ratelimit_entry(ratelimit, key, now / 1000, 1);
+        if(entry == NULL) {
+            return RATELIMIT_UNCOUNTED;
+        }
+        RATELIMIT_STORE(entry->used, now / 1000);
+        uint32_t connections = __atomic_load_n(&entry->connections, __ATOMIC_ACQUIRE);
+        do {
+            if(connections == RATELIMIT_CLAIMED) {
+                break;
+            }
+            if(connections >= limit) {
+                return 0;
+            }
+        }while(!__atomic_compare_exchange_n(&entry->connections, &connections, connections + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+        if(connections == RATELIMIT_CLAIMED) {
+            continue;
+        }
+        // Counted entry can't be claimed anymore, but it could have changed key just before
+        if(RATELIMIT_LOAD(entry->key) == key) {
+            return RATELIMIT_COUNTED;
+        }
+        ratelimit_release(entry);
+    }
+    // Entry keeps changing hands, the connection is not limited as when the table is full
+    return RATELIMIT_UNCOUNTED;
+}
+
+void ratelimit_disconnect(struct RATELIMIT *ratelimit, uint64_t key) {
+    // Workers creating entry of the same key at once may leave it in two slots, connections are
+    // counted on either of them
+    unsigned int mask = ratelimit->size - 1;
+    for(unsigned int i = 0; i != RATELIMIT_PROBES; ++i) {
+        struct RATELIMIT_ENTRY *entry = &ratelimit->entries[(key + i) & mask];
+        if(RATELIMIT_LOAD(entry->key) == key && ratelimit_release(entry)) {
+            return;
+        }
+    }
+}
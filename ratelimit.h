@@ -0,0 +1,71 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _RATELIMIT_H
+#define _RATELIMIT_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Token buckets and connection counters of client addresses in a fixed shared table, so
+// limits hold across workers. Entry is found by probing RATELIMIT_PROBES slots from the key
+// hash, when all of them are taken the least recently used idle one is replaced
+#define RATELIMIT_DEFAULT_SIZE  (1 << 18)
+#define RATELIMIT_PROBES        8
+// Bucket keeps milli-tokens in low bits and time of last refill in milliseconds above them
+#define RATELIMIT_TOKEN_BITS    24
+#define RATELIMIT_MAX_BURST     ((1 << RATELIMIT_TOKEN_BITS) / 1000 - 1)
+
+#define RATELIMIT_PARAM_ERROR   -1
+#define RATELIMIT_MALLOC_ERROR  -2
+#define RATELIMIT_OK             0
+
+#define RATELIMIT_COUNTED       1
+#define RATELIMIT_UNCOUNTED     2
+
+struct RATELIMIT_ENTRY {
+    // Hash of address and rule, 0 if slot is free
+    uint64_t key;
+    uint64_t bucket;
+    uint32_t connections;
+    // CLOCK_MONOTONIC seconds of last use
+    uint32_t used;
+};
+
+struct RATELIMIT {
+    struct RATELIMIT_ENTRY *entries;
+    // Power of two
+    unsigned int size;
+};
+
+// Limits of all requests of a client or of requests to one route
+struct RATELIMIT_RULE {
+    // Requests per second, 0 is unlimited
+    unsigned int rate;
+    // Requests allowed at once, 0 is one second of rate
+    unsigned int burst;
+    // Connections of one address, only for the global rule
+    unsigned int connections;
+    uint32_t id;
+};
+
+// Map shared table of at least 'size' entries, must be called before fork
+// Return error code
+int ratelimit_init(struct RATELIMIT *ratelimit, unsigned int size);
+
+// Build key of client address 'addr' for rule 'id'
+// Return key or 0 if the address is not limited
+uint64_t ratelimit_key(const struct sockaddr *addr, uint32_t id);
+
+// Take a token from bucket of 'key', 'now' is CLOCK_MONOTONIC milliseconds
+// Return 1 if request is allowed
+int ratelimit_request(struct RATELIMIT *ratelimit, uint64_t key, struct RATELIMIT_RULE *rule, uint64_t now);
+
+// Count new connection of 'key' unless it has 'limit' already. Connection of address that isn't
+// limited or that has no entry in a full table is allowed without counting
+// Return RATELIMIT_COUNTED, RATELIMIT_UNCOUNTED or 0 if connection is refused
+int ratelimit_connect(struct RATELIMIT *ratelimit, uint64_t key, unsigned int limit, uint64_t now);
+
+// Uncount closed connection of 'key', only for connections that were RATELIMIT_COUNTED
+void ratelimit_disconnect(struct RATELIMIT *ratelimit, uint64_t key);
+
+#endif
@@ -1,28 +1,168 @@
 // Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
 
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <sched.h>
+#include <errno.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <linux/limits.h>
 #include <bits/local_lim.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/epoll.h>
 #include <sys/wait.h>
-#include "tinyhttp.h"
+#include <sys/resource.h>
 #include "map.h"
+#include "http.h"
+#include "master.h"
+#include "listener.h"
+#include "accesslog.h"
+#include "metrics.h"
+#include "trace.h"
+#include "probes.h"
+#include "cache.h"
+#include "overload.h"
+#include "ratelimit.h"
+#include "bundle.h"
+#include "tls.h"
+#include "h2.h"
+#include "upstream.h"
+#include "tinyhttp.h"
 
 
 uint8_t verbose = 0;
+char access_log_path[PATH_MAX] = {0};
+int access_log_fd = -1;
+struct ACCESS_LOG access_log = {.records = NULL};
+struct ACCESS_LOG_RECORD *log_record = NULL;
+char trace_path[PATH_MAX] = {0};
+unsigned int trace_sample = 1;
+int trace_fd = -1;
+struct TRACE trace = {.buffer = NULL};
+int response_codes[sizeof(responses) / sizeof(responses_t)];
+char *status_buffer = NULL;
 char root[PATH_MAX] = {0};
 char host[HOST_NAME_MAX] = {0};
 struct MAP config = {.objects = NULL, .length = 0};
+int drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+struct LISTENER_OPTIONS listener_options = {.backlog = MAX_CLIENTS};
+// Worker slot accepting from listener, -1 if listener is shared by all workers
+int listener_slots[MASTER_MAX_LISTENERS];
+// Listener accepts TLS connections
+int listener_tls[MASTER_MAX_LISTENERS];
+int cpu_affinity = CPU_AFFINITY_OFF;
+// Allowed CPUs of the server, worker N runs on worker_cpus[N]
+int worker_cpus[CPU_SETSIZE];
+int worker_cpus_count = 0;
+volatile sig_atomic_t draining = 0;
+connection_t *connections = NULL;
+int connections_max = 0;
+int worker_connections = CONNECTIONS_DEFAULT_MAX;
+int connections_active = 0;
+int slow_request_ms = 0;
+cgi_job_t *cgi_jobs = NULL;
+int cgi_coalesce_timeout = CGI_COALESCE_TIMEOUT_MS;
+struct CGI_LIMITS cgi_limits = {.max_queued = CGI_DEFAULT_QUEUE};
+int cgi_queue_timeout = CGI_QUEUE_TIMEOUT_MS;
+int cgi_queue_order = CGI_ORDER_FIFO;
+proxy_t *proxies = NULL;
+struct UPSTREAM_OPTIONS upstream_options = {
+    .keepalive = UPSTREAM_DEFAULT_KEEPALIVE,
+    .max_fails = UPSTREAM_DEFAULT_MAX_FAILS,
+    .fail_timeout_ms = UPSTREAM_DEFAULT_FAIL_TIMEOUT_MS,
+    .connect_ms = UPSTREAM_DEFAULT_CONNECT_MS,
+    .timeout_ms = UPSTREAM_DEFAULT_TIMEOUT_MS
+};
+// Upstreams of all proxy routes, idle connections closed by servers are looked up there
+struct UPSTREAM *upstreams[PROXY_MAX_ROUTES];
+int upstreams_count = 0;
+int proxy_pipes[PROXY_MAX_PIPES][2];
+int proxy_pipes_count = 0;
+int retry_after = DEFAULT_RETRY_AFTER;
+int overload_target_ms = 0;
+int overload_interval_ms = OVERLOAD_DEFAULT_INTERVAL_MS;
+int overload_shed = SHED_RESPONSE;
+struct OVERLOAD overload = {.target_us = 0};
+char overload_response[RESPONSE_HEADER_SIZE];
+int overload_response_len = 0;
+int accept_paused = 0;
+struct RATELIMIT ratelimit = {.entries = NULL};
+unsigned int ratelimit_size = RATELIMIT_DEFAULT_SIZE;
+struct RATELIMIT_RULE ratelimit_rule = {.rate = 0};
+uint32_t ratelimit_rules = 0;
+char ratelimit_response[RESPONSE_HEADER_SIZE];
+int ratelimit_response_len = 0;
+char *read_buffer = NULL;
+char *buffer_pool[BUFFER_POOL_SIZE];
+unsigned int buffer_pool_len = 0;
+int http2 = 0;
+// HTTP/2 stream of request being handled, 0 for HTTP/1.1
+uint32_t h2_current_stream = 0;
+// Decoded header block and HTTP/1.1 request rebuilt from it
+char *h2_header_buffer = NULL;
+char *h2_request_buffer = NULL;
+uint8_t h2_upgrade_settings[H2_UPGRADE_SETTINGS];
+int h2_upgrade_settings_len = 0;
+char bundle_path[PATH_MAX] = {0};
+struct BUNDLE bundle = {.data = NULL};
+char tls_certificate[PATH_MAX] = {0};
+char tls_certificate_key[PATH_MAX] = {0};
+struct TLS tls = {.ctx = NULL};
+int preload = 0;
+uint64_t preload_readahead = 0;
+struct CACHE cache = {.slots = NULL};
+int cache_routes = 0;
+phases_t phases;
+const char *phase_names[PHASES] = {"recv", "queue", "parse", "route", "handle", "response"};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Mark end of request phase
+static void phase_end(int phase) {
+    phases.at[phase] = now_us();
+}
+
+// Print phase breakdown of request slower than slow_request_ms
+static void phases_log(int fd, int ret) {
+    uint64_t total = now_us() - phases.started;
+    if(total < slow_request_ms * 1000ull) {
+        return;
+    }
+
+    char breakdown[256];
+    int len = 0;
+    uint64_t prev = phases.started;
+    for(int i = 0; i != PHASES; ++i) {
+        if(phases.at[i]) {
+            len += snprintf(breakdown + len, sizeof(breakdown) - len, " %s %luus", phase_names[i], (unsigned long)(phases.at[i] - prev));
+            prev = phases.at[i];
+        }
+        else {
+            len += snprintf(breakdown + len, sizeof(breakdown) - len, " %s -", phase_names[i]);
+        }
+    }
+    printf("%i> slow request \"%s %s\" %i %lu.%03lums:%s\n", getpid(), phases.method[0] ? phases.method : "-", phases.path ? phases.path : "-",
+        phases.status ? phases.status : ret, (unsigned long)(total / 1000), (unsigned long)(total % 1000), breakdown);
+    fflush(stdout);
+}
 
 char *cgi_str(char *str, int n) {
     if(str == NULL) {
@@ -42,8 +182,34 @@ char *cgi_str(char *str, int n) {
     return str;
 }
 
+void cgi_env_free(char **env) {
+    if(env == NULL) {
+        return;
+    }
+    // Entries before QUERY_STRING are literals
+    for(int i = 6; i < PREDEF_ENV || env[i]; ++i) {
+        free(env[i]);
+    }
+    free(env);
+}
+
+// Build HTTP_NAME=value variable of request header
+static char *cgi_header_env(const char *name, int name_len, const char *value, int value_len) {
+    char *env = malloc(name_len + value_len + 2 + 5);
+    if(env == NULL) {
+        return NULL;
+    }
+    strcpy(env, "HTTP_");
+    memcpy(env + 5, name, name_len);
+    cgi_str(env + 5, name_len);
+    env[5 + name_len] = '=';
+    memcpy(env + 5 + name_len + 1, value, value_len);
+    env[5 + name_len + 1 + value_len] = 0;
+    return env;
+}
+
 char **cgi_env(struct MAP *map, request_t *req, int sock) {
-    char **env = malloc((map->count + 1 + PREDEF_ENV) * sizeof(void*));
+    char **env = malloc((map->count + __builtin_popcountll(req->headers_present) + 1 + PREDEF_ENV) * sizeof(void*));
 
     char *query = malloc(4096);
     char *script = malloc(4096);
@@ -51,11 +217,17 @@ char **cgi_env(struct MAP *map, request_t *req, int sock) {
     char *doc = malloc(4096);
     char *doc_root = malloc(4096);
     char *script_file = malloc(4096);
-    char *raddr = malloc(28);
+    char *raddr = malloc(LISTENER_ADDRSTRLEN + 12);
     char *rport = malloc(18);
-    char *saddr = malloc(28);
+    char *saddr = malloc(LISTENER_ADDRSTRLEN + 12);
     char *sport = malloc(18);
     char *server_name = malloc(HOST_NAME_MAX + 14);
+    env[12] = saddr;
+    env[13] = sport;
+    env[14] = raddr;
+    env[15] = rport;
+    env[16] = server_name;
+    env[PREDEF_ENV] = NULL;
 
     env[0] = FCGI_ROLE;
     if(req->method == GET) {
@@ -66,7 +238,7 @@ char **cgi_env(struct MAP *map, request_t *req, int sock) {
     }
     env[2] = GATEWAY_INTERFACE;
     env[3] = SERVER_SOFTWARE;
-    env[4] = REQUEST_SCHEME;
+    env[4] = connections[sock].flags & CONN_TLS ? REQUEST_SCHEME_HTTPS : REQUEST_SCHEME;
     env[5] = SERVER_PROTOCOL;
 
     snprintf(query, 4096, QUERY_STRING, req->query ? req->query : "");
@@ -87,453 +259,3698 @@ char **cgi_env(struct MAP *map, request_t *req, int sock) {
     snprintf(doc_root, 4096, DOCUMENT_ROOT, root);
     env[11] = doc_root;
 
-    char str[INET_ADDRSTRLEN];
-    struct sockaddr address;
-    socklen_t address_len = 16;
-    if(getsockname(sock, &address, &address_len) != 0) {
+    char str[LISTENER_ADDRSTRLEN];
+    int port;
+    struct sockaddr_storage address;
+    socklen_t address_len = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    if(getsockname(sock, (struct sockaddr *)&address, &address_len) != 0) {
+        cgi_env_free(env);
         return NULL;
     }
-    inet_ntop(AF_INET, &((struct sockaddr_in*)&address)->sin_addr, str, INET_ADDRSTRLEN);
-    snprintf(saddr, 28, SERVER_ADDR, str);
-    snprintf(sport, 18, SERVER_PORT, htons(((struct sockaddr_in*)&address)->sin_port));
+    listener_address_str((struct sockaddr *)&address, str, &port);
+    snprintf(saddr, LISTENER_ADDRSTRLEN + 12, SERVER_ADDR, str);
+    snprintf(sport, 18, SERVER_PORT, port);
 
-    if(getpeername(sock, &address, &address_len) != 0) {
+    address_len = sizeof(address);
+    memset(&address, 0, sizeof(address));
+    if(getpeername(sock, (struct sockaddr *)&address, &address_len) != 0) {
+        cgi_env_free(env);
         return NULL;
     }
-    inet_ntop(AF_INET, &((struct sockaddr_in*)&address)->sin_addr, str, INET_ADDRSTRLEN);
-    snprintf(raddr, 28, REMOTE_ADDR, str);
-    snprintf(rport, 18, REMOTE_PORT, htons(((struct sockaddr_in*)&address)->sin_port));
-
-    env[12] = saddr;
-    env[13] = sport;
-    env[14] = raddr;
-    env[15] = rport;
+    listener_address_str((struct sockaddr *)&address, str, &port);
+    snprintf(raddr, LISTENER_ADDRSTRLEN + 12, REMOTE_ADDR, str);
+    snprintf(rport, 18, REMOTE_PORT, port);
 
     snprintf(server_name, HOST_NAME_MAX + 14, SERVER_HOST, host);
-    env[16] = server_name;
 
+    int n = PREDEF_ENV;
+    for(int id = 0; id != HTTP_HEADERS_COUNT; ++id) {
+        const char *value;
+        int value_len = http_header(req, id, &value);
+        if(value_len >= 0) {
+            env[n++] = cgi_header_env(http_header_names[id], strlen(http_header_names[id]), value, value_len);
+        }
+    }
     map_get_objects_start(map);
     for(int i = 0; i != map->count; ++i) {
         struct MAP_OBJECT *obj = map_get_objects_next(map);
-
-        env[i + PREDEF_ENV] = malloc(obj->key_size + obj->value_size + 2 + 5);
-        strcpy(env[i + PREDEF_ENV], "HTTP_");
-        memcpy(env[i + PREDEF_ENV] + 5, obj->key, obj->key_size);
-        cgi_str(env[i + PREDEF_ENV] + 5, obj->key_size);
-        env[i + PREDEF_ENV][5 + obj->key_size] = '=';
-
-        memcpy(env[i + PREDEF_ENV] + obj->key_size + 1 + 5, obj->value, obj->value_size);
-        env[i + PREDEF_ENV][5 + obj->key_size + 2 + obj->value_size] = 0;
+        env[n++] = cgi_header_env(obj->key, obj->key_size, obj->value, obj->value_size);
     }
-    env[map->count + 1 + PREDEF_ENV] = NULL;
+    env[n] = NULL;
 
     return env;
 }
 
-int cgi_run(const char *command, int timeout, char *out_buffer, int out_buffer_size, int sock, struct MAP *map, request_t *req) {
-    int pipefd[2];
-    if(pipe(pipefd) < 0) {
-        return CGI_PIPE_ERROR;
+// Find running or pending CGI job of identical request
+static cgi_job_t *cgi_find(const char *key, int key_len) {
+    for(cgi_job_t *job = cgi_jobs; job; job = job->next) {
+        if(job->key_len == key_len && memcmp(job->key, key, key_len) == 0) {
+            return job;
+        }
     }
+    return NULL;
+}
 
-    pid_t pid = fork();
-    if(pid == -1) {
-        return CGI_FORK_ERROR;
+// Create job for request, it is started from the event loop by cgi_tick()
+// Return job or NULL
+static cgi_job_t *cgi_create(const char *command, struct CONFIG_PATH *route, const char *key, int key_len, request_t *req, struct MAP *map, int sock) {
+    cgi_job_t *job = malloc(sizeof(cgi_job_t));
+    if(job == NULL) {
+        return NULL;
     }
+    // Output buffer is not cleared
+    memset(job, 0, offsetof(cgi_job_t, out));
+    job->out_len = 0;
+    job->waiters = NULL;
+    job->next = NULL;
+    job->fd = -1;
+    job->command = strdup(command);
+    job->env = cgi_env(map, req, sock);
+    if(job->command == NULL || job->env == NULL) {
+        cgi_env_free(job->env);
+        free(job->command);
+        free(job);
+        return NULL;
+    }
+    job->content_type = route->content_type;
+    job->ttl = route->cache_ttl;
+    job->limits = route->cgi;
+    if(key_len > 0) {
+        memcpy(job->key, key, key_len);
+        job->key_len = key_len;
+    }
+    job->started = now_us();
 
-    if(pid == 0) {
-        dup2(pipefd[1], STDOUT_FILENO);
-        close(pipefd[0]);
-        close(pipefd[1]);
-
-        char **p = cgi_env(map, req, sock);
-
-        if(execle(command, command, NULL, p) == -1) {
-            return CGI_EXEC_ERROR;
-        }
+    cgi_job_t **pt = &cgi_jobs;
+    while(*pt) {
+        pt = &(*pt)->next;
     }
+    *pt = job;
+    return job;
+}
 
-    int child_done = 0;
-    while(timeout--) {
-        int res = waitpid(pid, NULL, WNOHANG);
-        if(res != 0) {
-            child_done = 1;
-            break;
+// Move job to 'state' keeping counters of its route and worker
+static void cgi_set_state(cgi_job_t *job, int state) {
+    struct CGI_LIMITS *limits[2] = {&cgi_limits, job->limits};
+    for(int i = 0; i != 2; ++i) {
+        if(limits[i] == NULL) {
+            continue;
+        }
+        if(job->state == CGI_QUEUED) {
+            --limits[i]->queued;
+        }
+        else if(job->state == CGI_RUNNING) {
+            --limits[i]->running;
+        }
+        if(state == CGI_QUEUED) {
+            ++limits[i]->queued;
+        }
+        else if(state == CGI_RUNNING) {
+            ++limits[i]->running;
         }
-        usleep(100000);
     }
+    job->state = state;
+}
+
+// Enqueue job, it may wait for a free slot until queue deadline
+static void cgi_queue(cgi_job_t *job, uint64_t now) {
+    cgi_set_state(job, CGI_QUEUED);
+    job->deadline = now + cgi_queue_timeout * 1000ull;
+}
 
-    if(timeout <= 0) {
-        kill(pid, 9);
+// Check that a new job fits into the queue, free slots count as queue space
+static int cgi_admit(struct CGI_LIMITS *limits) {
+    if(limits == NULL || limits->max_running == 0) {
+        return 1;
     }
-    else if(child_done) {
-        int status;
-        wait(&status);
+    unsigned int free = limits->running < limits->max_running ? limits->max_running - limits->running : 0;
+    return limits->queued < limits->max_queued + free;
+}
+
+// Check that job may start now
+static int cgi_slot(cgi_job_t *job) {
+    if(cgi_limits.max_running && cgi_limits.running >= cgi_limits.max_running) {
+        return 0;
     }
+    return job->limits == NULL || job->limits->max_running == 0 || job->limits->running < job->limits->max_running;
+}
 
-    close(pipefd[1]);
-    int rd = read(pipefd[0], out_buffer, out_buffer_size);
-    close(pipefd[0]);
+static void cgi_unlink(cgi_job_t *job) {
+    cgi_set_state(job, CGI_IDLE);
+    for(cgi_job_t **pt = &cgi_jobs; *pt; pt = &(*pt)->next) {
+        if(*pt == job) {
+            *pt = job->next;
+            return;
+        }
+    }
+}
 
-    return rd;
+static void cgi_free(cgi_job_t *job) {
+    cgi_unlink(job);
+    cgi_env_free(job->env);
+    free(job->command);
+    free(job);
 }
 
-int response(int code, int sock, char *data, unsigned int data_len, char *content_type) {
-    if(sock <= 0) {
-        return -1;
+// Fork CGI process with stdout connected to a pipe watched by the event loop
+// Return error code
+static int cgi_start(int epollfd, cgi_job_t *job) {
+    int pipefd[2];
+    if(pipe2(pipefd, O_CLOEXEC) < 0) {
+        return CGI_PIPE_ERROR;
+    }
+    if(pipefd[0] >= connections_max) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return CGI_PIPE_ERROR;
     }
 
-    if(data == NULL || data_len == 0) {
-        return -2;
+    pid_t pid = fork();
+    if(pid == -1) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return CGI_FORK_ERROR;
     }
 
-    char *send_buff = malloc(SEND_BUFFER_SIZE);
-    if(send_buff == NULL) {
-        return -3;
+    if(pid == 0) {
+        dup2(pipefd[1], STDOUT_FILENO);
+        // Client sockets and listeners must not outlive the worker in CGI processes
+        close_range(STDERR_FILENO + 1, ~0U, 0);
+        sigset_t set;
+        sigemptyset(&set);
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        signal(SIGCHLD, SIG_DFL);
+
+        execle(job->command, job->command, NULL, job->env);
+        // Never return into the worker loop from the child
+        _exit(127);
     }
+    close(pipefd[1]);
 
-    int r = snprintf(send_buff, SEND_BUFFER_SIZE, "HTTP/1.1 %s\r\n\
-Server: %s\r\n\
-Content-Length: %i\r\n\
-Content-Type: %s\r\n\
-Connection: keep-alive\r\n\r\n", responses[code].msg, SERVER_NAME, data_len, content_type);
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = pipefd[0]};
+    if(fcntl(pipefd[0], F_SETFL, O_NONBLOCK) == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, pipefd[0], &ev) == -1) {
+        kill(pid, SIGKILL);
+        close(pipefd[0]);
+        return CGI_PIPE_ERROR;
+    }
+    connections[pipefd[0]].type = CONN_CGI;
 
-    memcpy(send_buff + r, data, data_len);
-    send(sock, send_buff, r + data_len, 0);
+    cgi_set_state(job, CGI_RUNNING);
+    job->pid = pid;
+    job->fd = pipefd[0];
+    job->started = now_us();
+    job->deadline = job->started + CGI_TIMEOUT_MS * 1000ull;
+    cgi_env_free(job->env);
+    job->env = NULL;
 
-    free(send_buff);
-    return data_len;
+    metrics_add(&metrics->cgi_spawns, 1);
+    PROBE3(cgi__start, job->fd, pid, job->command);
+    return 0;
 }
 
-void http_get(request_t *req, struct MAP *map, int sock, char *data, size_t data_len) {
-    if(verbose) {
-        printf("\"GET %s %s\" ", req->path, req->version);
+// Requests waiting for a closed connection are answered to nobody
+static void cgi_detach(int fd) {
+    for(cgi_job_t *job = cgi_jobs; job; job = job->next) {
+        for(cgi_waiter_t *w = job->waiters; w; w = w->next) {
+            if(w->fd == fd) {
+                w->fd = -1;
+            }
+        }
     }
+}
 
-    char *file_path = malloc(PATH_MAX);
-    if(file_path == NULL) {
-        int rsz = response(RESPONSE_500, sock, responses[RESPONSE_500].msg, responses[RESPONSE_500].msg_len, "text/html");
-        if(verbose) {
-            printf("500 %i ", rsz);
+// Responses for a closed connection are read and dropped
+static void proxy_detach(int fd) {
+    for(proxy_t *p = proxies; p; p = p->next) {
+        if(p->waiter.fd == fd) {
+            p->waiter.fd = -1;
         }
-        return;
     }
+}
 
-    char *pt = stpcpy(file_path, root);
-    struct CONFIG_PATH config_path;
-    if(map_get(&config, req->path, strlen(req->path), &config_path, sizeof(struct CONFIG_PATH)) > 0) {
-        if(config_path.action[0] != '$') {
-            strcpy(pt, config_path.action);
-        }
+// Check that 'line' looks like "Name: value"
+static int cgi_header_line(const char *line, const char *end) {
+    const char *pt = line;
+    while(pt != end && (isalnum(*pt) || *pt == '-')) {
+        ++pt;
     }
-    else if(map_get(&config, req->path, strrchr(req->path, '/') - req->path + 1, &config_path, sizeof(struct CONFIG_PATH)) > 0) {
-            strcpy(pt, req->path + 1);
+    return pt != line && pt != end && *pt == ':';
+}
+
+// Parse header block at the start of CGI output, Content-Type and Cache-Control are used.
+// 'content_type' points into 'out' if set, 'ttl' is lowered to max-age or becomes 0 if response
+// must not be cached
+// Return length of header block, 0 if output has no headers
+static int cgi_headers(char *out, int len, char **content_type, unsigned int *ttl) {
+    char *lf = memmem(out, len, "\n\n", 2);
+    char *crlf = memmem(out, len, "\r\n\r\n", 4);
+    char *end = lf;
+    int headers_len = lf ? lf - out + 2 : 0;
+    if(crlf && (lf == NULL || crlf < lf)) {
+        end = crlf;
+        headers_len = crlf - out + 4;
     }
-    else {
-        int rsz = response(RESPONSE_403, sock, responses[RESPONSE_403].msg, responses[RESPONSE_403].msg_len, "text/html");
-        if(verbose) {
-            printf("403 %i ", rsz);
-        }
-        free(file_path);
-        return;
+    // Response body can't be empty
+    if(end == NULL || headers_len >= len) {
+        return 0;
     }
 
-    if(strcmp(config_path.action, "fastcgi") != 0 ) {
-        int file = open(file_path, O_RDONLY);
-        if(file < 0) {
-            int rsz = response(RESPONSE_404, sock, responses[RESPONSE_404].msg, responses[RESPONSE_404].msg_len, "text/html");
-            if(verbose) {
-                printf("404 %i ", rsz);
-            }
-            free(file_path);
-            return;
+    for(char *line = out; line < end; line = memchr(line, '\n', out + headers_len - line) + 1) {
+        if(!cgi_header_line(line, end)) {
+            return 0;
         }
+    }
 
-        char *file_buff = malloc(FILE_BUFFER_SIZE);
-        if(file_buff == NULL) {
-            int rsz = response(RESPONSE_500, sock, responses[RESPONSE_500].msg, responses[RESPONSE_500].msg_len, "text/html");
-            if(verbose) {
-                printf("500 %i ", rsz);
-            }
-            close(file);
-            free(file_path);
-            return;
+    for(char *line = out; line < end;) {
+        char *next = memchr(line, '\n', out + headers_len - line);
+        char *value_end = next[-1] == '\r' ? next - 1 : next;
+        char *value = memchr(line, ':', value_end - line) + 1;
+        while(value < value_end && *value == ' ') {
+            ++value;
         }
 
-        int rd = read(file, file_buff, FILE_BUFFER_SIZE);
-        if(rd > 0) {
-            int rsz = response(RESPONSE_200, sock, file_buff, rd, config_path.content_type);
-            if(verbose) {
-                printf("200 %i ", rsz);
-            }
+        if(strncasecmp(line, "Content-Type:", 13) == 0) {
+            *value_end = 0;
+            *content_type = value;
         }
-        else {
-            int rsz = response(RESPONSE_500, sock, responses[RESPONSE_500].msg, responses[RESPONSE_500].msg_len, "text/html");
-            if(verbose) {
-                printf("500 %i ", rsz);
+        else if(strncasecmp(line, "Cache-Control:", 14) == 0) {
+            *value_end = 0;
+            char *max_age = strcasestr(value, "max-age=");
+            if(strcasestr(value, "no-store") || strcasestr(value, "no-cache") || strcasestr(value, "private")) {
+                *ttl = 0;
             }
-        }
-
-        close(file);
-        free(file_buff);
-    }
-    else {
-        char *cgi_buff = malloc(CGI_BUFFER_SIZE);
-        if(cgi_buff == NULL) {
-            int rsz = response(RESPONSE_500, sock, responses[RESPONSE_500].msg, responses[RESPONSE_500].msg_len, "text/html");
-            if(verbose) {
-                printf("500 %i ", rsz);
+            // max-age may only shorten TTL of cgi_cache, anything but digits disables caching
+            else if(max_age && *ttl) {
+                char *digits = max_age + 8, *pt = digits;
+                unsigned long age = 0;
+                for(; isdigit(*pt); ++pt) {
+                    if(age < *ttl) {
+                        age = age * 10 + (*pt - '0');
+                    }
+                }
+                if(pt == digits || (*pt != 0 && *pt != ',' && *pt != ' ')) {
+                    *ttl = 0;
+                }
+                else if(age < *ttl) {
+                    *ttl = age;
+                }
             }
-            free(cgi_buff);
-            free(file_path);
-            return;
         }
+        line = next + 1;
+    }
+    return headers_len;
+}
 
-        int rd = cgi_run(file_path, 200, cgi_buff, CGI_BUFFER_SIZE, sock, map, req);
-        if(rd <= 0) {
-            int rsz = response(RESPONSE_502, sock, responses[RESPONSE_502].msg, responses[RESPONSE_502].msg_len, "text/html");
-            if(verbose) {
-                printf("502 %i ", rsz);
-            }
-            free(cgi_buff);
-            free(file_path);
-            return;
-        }
+static void h2_free(struct H2_SESSION *h2);
 
-        int rsz = response(RESPONSE_200, sock, cgi_buff, rd, config_path.content_type);
-        free(cgi_buff);
+// Take buffer of RECV_BUFFER_SIZE bytes from the worker pool
+// Return buffer or NULL
+static char *buffer_get(void) {
+    return buffer_pool_len ? buffer_pool[--buffer_pool_len] : malloc(RECV_BUFFER_SIZE);
+}
 
-        if(verbose) {
-            printf("200 %i ", rsz);
-        }
+// Return buffer of RECV_BUFFER_SIZE bytes to the worker pool, it's freed when the pool is full
+static void buffer_put(char *buffer) {
+    if(buffer == NULL) {
+        return;
+    }
+    if(buffer_pool_len != BUFFER_POOL_SIZE) {
+        buffer_pool[buffer_pool_len++] = buffer;
+    }
+    else {
+        free(buffer);
     }
+}
 
-    free(file_path);
+// Give up buffer of incomplete request, HTTP/2 connections hold whole frames in their own
+static void connection_release_in(connection_t *conn) {
+    if(conn->h2) {
+        free(conn->in);
+    }
+    else {
+        buffer_put(conn->in);
+    }
+    conn->in = NULL;
+    conn->in_len = 0;
 }
 
-void http_post(request_t *req, struct MAP *map, int sock, char *data, size_t data_len) {
+// Give up sent output batch, buffers grown for large responses are freed
+static void connection_release_out(connection_t *conn) {
+    if(conn->out_size == RECV_BUFFER_SIZE) {
+        buffer_put(conn->out);
+    }
+    else {
+        free(conn->out);
+    }
+    conn->out = NULL;
+    conn->out_size = 0;
+}
 
+void connection_close(int epollfd, int fd) {
+    connection_t *conn = &connections[fd];
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    if(conn->trace_id) {
+        trace_write(&trace, conn->trace_id, TRACE_CLOSE, NULL, 0);
+    }
+    if((conn->flags & CONN_WAIT_CGI) || conn->h2) {
+        cgi_detach(fd);
+        proxy_detach(fd);
+    }
+    connection_release_in(conn);
+    if(conn->h2) {
+        h2_free(conn->h2);
+    }
+    if(conn->flags & CONN_LIMITED) {
+        ratelimit_disconnect(&ratelimit, ratelimit_key((struct sockaddr *)&conn->addr, 0));
+    }
+    if(conn->tls) {
+        tls_free(conn->tls);
+    }
+    if(conn->type == CONN_CLIENT) {
+        --connections_active;
+        metrics_add(&metrics->connections, -1);
+    }
+    connection_release_out(conn);
+    memset(conn, 0, sizeof(connection_t));
 }
 
-int http_request(char *data, int data_length, int sock) {
-    int length = data_length;
-    if(data == NULL || data_length == 0) {
-        if(verbose) {
-            printf("empty request ");
+// Get space for 'len' more bytes in the connection output batch
+// Return pointer to the free space or NULL
+char *connection_reserve(int fd, unsigned int len) {
+    connection_t *conn = &connections[fd];
+    if(conn->out_len + len > conn->out_size) {
+        unsigned int size = conn->out_size ? conn->out_size : SEND_BUFFER_SIZE;
+        while(size < conn->out_len + len) {
+            size <<= 1;
         }
-        return REQUEST_EMPTY;
-    }
-    if(length < sizeof(http_methods[0].name)) {
-        if(verbose) {
-            printf("invalid request ");
+        char *out = conn->out == NULL && size == RECV_BUFFER_SIZE ? buffer_get() : realloc(conn->out, size);
+        if(out == NULL) {
+            return NULL;
         }
-        return REQUEST_INVALID;
+        conn->out = out;
+        conn->out_size = size;
     }
+    return conn->out + conn->out_len;
+}
 
-    request_t req;
+// Send batched responses with one call, wait for EPOLLOUT if socket buffer is full
+// Return 0 if connection is still open
+int connection_flush(int epollfd, int fd) {
+    connection_t *conn = &connections[fd];
+    struct epoll_event ev = {.data.fd = fd};
+    uint64_t started = slow_request_ms ? now_us() : 0;
+    unsigned int out_sent = conn->out_sent;
 
-    int error = REQUEST_METHOD_UNSUPPORTED;
-    for(int i = 0; i != sizeof(http_methods) / sizeof(http_method_t); ++i) {
-        if(memcmp(data, http_methods[i].name, http_methods[i].len) == 0) {
-            error = 0;
-            req.method = http_methods[i].key;
-            data += http_methods[i].len;
-            length -= http_methods[i].len;
-            break;
+    while(conn->out_sent != conn->out_len) {
+        int sent;
+        if(conn->flags & CONN_TLS_WRITE) {
+            sent = tls_write(conn->tls, conn->out + conn->out_sent, conn->out_len - conn->out_sent);
         }
-    }
-    if(error < 0) {
-        if(verbose) {
-            printf("unsupported method ");
+        else {
+            sent = send(fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent, MSG_NOSIGNAL);
+        }
+        if(sent < 0) {
+            if(errno != EAGAIN) {
+                connection_close(epollfd, fd);
+                return -1;
+            }
+            if((conn->flags & CONN_WAIT_OUT) == 0) {
+                ev.events = EPOLLOUT;
+                epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+                conn->flags |= CONN_WAIT_OUT;
+            }
+            return 0;
         }
-        return error;
+        conn->out_sent += sent;
+        metrics_add(&metrics->bytes_out, sent);
+        PROBE2(send, fd, sent);
     }
 
-    char *tmp = memchr(data, ' ', length);
-    if(tmp == NULL || tmp == data || *data != '/') {
-        if(verbose) {
-            printf("invalid path ");
-        }
-        return REQUEST_INVALID_PATH;
+    if(started && now_us() - started >= slow_request_ms * 1000ull) {
+        printf("%i> slow send %u bytes %lums\n", getpid(), conn->out_sent - out_sent, (unsigned long)((now_us() - started) / 1000));
+        fflush(stdout);
     }
-    req.path = data;
-    *tmp = 0;
-    length -= tmp - data + 1;
-    data = tmp + 1;
 
-    req.query = memchr(req.path, '?', tmp - req.path);
-    if(req.query) {
-        *req.query = 0;
-        ++req.query;
+    // Idle connection keeps no buffers
+    conn->out_len = 0;
+    conn->out_sent = 0;
+    connection_release_out(conn);
+
+    if(conn->flags & CONN_CLOSING) {
+        connection_close(epollfd, fd);
+        return -1;
     }
+    if(conn->flags & CONN_WAIT_OUT) {
+        ev.events = conn->flags & CONN_WAIT_CGI ? 0 : EPOLLIN;
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+        conn->flags &= ~CONN_WAIT_OUT;
+    }
+    return 0;
+}
 
-    if(length == 0) {
-        if(verbose) {
-            printf("protocol unsupported ");
-        }
-        return REQUEST_PROTOCOL_UNSUPPORTED;
+// Append response to the connection output batch, it is sent by connection_flush()
+int response(int code, int sock, char *data, unsigned int data_len, char *content_type) {
+    if(sock <= 0) {
+        return -1;
     }
 
-    tmp = memchr(data, '\r', length);
-    if(tmp == NULL) {
-        if(verbose) {
-            printf("protocol unsupported ");
-        }
-        return REQUEST_PROTOCOL_UNSUPPORTED;
+    if(data == NULL || data_len == 0) {
+        return -2;
     }
-    req.version = data;
-    *tmp = 0;
-    length -= tmp - data + 2;
-    data = tmp + 2;
 
-    if(*(uint64_t *)req.version != HTTP11_SIGNATURE) {
-        if(verbose) {
-            printf("protocol %s unsupported ", req.version);
-        }
-        return REQUEST_PROTOCOL_UNSUPPORTED;
+    char *send_buff = connection_reserve(sock, RESPONSE_HEADER_SIZE + data_len);
+    if(send_buff == NULL) {
+        return -3;
     }
 
-    if(length < 2) {
-        if(verbose) {
-            printf("invalid request ");
-        }
-        return REQUEST_INVALID;
+    // Overloaded server tells when to come back
+    char retry[32] = "";
+    if(code == RESPONSE_503 || code == RESPONSE_429) {
+        snprintf(retry, sizeof(retry), "Retry-After: %i\r\n", retry_after);
     }
 
-    struct MAP map = {.objects = NULL, .length = 0};
+    int r = snprintf(send_buff, RESPONSE_HEADER_SIZE, "HTTP/1.1 %s\r\n\
+Server: %s\r\n\
+Content-Length: %i\r\n\
+Content-Type: %s\r\n\
+%sConnection: %s\r\n\r\n", responses[code].msg, SERVER_NAME, data_len, content_type, retry, draining ? "close" : "keep-alive");
+    if(r >= RESPONSE_HEADER_SIZE) {
+        return -3;
+    }
 
-    while(length > 2) {
-        char *key;
-        int key_len;
-        char *val;
+    memcpy(send_buff + r, data, data_len);
+    connections[sock].out_len += r + data_len;
 
-        val = memchr(data, ':', length);
-        if(val == NULL) {
-            if(verbose) {
-                printf("invalid headers ");
-            }
-            return REQUEST_INVALID_HEADERS;
-        }
-        key = data;
-        key_len = val - data;
-        length -= key_len + 1;
-        data += key_len + 1;
+    metrics_add(&metrics->status[code], 1);
+    phases.status = responses[code].code;
+    phase_end(PHASE_RESPONSE);
+    PROBE3(response, sock, responses[code].code, data_len);
+    if(log_record) {
+        log_record->status = responses[code].code;
+        log_record->bytes += data_len;
+    }
 
-        if(data[0] != ' ') {
-            if(verbose) {
-                printf("invalid headers ");
-            }
-            return REQUEST_INVALID_HEADERS;
-        }
-        ++data;
-        --length;
+    return data_len;
+}
 
-        tmp = memchr(data, '\r', length);
-        if(tmp) {
-            map_add(&map, key, key_len, data, tmp - data);
-            length -= tmp - data + 2;
-            data += tmp - data + 2;
-        }
-        else {
-            map_add(&map, key, key_len, data, length);
-            break;
-        }
-    }
+// Build complete error response 'code' once, so it can be sent without formatting
+// Return length of response
+static int response_prebuild(char *buffer, int code, const char *connection) {
+    return snprintf(buffer, RESPONSE_HEADER_SIZE, "HTTP/1.1 %s\r\n\
+Server: %s\r\n\
+Content-Length: %i\r\n\
+Content-Type: text/html\r\n\
+Retry-After: %i\r\n\
+Connection: %s\r\n\r\n%s", responses[code].msg, SERVER_NAME, responses[code].msg_len, retry_after, connection, responses[code].msg);
+}
 
-    switch(req.method) {
-        case GET:
-            http_get(&req, &map, sock, data, length);
-            break;
-        case POST:
-            http_post(&req, &map, sock, data, length);
-            break;
-        default:
-            int rsz = response(RESPONSE_405, sock, responses[RESPONSE_405].msg, responses[RESPONSE_405].msg_len, "text/html");
-            if(verbose) {
-                printf("405 %i ", rsz);
-            }
-            return REQUEST_METHOD_UNSUPPORTED;
+// Append response built by response_prebuild() to the connection output batch
+static void response_prebuilt(int sock, const char *data, int len, int code) {
+    char *out = connection_reserve(sock, len);
+    if(out == NULL) {
+        return;
     }
+    memcpy(out, data, len);
+    connections[sock].out_len += len;
+    metrics_add(&metrics->status[code], 1);
+}
 
-    if(verbose) {
-        char user_agent[256];
-        int user_agent_len = map_get(&map, "User-Agent", 10, user_agent, sizeof(user_agent));
-        user_agent[user_agent_len] = 0;
-        printf("\"%s\"", user_agent);
+// Append response with prerendered status line and headers, Connection header is added here
+static void response_prerendered(int sock, int code, const char *headers, unsigned int headers_len, const char *body, unsigned int body_len) {
+    const char *connection = draining ? "Connection: close\r\n\r\n" : "Connection: keep-alive\r\n\r\n";
+    int connection_len = strlen(connection);
+    char *out = connection_reserve(sock, headers_len + connection_len + body_len);
+    if(out == NULL) {
+        return;
+    }
+    memcpy(out, headers, headers_len);
+    memcpy(out + headers_len, connection, connection_len);
+    if(body_len) {
+        memcpy(out + headers_len + connection_len, body, body_len);
     }
+    connections[sock].out_len += headers_len + connection_len + body_len;
 
-    char connection[64];
-    int qr = map_get(&map, "Connection", 10, connection, sizeof(connection));
-    if(qr > 0) {
-        connection[qr] = 0;
-        if(memcmp(connection, "close", 6) == 0 || memcmp(connection, "Close", 6) == 0) {
-            close(sock);
-        }
+    metrics_add(&metrics->status[code], 1);
+    phases.status = responses[code].code;
+    phase_end(PHASE_RESPONSE);
+    PROBE3(response, sock, responses[code].code, body_len);
+    if(log_record) {
+        log_record->status = responses[code].code;
+        log_record->bytes += body_len;
     }
+}
 
-    map_destroy(&map);
-    return 0;
+// Append packed response of bundle entry, 304 if client has it and gzip variant if accepted
+static void bundle_respond(int sock, const struct BUNDLE_ENTRY *entry, request_t *req) {
+    const struct BUNDLE_BLOCK *headers = &entry->headers[BUNDLE_IDENTITY];
+    const struct BUNDLE_BLOCK *body = &entry->bodies[BUNDLE_IDENTITY];
+    int code = RESPONSE_200;
+    const char *value;
+    int len = http_header(req, HTTP_HEADER_IF_NONE_MATCH, &value);
+    if(len > 0 && (memmem(value, len, bundle.data + entry->etag.offset, entry->etag.len) || (len == 1 && value[0] == '*'))) {
+        code = RESPONSE_304;
+        headers = &entry->not_modified;
+        body = NULL;
+    }
+    else if(entry->headers[BUNDLE_GZIP].len && (len = http_header(req, HTTP_HEADER_ACCEPT_ENCODING, &value)) > 0 && memmem(value, len, "gzip", 4)) {
+        headers = &entry->headers[BUNDLE_GZIP];
+        body = &entry->bodies[BUNDLE_GZIP];
+    }
+    response_prerendered(sock, code, bundle.data + headers->offset, headers->len, body ? bundle.data + body->offset : NULL, body ? body->len : 0);
 }
 
-int get_config(char *path) {
-    FILE *f = fopen(path, "r");
-    if(f == NULL) {
-        return CONFIG_NOTFOUND;
+// Append frame with 'len' bytes of payload to the connection output
+// Return pointer to the payload or NULL
+static uint8_t *h2_frame(int fd, unsigned int len, uint8_t type, uint8_t flags, uint32_t stream) {
+    uint8_t *out = (uint8_t *)connection_reserve(fd, H2_FRAME_HEADER + len);
+    if(out == NULL) {
+        return NULL;
+    }
+    h2_frame_header(out, len, type, flags, stream);
+    connections[fd].out_len += H2_FRAME_HEADER + len;
+    return out + H2_FRAME_HEADER;
+}
+
+static void h2_u32(uint8_t *out, uint32_t value) {
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+static void h2_rst(int fd, uint32_t stream, uint32_t code) {
+    uint8_t *payload = h2_frame(fd, 4, H2_RST_STREAM, 0, stream);
+    if(payload) {
+        h2_u32(payload, code);
+    }
+}
+
+// Stop taking new streams, errors close the connection once GOAWAY is sent
+static void h2_goaway(int fd, uint32_t code) {
+    connection_t *conn = &connections[fd];
+    uint8_t *payload = h2_frame(fd, 8, H2_GOAWAY, 0, 0);
+    if(payload) {
+        h2_u32(payload, conn->h2->last_stream);
+        h2_u32(payload + 4, code);
+    }
+    conn->h2->goaway = 1;
+    if(code != H2_NO_ERROR || conn->h2->streams_count == 0) {
+        conn->flags |= CONN_CLOSING;
+    }
+}
+
+static struct H2_STREAM *h2_stream_find(struct H2_SESSION *h2, uint32_t id) {
+    struct H2_STREAM *stream = h2->streams;
+    while(stream && stream->id != id) {
+        stream = stream->next;
+    }
+    return stream;
+}
+
+static struct H2_STREAM *h2_stream_add(struct H2_SESSION *h2, uint32_t id) {
+    struct H2_STREAM *stream = calloc(1, sizeof(struct H2_STREAM));
+    if(stream == NULL) {
+        return NULL;
+    }
+    stream->id = id;
+    stream->window = h2->initial_window;
+    // Appended, so bodies are sent in order of requests
+    struct H2_STREAM **pt = &h2->streams;
+    while(*pt) {
+        pt = &(*pt)->next;
+    }
+    *pt = stream;
+    ++h2->streams_count;
+    return stream;
+}
+
+static void h2_stream_remove(struct H2_SESSION *h2, struct H2_STREAM *stream) {
+    struct H2_STREAM **pt = &h2->streams;
+    while(*pt != stream) {
+        pt = &(*pt)->next;
+    }
+    *pt = stream->next;
+    --h2->streams_count;
+    free(stream->body);
+    buffer_put(stream->request);
+    free(stream);
+}
+
+// Send bodies of streams as far as flow control windows allow, finished streams are removed
+static void h2_send(int fd) {
+    struct H2_SESSION *h2 = connections[fd].h2;
+    struct H2_STREAM *next;
+    for(struct H2_STREAM *stream = h2->streams; stream && h2->window > 0; stream = next) {
+        next = stream->next;
+        if(stream->pending) {
+            continue;
+        }
+        while(stream->body_sent != stream->body_len && stream->window > 0 && h2->window > 0) {
+            unsigned int len = stream->body_len - stream->body_sent;
+            len = len < (unsigned int)stream->window ? len : (unsigned int)stream->window;
+            len = len < (unsigned int)h2->window ? len : (unsigned int)h2->window;
+            len = len < h2->max_frame ? len : h2->max_frame;
+            int last = stream->body_sent + len == stream->body_len;
+            uint8_t *payload = h2_frame(fd, len, H2_DATA, last ? H2_FLAG_END_STREAM : 0, stream->id);
+            if(payload == NULL) {
+                return;
+            }
+            memcpy(payload, stream->body + stream->body_sent, len);
+            stream->body_sent += len;
+            stream->window -= len;
+            h2->window -= len;
+        }
+        if(stream->body_sent == stream->body_len) {
+            h2_stream_remove(h2, stream);
+        }
+    }
+    if(h2->goaway && h2->streams_count == 0) {
+        connections[fd].flags |= CONN_CLOSING;
+    }
+}
+
+// Return 1 if lower case header 'name' is 'header'
+static int h2_header_is(const char *name, unsigned int name_len, const char *header) {
+    return name_len == strlen(header) && memcmp(name, header, name_len) == 0;
+}
+
+// Turn HTTP/1.1 response appended to the output at 'start' into HEADERS and DATA frames of
+// stream, the body waits in the stream for flow control windows
+static void h2_respond(int fd, uint32_t id, unsigned int start) {
+    connection_t *conn = &connections[fd];
+    struct H2_SESSION *h2 = conn->h2;
+    struct H2_STREAM *stream = h2_stream_find(h2, id);
+    char *response = conn->out + start;
+    unsigned int len = conn->out_len - start;
+    char *end = len ? memmem(response, len, "\r\n\r\n", 4) : NULL;
+    // Request got no response, as POST
+    if(end == NULL) {
+        conn->out_len = start;
+        h2_rst(fd, id, H2_INTERNAL_ERROR);
+        if(stream) {
+            h2_stream_remove(h2, stream);
+        }
+        return;
+    }
+
+    unsigned int head_len = end + 4 - response;
+    unsigned int body_len = len - head_len;
+    char *body = NULL;
+    if(body_len) {
+        body = malloc(body_len);
+        if(body == NULL) {
+            conn->out_len = start;
+            h2_rst(fd, id, H2_INTERNAL_ERROR);
+            if(stream) {
+                h2_stream_remove(h2, stream);
+            }
+            return;
+        }
+        memcpy(body, end + 4, body_len);
+    }
+
+    // Status and headers are encoded from the response line by line. A field takes at most 9
+    // bytes more than its line of at least 3 bytes, so the block can't run out of space
+    unsigned int block_size = head_len * 4 + 32;
+    uint8_t *block = malloc(block_size);
+    int n = block ? hpack_encode_start(&h2->encoder, block, block_size) : -1;
+    int r = n < 0 ? -1 : hpack_encode(&h2->encoder, block + n, block_size - n, ":status", 7, response + 9, 3, 1);
+    n = r < 0 ? -1 : n + r;
+    char *line = memchr(response, '\n', head_len) + 1;
+    while(n >= 0 && line < end + 2) {
+        char *eol = memchr(line, '\r', end + 2 - line);
+        char *colon = memchr(line, ':', eol - line);
+        if(colon) {
+            // Names are lower cased in place, the response is dropped from output below
+            char *name = line;
+            unsigned int name_len = colon - line;
+            char *value = colon + 1;
+            while(*value == ' ') {
+                ++value;
+            }
+            for(unsigned int i = 0; i != name_len; ++i) {
+                name[i] = tolower(name[i]);
+            }
+            // Connection specific headers are not allowed, unique values are not worth indexing
+            if(!h2_header_is(name, name_len, "connection") && !h2_header_is(name, name_len, "keep-alive")) {
+                int indexed = !h2_header_is(name, name_len, "content-length") && !h2_header_is(name, name_len, "etag");
+                r = hpack_encode(&h2->encoder, block + n, block_size - n, name, name_len, value, eol - value, indexed);
+                n = r < 0 ? -1 : n + r;
+            }
+        }
+        line = eol + 2;
+    }
+    conn->out_len = start;
+    if(n < 0) {
+        free(block);
+        free(body);
+        h2_rst(fd, id, H2_INTERNAL_ERROR);
+        if(stream) {
+            h2_stream_remove(h2, stream);
+        }
+        return;
+    }
+
+    // Block larger than a frame continues in CONTINUATION frames
+    unsigned int sent = 0;
+    do {
+        unsigned int part = n - sent < h2->max_frame ? n - sent : h2->max_frame;
+        uint8_t flags = sent + part == (unsigned int)n ? H2_FLAG_END_HEADERS : 0;
+        if(sent == 0 && body_len == 0) {
+            flags |= H2_FLAG_END_STREAM;
+        }
+        uint8_t *payload = h2_frame(fd, part, sent ? H2_CONTINUATION : H2_HEADERS, flags, id);
+        if(payload) {
+            memcpy(payload, block + sent, part);
+        }
+        sent += part;
+    } while(sent != (unsigned int)n);
+    free(block);
+    if(body_len == 0) {
+        if(stream) {
+            h2_stream_remove(h2, stream);
+        }
+        return;
+    }
+    if(stream == NULL) {
+        stream = h2_stream_add(h2, id);
+        if(stream == NULL) {
+            free(body);
+            h2_rst(fd, id, H2_INTERNAL_ERROR);
+            return;
+        }
+    }
+    stream->pending = 0;
+    stream->body = body;
+    stream->body_len = body_len;
+    h2_send(fd);
+}
+
+// Switch connection to HTTP/2 and send server settings
+// Return 0 on success
+static int h2_start(int fd) {
+    connection_t *conn = &connections[fd];
+    struct H2_SESSION *h2 = calloc(1, sizeof(struct H2_SESSION));
+    if(h2 == NULL) {
+        return -1;
+    }
+    hpack_init(&h2->decoder);
+    hpack_init(&h2->encoder);
+    h2->preface = H2_PREFACE_LEN;
+    h2->window = H2_DEFAULT_WINDOW;
+    h2->initial_window = H2_DEFAULT_WINDOW;
+    h2->max_frame = H2_FRAME_SIZE;
+    conn->h2 = h2;
+    // Leftover of HTTP/1.1 is already in read buffer, larger frames need larger one
+    buffer_put(conn->in);
+    conn->in = NULL;
+
+    uint8_t *payload = h2_frame(fd, 6, H2_SETTINGS, 0, 0);
+    if(payload == NULL) {
+        return -1;
+    }
+    payload[0] = 0;
+    payload[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    h2_u32(payload + 2, H2_MAX_STREAMS);
+    metrics_add(&metrics->h2_connections, 1);
+    return 0;
+}
+
+static void h2_free(struct H2_SESSION *h2) {
+    while(h2->streams) {
+        h2_stream_remove(h2, h2->streams);
+    }
+    hpack_free(&h2->decoder);
+    hpack_free(&h2->encoder);
+    free(h2->block);
+    free(h2);
+}
+
+static int worker_process(int epollfd, int fd, int length, uint64_t recv_started, uint64_t recv_done, uint64_t arrived);
+static void worker_resume(int epollfd, int fd);
+static int h2_process(int epollfd, int fd, int length, uint64_t recv_started, uint64_t recv_done, uint64_t arrived);
+static int h2_upgrade(int epollfd, int fd, unsigned int start, int length, uint64_t recv_started, uint64_t recv_done);
+
+// Save context of current request, its response is produced outside of the request handler
+static void request_park(cgi_waiter_t *w, int sock) {
+    w->fd = sock;
+    w->stream = h2_current_stream;
+    w->phases = phases;
+    strncpy(w->path, phases.path ? phases.path : "", ACCESS_LOG_PATH_SIZE - 1);
+    w->path[ACCESS_LOG_PATH_SIZE - 1] = 0;
+    w->has_record = log_record != NULL;
+    if(log_record) {
+        // Record is reserved again on response, the ring slot is reused meanwhile
+        w->record = *log_record;
+        log_record = NULL;
+    }
+    w->next = NULL;
+}
+
+// Restore context of parked request when its response is ready
+static void request_unpark(cgi_waiter_t *w) {
+    phases = w->phases;
+    phases.path = w->path;
+    phase_end(PHASE_HANDLE);
+    log_record = w->has_record ? access_log_reserve(&access_log) : NULL;
+    if(log_record) {
+        *log_record = w->record;
+    }
+}
+
+// Complete phases and log record of parked request after its response
+static void request_done(int fd) {
+    PROBE3(request__done, fd, now_us() - phases.started, phases.path);
+    if(slow_request_ms) {
+        phases_log(fd, 0);
+    }
+    if(log_record) {
+        log_record->duration_us = now_us() - log_record->started_us;
+        access_log_commit(&access_log);
+        log_record = NULL;
+    }
+}
+
+// Park current request until job output is ready
+// Return REQUEST_PENDING or error code
+static int cgi_wait(cgi_job_t *job, int sock) {
+    cgi_waiter_t *w = malloc(sizeof(cgi_waiter_t));
+    if(w == NULL) {
+        return -1;
+    }
+    request_park(w, sock);
+
+    cgi_waiter_t **pt = &job->waiters;
+    while(*pt) {
+        pt = &(*pt)->next;
+    }
+    *pt = w;
+    return REQUEST_PENDING;
+}
+
+// Send response of parked request appended to the output at 'start' and continue with requests
+// pipelined behind it
+static void request_resume(int epollfd, cgi_waiter_t *w, unsigned int start) {
+    int fd = w->fd;
+    connection_t *conn = &connections[fd];
+    request_done(fd);
+
+    // Other streams went on meanwhile, only this one is answered
+    if(w->stream) {
+        if(h2_stream_find(conn->h2, w->stream)) {
+            h2_respond(fd, w->stream, start);
+        }
+        else {
+            conn->out_len = start;
+        }
+        if(conn->h2->goaway && conn->h2->streams_count == 0) {
+            conn->flags |= CONN_CLOSING;
+        }
+        connection_flush(epollfd, fd);
+        return;
+    }
+
+    conn->flags &= ~CONN_WAIT_CGI;
+    if((conn->flags & CONN_CLOSE_AFTER) || draining) {
+        conn->flags |= CONN_CLOSING;
+        conn->in_len = 0;
+    }
+    worker_resume(epollfd, fd);
+}
+
+// Send response of parked request
+static void request_respond(int epollfd, cgi_waiter_t *w, int code, char *body, int len, char *content_type) {
+    if(w->fd < 0) {
+        return;
+    }
+    request_unpark(w);
+    unsigned int start = connections[w->fd].out_len;
+    response(code, w->fd, body, len, content_type);
+    request_resume(epollfd, w, start);
+}
+
+// Answer every request waiting for job
+// Return number of answered requests
+static int cgi_notify(int epollfd, cgi_job_t *job, int code, char *body, int len, char *content_type) {
+    int count = 0;
+    cgi_waiter_t *w = job->waiters;
+    job->waiters = NULL;
+    while(w) {
+        cgi_waiter_t *next = w->next;
+        request_respond(epollfd, w, code, body, len, content_type);
+        free(w);
+        w = next;
+        ++count;
+    }
+    return count;
+}
+
+// Store output of finished job in cache and send it to waiting requests
+static void cgi_finish(int epollfd, cgi_job_t *job) {
+    // Unlink first, answered connections may start new requests
+    cgi_unlink(job);
+    if(job->fd >= 0) {
+        connection_close(epollfd, job->fd);
+        metrics_observe(METRICS_PHASE_CGI, now_us() - job->started);
+        PROBE3(cgi__done, job->fd, job->pid, job->out_len);
+    }
+
+    char *content_type = job->content_type;
+    unsigned int ttl = job->ttl;
+    int headers = job->out_len > 0 ? cgi_headers(job->out, job->out_len, &content_type, &ttl) : 0;
+    if(job->key_len) {
+        if(job->out_len > 0 && ttl) {
+            cache_put(&cache, job->key, job->key_len, job->out + headers, job->out_len - headers, content_type, ttl, now_us());
+        }
+        else {
+            cache_release(&cache, job->key, job->key_len);
+        }
+        if(job->claimed) {
+            cache_unclaim(&cache, job->key, job->key_len);
+        }
+    }
+
+    int count;
+    if(job->out_len > 0) {
+        count = cgi_notify(epollfd, job, RESPONSE_200, job->out + headers, job->out_len - headers, content_type);
+    }
+    else {
+        count = cgi_notify(epollfd, job, RESPONSE_502, responses[RESPONSE_502].msg, responses[RESPONSE_502].msg_len, "text/html");
+    }
+    // The first one started the process
+    if(count > 1) {
+        metrics_add(&metrics->cgi_coalesced, count - 1);
+    }
+    cgi_free(job);
+}
+
+// Read output of CGI process, the job is finished on EOF or when buffer is full
+static void cgi_read(int epollfd, int fd) {
+    cgi_job_t *job = cgi_jobs;
+    while(job && job->fd != fd) {
+        job = job->next;
+    }
+    if(job == NULL) {
+        connection_close(epollfd, fd);
+        return;
+    }
+
+    while(job->out_len != CGI_BUFFER_SIZE) {
+        int rd = read(fd, job->out + job->out_len, CGI_BUFFER_SIZE - job->out_len);
+        if(rd > 0) {
+            job->out_len += rd;
+            continue;
+        }
+        if(rd < 0 && errno == EAGAIN) {
+            return;
+        }
+        break;
+    }
+    // Output beyond the buffer is dropped
+    if(job->out_len == CGI_BUFFER_SIZE) {
+        kill(job->pid, SIGKILL);
+    }
+    cgi_finish(epollfd, job);
+}
+
+// Answer requests of job that can't run with 503
+static void cgi_reject(int epollfd, cgi_job_t *job) {
+    cgi_unlink(job);
+    if(job->key_len) {
+        cache_release(&cache, job->key, job->key_len);
+        if(job->claimed) {
+            cache_unclaim(&cache, job->key, job->key_len);
+        }
+    }
+    metrics_add(&metrics->cgi_rejected, cgi_notify(epollfd, job, RESPONSE_503, responses[RESPONSE_503].msg, responses[RESPONSE_503].msg_len, "text/html"));
+    cgi_free(job);
+}
+
+// Start queued jobs while their route and worker have free slots
+static void cgi_schedule(int epollfd) {
+    while(1) {
+        cgi_job_t *pick = NULL;
+        for(cgi_job_t *job = cgi_jobs; job; job = job->next) {
+            if(job->state != CGI_QUEUED || !cgi_slot(job)) {
+                continue;
+            }
+            if(cgi_queue_order == CGI_ORDER_FIFO) {
+                pick = job;
+                break;
+            }
+            if(pick == NULL || (job->limits ? job->limits->priority : 0) > (pick->limits ? pick->limits->priority : 0)) {
+                pick = job;
+            }
+        }
+        if(pick == NULL) {
+            return;
+        }
+        if(cgi_start(epollfd, pick) != 0) {
+            cgi_finish(epollfd, pick);
+        }
+    }
+}
+
+// Poll cache for requests run by other workers, start queued CGI processes and expire the rest
+// Return epoll timeout in milliseconds
+static int cgi_tick(int epollfd) {
+    if(cgi_jobs == NULL) {
+        return -1;
+    }
+    uint64_t now = now_us();
+    cgi_job_t *next;
+    for(cgi_job_t *job = cgi_jobs; job; job = next) {
+        next = job->next;
+        if(job->state != CGI_WAITING) {
+            continue;
+        }
+        struct CACHE_ENTRY entry;
+        int state = cache_get(&cache, job->key, job->key_len, now, &entry);
+        if(state != CACHE_MISS) {
+            if(state != CACHE_REFRESH) {
+                cgi_unlink(job);
+            }
+            metrics_add(&metrics->cgi_coalesced, cgi_notify(epollfd, job, RESPONSE_200, entry.body, entry.body_len, entry.content_type));
+            if(state != CACHE_REFRESH) {
+                cgi_free(job);
+                continue;
+            }
+            // Stale response was sent, refresh it in background
+            cgi_queue(job, now);
+        }
+        else if(now >= job->deadline) {
+            cgi_queue(job, now);
+        }
+        else if(cache_claim(&cache, job->key, job->key_len, now, now + CGI_TIMEOUT_MS * 1000ull)) {
+            // Another worker gave up without storing a response
+            job->claimed = 1;
+            cgi_queue(job, now);
+        }
+    }
+
+    cgi_schedule(epollfd);
+
+    int timeout = -1;
+    now = now_us();
+    for(cgi_job_t *job = cgi_jobs; job; job = next) {
+        next = job->next;
+        if(job->state != CGI_WAITING && now >= job->deadline) {
+            if(job->state == CGI_QUEUED) {
+                cgi_reject(epollfd, job);
+                continue;
+            }
+            kill(job->pid, SIGKILL);
+            metrics_add(&metrics->cgi_timeouts, 1);
+            job->out_len = 0;
+            cgi_finish(epollfd, job);
+            continue;
+        }
+        int left = job->state == CGI_WAITING ? CGI_POLL_MS : (job->deadline - now) / 1000 + 1;
+        if(timeout < 0 || left < timeout) {
+            timeout = left;
+        }
+    }
+    return timeout;
+}
+
+// Check that header line ending with 'colon' is hop-by-hop, it is not passed through proxy
+static int proxy_hop_header(const char *line, const char *colon) {
+    int id = http_header_lookup(line, colon - line);
+    if(id == HTTP_HEADER_CONNECTION || id == HTTP_HEADER_KEEP_ALIVE || id == HTTP_HEADER_UPGRADE || id == HTTP_HEADER_TE || id == HTTP_HEADER_HTTP2_SETTINGS) {
+        return 1;
+    }
+    return colon - line == 16 && strncasecmp(line, "Proxy-Connection", 16) == 0;
+}
+
+// Queue request to upstream servers of proxy route, it is started from the event loop by proxy_tick()
+// Return REQUEST_PENDING or error code
+static int proxy_create(struct CONFIG_PATH *route, request_t *req, int sock, char *body, size_t body_len) {
+    if(route->upstream == NULL || route->upstream->count == 0) {
+        return -1;
+    }
+    // Header lines follow request line, its CR was replaced with terminating zero. Parser may
+    // stop before the empty line when there is no body
+    char *headers = req->version + 10;
+    char *headers_end = headers;
+    char *end = body + body_len;
+    while(headers_end + 2 <= end && headers_end[0] != '\r') {
+        char *lf = memchr(headers_end, '\n', end - headers_end);
+        if(lf == NULL) {
+            return -1;
+        }
+        headers_end = lf + 1;
+    }
+    body = headers_end + 2 < end ? headers_end + 2 : end;
+    body_len = end - body;
+    const char *forwarded = "";
+    int forwarded_len = http_header(req, HTTP_HEADER_X_FORWARDED_FOR, &forwarded);
+    if(forwarded_len < 0) {
+        forwarded = "";
+        forwarded_len = 0;
+    }
+    unsigned int size = RESPONSE_HEADER_SIZE + LISTENER_ADDRSTRLEN + strlen(req->path) + (req->query ? strlen(req->query) : 0) + (headers_end - headers) + forwarded_len + body_len;
+    proxy_t *p = malloc(sizeof(proxy_t));
+    char *request = malloc(size);
+    if(p == NULL || request == NULL) {
+        free(request);
+        free(p);
+        return -1;
+    }
+    // Head buffer is not cleared
+    memset(p, 0, offsetof(proxy_t, head));
+    p->fd = -1;
+    p->pipe[0] = -1;
+    p->pipe[1] = -1;
+    p->upstream = route->upstream;
+    p->idempotent = req->method == GET;
+    p->request = request;
+
+    int n = snprintf(request, size, "%s%s%s%s HTTP/1.1\r\n", http_methods[req->method].name, req->path, req->query ? "?" : "", req->query ? req->query : "");
+    for(char *line = headers; line < headers_end;) {
+        char *next = memchr(line, '\n', headers_end - line) + 1;
+        char *colon = memchr(line, ':', next - line);
+        int id = colon ? http_header_lookup(line, colon - line) : -1;
+        if(colon && !proxy_hop_header(line, colon) && id != HTTP_HEADER_X_FORWARDED_FOR && id != HTTP_HEADER_X_FORWARDED_PROTO) {
+            memcpy(request + n, line, next - line);
+            n += next - line;
+        }
+        line = next;
+    }
+    char addr[LISTENER_ADDRSTRLEN];
+    int port;
+    listener_address_str((struct sockaddr *)&connections[sock].addr, addr, &port);
+    n += snprintf(request + n, size - n, "X-Forwarded-For: %.*s%s%s\r\nX-Forwarded-Proto: %s\r\n%s\r\n", forwarded_len, forwarded, forwarded_len ? ", " : "", addr,
+        connections[sock].flags & CONN_TLS ? "https" : "http", upstream_options.keepalive ? "" : "Connection: close\r\n");
+    memcpy(request + n, body, body_len);
+    p->request_len = n + body_len;
+
+    request_park(&p->waiter, sock);
+    metrics_add(&metrics->proxy_requests, 1);
+    proxy_t **pt = &proxies;
+    while(*pt) {
+        pt = &(*pt)->next;
+    }
+    *pt = p;
+    return REQUEST_PENDING;
+}
+
+static void proxy_free(proxy_t *p) {
+    for(proxy_t **pt = &proxies; *pt; pt = &(*pt)->next) {
+        if(*pt == p) {
+            *pt = p->next;
+            break;
+        }
+    }
+    free(p->request);
+    free(p->body);
+    free(p);
+}
+
+// Get pipe for splice() from pool or create one
+// Return 0 on success
+static int proxy_pipe(proxy_t *p) {
+    if(proxy_pipes_count) {
+        --proxy_pipes_count;
+        p->pipe[0] = proxy_pipes[proxy_pipes_count][0];
+        p->pipe[1] = proxy_pipes[proxy_pipes_count][1];
+        return 0;
+    }
+    if(pipe2(p->pipe, O_NONBLOCK | O_CLOEXEC) != 0) {
+        p->pipe[0] = -1;
+        p->pipe[1] = -1;
+        return -1;
+    }
+    fcntl(p->pipe[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+    return 0;
+}
+
+// Put connection to server into idle pool or close it, empty pipe goes back to pool too
+static void proxy_release(int epollfd, proxy_t *p, int keep) {
+    if(p->fd >= 0) {
+        int fd = p->fd;
+        p->fd = -1;
+        --p->server->active;
+        if(keep) {
+            // Idle connection is watched for close by server
+            struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+            epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+            fd = upstream_idle_put(p->server, &upstream_options, fd);
+        }
+        if(fd >= 0) {
+            connection_close(epollfd, fd);
+        }
+    }
+    if(p->pipe[0] >= 0) {
+        if(p->pipe_len == 0 && proxy_pipes_count != PROXY_MAX_PIPES) {
+            proxy_pipes[proxy_pipes_count][0] = p->pipe[0];
+            proxy_pipes[proxy_pipes_count][1] = p->pipe[1];
+            ++proxy_pipes_count;
+        }
+        else {
+            close(p->pipe[0]);
+            close(p->pipe[1]);
+        }
+        p->pipe[0] = -1;
+        p->pipe[1] = -1;
+        p->pipe_len = 0;
+    }
+}
+
+// Restore context of parked request and record status of relayed response
+static void proxy_unpark(proxy_t *p) {
+    request_unpark(&p->waiter);
+    phases.status = p->status;
+    phase_end(PHASE_RESPONSE);
+    PROBE3(response, p->waiter.fd, p->status, p->bytes);
+    if(log_record) {
+        log_record->status = p->status;
+        log_record->bytes = p->bytes;
+    }
+}
+
+// Give up on current attempt. Request goes to a new connection if the client got nothing yet
+// and it's safe to send it again, otherwise the client gets 502 or its connection is closed
+static void proxy_error(int epollfd, proxy_t *p, int error) {
+    if(error == PROXY_ERROR_SERVER && p->server) {
+        metrics_add(&metrics->upstream_failures, 1);
+        if(upstream_fail(p->server, &upstream_options, now_us() / 1000)) {
+            metrics_add(&metrics->upstream_ejections, 1);
+        }
+    }
+    // HTTP/1.1 client got response head already, HTTP/2 one gets response when it's complete
+    int started = p->state == PROXY_BODY && p->waiter.stream == 0;
+    proxy_release(epollfd, p, 0);
+
+    int retry = 0;
+    if(!started && p->waiter.fd >= 0) {
+        if(error == PROXY_ERROR_STALE && p->reused) {
+            // Server closed idle connection, the request didn't reach it
+            retry = 1;
+        }
+        else if(error == PROXY_ERROR_SERVER && !p->retried && (p->idempotent || p->request_sent == 0)) {
+            p->retried = 1;
+            p->failed = p->server;
+            p->server = NULL;
+            retry = 1;
+        }
+    }
+    if(retry) {
+        p->state = PROXY_QUEUED;
+        p->fresh = 1;
+        p->request_sent = 0;
+        p->head_len = 0;
+        p->status = 0;
+        p->body_left = 0;
+        memset(&p->chunked, 0, sizeof(p->chunked));
+        p->body_len = 0;
+        p->bytes = 0;
+        return;
+    }
+
+    if(started && p->waiter.fd >= 0) {
+        // Response is cut, the client must not take it as complete
+        int fd = p->waiter.fd;
+        proxy_unpark(p);
+        request_done(fd);
+        connection_close(epollfd, fd);
+    }
+    else {
+        request_respond(epollfd, &p->waiter, RESPONSE_502, responses[RESPONSE_502].msg, responses[RESPONSE_502].msg_len, "text/html");
+    }
+    proxy_free(p);
+}
+
+// Complete relayed response, connection to server goes back to pool
+static void proxy_finish(int epollfd, proxy_t *p) {
+    proxy_release(epollfd, p, p->keepalive);
+    for(unsigned int i = 0; i != sizeof(responses) / sizeof(responses_t); ++i) {
+        if(responses[i].code == p->status) {
+            metrics_add(&metrics->status[i], 1);
+            break;
+        }
+    }
+
+    cgi_waiter_t *w = &p->waiter;
+    if(w->fd >= 0) {
+        connection_t *conn = &connections[w->fd];
+        proxy_unpark(p);
+        unsigned int start = conn->out_len;
+        if(w->stream) {
+            char *out = connection_reserve(w->fd, p->body_len);
+            if(out) {
+                memcpy(out, p->body, p->body_len);
+                conn->out_len += p->body_len;
+            }
+        }
+        request_resume(epollfd, w, start);
+    }
+    proxy_free(p);
+}
+
+// Stop reading from server until client output is sent
+static void proxy_pause(int epollfd, proxy_t *p) {
+    struct epoll_event ev = {.events = 0, .data.fd = p->fd};
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, p->fd, &ev);
+    p->paused = 1;
+}
+
+// Follow body bytes placed at 'data', chunked body of HTTP/2 response is decoded in place.
+// Bytes past the body are dropped with the connection
+// Return 0 with number of bytes to keep in 'keep' or -1 if body is broken
+static int proxy_consume(proxy_t *p, char *data, unsigned int len, unsigned int *keep) {
+    unsigned int used = len;
+    if(p->body_left == PROXY_BODY_CHUNKED) {
+        int r = upstream_chunked(&p->chunked, data, len, p->waiter.stream ? keep : NULL);
+        if(r < 0) {
+            return -1;
+        }
+        used = r;
+        if(p->waiter.stream == 0) {
+            *keep = used;
+        }
+        if(p->chunked.state == UPSTREAM_CHUNKED_DONE) {
+            p->body_left = 0;
+        }
+    }
+    else if(p->body_left != PROXY_BODY_CLOSE) {
+        used = len < p->body_left ? len : p->body_left;
+        p->body_left -= used;
+        *keep = used;
+    }
+    else {
+        *keep = len;
+    }
+    if(used != len) {
+        p->keepalive = 0;
+    }
+    return 0;
+}
+
+// Read part of body into client output or into response collected for HTTP/2 stream
+// Return 1 if more may be read, 0 to wait for server, -1 if request is done with
+static int proxy_recv(int epollfd, proxy_t *p) {
+    int fd = p->waiter.fd;
+    char *out;
+    if(p->waiter.stream) {
+        if(p->body_size - p->body_len < PROXY_READ_SIZE) {
+            char *body = p->body_size < PROXY_MAX_BUFFERED ? realloc(p->body, p->body_size * 2) : NULL;
+            if(body == NULL) {
+                proxy_error(epollfd, p, PROXY_ERROR_LOCAL);
+                return -1;
+            }
+            p->body = body;
+            p->body_size *= 2;
+        }
+        out = p->body + p->body_len;
+    }
+    else {
+        out = connection_reserve(fd, PROXY_READ_SIZE);
+        if(out == NULL) {
+            proxy_error(epollfd, p, PROXY_ERROR_LOCAL);
+            return -1;
+        }
+    }
+
+    int rd = recv(p->fd, out, PROXY_READ_SIZE, 0);
+    if(rd < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    if(rd == 0 && p->body_left == PROXY_BODY_CLOSE) {
+        p->body_left = 0;
+        return 1;
+    }
+    unsigned int keep;
+    if(rd <= 0 || proxy_consume(p, out, rd, &keep) != 0) {
+        proxy_error(epollfd, p, PROXY_ERROR_SERVER);
+        return -1;
+    }
+    p->deadline = now_us() + upstream_options.timeout_ms * 1000ull;
+    p->bytes += keep;
+    if(p->waiter.stream) {
+        p->body_len += keep;
+        return 1;
+    }
+    connections[fd].out_len += keep;
+    if(connection_flush(epollfd, fd) != 0) {
+        // Client is gone, the rest of response is not read
+        proxy_release(epollfd, p, 0);
+        proxy_free(p);
+        return -1;
+    }
+    return 1;
+}
+
+// Move part of body from server to client through pipe
+// Return 1 if more may be moved, 0 to wait for server, -1 if request is done with
+static int proxy_splice(int epollfd, proxy_t *p) {
+    int fd = p->waiter.fd;
+    int drained = 0;
+    if(p->body_left > 0 && p->pipe_len < PROXY_PIPE_SIZE) {
+        unsigned int len = PROXY_PIPE_SIZE - p->pipe_len;
+        ssize_t n = splice(p->fd, NULL, p->pipe[1], NULL, p->body_left < len ? p->body_left : len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n == 0 || (n < 0 && errno != EAGAIN)) {
+            proxy_error(epollfd, p, PROXY_ERROR_SERVER);
+            return -1;
+        }
+        if(n > 0) {
+            p->pipe_len += n;
+            p->body_left -= n;
+            p->deadline = now_us() + upstream_options.timeout_ms * 1000ull;
+        }
+        else {
+            drained = 1;
+        }
+    }
+    if(p->pipe_len) {
+        ssize_t n = splice(p->pipe[0], NULL, fd, NULL, p->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n < 0 && errno == EAGAIN) {
+            // Wait for EPOLLOUT as connection_flush() does, reads are paused meanwhile
+            struct epoll_event ev = {.events = EPOLLOUT, .data.fd = fd};
+            epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+            connections[fd].flags |= CONN_WAIT_OUT;
+            return 1;
+        }
+        if(n <= 0) {
+            connection_close(epollfd, fd);
+            proxy_release(epollfd, p, 0);
+            proxy_free(p);
+            return -1;
+        }
+        p->pipe_len -= n;
+        p->bytes += n;
+        metrics_add(&metrics->bytes_out, n);
+        PROBE2(send, fd, n);
+    }
+    return drained && p->pipe_len == 0 ? 0 : 1;
+}
+
+// Relay response body from server to client until it ends, server has no more data or client
+// output is full
+static void proxy_body(int epollfd, proxy_t *p) {
+    int fd = p->waiter.fd;
+    connection_t *conn = &connections[fd];
+    // Body of known length skips user space once plain or kTLS client got everything before it
+    if(p->pipe[0] < 0 && p->waiter.stream == 0 && p->body_left > 0 && (conn->flags & CONN_TLS_WRITE) == 0 && conn->out_len == 0) {
+        proxy_pipe(p);
+    }
+    while(p->body_left != 0 || p->pipe_len) {
+        if(p->waiter.stream == 0 && (conn->flags & CONN_WAIT_OUT)) {
+            proxy_pause(epollfd, p);
+            return;
+        }
+        int ret = p->pipe[0] >= 0 ? proxy_splice(epollfd, p) : proxy_recv(epollfd, p);
+        if(ret <= 0) {
+            return;
+        }
+    }
+    proxy_finish(epollfd, p);
+}
+
+// Read response head and pass it to the client without hop-by-hop headers
+static void proxy_head(int epollfd, proxy_t *p) {
+    int rd = recv(p->fd, p->head + p->head_len, PROXY_HEADER_SIZE - p->head_len, 0);
+    if(rd < 0 && errno == EAGAIN) {
+        return;
+    }
+    if(rd <= 0) {
+        proxy_error(epollfd, p, p->reused && p->head_len == 0 ? PROXY_ERROR_STALE : PROXY_ERROR_SERVER);
+        return;
+    }
+    p->head_len += rd;
+    p->deadline = now_us() + upstream_options.timeout_ms * 1000ull;
+
+    char *end;
+    while(1) {
+        end = memmem(p->head, p->head_len, "\r\n\r\n", 4);
+        if(end == NULL) {
+            if(p->head_len == PROXY_HEADER_SIZE) {
+                proxy_error(epollfd, p, PROXY_ERROR_SERVER);
+            }
+            return;
+        }
+        p->status = memcmp(p->head, "HTTP/1.", 7) == 0 && p->head[8] == ' ' ? atoi(p->head + 9) : 0;
+        if(p->status < 100 || p->status > 999) {
+            proxy_error(epollfd, p, PROXY_ERROR_SERVER);
+            return;
+        }
+        if(p->status >= 200) {
+            break;
+        }
+        // Interim response, as 100 Continue
+        unsigned int len = end + 4 - p->head;
+        memmove(p->head, end + 4, p->head_len - len);
+        p->head_len -= len;
+    }
+
+    unsigned int head_len = end + 4 - p->head;
+    char *status_end = memchr(p->head, '\n', head_len) + 1;
+    p->keepalive = p->head[7] == '1';
+    p->body_left = PROXY_BODY_CLOSE;
+    for(char *line = status_end; line < end + 2;) {
+        char *next = memchr(line, '\n', end + 2 - line) + 1;
+        char *colon = memchr(line, ':', next - line);
+        if(colon) {
+            int id = http_header_lookup(line, colon - line);
+            char *value = colon + 1;
+            while(*value == ' ' || *value == '\t') {
+                ++value;
+            }
+            if(id == HTTP_HEADER_CONTENT_LENGTH && p->body_left != PROXY_BODY_CHUNKED) {
+                if(!isdigit(*value)) {
+                    proxy_error(epollfd, p, PROXY_ERROR_SERVER);
+                    return;
+                }
+                p->body_left = strtoll(value, NULL, 10);
+            }
+            else if(id == HTTP_HEADER_TRANSFER_ENCODING && memmem(value, next - value, "chunked", 7)) {
+                p->body_left = PROXY_BODY_CHUNKED;
+            }
+            else if(id == HTTP_HEADER_CONNECTION) {
+                p->keepalive = strncasecmp(value, "close", 5) != 0 && (p->keepalive || strncasecmp(value, "keep-alive", 10) == 0);
+            }
+        }
+        line = next;
+    }
+    if(p->status == 204 || p->status == 304) {
+        p->body_left = 0;
+    }
+    if(p->body_left == PROXY_BODY_CLOSE) {
+        p->keepalive = 0;
+    }
+    upstream_success(p->server);
+
+    int fd = p->waiter.fd;
+    connection_t *conn = &connections[fd];
+    // Body without length ends with connection, so does the client one
+    int closing = p->body_left == PROXY_BODY_CLOSE || (conn->flags & CONN_CLOSE_AFTER) || draining;
+    char *out;
+    if(p->waiter.stream) {
+        p->body_size = p->head_len + PROXY_READ_SIZE;
+        p->body = malloc(p->body_size);
+        out = p->body;
+    }
+    else {
+        out = connection_reserve(fd, p->head_len + 32);
+    }
+    if(out == NULL) {
+        proxy_error(epollfd, p, PROXY_ERROR_LOCAL);
+        return;
+    }
+
+    memcpy(out, "HTTP/1.1", 8);
+    int n = status_end - p->head;
+    memcpy(out + 8, p->head + 8, n - 8);
+    for(char *line = status_end; line < end + 2;) {
+        char *next = memchr(line, '\n', end + 2 - line) + 1;
+        char *colon = memchr(line, ':', next - line);
+        // Stream gets body decoded, HTTP/2 has no chunked encoding
+        if(colon && !proxy_hop_header(line, colon) && !(p->waiter.stream && http_header_lookup(line, colon - line) == HTTP_HEADER_TRANSFER_ENCODING)) {
+            memcpy(out + n, line, next - line);
+            n += next - line;
+        }
+        line = next;
+    }
+    if(p->waiter.stream) {
+        memcpy(out + n, "\r\n", 2);
+        n += 2;
+    }
+    else {
+        n += sprintf(out + n, "Connection: %s\r\n\r\n", closing ? "close" : "keep-alive");
+        if(closing) {
+            conn->flags |= CONN_CLOSE_AFTER;
+        }
+    }
+
+    // Start of body came with the head
+    unsigned int keep = 0;
+    memcpy(out + n, end + 4, p->head_len - head_len);
+    if(proxy_consume(p, out + n, p->head_len - head_len, &keep) != 0) {
+        proxy_error(epollfd, p, PROXY_ERROR_SERVER);
+        return;
+    }
+    n += keep;
+    p->bytes = keep;
+    p->state = PROXY_BODY;
+    if(p->waiter.stream) {
+        p->body_len = n;
+    }
+    else {
+        conn->out_len += n;
+        if(connection_flush(epollfd, fd) != 0) {
+            proxy_release(epollfd, p, 0);
+            proxy_free(p);
+            return;
+        }
+    }
+    proxy_body(epollfd, p);
+}
+
+// Finish connect and send request, then wait for response
+static void proxy_send(int epollfd, proxy_t *p) {
+    if(p->state == PROXY_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if(getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err) {
+            proxy_error(epollfd, p, PROXY_ERROR_SERVER);
+            return;
+        }
+        p->state = PROXY_SENDING;
+        p->deadline = now_us() + upstream_options.timeout_ms * 1000ull;
+    }
+    struct epoll_event ev = {.data.fd = p->fd};
+    while(p->request_sent != p->request_len) {
+        int sent = send(p->fd, p->request + p->request_sent, p->request_len - p->request_sent, MSG_NOSIGNAL);
+        if(sent < 0) {
+            if(errno != EAGAIN) {
+                proxy_error(epollfd, p, p->reused ? PROXY_ERROR_STALE : PROXY_ERROR_SERVER);
+            }
+            else if(!p->writing) {
+                ev.events = EPOLLOUT;
+                epoll_ctl(epollfd, EPOLL_CTL_MOD, p->fd, &ev);
+                p->writing = 1;
+            }
+            return;
+        }
+        p->request_sent += sent;
+    }
+    p->state = PROXY_HEADERS;
+    // Idle connection is watched for EPOLLIN already
+    if(p->writing) {
+        ev.events = EPOLLIN;
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, p->fd, &ev);
+        p->writing = 0;
+    }
+}
+
+// Pick server and send request over its idle connection or start connecting to it
+static void proxy_start(int epollfd, proxy_t *p) {
+    uint64_t now = now_us();
+    if(p->server == NULL) {
+        p->server = upstream_pick(p->upstream, p->failed, now / 1000);
+        // Server that failed the first attempt is the only one left
+        if(p->server == NULL && p->failed && p->failed->ejected <= now / 1000) {
+            p->server = p->failed;
+        }
+    }
+    if(p->server == NULL) {
+        request_respond(epollfd, &p->waiter, RESPONSE_502, responses[RESPONSE_502].msg, responses[RESPONSE_502].msg_len, "text/html");
+        proxy_free(p);
+        return;
+    }
+
+    struct UPSTREAM_SERVER *server = p->server;
+    int fd = p->fresh ? -1 : upstream_idle_get(server);
+    p->reused = fd >= 0;
+    p->writing = !p->reused;
+    if(p->reused) {
+        metrics_add(&metrics->upstream_reused, 1);
+        p->state = PROXY_SENDING;
+    }
+    else {
+        fd = upstream_connect(server);
+        struct epoll_event ev = {.events = EPOLLOUT, .data.fd = fd};
+        if(fd >= connections_max || (fd >= 0 && epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+        if(fd < 0) {
+            proxy_error(epollfd, p, PROXY_ERROR_SERVER);
+            return;
+        }
+        metrics_add(&metrics->upstream_connects, 1);
+        p->state = PROXY_CONNECTING;
+    }
+    connections[fd].type = CONN_UPSTREAM;
+    ++server->active;
+    p->fd = fd;
+    p->deadline = now + (p->reused ? upstream_options.timeout_ms : upstream_options.connect_ms) * 1000ull;
+    if(p->reused) {
+        proxy_send(epollfd, p);
+    }
+}
+
+// Handle event of connection to upstream server
+static void proxy_event(int epollfd, int fd) {
+    proxy_t *p = proxies;
+    while(p && p->fd != fd) {
+        p = p->next;
+    }
+    if(p == NULL) {
+        // Idle connection was closed by server
+        for(int i = 0; i != upstreams_count; ++i) {
+            if(upstream_idle_remove(upstreams[i], fd)) {
+                break;
+            }
+        }
+        connection_close(epollfd, fd);
+        return;
+    }
+    if(p->waiter.fd < 0) {
+        // Dropped by proxy_tick()
+        return;
+    }
+    if(p->paused) {
+        // Only hangup is reported
+        proxy_error(epollfd, p, PROXY_ERROR_SERVER);
+        return;
+    }
+    switch(p->state) {
+        case PROXY_CONNECTING:
+        case PROXY_SENDING:
+            proxy_send(epollfd, p);
+            break;
+        case PROXY_HEADERS:
+            proxy_head(epollfd, p);
+            break;
+        case PROXY_BODY:
+            proxy_body(epollfd, p);
+            break;
+    }
+}
+
+// Continue relaying response after client output was sent
+static void proxy_resume(int epollfd, int fd) {
+    for(proxy_t *p = proxies; p; p = p->next) {
+        if(p->waiter.fd == fd && p->paused) {
+            struct epoll_event ev = {.events = EPOLLIN, .data.fd = p->fd};
+            epoll_ctl(epollfd, EPOLL_CTL_MOD, p->fd, &ev);
+            p->paused = 0;
+            proxy_body(epollfd, p);
+            return;
+        }
+    }
+}
+
+// Start queued proxy requests, drop those of closed connections and expire the rest
+// Return epoll timeout in milliseconds
+static int proxy_tick(int epollfd) {
+    if(proxies == NULL) {
+        return -1;
+    }
+    uint64_t now = now_us();
+    proxy_t *next;
+    for(proxy_t *p = proxies; p; p = next) {
+        next = p->next;
+        if(p->waiter.fd < 0) {
+            // Connection can't be reused with response not read to the end
+            proxy_release(epollfd, p, 0);
+            proxy_free(p);
+        }
+        else if(p->state == PROXY_QUEUED) {
+            proxy_start(epollfd, p);
+        }
+        else if(!p->paused && now >= p->deadline) {
+            proxy_error(epollfd, p, PROXY_ERROR_SERVER);
+        }
+    }
+
+    int timeout = -1;
+    now = now_us();
+    for(proxy_t *p = proxies; p; p = p->next) {
+        if(p->paused) {
+            continue;
+        }
+        int left = p->state == PROXY_QUEUED || p->waiter.fd < 0 || now >= p->deadline ? 0 : (p->deadline - now) / 1000 + 1;
+        if(timeout < 0 || left < timeout) {
+            timeout = left;
+        }
+    }
+    return timeout;
+}
+
+// Return REQUEST_PENDING if response is sent later
+int http_get(request_t *req, struct MAP *map, int sock, char *data, size_t data_len) {
+    char *file_path = malloc(PATH_MAX);
+    if(file_path == NULL) {
+        response(RESPONSE_500, sock, responses[RESPONSE_500].msg, responses[RESPONSE_500].msg_len, "text/html");
+        return 0;
+    }
+
+    char *pt = stpcpy(file_path, root);
+    struct CONFIG_PATH config_path;
+    int route = http_route(&config, req->path, &config_path);
+    if(route == ROUTE_EXACT) {
+        if(config_path.action[0] != '$') {
+            strcpy(pt, config_path.action);
+        }
+    }
+    else if(route == ROUTE_DIRECTORY) {
+        strcpy(pt, req->path + 1);
+    }
+    else {
+        response(RESPONSE_403, sock, responses[RESPONSE_403].msg, responses[RESPONSE_403].msg_len, "text/html");
+        free(file_path);
+        return 0;
+    }
+    phase_end(PHASE_ROUTE);
+    metrics_observe(METRICS_PHASE_ROUTE, phases.at[PHASE_ROUTE] - phases.at[PHASE_PARSE]);
+    PROBE3(request__routed, sock, req->path, config_path.action);
+
+    if(config_path.ratelimit && !ratelimit_request(&ratelimit, ratelimit_key((struct sockaddr *)&connections[sock].addr, config_path.ratelimit->id), config_path.ratelimit, phases.at[PHASE_ROUTE] / 1000)) {
+        response_prebuilt(sock, ratelimit_response, ratelimit_response_len, RESPONSE_429);
+        metrics_add(&metrics->ratelimited, 1);
+        if(log_record) {
+            log_record->status = responses[RESPONSE_429].code;
+        }
+        free(file_path);
+        return 0;
+    }
+
+    if(strcmp(config_path.action, "proxy") == 0) {
+        free(file_path);
+        if(proxy_create(&config_path, req, sock, data, data_len) != REQUEST_PENDING) {
+            response(RESPONSE_502, sock, responses[RESPONSE_502].msg, responses[RESPONSE_502].msg_len, "text/html");
+            return 0;
+        }
+        return REQUEST_PENDING;
+    }
+    else if(strcmp(config_path.action, "status") == 0) {
+        int len = metrics_render(status_buffer, METRICS_BUFFER_SIZE, response_codes, sizeof(responses) / sizeof(responses_t));
+        phase_end(PHASE_HANDLE);
+        response(RESPONSE_200, sock, status_buffer, len, config_path.content_type);
+    }
+    else if(route == ROUTE_EXACT && config_path.preloaded) {
+        struct PRELOADED *preloaded = config_path.preloaded;
+        phase_end(PHASE_HANDLE);
+        metrics_observe(METRICS_PHASE_FILE, phases.at[PHASE_HANDLE] - phases.at[PHASE_ROUTE]);
+        response_prerendered(sock, RESPONSE_200, preloaded->headers, preloaded->headers_len, preloaded->body, preloaded->body_len);
+    }
+    else if(strcmp(config_path.action, "fastcgi") != 0 ) {
+        // Packed files are served from the shared mapping without touching filesystem
+        const struct BUNDLE_ENTRY *entry = bundle_find(&bundle, req->path, strlen(req->path));
+        if(entry) {
+            phase_end(PHASE_HANDLE);
+            metrics_observe(METRICS_PHASE_FILE, phases.at[PHASE_HANDLE] - phases.at[PHASE_ROUTE]);
+            bundle_respond(sock, entry, req);
+            free(file_path);
+            return 0;
+        }
+
+        int file = open(file_path, O_RDONLY);
+        if(file < 0) {
+            response(RESPONSE_404, sock, responses[RESPONSE_404].msg, responses[RESPONSE_404].msg_len, "text/html");
+            free(file_path);
+            return 0;
+        }
+
+        char *file_buff = malloc(FILE_BUFFER_SIZE);
+        if(file_buff == NULL) {
+            response(RESPONSE_500, sock, responses[RESPONSE_500].msg, responses[RESPONSE_500].msg_len, "text/html");
+            close(file);
+            free(file_path);
+            return 0;
+        }
+
+        int rd = read(file, file_buff, FILE_BUFFER_SIZE);
+        phase_end(PHASE_HANDLE);
+        metrics_observe(METRICS_PHASE_FILE, phases.at[PHASE_HANDLE] - phases.at[PHASE_ROUTE]);
+        if(rd > 0) {
+            response(RESPONSE_200, sock, file_buff, rd, config_path.content_type);
+        }
+        else {
+            response(RESPONSE_500, sock, responses[RESPONSE_500].msg, responses[RESPONSE_500].msg_len, "text/html");
+        }
+
+        close(file);
+        free(file_buff);
+    }
+    else {
+        char key[CACHE_KEY_SIZE];
+        int key_len = config_path.cache_ttl ? cache_key(&cache, key, req, map) : CACHE_KEY_ERROR;
+        cgi_job_t *job = NULL;
+        if(key_len > 0) {
+            struct CACHE_ENTRY entry;
+            int state = cache_get(&cache, key, key_len, now_us(), &entry);
+            if(state != CACHE_MISS) {
+                phase_end(PHASE_HANDLE);
+                metrics_add(&metrics->cache_hits, 1);
+                response(RESPONSE_200, sock, entry.body, entry.body_len, entry.content_type);
+                // Refresh runs in background, the request doesn't wait for it
+                if(state == CACHE_REFRESH && cgi_find(key, key_len) == NULL) {
+                    job = cgi_admit(&cgi_limits) && cgi_admit(config_path.cgi) ? cgi_create(file_path, &config_path, key, key_len, req, map, sock) : NULL;
+                    if(job) {
+                        cgi_queue(job, now_us());
+                    }
+                    else {
+                        cache_release(&cache, key, key_len);
+                    }
+                }
+                free(file_path);
+                return 0;
+            }
+
+            // Identical request is already running in this worker
+            job = cgi_find(key, key_len);
+            if(job) {
+                free(file_path);
+                if(cgi_wait(job, sock) != REQUEST_PENDING) {
+                    response(RESPONSE_500, sock, responses[RESPONSE_500].msg, responses[RESPONSE_500].msg_len, "text/html");
+                    return 0;
+                }
+                return REQUEST_PENDING;
+            }
+        }
+
+        if(!cgi_admit(&cgi_limits) || !cgi_admit(config_path.cgi)) {
+            phase_end(PHASE_HANDLE);
+            metrics_add(&metrics->cgi_rejected, 1);
+            response(RESPONSE_503, sock, responses[RESPONSE_503].msg, responses[RESPONSE_503].msg_len, "text/html");
+            free(file_path);
+            return 0;
+        }
+
+        job = cgi_create(file_path, &config_path, key, key_len, req, map, sock);
+        free(file_path);
+        if(job == NULL) {
+            response(RESPONSE_500, sock, responses[RESPONSE_500].msg, responses[RESPONSE_500].msg_len, "text/html");
+            return 0;
+        }
+        uint64_t now = now_us();
+        if(key_len > 0 && cgi_coalesce_timeout && !cache_claim(&cache, key, key_len, now, now + CGI_TIMEOUT_MS * 1000ull)) {
+            // Wait for another worker running identical request
+            cgi_set_state(job, CGI_WAITING);
+            job->deadline = now + cgi_coalesce_timeout * 1000ull;
+        }
+        else {
+            job->claimed = key_len > 0 && cgi_coalesce_timeout;
+            cgi_queue(job, now);
+        }
+        if(cgi_wait(job, sock) != REQUEST_PENDING) {
+            response(RESPONSE_500, sock, responses[RESPONSE_500].msg, responses[RESPONSE_500].msg_len, "text/html");
+            return 0;
+        }
+        return REQUEST_PENDING;
+    }
+
+    free(file_path);
+    return 0;
+}
+
+// Return REQUEST_PENDING if response is sent later
+int http_post(request_t *req, struct MAP *map, int sock, char *data, size_t data_len) {
+    struct CONFIG_PATH config_path;
+    if(http_route(&config, req->path, &config_path) == ROUTE_NOT_FOUND || strcmp(config_path.action, "proxy") != 0) {
+        return 0;
+    }
+    phase_end(PHASE_ROUTE);
+    metrics_observe(METRICS_PHASE_ROUTE, phases.at[PHASE_ROUTE] - phases.at[PHASE_PARSE]);
+    PROBE3(request__routed, sock, req->path, config_path.action);
+    if(proxy_create(&config_path, req, sock, data, data_len) != REQUEST_PENDING) {
+        response(RESPONSE_502, sock, responses[RESPONSE_502].msg, responses[RESPONSE_502].msg_len, "text/html");
+        return 0;
+    }
+    return REQUEST_PENDING;
+}
+
+int http_request(char *data, int data_length, int sock) {
+    request_t req;
+    struct MAP map = {.objects = NULL, .length = 0};
+
+    int head = http_parse(data, data_length, &req, &map);
+    if(head < 0) {
+        return head;
+    }
+    const http_method_t *method = &http_methods[req.method];
+    phase_end(PHASE_PARSE);
+    memcpy(phases.method, method->name, method->len - 1);
+    phases.path = req.path;
+    metrics_observe(METRICS_PHASE_PARSE, phases.at[PHASE_PARSE] - phases.at[PHASE_QUEUE]);
+    PROBE3(request__parsed, sock, phases.method, req.path);
+    if(log_record) {
+        strcpy(log_record->method, phases.method);
+        strncpy(log_record->path, req.path, ACCESS_LOG_PATH_SIZE - 1);
+        log_record->path[ACCESS_LOG_PATH_SIZE - 1] = 0;
+    }
+
+    connections[sock].flags |= CONN_SERVED;
+    int ret = draining ? REQUEST_CLOSE : 0;
+    // Plain connection may switch to HTTP/2 after the response, it goes to stream 1
+    const char *upgrade;
+    int upgrade_len = http_header(&req, HTTP_HEADER_UPGRADE, &upgrade);
+    if(http2 && !draining && req.method == GET && connections[sock].h2 == NULL && !(connections[sock].flags & CONN_TLS) && upgrade_len >= 3 && memmem(upgrade, upgrade_len, "h2c", 3)) {
+        const char *settings;
+        int settings_len = http_header(&req, HTTP_HEADER_HTTP2_SETTINGS, &settings);
+        h2_upgrade_settings_len = settings_len >= 0 ? h2_base64url(settings, settings_len, h2_upgrade_settings, sizeof(h2_upgrade_settings)) : -1;
+        if(h2_upgrade_settings_len >= 0 && h2_upgrade_settings_len % 6 == 0) {
+            ret |= REQUEST_UPGRADE;
+        }
+    }
+    switch(req.method) {
+        case GET:
+            ret |= http_get(&req, &map, sock, data + head, data_length - head);
+            break;
+        case POST:
+            ret |= http_post(&req, &map, sock, data + head, data_length - head);
+            break;
+        default:
+            response(RESPONSE_405, sock, responses[RESPONSE_405].msg, responses[RESPONSE_405].msg_len, "text/html");
+            map_destroy(&map);
+            return REQUEST_METHOD_UNSUPPORTED;
+    }
+
+    const char *connection;
+    if(http_header(&req, HTTP_HEADER_CONNECTION, &connection) == 5 && strncasecmp(connection, "close", 5) == 0) {
+        ret |= REQUEST_CLOSE;
+    }
+
+    map_destroy(&map);
+    return ret;
+}
+
+// Read file of exact route and render its response
+// Return rendered response or NULL
+static struct PRELOADED *preload_file(const char *file_path, const char *content_type) {
+    int fd = open(file_path, O_RDONLY | O_CLOEXEC);
+    if(fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    struct PRELOADED *preloaded = calloc(1, sizeof(struct PRELOADED));
+    // Requests read only FILE_BUFFER_SIZE of larger files
+    if(preloaded == NULL || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || st.st_size > FILE_BUFFER_SIZE) {
+        free(preloaded);
+        close(fd);
+        return NULL;
+    }
+    preloaded->headers = malloc(RESPONSE_HEADER_SIZE + st.st_size);
+    if(preloaded->headers == NULL) {
+        free(preloaded);
+        close(fd);
+        return NULL;
+    }
+    int r = snprintf(preloaded->headers, RESPONSE_HEADER_SIZE, "HTTP/1.1 %s\r\n\
+Server: %s\r\n\
+Content-Length: %i\r\n\
+Content-Type: %s\r\n", responses[RESPONSE_200].msg, SERVER_NAME, (int)st.st_size, content_type);
+    preloaded->body = preloaded->headers + r;
+    if(r >= RESPONSE_HEADER_SIZE || read(fd, preloaded->body, st.st_size) != st.st_size) {
+        free(preloaded->headers);
+        free(preloaded);
+        close(fd);
+        return NULL;
+    }
+    close(fd);
+    preloaded->headers_len = r;
+    preloaded->body_len = st.st_size;
+    return preloaded;
+}
+
+// Render responses of exact file routes and read files of '$' routes into page cache up to
+// preload_readahead bytes. Runs before fork, so workers share rendered responses
+static void preload_routes(void) {
+    unsigned int files = 0;
+    uint64_t bytes = 0, readahead_bytes = 0;
+    char file_path[PATH_MAX];
+    if(map_get_objects_start(&config) != MAP_OK) {
+        return;
+    }
+    struct MAP_OBJECT *obj;
+    while((obj = map_get_objects_next(&config))) {
+        struct CONFIG_PATH *route = obj->value;
+        if(strcmp(route->action, "fastcgi") == 0 || strcmp(route->action, "status") == 0) {
+            continue;
+        }
+        if(route->action[0] != '$') {
+            free(route->preloaded ? route->preloaded->headers : NULL);
+            free(route->preloaded);
+            route->preloaded = NULL;
+            if(snprintf(file_path, sizeof(file_path), "%s%s", root, route->action) < sizeof(file_path)) {
+                route->preloaded = preload_file(file_path, route->content_type);
+            }
+            if(route->preloaded == NULL) {
+                printf("Can't preload %s\n", file_path);
+                continue;
+            }
+            ++files;
+            bytes += route->preloaded->body_len;
+            continue;
+        }
+
+        const char *path = obj->key;
+        if(obj->key_size == 0 || path[obj->key_size - 1] != '/' || readahead_bytes >= preload_readahead) {
+            continue;
+        }
+        if(snprintf(file_path, sizeof(file_path), "%s%.*s", root, obj->key_size - 1, path + 1) >= sizeof(file_path)) {
+            continue;
+        }
+        DIR *d = opendir(file_path);
+        struct dirent *de;
+        while(d && readahead_bytes < preload_readahead && (de = readdir(d))) {
+            struct stat st;
+            int fd = openat(dirfd(d), de->d_name, O_RDONLY | O_CLOEXEC);
+            if(fd < 0) {
+                continue;
+            }
+            if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+                uint64_t len = st.st_size < preload_readahead - readahead_bytes ? st.st_size : preload_readahead - readahead_bytes;
+                readahead(fd, 0, len);
+                readahead_bytes += len;
+            }
+            close(fd);
+        }
+        if(d) {
+            closedir(d);
+        }
+    }
+    printf("Preloaded %u files, %lu bytes, readahead %lu bytes\n", files, (unsigned long)bytes, (unsigned long)readahead_bytes);
+}
+
+// Get CGI limits of route 'path' defined above, they are created on first use
+// Return limits or NULL
+static struct CGI_LIMITS *config_cgi_limits(char *path) {
+    struct CONFIG_PATH config_path;
+    if(map_get(&config, path, strlen(path), &config_path, sizeof(config_path)) != sizeof(config_path)) {
+        return NULL;
+    }
+    if(config_path.cgi == NULL) {
+        config_path.cgi = calloc(1, sizeof(struct CGI_LIMITS));
+        if(config_path.cgi == NULL) {
+            return NULL;
+        }
+        config_path.cgi->max_queued = CGI_DEFAULT_QUEUE;
+        if(map_add(&config, path, strlen(path), &config_path, sizeof(config_path)) != MAP_OK) {
+            return NULL;
+        }
+    }
+    return config_path.cgi;
+}
+
+// Get request rate rule of route 'path' defined above, it is created on first use
+// Return rule or NULL
+static struct RATELIMIT_RULE *config_ratelimit_rule(char *path) {
+    struct CONFIG_PATH config_path;
+    if(map_get(&config, path, strlen(path), &config_path, sizeof(config_path)) != sizeof(config_path)) {
+        return NULL;
+    }
+    if(config_path.ratelimit == NULL) {
+        config_path.ratelimit = calloc(1, sizeof(struct RATELIMIT_RULE));
+        if(config_path.ratelimit == NULL) {
+            return NULL;
+        }
+        config_path.ratelimit->id = ++ratelimit_rules;
+        if(map_add(&config, path, strlen(path), &config_path, sizeof(config_path)) != MAP_OK) {
+            return NULL;
+        }
+    }
+    return config_path.ratelimit;
+}
+
+// Get upstream of route 'path' defined above, it is created on first use
+// Return upstream or NULL
+static struct UPSTREAM *config_upstream(char *path) {
+    struct CONFIG_PATH config_path;
+    if(map_get(&config, path, strlen(path), &config_path, sizeof(config_path)) != sizeof(config_path)) {
+        return NULL;
+    }
+    if(config_path.upstream == NULL) {
+        if(upstreams_count == PROXY_MAX_ROUTES) {
+            return NULL;
+        }
+        config_path.upstream = calloc(1, sizeof(struct UPSTREAM));
+        if(config_path.upstream == NULL) {
+            return NULL;
+        }
+        if(map_add(&config, path, strlen(path), &config_path, sizeof(config_path)) != MAP_OK) {
+            return NULL;
+        }
+        upstreams[upstreams_count++] = config_path.upstream;
+    }
+    return config_path.upstream;
+}
+
+// Set global option 'name' from config file
+// Return error code
+int config_option(char *name, char *value, char *param) {
+    if(strcmp(name, "access_log") == 0) {
+        if(strlen(value) >= sizeof(access_log_path)) {
+            return CONFIG_INCORRECT;
+        }
+        strcpy(access_log_path, value);
+        return 0;
+    }
+    if(strcmp(name, "tls_certificate") == 0 || strcmp(name, "tls_certificate_key") == 0) {
+        char *path = name[15] ? tls_certificate_key : tls_certificate;
+        if(strlen(value) >= PATH_MAX) {
+            return CONFIG_INCORRECT;
+        }
+        strcpy(path, value);
+        return 0;
+    }
+    if(strcmp(name, "bundle") == 0) {
+        if(strlen(value) >= sizeof(bundle_path)) {
+            return CONFIG_INCORRECT;
+        }
+        strcpy(bundle_path, value);
+        return 0;
+    }
+    if(strcmp(name, "cgi_cache") == 0) {
+        // Per route TTL, the route must be defined above
+        struct CONFIG_PATH config_path;
+        if(param == NULL || atoi(param) <= 0 || map_get(&config, value, strlen(value), &config_path, sizeof(config_path)) != sizeof(config_path)) {
+            return CONFIG_INCORRECT;
+        }
+        config_path.cache_ttl = atoi(param);
+        ++cache_routes;
+        return map_add(&config, value, strlen(value), &config_path, sizeof(config_path)) == MAP_OK ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "cgi_cache_stale") == 0) {
+        cache.stale = atoi(value);
+        return 0;
+    }
+    if(strcmp(name, "cgi_cache_size") == 0) {
+        cache.size = strtoul(value, NULL, 10);
+        return cache.size ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "cgi_cache_vary") == 0) {
+        return cache_vary(&cache, value) == CACHE_OK ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "cgi_coalesce_timeout") == 0) {
+        cgi_coalesce_timeout = atoi(value);
+        return cgi_coalesce_timeout >= 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "cgi_max_running") == 0) {
+        // Limit of the worker, or of the route given as first value
+        struct CGI_LIMITS *limits = param ? config_cgi_limits(value) : &cgi_limits;
+        int n = atoi(param ? param : value);
+        if(limits == NULL || n < 0) {
+            return CONFIG_INCORRECT;
+        }
+        limits->max_running = n;
+        return 0;
+    }
+    if(strcmp(name, "cgi_queue") == 0) {
+        struct CGI_LIMITS *limits = param ? config_cgi_limits(value) : &cgi_limits;
+        int n = atoi(param ? param : value);
+        if(limits == NULL || n < 0) {
+            return CONFIG_INCORRECT;
+        }
+        limits->max_queued = n;
+        return 0;
+    }
+    if(strcmp(name, "cgi_priority") == 0) {
+        struct CGI_LIMITS *limits = param ? config_cgi_limits(value) : NULL;
+        if(limits == NULL) {
+            return CONFIG_INCORRECT;
+        }
+        limits->priority = atoi(param);
+        return 0;
+    }
+    if(strcmp(name, "cgi_queue_timeout") == 0) {
+        cgi_queue_timeout = atoi(value);
+        return cgi_queue_timeout > 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "cgi_queue_order") == 0) {
+        if(strcmp(value, "fifo") == 0) {
+            cgi_queue_order = CGI_ORDER_FIFO;
+        }
+        else if(strcmp(value, "priority") == 0) {
+            cgi_queue_order = CGI_ORDER_PRIORITY;
+        }
+        else {
+            return CONFIG_INCORRECT;
+        }
+        return 0;
+    }
+    if(strcmp(name, "overload_target_ms") == 0) {
+        overload_target_ms = atoi(value);
+        return overload_target_ms >= 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "overload_interval_ms") == 0) {
+        overload_interval_ms = atoi(value);
+        return overload_interval_ms > 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "overload_shed") == 0) {
+        if(strcmp(value, "503") == 0) {
+            overload_shed = SHED_RESPONSE;
+        }
+        else if(strcmp(value, "accept") == 0) {
+            overload_shed = SHED_ACCEPT;
+        }
+        else {
+            return CONFIG_INCORRECT;
+        }
+        return 0;
+    }
+    if(strcmp(name, "http2") == 0) {
+        http2 = strcmp(value, "on") == 0;
+        return 0;
+    }
+    if(strcmp(name, "cpu_affinity") == 0) {
+        if(strcmp(value, "off") == 0) {
+            cpu_affinity = CPU_AFFINITY_OFF;
+        }
+        else if(strcmp(value, "pin") == 0) {
+            cpu_affinity = CPU_AFFINITY_PIN;
+        }
+        else if(strcmp(value, "steer") == 0) {
+            cpu_affinity = CPU_AFFINITY_STEER;
+        }
+        else {
+            return CONFIG_INCORRECT;
+        }
+        return 0;
+    }
+    if(strcmp(name, "preload") == 0) {
+        preload = strcmp(value, "on") == 0;
+        return preload || strcmp(value, "off") == 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "preload_readahead") == 0) {
+        preload_readahead = strtoull(value, NULL, 10);
+        return 0;
+    }
+    if(strcmp(name, "ratelimit_rate") == 0) {
+        // Limit of every request of a client, or of requests to the route given as first value
+        struct RATELIMIT_RULE *rule = param ? config_ratelimit_rule(value) : &ratelimit_rule;
+        int n = atoi(param ? param : value);
+        if(rule == NULL || n < 0) {
+            return CONFIG_INCORRECT;
+        }
+        rule->rate = n;
+        return 0;
+    }
+    if(strcmp(name, "ratelimit_burst") == 0) {
+        struct RATELIMIT_RULE *rule = param ? config_ratelimit_rule(value) : &ratelimit_rule;
+        int n = atoi(param ? param : value);
+        if(rule == NULL || n < 0 || n > RATELIMIT_MAX_BURST) {
+            return CONFIG_INCORRECT;
+        }
+        rule->burst = n;
+        return 0;
+    }
+    if(strcmp(name, "ratelimit_connections") == 0) {
+        ratelimit_rule.connections = atoi(value);
+        return ratelimit_rule.connections > 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "ratelimit_size") == 0) {
+        ratelimit_size = strtoul(value, NULL, 10);
+        return ratelimit_size ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "retry_after") == 0) {
+        retry_after = atoi(value);
+        return retry_after >= 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "worker_connections") == 0) {
+        worker_connections = atoi(value);
+        return worker_connections >= CONNECTIONS_MIN ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "slow_request_ms") == 0) {
+        slow_request_ms = atoi(value);
+        return slow_request_ms >= 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "upstream") == 0) {
+        struct UPSTREAM *upstream = param ? config_upstream(value) : NULL;
+        return upstream && upstream_add(upstream, param) == UPSTREAM_OK ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "upstream_balance") == 0) {
+        struct UPSTREAM *upstream = param ? config_upstream(value) : NULL;
+        if(upstream == NULL) {
+            return CONFIG_INCORRECT;
+        }
+        if(strcmp(param, "round_robin") == 0) {
+            upstream->balance = UPSTREAM_ROUND_ROBIN;
+        }
+        else if(strcmp(param, "least_conn") == 0) {
+            upstream->balance = UPSTREAM_LEAST_CONN;
+        }
+        else {
+            return CONFIG_INCORRECT;
+        }
+        return 0;
+    }
+    if(strcmp(name, "upstream_keepalive") == 0) {
+        int n = atoi(value);
+        upstream_options.keepalive = n;
+        return n >= 0 && n <= UPSTREAM_MAX_IDLE ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "upstream_max_fails") == 0) {
+        int n = atoi(value);
+        upstream_options.max_fails = n;
+        return n >= 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "upstream_fail_timeout") == 0) {
+        int n = atoi(value);
+        upstream_options.fail_timeout_ms = n;
+        return n > 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "upstream_connect_timeout") == 0) {
+        int n = atoi(value);
+        upstream_options.connect_ms = n;
+        return n > 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "upstream_timeout") == 0) {
+        int n = atoi(value);
+        upstream_options.timeout_ms = n;
+        return n > 0 ? 0 : CONFIG_INCORRECT;
+    }
+    if(strcmp(name, "trace_file") == 0) {
+        if(strlen(value) >= sizeof(trace_path)) {
+            return CONFIG_INCORRECT;
+        }
+        strcpy(trace_path, value);
+        return 0;
+    }
+    if(strcmp(name, "trace_sample") == 0) {
+        trace_sample = atoi(value);
+        return trace_sample > 0 ? 0 : CONFIG_INCORRECT;
+    }
+    return listener_option(&listener_options, name, value, param) == LISTENER_OK ? 0 : CONFIG_INCORRECT;
+}
+
+int get_config(char *path) {
+    FILE *f = fopen(path, "r");
+    if(f == NULL) {
+        return CONFIG_NOTFOUND;
     }
 
     char spath[128], stype[128], sact[128];
     char buff[512];
 
-    while(fgets(buff, 512, f)) {
-        if(buff[0] == '#') {
-            continue;
+    while(fgets(buff, 512, f)) {
+        if(buff[0] == '#') {
+            continue;
+        }
+
+        int r = sscanf(buff, "%s %s %s\n", spath, stype, sact);
+        if(r >= 2 && spath[0] != '/') {
+            if(config_option(spath, stype, r == 3 ? sact : NULL) != 0) {
+                fclose(f);
+                return CONFIG_INCORRECT;
+            }
+            continue;
+        }
+        if(r != 3) {
+            continue;
+        }
+
+        struct CONFIG_PATH config_path;
+        config_path.content_type = malloc(strlen(stype) + 1);
+        if(config_path.content_type == NULL) {
+            return CONFIG_MALLOC_ERROR;
+        }
+        strcpy(config_path.content_type, stype);
+
+        config_path.action = malloc(strlen(sact) + 1);
+        if(config_path.action == NULL) {
+            free(config_path.content_type);
+            return CONFIG_MALLOC_ERROR;
+        }
+        strcpy(config_path.action, sact);
+        config_path.cache_ttl = 0;
+        config_path.cgi = NULL;
+        config_path.ratelimit = NULL;
+        config_path.preloaded = NULL;
+        config_path.upstream = NULL;
+        map_add(&config, spath, strlen(spath), &config_path, sizeof(struct CONFIG_PATH));
+    }
+
+    fclose(f);
+    return 1;
+}
+
+void usage(char *argv0) {
+    printf("%s server\n", SERVER_NAME);
+    printf("Usage: %s [-v] [-w num] [-p port]\n", argv0);
+    printf("  -v        : write access log to stdout if access_log is not set\n");
+    printf("  -w num    : workers number, minimum when scaling\n");
+    printf("  -W num    : maximum workers number, enables load-adaptive scaling\n");
+    printf("  -p port   : port\n");
+    printf("  -r path   : root path\n");
+    printf("  -c config : config path\n");
+    printf("  -d sec    : drain timeout on graceful shutdown\n");
+    printf("  -h        : print thist help\n");
+    printf("Signals: QUIT - graceful shutdown, USR2 - binary upgrade\n");
+}
+
+static void worker_signal(int sig) {
+    draining = 1;
+}
+
+// Stop accepting and close idle keep-alive connections
+static void worker_drain(int epollfd, int *listeners, int listeners_count) {
+    for(int i = 0; i != listeners_count; ++i) {
+        connection_close(epollfd, listeners[i]);
+    }
+
+    char c;
+    for(int fd = 0; fd != connections_max; ++fd) {
+        connection_t *conn = &connections[fd];
+        if(conn->type != CONN_CLIENT) {
+            continue;
+        }
+        // HTTP/2 connection is closed when its open streams are done
+        if(conn->h2) {
+            h2_goaway(fd, H2_NO_ERROR);
+            connection_flush(epollfd, fd);
+        }
+        // Connection with unsent responses or unread data has request in flight, it will be closed after response
+        else if(conn->flags & CONN_WAIT_CGI) {
+            conn->flags |= CONN_CLOSE_AFTER;
+        }
+        else if(conn->out_len) {
+            conn->flags |= CONN_CLOSING;
+        }
+        // Idle keep-alive connection is closed unless its next request is already here. Connection
+        // that didn't send its first request yet is left to the drain deadline, only a closed or
+        // failed one goes now
+        else if(conn->in_len == 0) {
+            int peeked = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+            if(peeked == 0 || (peeked < 0 && errno != EAGAIN && errno != EWOULDBLOCK) || (peeked < 0 && (conn->flags & CONN_SERVED))) {
+                connection_close(epollfd, fd);
+            }
+        }
+    }
+}
+
+// Receive data with kernel timestamp of its arrival, 'arrived' is left 0 if there is none
+// Return recv() result
+static int worker_recv(int fd, char *buffer, int size, uint64_t *arrived) {
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct iovec iov = {.iov_base = buffer, .iov_len = size};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    int recvd = recvmsg(fd, &msg, 0);
+    struct cmsghdr *cmsg = recvd > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+        // Timestamp is CLOCK_REALTIME, only its age is used
+        struct timespec ts, now;
+        memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+        clock_gettime(CLOCK_REALTIME, &now);
+        int64_t age = (now.tv_sec - ts.tv_sec) * 1000000ll + (now.tv_nsec - ts.tv_nsec) / 1000;
+        *arrived = now_us() - (age > 0 ? age : 0);
+    }
+    return recvd;
+}
+
+// Answer request with prebuilt 503 and close connection, nothing is parsed
+static void worker_shed(int fd) {
+    response_prebuilt(fd, overload_response, overload_response_len, RESPONSE_503);
+    // HTTP/2 stream is refused alone
+    if(connections[fd].h2 == NULL) {
+        connections[fd].flags |= CONN_CLOSING;
+    }
+    metrics_add(&metrics->overload_shed, 1);
+}
+
+// Update overload state, with SHED_ACCEPT listeners are paused while it lasts
+// Return 1 while overloaded
+static int worker_overload(int epollfd, int *listeners, int listeners_count) {
+    int active = overload_check(&overload, now_us());
+    if(overload_shed == SHED_ACCEPT && active != accept_paused && !draining) {
+        struct epoll_event ev = {.events = active ? 0 : EPOLLIN};
+        for(int i = 0; i != listeners_count; ++i) {
+            ev.data.fd = listeners[i];
+            epoll_ctl(epollfd, EPOLL_CTL_MOD, listeners[i], &ev);
+        }
+        accept_paused = active;
+        if(active) {
+            metrics_add(&metrics->overload_pauses, 1);
+        }
+    }
+    return active;
+}
+
+// Read from connection and handle every complete request, responses are sent together
+static void worker_read(int epollfd, int fd) {
+    connection_t *conn = &connections[fd];
+    char *buffer = read_buffer;
+    int length = conn->in_len;
+    if(length) {
+        memcpy(buffer, conn->in, length);
+    }
+
+    uint64_t recv_started = now_us();
+    uint64_t arrived = 0;
+    int recvd;
+    int size = conn->h2 ? H2_BUFFER_SIZE : RECV_BUFFER_SIZE;
+    if(conn->tls) {
+        recvd = tls_read(conn->tls, buffer + length, size - length);
+    }
+    else if(overload.target_us) {
+        recvd = worker_recv(fd, buffer + length, size - length, &arrived);
+    }
+    else {
+        recvd = recv(fd, buffer + length, size - length, 0);
+    }
+    uint64_t recv_done = now_us();
+    if(recvd <= 0) {
+        if(recvd == 0 || errno != EAGAIN) {
+            connection_close(epollfd, fd);
+        }
+        return;
+    }
+    if(conn->trace_id) {
+        trace_write(&trace, conn->trace_id, TRACE_DATA, buffer + length, recvd);
+    }
+    length += recvd;
+    metrics_add(&metrics->bytes_in, recvd);
+    PROBE2(recv, fd, recvd);
+
+    if(conn->h2) {
+        h2_process(epollfd, fd, length, recv_started, recv_done, arrived);
+    }
+    else {
+        worker_process(epollfd, fd, length, recv_started, recv_done, arrived);
+    }
+}
+
+// Handle complete request, its response is appended to the connection output unless it is pending
+// Return http_request() result, REQUEST_CLOSE if request was shed
+static int worker_request(int fd, char *data, int request_length, uint64_t recv_started, uint64_t recv_done, uint64_t arrived) {
+    connection_t *conn = &connections[fd];
+    memset(&phases, 0, sizeof(phases));
+    phases.started = recv_started;
+    phases.at[PHASE_RECV] = recv_done;
+    phase_end(PHASE_QUEUE);
+
+    // Time since the request reached the socket, including event loop lag
+    if(arrived) {
+        uint64_t sojourn = phases.at[PHASE_QUEUE] > arrived ? phases.at[PHASE_QUEUE] - arrived : 0;
+        metrics_observe(METRICS_PHASE_QUEUE, sojourn);
+        if(overload_sample(&overload, sojourn, phases.at[PHASE_QUEUE]) == OVERLOAD_SHED && overload_shed == SHED_RESPONSE) {
+            worker_shed(fd);
+            return REQUEST_CLOSE;
+        }
+    }
+
+    // Client over its request rate is answered before parsing
+    if(ratelimit_rule.rate && !ratelimit_request(&ratelimit, ratelimit_key((struct sockaddr *)&conn->addr, 0), &ratelimit_rule, phases.at[PHASE_QUEUE] / 1000)) {
+        response_prebuilt(fd, ratelimit_response, ratelimit_response_len, RESPONSE_429);
+        metrics_add(&metrics->ratelimited, 1);
+        return 0;
+    }
+
+    log_record = access_log_reserve(&access_log);
+    if(log_record) {
+        clock_gettime(CLOCK_REALTIME, &log_record->time);
+        log_record->started_us = phases.at[PHASE_QUEUE];
+        log_record->status = 0;
+        log_record->bytes = 0;
+        log_record->method[0] = 0;
+        log_record->path[0] = 0;
+        log_record->addr = conn->addr;
+    }
+
+    int ret = http_request(data, request_length, fd);
+    if(ret < 0) {
+        metrics_add(&metrics->request_errors, 1);
+    }
+    else if(ret & REQUEST_PENDING) {
+        // Logged when response is ready
+        return ret;
+    }
+    PROBE3(request__done, fd, now_us() - phases.started, phases.path);
+    if(slow_request_ms) {
+        phases_log(fd, ret);
+    }
+
+    if(log_record) {
+        if(log_record->status == 0) {
+            log_record->status = ret;
+        }
+        log_record->duration_us = now_us() - log_record->started_us;
+        access_log_commit(&access_log);
+        log_record = NULL;
+    }
+    return ret;
+}
+
+// Handle complete requests in read buffer, stop at request waiting for CGI and keep the rest
+// Return 0 if connection is still open
+static int worker_process(int epollfd, int fd, int length, uint64_t recv_started, uint64_t recv_done, uint64_t arrived) {
+    connection_t *conn = &connections[fd];
+    char *data = read_buffer;
+    while(length > 0) {
+        // HTTP/2 with prior knowledge starts with connection preface
+        if(http2 && memcmp(data, H2_PREFACE, length < H2_PREFACE_LEN ? length : H2_PREFACE_LEN) == 0) {
+            if(length < H2_PREFACE_LEN) {
+                break;
+            }
+            memmove(read_buffer, data, length);
+            if(h2_start(fd) != 0) {
+                connection_close(epollfd, fd);
+                return -1;
+            }
+            return h2_process(epollfd, fd, length, recv_started, recv_done, arrived);
+        }
+
+        int request_length = http_request_length(data, length, RECV_BUFFER_SIZE);
+        if(request_length == 0) {
+            // Request doesn't fit into receive buffer
+            if(length == RECV_BUFFER_SIZE) {
+                request_length = REQUEST_INVALID;
+            }
+            else {
+                break;
+            }
+        }
+        if(request_length < 0) {
+            response(RESPONSE_400, fd, responses[RESPONSE_400].msg, responses[RESPONSE_400].msg_len, "text/html");
+            conn->flags |= CONN_CLOSING;
+            length = 0;
+            break;
+        }
+
+        unsigned int start = conn->out_len;
+        int ret = worker_request(fd, data, request_length, recv_started, recv_done, arrived);
+        if(ret > 0 && (ret & REQUEST_PENDING)) {
+            conn->flags |= CONN_WAIT_CGI;
+            data += request_length;
+            length -= request_length;
+            if((ret & REQUEST_CLOSE) || draining) {
+                conn->flags |= CONN_CLOSE_AFTER;
+                length = 0;
+            }
+            break;
+        }
+
+        data += request_length;
+        length -= request_length;
+        if(ret > 0 && (ret & REQUEST_UPGRADE)) {
+            memmove(read_buffer, data, length);
+            return h2_upgrade(epollfd, fd, start, length, recv_started, recv_done);
+        }
+        if(ret == REQUEST_CLOSE || draining) {
+            conn->flags |= CONN_CLOSING;
+            length = 0;
+            break;
+        }
+    }
+
+    // Keep incomplete request until the rest arrives
+    if(length && conn->in == NULL) {
+        conn->in = buffer_get();
+        if(conn->in == NULL) {
+            connection_close(epollfd, fd);
+            return -1;
+        }
+    }
+    if(length) {
+        memmove(conn->in, data, length);
+        conn->in_len = length;
+    }
+    else {
+        connection_release_in(conn);
+    }
+
+    if(connection_flush(epollfd, fd) != 0) {
+        return -1;
+    }
+    // Stop reading until CGI response is sent
+    if((conn->flags & (CONN_WAIT_CGI | CONN_WAIT_OUT)) == CONN_WAIT_CGI) {
+        struct epoll_event ev = {.events = 0, .data.fd = fd};
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+    }
+    return 0;
+}
+
+// Apply SETTINGS of peer
+// Return 0 or HTTP/2 error code
+static int h2_settings(int fd, const uint8_t *payload, unsigned int len) {
+    struct H2_SESSION *h2 = connections[fd].h2;
+    for(unsigned int i = 0; i + 6 <= len; i += 6) {
+        unsigned int id = payload[i] << 8 | payload[i + 1];
+        uint32_t value = (uint32_t)payload[i + 2] << 24 | payload[i + 3] << 16 | payload[i + 4] << 8 | payload[i + 5];
+        switch(id) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                hpack_resize(&h2->encoder, value);
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+                if(value > H2_MAX_WINDOW) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                // Change applies to windows of open streams
+                for(struct H2_STREAM *stream = h2->streams; stream; stream = stream->next) {
+                    int64_t window = (int64_t)stream->window + (int64_t)value - h2->initial_window;
+                    if(window > H2_MAX_WINDOW) {
+                        return H2_FLOW_CONTROL_ERROR;
+                    }
+                    stream->window = window;
+                }
+                h2->initial_window = value;
+                break;
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if(value < H2_FRAME_SIZE || value > 0xffffff) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                h2->max_frame = value;
+                break;
+        }
+    }
+    return 0;
+}
+
+// Answer request that doesn't fit into receive buffer with 400, as HTTP/1.1 does. The rest of
+// its body is ignored
+static void h2_too_large(int fd, uint32_t id) {
+    unsigned int start = connections[fd].out_len;
+    response(RESPONSE_400, fd, responses[RESPONSE_400].msg, responses[RESPONSE_400].msg_len, "text/html");
+    h2_respond(fd, id, start);
+}
+
+// Handle complete request of stream as HTTP/1.1 one, the response is converted to frames of
+// stream unless it waits for CGI or upstream. 'request' holds head without the empty line
+// followed by body, Content-Length is set from the body received
+// Return 0 or HTTP/2 error code
+static int h2_dispatch(int fd, uint32_t id, char *request, unsigned int head_len, unsigned int len, int64_t declared, uint64_t recv_started, uint64_t recv_done, uint64_t arrived) {
+    struct H2_SESSION *h2 = connections[fd].h2;
+    unsigned int body_len = len - head_len;
+    // Malformed request, RFC 9113 section 8.1.1
+    if(declared >= 0 && declared != body_len) {
+        h2_rst(fd, id, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+    char length[32];
+    int length_len = 0;
+    if(declared >= 0 || body_len) {
+        length_len = snprintf(length, sizeof(length), "Content-Length: %u\r\n", body_len);
+    }
+    if(len + length_len + 2 >= RECV_BUFFER_SIZE) {
+        h2_too_large(fd, id);
+        return 0;
+    }
+    memmove(request + head_len + length_len + 2, request + head_len, body_len);
+    memcpy(request + head_len, length, length_len);
+    memcpy(request + head_len + length_len, "\r\n", 2);
+    len += length_len + 2;
+    request[len] = 0;
+
+    metrics_add(&metrics->h2_streams, 1);
+    unsigned int start = connections[fd].out_len;
+    h2_current_stream = id;
+    int ret = worker_request(fd, request, len, recv_started, recv_done, arrived);
+    h2_current_stream = 0;
+    if(ret > 0 && (ret & REQUEST_PENDING)) {
+        struct H2_STREAM *stream = h2_stream_add(h2, id);
+        if(stream == NULL) {
+            return H2_INTERNAL_ERROR;
+        }
+        stream->pending = 1;
+        return 0;
+    }
+    h2_respond(fd, id, start);
+    return 0;
+}
+
+// Request body of stream is complete
+// Return 0 or HTTP/2 error code
+static int h2_body_end(int fd, struct H2_STREAM *stream, uint64_t recv_started, uint64_t recv_done, uint64_t arrived) {
+    uint32_t id = stream->id;
+    char *request = stream->request;
+    unsigned int head_len = stream->head_len;
+    unsigned int len = stream->request_len;
+    int64_t declared = stream->declared;
+    stream->request = NULL;
+    h2_stream_remove(connections[fd].h2, stream);
+    int error = h2_dispatch(fd, id, request, head_len, len, declared, recv_started, recv_done, arrived);
+    buffer_put(request);
+    return error;
+}
+
+// Turn decoded header block into HTTP/1.1 request head. Request without body is handled at
+// once, otherwise stream collects DATA until END_STREAM
+// Return 0 or HTTP/2 error code
+static int h2_headers(int fd, uint32_t id, uint8_t flags, const uint8_t *block, unsigned int len, uint64_t recv_started, uint64_t recv_done, uint64_t arrived) {
+    connection_t *conn = &connections[fd];
+    struct H2_SESSION *h2 = conn->h2;
+    struct HPACK_HEADER headers[H2_MAX_HEADERS];
+    // Block is decoded even if stream is ignored, decoder table is shared by all of them
+    int count = hpack_decode(&h2->decoder, block, len, headers, H2_MAX_HEADERS, h2_header_buffer, RECV_BUFFER_SIZE);
+    if(count == HPACK_ERROR || count == HPACK_MEMORY_ERROR) {
+        return H2_COMPRESSION_ERROR;
+    }
+    // Trailers end body of stream, their fields are not used. New streams after GOAWAY are ignored
+    if(id <= h2->last_stream || h2->goaway) {
+        struct H2_STREAM *stream = h2_stream_find(h2, id);
+        if(stream && stream->request && (flags & H2_FLAG_END_STREAM)) {
+            return h2_body_end(fd, stream, recv_started, recv_done, arrived);
+        }
+        return 0;
+    }
+    if((id & 1) == 0) {
+        return H2_PROTOCOL_ERROR;
+    }
+    h2->last_stream = id;
+    if(count < 0 || h2->streams_count >= H2_MAX_STREAMS) {
+        h2_rst(fd, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+
+    const struct HPACK_HEADER *method = NULL, *path = NULL, *authority = NULL;
+    int64_t declared = -1;
+    for(int i = 0; i != count; ++i) {
+        if(headers[i].name_len == 7 && memcmp(headers[i].name, ":method", 7) == 0) {
+            method = &headers[i];
+        }
+        else if(headers[i].name_len == 5 && memcmp(headers[i].name, ":path", 5) == 0) {
+            path = &headers[i];
+        }
+        else if(headers[i].name_len == 10 && memcmp(headers[i].name, ":authority", 10) == 0) {
+            authority = &headers[i];
+        }
+        else if(headers[i].name_len == 14 && memcmp(headers[i].name, "content-length", 14) == 0) {
+            if(headers[i].value_len == 0 || headers[i].value_len > 18) {
+                declared = -2;
+                break;
+            }
+            declared = 0;
+            for(unsigned int j = 0; j != headers[i].value_len && declared >= 0; ++j) {
+                char c = headers[i].value[j];
+                declared = c >= '0' && c <= '9' ? declared * 10 + c - '0' : -2;
+            }
+            if(declared < 0) {
+                break;
+            }
+        }
+    }
+    if(method == NULL || path == NULL || declared == -2) {
+        h2_rst(fd, id, H2_PROTOCOL_ERROR);
+        return 0;
+    }
+
+    // Content-Length is added when body is complete
+    char *request = h2_request_buffer;
+    int n = snprintf(request, RECV_BUFFER_SIZE, "%.*s %.*s HTTP/1.1\r\n", method->value_len, method->value, path->value_len, path->value);
+    if(authority && n < RECV_BUFFER_SIZE) {
+        n += snprintf(request + n, RECV_BUFFER_SIZE - n, "Host: %.*s\r\n", authority->value_len, authority->value);
+    }
+    for(int i = 0; i != count && n < RECV_BUFFER_SIZE; ++i) {
+        if(headers[i].name_len && headers[i].name[0] != ':' && !h2_header_is(headers[i].name, headers[i].name_len, "content-length")) {
+            n += snprintf(request + n, RECV_BUFFER_SIZE - n, "%.*s: %.*s\r\n", headers[i].name_len, headers[i].name, headers[i].value_len, headers[i].value);
+        }
+    }
+    if(n + 2 >= RECV_BUFFER_SIZE) {
+        h2_rst(fd, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+
+    if(flags & H2_FLAG_END_STREAM) {
+        return h2_dispatch(fd, id, request, n, n, declared, recv_started, recv_done, arrived);
+    }
+    struct H2_STREAM *stream = h2_stream_add(h2, id);
+    if(stream == NULL) {
+        return H2_INTERNAL_ERROR;
+    }
+    stream->pending = 1;
+    stream->request = buffer_get();
+    if(stream->request == NULL) {
+        h2_stream_remove(h2, stream);
+        return H2_INTERNAL_ERROR;
+    }
+    memcpy(stream->request, request, n);
+    stream->request_len = n;
+    stream->head_len = n;
+    stream->declared = declared;
+    return 0;
+}
+
+// Handle one frame with complete payload
+// Return 0 or HTTP/2 error code of connection
+static int h2_frame_handle(int fd, const struct H2_FRAME *frame, const uint8_t *payload, uint64_t recv_started, uint64_t recv_done, uint64_t arrived) {
+    struct H2_SESSION *h2 = connections[fd].h2;
+    // Header block can't be interleaved with other frames
+    if(h2->block_stream && (frame->type != H2_CONTINUATION || frame->stream != h2->block_stream)) {
+        return H2_PROTOCOL_ERROR;
+    }
+
+    unsigned int len = frame->len;
+    struct H2_STREAM *stream;
+    uint32_t increment;
+    uint8_t *out;
+    int error;
+    switch(frame->type) {
+        case H2_DATA:
+            if(frame->stream == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            // Request body is limited by receive buffer, not by flow control, received data
+            // returns to the windows at once
+            h2->consumed += len;
+            if(len && (frame->flags & H2_FLAG_END_STREAM) == 0) {
+                out = h2_frame(fd, 4, H2_WINDOW_UPDATE, 0, frame->stream);
+                if(out) {
+                    h2_u32(out, len);
+                }
+            }
+            if(frame->flags & H2_FLAG_PADDED) {
+                if(len == 0 || payload[0] >= len) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                len -= 1 + payload[0];
+                ++payload;
+            }
+            // Body of stream that was answered or reset is dropped
+            stream = h2_stream_find(h2, frame->stream);
+            if(stream == NULL || stream->request == NULL) {
+                return 0;
+            }
+            if(stream->request_len + len >= RECV_BUFFER_SIZE) {
+                buffer_put(stream->request);
+                stream->request = NULL;
+                h2_too_large(fd, frame->stream);
+                return 0;
+            }
+            memcpy(stream->request + stream->request_len, payload, len);
+            stream->request_len += len;
+            if(frame->flags & H2_FLAG_END_STREAM) {
+                return h2_body_end(fd, stream, recv_started, recv_done, arrived);
+            }
+            return 0;
+
+        case H2_HEADERS:
+            if(frame->stream == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if(frame->flags & H2_FLAG_PADDED) {
+                if(len == 0 || payload[0] >= len) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                len -= 1 + payload[0];
+                ++payload;
+            }
+            if(frame->flags & H2_FLAG_PRIORITY) {
+                if(len < 5) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                len -= 5;
+                payload += 5;
+            }
+            if(frame->flags & H2_FLAG_END_HEADERS) {
+                return h2_headers(fd, frame->stream, frame->flags, payload, len, recv_started, recv_done, arrived);
+            }
+            if(h2->block == NULL) {
+                h2->block = malloc(H2_MAX_BLOCK);
+                if(h2->block == NULL) {
+                    return H2_INTERNAL_ERROR;
+                }
+            }
+            memcpy(h2->block, payload, len);
+            h2->block_len = len;
+            h2->block_stream = frame->stream;
+            h2->block_flags = frame->flags;
+            return 0;
+
+        case H2_CONTINUATION:
+            if(h2->block_stream == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if(h2->block_len + len > H2_MAX_BLOCK) {
+                return H2_COMPRESSION_ERROR;
+            }
+            memcpy(h2->block + h2->block_len, payload, len);
+            h2->block_len += len;
+            if(frame->flags & H2_FLAG_END_HEADERS) {
+                uint32_t id = h2->block_stream;
+                h2->block_stream = 0;
+                return h2_headers(fd, id, h2->block_flags, h2->block, h2->block_len, recv_started, recv_done, arrived);
+            }
+            return 0;
+
+        case H2_SETTINGS:
+            if(frame->stream != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if(frame->flags & H2_FLAG_ACK) {
+                return len ? H2_FRAME_SIZE_ERROR : 0;
+            }
+            if(len % 6) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            error = h2_settings(fd, payload, len);
+            if(error) {
+                return error;
+            }
+            h2_frame(fd, 0, H2_SETTINGS, H2_FLAG_ACK, 0);
+            return 0;
+
+        case H2_PING:
+            if(frame->stream != 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if(len != 8) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            if((frame->flags & H2_FLAG_ACK) == 0) {
+                out = h2_frame(fd, 8, H2_PING, H2_FLAG_ACK, 0);
+                if(out) {
+                    memcpy(out, payload, 8);
+                }
+            }
+            return 0;
+
+        case H2_GOAWAY:
+            h2->goaway = 1;
+            return 0;
+
+        case H2_WINDOW_UPDATE:
+            if(len != 4) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            increment = ((uint32_t)payload[0] << 24 | payload[1] << 16 | payload[2] << 8 | payload[3]) & H2_MAX_WINDOW;
+            if(increment == 0) {
+                return frame->stream ? 0 : H2_PROTOCOL_ERROR;
+            }
+            if(frame->stream == 0) {
+                if((int64_t)h2->window + increment > H2_MAX_WINDOW) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                h2->window += increment;
+                return 0;
+            }
+            stream = h2_stream_find(h2, frame->stream);
+            if(stream) {
+                if((int64_t)stream->window + increment > H2_MAX_WINDOW) {
+                    h2_rst(fd, stream->id, H2_FLOW_CONTROL_ERROR);
+                    h2_stream_remove(h2, stream);
+                    return 0;
+                }
+                stream->window += increment;
+            }
+            return 0;
+
+        case H2_RST_STREAM:
+            if(frame->stream == 0) {
+                return H2_PROTOCOL_ERROR;
+            }
+            if(len != 4) {
+                return H2_FRAME_SIZE_ERROR;
+            }
+            // Pending CGI response of stream is dropped when it comes
+            stream = h2_stream_find(h2, frame->stream);
+            if(stream) {
+                h2_stream_remove(h2, stream);
+            }
+            return 0;
+
+        case H2_PUSH_PROMISE:
+            return H2_PROTOCOL_ERROR;
+    }
+    // PRIORITY and unknown frames
+    return 0;
+}
+
+// Handle complete frames in read buffer and keep the rest, then send what flow control allows
+// Return 0 if connection is still open
+static int h2_process(int epollfd, int fd, int length, uint64_t recv_started, uint64_t recv_done, uint64_t arrived) {
+    connection_t *conn = &connections[fd];
+    struct H2_SESSION *h2 = conn->h2;
+    uint8_t *data = (uint8_t *)read_buffer;
+
+    if(h2->preface) {
+        int n = length < h2->preface ? length : h2->preface;
+        if(memcmp(data, H2_PREFACE + H2_PREFACE_LEN - h2->preface, n) != 0) {
+            connection_close(epollfd, fd);
+            return -1;
+        }
+        h2->preface -= n;
+        data += n;
+        length -= n;
+    }
+
+    while(length >= H2_FRAME_HEADER && (conn->flags & CONN_CLOSING) == 0) {
+        struct H2_FRAME frame;
+        h2_frame_parse(data, &frame);
+        int error = frame.len > H2_FRAME_SIZE ? H2_FRAME_SIZE_ERROR : 0;
+        if(error == 0) {
+            if(length < H2_FRAME_HEADER + (int)frame.len) {
+                break;
+            }
+            error = h2_frame_handle(fd, &frame, data + H2_FRAME_HEADER, recv_started, recv_done, arrived);
+            data += H2_FRAME_HEADER + frame.len;
+            length -= H2_FRAME_HEADER + frame.len;
+        }
+        if(error) {
+            h2_goaway(fd, error);
+        }
+    }
+    if(conn->flags & CONN_CLOSING) {
+        length = 0;
+    }
+
+    // Keep incomplete frame until the rest arrives
+    if(length && conn->in == NULL) {
+        conn->in = malloc(H2_BUFFER_SIZE);
+        if(conn->in == NULL) {
+            connection_close(epollfd, fd);
+            return -1;
+        }
+    }
+    if(length) {
+        memmove(conn->in, data, length);
+        conn->in_len = length;
+    }
+    else {
+        connection_release_in(conn);
+    }
+
+    if(h2->consumed >= H2_DEFAULT_WINDOW / 2) {
+        uint8_t *payload = h2_frame(fd, 4, H2_WINDOW_UPDATE, 0, 0);
+        if(payload) {
+            h2_u32(payload, h2->consumed);
         }
+        h2->consumed = 0;
+    }
+    h2_send(fd);
+    return connection_flush(epollfd, fd);
+}
 
-        int r = sscanf(buff, "%s %s %s\n", spath, stype, sact);
-        if(r != 3) {
-            continue;
+// Answer upgrade request with 101, its response goes to stream 1 of the new HTTP/2 session
+// Return 0 if connection is still open
+static int h2_upgrade(int epollfd, int fd, unsigned int start, int length, uint64_t recv_started, uint64_t recv_done) {
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+    connection_t *conn = &connections[fd];
+    unsigned int response_len = conn->out_len - start;
+    char *response = malloc(response_len ? response_len : 1);
+    if(response == NULL) {
+        connection_close(epollfd, fd);
+        return -1;
+    }
+    memcpy(response, conn->out + start, response_len);
+    conn->out_len = start;
+
+    char *out = connection_reserve(fd, sizeof(switching) - 1);
+    if(out) {
+        memcpy(out, switching, sizeof(switching) - 1);
+        conn->out_len += sizeof(switching) - 1;
+    }
+    if(out == NULL || h2_start(fd) != 0) {
+        free(response);
+        connection_close(epollfd, fd);
+        return -1;
+    }
+    // Settings of HTTP2-Settings header are acknowledged implicitly
+    h2_settings(fd, h2_upgrade_settings, h2_upgrade_settings_len);
+    conn->h2->last_stream = 1;
+
+    unsigned int pos = conn->out_len;
+    out = connection_reserve(fd, response_len);
+    if(out == NULL) {
+        free(response);
+        connection_close(epollfd, fd);
+        return -1;
+    }
+    memcpy(out, response, response_len);
+    conn->out_len += response_len;
+    free(response);
+    h2_respond(fd, 1, pos);
+    return h2_process(epollfd, fd, length, recv_started, recv_done, 0);
+}
+
+// Read requests left decrypted in OpenSSL buffers, epoll reports only data in the socket
+static void worker_pending(int epollfd, int fd) {
+    while(connections[fd].tls && (connections[fd].flags & (CONN_WAIT_CGI | CONN_WAIT_OUT | CONN_HANDSHAKE)) == 0 && tls_pending(connections[fd].tls)) {
+        worker_read(epollfd, fd);
+    }
+}
+
+// Continue with requests pipelined behind the one answered by CGI
+static void worker_resume(int epollfd, int fd) {
+    connection_t *conn = &connections[fd];
+    int length = conn->in_len;
+    if(length) {
+        memcpy(read_buffer, conn->in, length);
+    }
+    uint64_t now = now_us();
+    if(worker_process(epollfd, fd, length, now, now, 0) == 0 && (conn->flags & (CONN_WAIT_CGI | CONN_WAIT_OUT)) == 0) {
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+        worker_pending(epollfd, fd);
+    }
+}
+
+// Continue TLS handshake, when it is done directions supported by kTLS are left to the kernel
+static void worker_handshake(int epollfd, int fd) {
+    connection_t *conn = &connections[fd];
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    int ret = tls_handshake(conn->tls);
+    if(ret == TLS_ERROR) {
+        connection_close(epollfd, fd);
+        return;
+    }
+    if(ret != TLS_OK) {
+        ev.events = ret == TLS_WANT_WRITE ? EPOLLOUT : EPOLLIN;
+        epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+        return;
+    }
+
+    metrics_add(&metrics->tls_handshakes, 1);
+    if(tls_resumed(conn->tls)) {
+        metrics_add(&metrics->tls_resumed, 1);
+    }
+    // ALPN result is gone with the session once kTLS took it over
+    int h2 = http2 && tls_h2(conn->tls);
+    int offload = tls_offload(conn->tls);
+    if(offload == (TLS_KTLS_SEND | TLS_KTLS_RECV)) {
+        // Plain socket from now on
+        tls_free(conn->tls);
+        conn->tls = NULL;
+        metrics_add(&metrics->tls_offloaded, 1);
+    }
+    else if((offload & TLS_KTLS_SEND) == 0) {
+        conn->flags |= CONN_TLS_WRITE;
+    }
+    conn->flags &= ~CONN_HANDSHAKE;
+    if(h2 && (h2_start(fd) != 0 || connection_flush(epollfd, fd) != 0)) {
+        if(connections[fd].type != CONN_FREE) {
+            connection_close(epollfd, fd);
         }
+        return;
+    }
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+    // Request may have come with the last handshake message
+    worker_pending(epollfd, fd);
+}
 
-        struct CONFIG_PATH config_path;
-        config_path.content_type = malloc(strlen(stype) + 1);
-        if(config_path.content_type == NULL) {
-            return CONFIG_MALLOC_ERROR;
+int worker_run(int *listeners, int listeners_count) {
+
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &set, &old);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = worker_signal;
+    sigaction(SIGQUIT, &sa, NULL);
+    // CGI processes are reaped by the kernel
+    signal(SIGCHLD, SIG_IGN);
+
+    int cpu = -1;
+    if(cpu_affinity != CPU_AFFINITY_OFF && worker_cpus_count) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        cpu = worker_cpus[worker_slot % worker_cpus_count];
+        CPU_SET(cpu, &set);
+        if(sched_setaffinity(0, sizeof(set), &set) != 0) {
+            perror("sched_setaffinity() error");
+            cpu = -1;
         }
-        strcpy(config_path.content_type, stype);
+    }
+    // Other members of reuseport groups belong to other workers
+    int own = 0;
+    for(int i = 0; i != listeners_count; ++i) {
+        if(listener_slots[i] < 0 || listener_slots[i] == worker_slot) {
+            listener_tls[own] = listener_tls[i];
+            listeners[own++] = listeners[i];
+        }
+        else {
+            close(listeners[i]);
+        }
+    }
+    listeners_count = own;
 
-        config_path.action = malloc(strlen(sact) + 1);
-        if(config_path.action == NULL) {
-            free(config_path.content_type);
-            return CONFIG_MALLOC_ERROR;
+    // Connection table is indexed by descriptor, entries of idle connections hold no buffers, so
+    // the soft limit is set to worker_connections as far as the hard limit allows. Untouched pages
+    // of the table are never mapped
+    struct rlimit rl;
+    connections_max = worker_connections;
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        if(rl.rlim_max != RLIM_INFINITY && rl.rlim_max < (rlim_t)connections_max) {
+            connections_max = rl.rlim_max;
         }
-        strcpy(config_path.action, sact);
-        map_add(&config, spath, strlen(spath), &config_path, sizeof(struct CONFIG_PATH));
+        rl.rlim_cur = connections_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    connections = calloc(connections_max, sizeof(connection_t));
+    // Worker exiting here would be respawned into the same failure, it runs with a smaller table
+    while(connections == NULL && connections_max > CONNECTIONS_MIN) {
+        printf("Can't allocate table of %i connections, ", connections_max);
+        connections_max /= 2;
+        if(connections_max < CONNECTIONS_MIN) {
+            connections_max = CONNECTIONS_MIN;
+        }
+        printf("trying %i\n", connections_max);
+        connections = calloc(connections_max, sizeof(connection_t));
+    }
+    if(connections == NULL) {
+        printf("malloc() error");
+        return 1;
+    }
+    // Descriptors above the table are not accepted by the kernel
+    if(getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur > (rlim_t)connections_max) {
+        rl.rlim_cur = connections_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
 
-    fclose(f);
-    return 1;
-}
+    // HTTP/2 connections read whole frames, requests of streams are rebuilt in their own buffers
+    read_buffer = malloc(http2 ? H2_BUFFER_SIZE : RECV_BUFFER_SIZE);
+    status_buffer = malloc(METRICS_BUFFER_SIZE);
+    if(http2) {
+        h2_header_buffer = malloc(RECV_BUFFER_SIZE);
+        h2_request_buffer = malloc(RECV_BUFFER_SIZE);
+    }
+    if(read_buffer == NULL || status_buffer == NULL || (http2 && (h2_header_buffer == NULL || h2_request_buffer == NULL))) {
+        printf("malloc() error");
+        free(connections);
+        free(read_buffer);
+        return 1;
+    }
+    metrics_attach(worker_slot);
 
-void usage(char *argv0) {
-    printf("%s server\n", SERVER_NAME);
-    printf("Usage: %s [-v] [-w num] [-p port]\n", argv0);
-    printf("  -v        : verbose\n");
-    printf("  -w num    : workers number\n");
-    printf("  -p port   : port\n");
-    printf("  -r path   : root path\n");
-    printf("  -c config : config path\n");
-    printf("  -h        : print thist help\n");
+    struct epoll_event ev, events[MAX_EVENTS];
+    int nfds, epollfd;
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollfd == -1) {
+        perror("epoll_create1() error");
+        free(connections);
+        free(read_buffer);
+        return 1;
+    }
+
+    for(int i = 0; i != listeners_count; ++i) {
+        ev.events = EPOLLIN;
+        ev.data.fd = listeners[i];
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, listeners[i], &ev) == -1) {
+            perror("epoll_ctl() sock");
+            close(epollfd);
+            free(connections);
+            free(read_buffer);
+            return 1;
+        }
+        connections[listeners[i]].type = CONN_LISTENER;
+        connections[listeners[i]].flags = listener_tls[i] ? CONN_TLS : 0;
+    }
+
+    pid_t pid = getpid();
+    printf("Worker process %i started\n", pid);
+    fflush(stdout);
+
+    if(access_log_fd >= 0 && access_log_start(&access_log, access_log_fd) != ACCESS_LOG_OK) {
+        printf("Can't start access log\n");
+    }
+    if(trace_fd >= 0 && trace_start(&trace, trace_fd, trace_sample) != TRACE_OK) {
+        printf("Can't start request trace\n");
+    }
+
+    if(overload_target_ms) {
+        overload_init(&overload, overload_target_ms, overload_interval_ms, now_us());
+        overload_response_len = response_prebuild(overload_response, RESPONSE_503, "close");
+    }
+    if(ratelimit.entries) {
+        ratelimit_response_len = response_prebuild(ratelimit_response, RESPONSE_429, "keep-alive");
+    }
+
+    time_t deadline = 0;
+    struct sockaddr_storage client_addr;
+    while(1) {
+        socklen_t client_addr_len = sizeof(client_addr);
+
+        int timeout = cgi_tick(epollfd);
+        int proxy_timeout = proxy_tick(epollfd);
+        if(proxy_timeout >= 0 && (timeout < 0 || proxy_timeout < timeout)) {
+            timeout = proxy_timeout;
+        }
+        if(draining && (timeout < 0 || timeout > DRAIN_POLL_TIMEOUT)) {
+            timeout = DRAIN_POLL_TIMEOUT;
+        }
+        // Wake up to notice that overload is over
+        if(overload.target_us && worker_overload(epollfd, listeners, listeners_count) && (timeout < 0 || timeout > overload_interval_ms)) {
+            timeout = overload_interval_ms;
+        }
+        nfds = epoll_pwait(epollfd, events, MAX_EVENTS, timeout, &old);
+        if(nfds == -1) {
+            if(errno != EINTR) {
+                perror("epoll_wait() error");
+                close(epollfd);
+                free(connections);
+                free(read_buffer);
+                return 1;
+            }
+            nfds = 0;
+        }
+        uint64_t busy_start = worker_load ? now_us() : 0;
+
+        if(draining) {
+            if(deadline == 0) {
+                deadline = time(NULL) + drain_timeout;
+                worker_drain(epollfd, listeners, listeners_count);
+            }
+            if(connections_active == 0 || time(NULL) >= deadline) {
+                break;
+            }
+        }
+
+        for(int i = 0; i != nfds; ++i) {
+            int fd = events[i].data.fd;
+            if(connections[fd].type == CONN_LISTENER) {
+                memset(&client_addr, 0, sizeof(struct sockaddr_in6));
+                int client_socket = accept(fd, (struct sockaddr *)&client_addr, &client_addr_len);
+                if(client_socket == -1) {
+                    continue;
+                }
+                if(client_socket >= connections_max) {
+                    close(client_socket);
+                    continue;
+                }
+
+                int flags = fcntl(client_socket, F_GETFL, 0);
+                if(flags == -1) {
+                    perror("fcntl(..., F_GETFL, ...) error");
+                    close(client_socket);
+                    continue;
+                }
+                flags |= O_NONBLOCK;
+                if(fcntl(client_socket, F_SETFL, flags) == -1) {
+                    perror("fcntl(..., F_SETFL, ...) error");
+                    close(client_socket);
+                    continue;
+                }
+
+                // ev.events = EPOLLIN | EPOLLET;
+                ev.events = EPOLLIN;
+                ev.data.fd = client_socket;
+                if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client_socket, &ev) == -1) {
+                    perror("epoll_ctl(..., EPOLL_CTL_ADD, ...) error");
+                    close(client_socket);
+                    continue;
+                }
+
+                // Client with too many connections gets 429 and is closed at once
+                int limited = 0;
+                if(ratelimit_rule.connections) {
+                    limited = ratelimit_connect(&ratelimit, ratelimit_key((struct sockaddr *)&client_addr, 0), ratelimit_rule.connections, now_us() / 1000);
+                    if(!limited) {
+                        // TLS client gets only the close before handshake
+                        if((connections[fd].flags & CONN_TLS) == 0) {
+                            send(client_socket, ratelimit_response, ratelimit_response_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+                        }
+                        close(client_socket);
+                        metrics_add(&metrics->status[RESPONSE_429], 1);
+                        metrics_add(&metrics->ratelimited, 1);
+                        continue;
+                    }
+                }
+
+                if(cpu_affinity == CPU_AFFINITY_STEER && cpu >= 0) {
+                    int incoming = -1;
+                    socklen_t len = sizeof(incoming);
+                    if(getsockopt(client_socket, SOL_SOCKET, SO_INCOMING_CPU, &incoming, &len) == 0 && incoming >= 0 && incoming != cpu) {
+                        metrics_add(&metrics->cpu_misses, 1);
+                    }
+                }
+                listener_accepted(client_socket, client_addr.ss_family, &listener_options);
+                connections[client_socket].type = CONN_CLIENT;
+                connections[client_socket].flags = limited == RATELIMIT_COUNTED ? CONN_LIMITED : 0;
+                metrics_add(&metrics->connections, 1);
+                // Unix socket peer is kept as family alone, its path doesn't fit and clients rarely bind one
+                if(client_addr.ss_family == AF_UNIX) {
+                    memset(&connections[client_socket].addr, 0, sizeof(connections[client_socket].addr));
+                    connections[client_socket].addr.sin6_family = AF_UNIX;
+                }
+                else {
+                    memcpy(&connections[client_socket].addr, &client_addr, sizeof(connections[client_socket].addr));
+                }
+                connections[client_socket].trace_id = trace_connection(&trace, client_addr.ss_family);
+                ++connections_active;
+
+                if(connections[fd].flags & CONN_TLS) {
+                    connections[client_socket].tls = tls_new(&tls, client_socket);
+                    if(connections[client_socket].tls == NULL) {
+                        connection_close(epollfd, client_socket);
+                        continue;
+                    }
+                    connections[client_socket].flags |= CONN_TLS | CONN_HANDSHAKE;
+                    // Client hello is usually there already
+                    worker_handshake(epollfd, client_socket);
+                }
+            }
+            else if(connections[fd].type == CONN_CLIENT) {
+                if(connections[fd].flags & CONN_HANDSHAKE) {
+                    worker_handshake(epollfd, fd);
+                    continue;
+                }
+                if((events[i].events & EPOLLOUT) && connection_flush(epollfd, fd) != 0) {
+                    continue;
+                }
+                if(connections[fd].flags & CONN_WAIT_CGI) {
+                    // Input is paused, only hangup is reported
+                    if(events[i].events & (EPOLLHUP | EPOLLERR)) {
+                        connection_close(epollfd, fd);
+                    }
+                    // Proxied response waited for output to be sent
+                    else if((events[i].events & EPOLLOUT) && (connections[fd].flags & CONN_WAIT_OUT) == 0) {
+                        proxy_resume(epollfd, fd);
+                    }
+                }
+                else if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                    worker_read(epollfd, fd);
+                }
+                worker_pending(epollfd, fd);
+            }
+            else if(connections[fd].type == CONN_CGI) {
+                cgi_read(epollfd, fd);
+            }
+            else if(connections[fd].type == CONN_UPSTREAM) {
+                proxy_event(epollfd, fd);
+            }
+        }
+
+        trace_flush(&trace, 0);
+
+        // Event loop utilization for the master's worker scaling
+        if(worker_load) {
+            __atomic_store_n(&worker_load->busy_us, worker_load->busy_us + now_us() - busy_start, __ATOMIC_RELAXED);
+        }
+    }
+
+    while(cgi_jobs) {
+        if(cgi_jobs->pid) {
+            kill(cgi_jobs->pid, SIGKILL);
+        }
+        if(cgi_jobs->claimed) {
+            cache_unclaim(&cache, cgi_jobs->key, cgi_jobs->key_len);
+        }
+        cgi_free(cgi_jobs);
+    }
+    while(proxies) {
+        proxy_release(epollfd, proxies, 0);
+        proxy_free(proxies);
+    }
+    access_log_stop(&access_log);
+    trace_stop(&trace);
+    if(trace.dropped) {
+        printf("%lu request trace batches dropped\n", (unsigned long)trace.dropped);
+    }
+    free(read_buffer);
+    while(buffer_pool_len) {
+        free(buffer_pool[--buffer_pool_len]);
+    }
+    free(connections);
+    close(epollfd);
+
+    printf("Worker process %i stopped\n", pid);
+    return 0;
 }
 
 int main(int argc, char *argv[]) {
     int workers = 0;
+    int workers_max = 0;
     uint16_t port = 0;
     char config_path[PATH_MAX] = "tinyhttp.conf";
-    char str[INET_ADDRSTRLEN];
 
     extern char *optarg;
     int opt;
-    while((opt = getopt(argc, argv, "vw:p:r:c:n:h")) > 0) {
+    while((opt = getopt(argc, argv, "vw:W:p:r:c:n:d:h")) > 0) {
         switch(opt) {
             case 'v':
                 verbose = 1;
@@ -541,6 +3958,9 @@ int main(int argc, char *argv[]) {
             case 'w':
                 workers = atoi(optarg);
                 break;
+            case 'W':
+                workers_max = atoi(optarg);
+                break;
             case 'p':
                 port = atoi(optarg);
                 break;
@@ -559,6 +3979,9 @@ int main(int argc, char *argv[]) {
             case 'n':
                 strcpy(host, optarg);
                 break;
+            case 'd':
+                drain_timeout = atoi(optarg);
+                break;
             case 'h':
                 usage(argv[0]);
                 break;
@@ -567,8 +3990,8 @@ int main(int argc, char *argv[]) {
                 return 1;
         }
     }
-    if(workers-- == 0) {
-        workers = WORKERS - 1;
+    if(workers <= 0) {
+        workers = WORKERS;
     }
     if(port == 0) {
         port = DEFAULT_PORT;
@@ -593,139 +4016,172 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    char *buffer = malloc(RECV_BUFFER_SIZE);
-    if(buffer == NULL) {
-        printf("malloc() error");
-        return 1;
+    if(access_log_path[0]) {
+        access_log_fd = open(access_log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if(access_log_fd < 0) {
+            printf("Can't open access log %s\n", access_log_path);
+            return 1;
+        }
     }
-
-    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if(sock == -1) {
-        free(buffer);
-        perror("socket() error");
-        return 1;
+    else if(verbose) {
+        access_log_fd = STDOUT_FILENO;
     }
 
-    struct sockaddr_in server_address;
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(port);
-    server_address.sin_addr.s_addr = INADDR_ANY;
+    // Binary upgrade starts new master, so responses are rendered again from current files
+    if(preload) {
+        preload_routes();
+    }
 
-    if(bind(sock, (struct sockaddr*) &server_address, sizeof(server_address)) == -1) {
-        perror("bind() error");
-        close(sock);
-        free(buffer);
-        return 1;
+    // Context is shared by workers, and so are session ticket keys
+    for(int i = 0; i != listener_options.addresses_count; ++i) {
+        if(!listener_options.addresses[i].tls || tls.ctx) {
+            continue;
+        }
+        int ret = tls_init(&tls, tls_certificate, tls_certificate_key[0] ? tls_certificate_key : tls_certificate);
+        if(ret != TLS_OK) {
+            printf("Can't load TLS %s %s\n", ret == TLS_KEY_ERROR ? "key" : "certificate", ret == TLS_KEY_ERROR && tls_certificate_key[0] ? tls_certificate_key : tls_certificate);
+            return 1;
+        }
+        tls.http2 = http2;
     }
 
-    if(listen(sock, MAX_CLIENTS) != 0) {
-        perror("listen() error");
-        close(sock);
-        free(buffer);
+    if(bundle_path[0] && bundle_open(&bundle, bundle_path) != BUNDLE_OK) {
+        printf("Can't open bundle %s\n", bundle_path);
         return 1;
     }
 
-    struct epoll_event ev, events[MAX_EVENTS];
-    int nfds, epollfd;
-    epollfd = epoll_create1(0);
-    if(epollfd == -1) {
-        perror("epoll_create1() error");
-        close(epollfd);
-        close(sock);
-        free(buffer);
+    if(cache_routes && cache_init(&cache) != CACHE_OK) {
+        printf("Can't allocate CGI cache of %zu bytes\n", cache.size);
         return 1;
     }
 
-    ev.events = EPOLLIN;
-    ev.data.fd = sock;
-    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, sock, &ev) == -1) {
-        perror("epoll_ctl() sock");
-        close(epollfd);
-        close(sock);
-        free(buffer);
+    if((ratelimit_rule.rate || ratelimit_rule.connections || ratelimit_rules) && ratelimit_init(&ratelimit, ratelimit_size) != RATELIMIT_OK) {
+        printf("Can't allocate rate limit table of %u entries\n", ratelimit_size);
         return 1;
     }
 
-    for(int i = 0; i != workers; ++i) {
-        if(fork() != 0) {
-            break;
+    if(trace_path[0]) {
+        trace_fd = trace_open(trace_path);
+        if(trace_fd < 0) {
+            printf("Can't open request trace %s\n", trace_path);
+            return 1;
         }
     }
-    pid_t pid = getpid();
-    printf("Worker process %i started\n", pid);
 
-    while(1) {
-        struct sockaddr client_addr;
-        socklen_t client_addr_len = INET_ADDRSTRLEN;
+    if(listener_options.addresses_count == 0) {
+        char address[8];
+        snprintf(address, sizeof(address), "*:%i", port);
+        listener_option(&listener_options, "listen", address, NULL);
+    }
 
-        nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
-        if(nfds == -1) {
-            perror("epoll_wait() error");
-            close(epollfd);
-            close(sock);
-            free(buffer);
-            return 1;
+    cpu_set_t cpu_set;
+    if(cpu_affinity != CPU_AFFINITY_OFF && sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+        for(int i = 0; i != CPU_SETSIZE; ++i) {
+            if(CPU_ISSET(i, &cpu_set)) {
+                worker_cpus[worker_cpus_count++] = i;
+            }
         }
-        for(int i = 0; i != nfds; ++i) {
-            if(events[i].data.fd == sock) {
-                int client_socket = accept(sock, &client_addr, &client_addr_len);
-                if(client_socket == -1) {
-                    continue;
-                }
+    }
+    // Steering needs a fixed socket per worker, one worker per CPU
+    int group_size = 1;
+    if(cpu_affinity == CPU_AFFINITY_STEER) {
+        if(worker_cpus_count && workers > worker_cpus_count) {
+            printf("cpu_affinity steer: %i workers for %i CPUs\n", worker_cpus_count, worker_cpus_count);
+            workers = worker_cpus_count;
+        }
+        workers_max = 0;
+        group_size = workers;
+        listener_options.reuseport = group_size > 1;
+    }
 
-                int flags = fcntl(client_socket, F_GETFL, 0);
-                if(flags == -1) {
-                    perror("fcntl(..., F_GETFL, ...) error");
-                    continue;
-                }
-                flags |= O_NONBLOCK;
-                if(fcntl(client_socket, F_SETFL, flags) == -1) {
-                    perror("fcntl(..., F_SETFL, ...) error");
-                    continue;
+    // Reuse sockets inherited during binary upgrade, create the rest
+    int inherited[MASTER_MAX_LISTENERS];
+    int inherited_count = master_inherit_listeners(inherited, MASTER_MAX_LISTENERS);
+    int listeners[MASTER_MAX_LISTENERS];
+    int listeners_count = 0;
+    for(int i = 0; i != listener_options.addresses_count; ++i) {
+        struct LISTENER_ADDRESS *addr = &listener_options.addresses[i];
+        int tcp = strncmp(addr->address, LISTENER_UNIX_PREFIX, strlen(LISTENER_UNIX_PREFIX)) != 0;
+        int *group = &listeners[listeners_count];
+        int members = 0;
+        while(members != (tcp ? group_size : 1) && listeners_count != MASTER_MAX_LISTENERS) {
+            int sock = -1;
+            for(int j = 0; j != inherited_count; ++j) {
+                if(inherited[j] >= 0 && listener_match(inherited[j], addr)) {
+                    sock = inherited[j];
+                    inherited[j] = -1;
+                    break;
                 }
+            }
 
-                // ev.events = EPOLLIN | EPOLLET;
-                ev.events = EPOLLIN;
-                ev.data.fd = client_socket;
-                if (epoll_ctl(epollfd, EPOLL_CTL_ADD, client_socket, &ev) == -1) {
-                    perror("epoll_ctl(..., EPOLL_CTL_ADD, ...) error");
-                    continue;
+            if(sock >= 0) {
+                if(listener_setup(sock, &listener_options) != LISTENER_OK) {
+                    perror("listen() error");
+                    return 1;
                 }
             }
             else {
-                int recvd = recv(events[i].data.fd, buffer, RECV_BUFFER_SIZE, 0);
-                if(recvd > 0) {
-                    if(verbose) {
-                        struct in_addr ipAddr = ((struct sockaddr_in*)&client_addr)->sin_addr;
-                        inet_ntop(AF_INET, &ipAddr, str, INET_ADDRSTRLEN);
-
-                        struct timeval te;
-                        gettimeofday(&te, NULL);
-                        struct tm tm = *localtime(&te.tv_sec);
-
-                        printf("%i> [%04i-%02i-%02i %02i:%02i:%02i] %s ", pid, tm.tm_year + 1900, tm.tm_mon, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, str);
-                    }
-
-                    int ret = http_request(buffer, recvd, events[i].data.fd);
-                    if(ret < 0 && verbose) {
-                        printf("http_request() returned %i ", ret);
-                    }
-
-                    if(verbose) {
-                        putchar('\n');
-                    }
+                sock = listener_create(addr, &listener_options);
+                // Socket inherited from server without steering can't join reuseport group
+                if(sock < 0 && members) {
+                    printf("Can't steer connections on %s, restart is needed\n", addr->address);
+                    break;
                 }
-                else if(recvd == 0) {
-                    epoll_ctl(epollfd, EPOLL_CTL_DEL, events[i].data.fd, NULL);
-                    close(events[i].data.fd);
+                if(sock < 0) {
+                    printf("Can't listen on %s: ", addr->address);
+                    fflush(stdout);
+                    perror(sock == LISTENER_BIND_ERROR ? "bind() error" : sock == LISTENER_LISTEN_ERROR ? "listen() error" : "socket() error");
+                    return 1;
                 }
             }
+            listener_slots[listeners_count] = members;
+            listener_tls[listeners_count] = addr->tls;
+            listeners[listeners_count++] = sock;
+            ++members;
+        }
+        if(members == group_size && members > 1) {
+            listener_steer(group, members, worker_cpus);
+        }
+        else {
+            // Incomplete group is shared by all workers
+            for(int j = 0; j != members; ++j) {
+                listener_slots[listeners_count - members + j] = -1;
+            }
+        }
+    }
+    for(int j = 0; j != inherited_count; ++j) {
+        if(inherited[j] >= 0) {
+            close(inherited[j]);
         }
     }
+    // Accepted sockets inherit receive timestamps used to measure queueing delay
+    for(int i = 0; overload_target_ms && i != listeners_count; ++i) {
+        int one = 1;
+        setsockopt(listeners[i], SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one));
+    }
 
-    close(sock);
-    free(buffer);
-    close(epollfd);
+    for(int i = 0; i != sizeof(responses) / sizeof(responses_t); ++i) {
+        response_codes[i] = responses[i].code;
+    }
+    if(metrics_init(workers_max > workers ? workers_max : workers) != METRICS_OK) {
+        printf("Can't map metrics segment\n");
+        return 1;
+    }
+
+    struct MASTER master = {
+        .argv = argv,
+        .listeners = listeners,
+        .listeners_count = listeners_count,
+        .workers_min = workers,
+        .workers_max = workers_max,
+        .drain_timeout = drain_timeout,
+        .worker = worker_run
+    };
+    int ret = master_run(&master);
+    if(ret < 0) {
+        printf("Can't start workers (exit code: %i)\n", ret);
+        return 1;
+    }
 
     printf("%s has stoped\n", SERVER_NAME);
     return 0;
@@ -4,34 +4,56 @@
 
 #define RECV_BUFFER_SIZE (4096)
 #define SEND_BUFFER_SIZE (4096)
+#define RESPONSE_HEADER_SIZE (512)
 #define FILE_BUFFER_SIZE (1024 << 10)
 #define CGI_BUFFER_SIZE  (4096)
+// Free buffers of RECV_BUFFER_SIZE kept by a worker, connections hold one only while a request
+// is incomplete or a response is being sent
+#define BUFFER_POOL_SIZE (1024)
 
 #define DEFAULT_PORT  9000
 #define MAX_CLIENTS   SOMAXCONN
 #define WORKERS       4
 #define MAX_EVENTS    200
 
-#define HTTP11_SIGNATURE 0x312e312F50545448
+#define DEFAULT_DRAIN_TIMEOUT  30
+#define DRAIN_POLL_TIMEOUT     100
+// Seconds in Retry-After of 503 responses
+#define DEFAULT_RETRY_AFTER    1
+
+// Overloaded worker answers new requests with 503, or stops accepting connections
+#define SHED_RESPONSE  0
+#define SHED_ACCEPT    1
+
+// HTTP/2 streams open at once on a connection, further ones are refused
+#define H2_MAX_STREAMS      128
+// Read buffer of HTTP/2 connection holds a whole frame
+#define H2_BUFFER_SIZE      (H2_FRAME_SIZE + H2_FRAME_HEADER)
+// Limits of decoded header block and of header block collected from CONTINUATION frames
+#define H2_MAX_HEADERS      64
+#define H2_MAX_BLOCK        (64 << 10)
+// Settings carried by HTTP2-Settings header of upgrade request
+#define H2_UPGRADE_SETTINGS 64
+
+// Worker N runs on N-th allowed CPU, with steering connections are accepted by the worker
+// on CPU that received them
+#define CPU_AFFINITY_OFF    0
+#define CPU_AFFINITY_PIN    1
+#define CPU_AFFINITY_STEER  2
 
 #define RESPONSE_100  0
 #define RESPONSE_200  1
-#define RESPONSE_400  2
-#define RESPONSE_401  3
-#define RESPONSE_403  4
-#define RESPONSE_404  5
-#define RESPONSE_405  6
-#define RESPONSE_500  7
-#define RESPONSE_501  8
-#define RESPONSE_502  9
-
-#define REQUEST_EMPTY                 -1
-#define REQUEST_INVALID               -2
-#define REQUEST_INVALID_PATH          -3
-#define REQUEST_UNSUPPORTED           -4
-#define REQUEST_INVALID_HEADERS       -5
-#define REQUEST_METHOD_UNSUPPORTED    -6
-#define REQUEST_PROTOCOL_UNSUPPORTED  -7
+#define RESPONSE_304  2
+#define RESPONSE_400  3
+#define RESPONSE_401  4
+#define RESPONSE_403  5
+#define RESPONSE_404  6
+#define RESPONSE_405  7
+#define RESPONSE_429  8
+#define RESPONSE_500  9
+#define RESPONSE_501  10
+#define RESPONSE_502  11
+#define RESPONSE_503  12
 
 #define CONFIG_NOTFOUND      -1
 #define CONFIG_INCORRECT     -2
@@ -41,6 +63,55 @@
 #define CGI_FORK_ERROR  -2
 #define CGI_EXEC_ERROR  -3
 
+// Size of descriptor indexed connection table of a worker, and the smallest one it falls back to
+// when the configured size can't be allocated
+#define CONNECTIONS_DEFAULT_MAX  (1 << 16)
+#define CONNECTIONS_MIN          1024
+
+#define CGI_TIMEOUT_MS           20000
+// How long identical requests wait for a CGI process of another worker
+#define CGI_COALESCE_TIMEOUT_MS  1000
+// Shared cache is polled this often while another worker runs the request
+#define CGI_POLL_MS              10
+// Jobs waiting for a free slot when concurrency is limited, and how long they may wait
+#define CGI_DEFAULT_QUEUE        32
+#define CGI_QUEUE_TIMEOUT_MS     5000
+
+#define CGI_IDLE     0
+#define CGI_QUEUED   1
+#define CGI_WAITING  2
+#define CGI_RUNNING  3
+
+#define CGI_ORDER_FIFO      0
+#define CGI_ORDER_PRIORITY  1
+
+// Head of upstream response must fit into its buffer, body is read in parts. Body of known
+// length goes from server to plain or kTLS client through a pipe with splice()
+#define PROXY_HEADER_SIZE  8192
+#define PROXY_READ_SIZE    16384
+#define PROXY_PIPE_SIZE    (64 << 10)
+// Emptied pipes kept for next responses
+#define PROXY_MAX_PIPES    16
+#define PROXY_MAX_ROUTES   64
+// HTTP/2 streams get the whole response at once, it is collected up to this size
+#define PROXY_MAX_BUFFERED (16 << 20)
+
+#define PROXY_QUEUED      0
+#define PROXY_CONNECTING  1
+#define PROXY_SENDING     2
+#define PROXY_HEADERS     3
+#define PROXY_BODY        4
+
+// Response body has no length, it ends with chunked encoding or with connection
+#define PROXY_BODY_CHUNKED  -1
+#define PROXY_BODY_CLOSE    -2
+
+// Attempt failed on our side, on idle connection closed by server or by server itself. Only
+// the last one counts towards ejection, the last two let request go to a new connection
+#define PROXY_ERROR_LOCAL   0
+#define PROXY_ERROR_STALE   1
+#define PROXY_ERROR_SERVER  2
+
 #define PREDEF_ENV           17
 #define FCGI_ROLE            "FCGI_ROLE=RESPONDER"
 #define QUERY_STRING         "QUERY_STRING=%s"
@@ -53,6 +124,7 @@
 #define GATEWAY_INTERFACE    "GATEWAY_INTERFACE=CGI/1.1"
 #define SERVER_SOFTWARE      "SERVER_SOFTWARE="SERVER_NAME
 #define REQUEST_SCHEME       "REQUEST_SCHEME=http"
+#define REQUEST_SCHEME_HTTPS "REQUEST_SCHEME=https"
 #define SERVER_PROTOCOL      "SERVER_PROTOCOL=HTTP/1.1"
 #define DOCUMENT_URI         "DOCUMENT_URI=%s"
 #define SCRIPT_FILENAME      "SCRIPT_FILENAME=%s%s"
@@ -63,37 +135,6 @@
 #define SERVER_PORT          "SERVER_PORT=%i"
 #define SERVER_HOST          "SERVER_NAME=%s"
 
-typedef struct {
-    char name[10];
-    uint8_t len;
-    uint8_t key;
-} http_method_t;
-
-enum METHODS {
-    GET,
-    POST,
-    HEAD,
-    OPTIONS,
-    PUT,
-    DELETE
-};
-
-http_method_t http_methods[] = {
-    {"GET ", 4, GET},
-    {"POST ", 5, POST},
-    {"HEAD ", 5, HEAD},
-    {"OPTIONS ", 8, OPTIONS},
-    {"PUT ", 4, PUT},
-    {"DELETE ", 7, DELETE}
-};
-
-typedef struct {
-    uint8_t method;
-    char *path;
-    char *query;
-    char *version;
-} request_t;
-
 typedef struct {
     char *msg;
     int msg_len;
@@ -103,17 +144,224 @@ typedef struct {
 responses_t responses[] = {
     {"100 Continue", 12, 100},
     {"200 OK", 6, 200},
+    {"304 Not Modified", 16, 304},
     {"400 Bad Request", 15, 400},
     {"401 Unauthorized", 16, 401},
     {"403 Forbidden", 13, 403},
     {"404 Not Found", 13, 404},
     {"405 Method Not Allowed", 22, 405},
+    {"429 Too Many Requests", 21, 429},
     {"500 Internal Server Error", 25, 500},
     {"501 Not Implemented", 19, 501},
-    {"502 Bad Gateway", 15, 502}
+    {"502 Bad Gateway", 15, 502},
+    {"503 Service Unavailable", 23, 503}
 };
 
-struct CONFIG_PATH {
-    char *content_type;
-    char *action;
+// Request phases, each one ends at its timestamp in phases_t
+#define PHASE_RECV      0
+#define PHASE_QUEUE     1
+#define PHASE_PARSE     2
+#define PHASE_ROUTE     3
+#define PHASE_HANDLE    4
+#define PHASE_RESPONSE  5
+#define PHASES          6
+
+typedef struct {
+    // Start of recv() that completed the request
+    uint64_t started;
+    // CLOCK_MONOTONIC microseconds, 0 if phase was not reached
+    uint64_t at[PHASES];
+    int status;
+    char method[8];
+    const char *path;
+} phases_t;
+
+#define CONN_FREE      0
+#define CONN_LISTENER  1
+#define CONN_CLIENT    2
+#define CONN_CGI       3
+#define CONN_UPSTREAM  4
+
+#define CONN_WAIT_OUT      0x01
+#define CONN_CLOSING       0x02
+// Request waits for CGI output, following pipelined requests are not read until it is sent
+#define CONN_WAIT_CGI      0x04
+#define CONN_CLOSE_AFTER   0x08
+// Connection is counted in per-address limits
+#define CONN_LIMITED       0x10
+// TLS connection or listener, handshake is not finished yet, responses are encrypted by OpenSSL
+#define CONN_TLS           0x20
+#define CONN_HANDSHAKE     0x40
+#define CONN_TLS_WRITE     0x80
+// Connection got a request parsed, without it an idle connection is just accepted and is not
+// closed on drain before its first request
+#define CONN_SERVED        0x100
+
+typedef struct {
+    uint8_t type;
+    uint16_t flags;
+    // Peer address, large enough for both IPv4 and IPv6. Unix socket peer has only the family set
+    struct sockaddr_in6 addr;
+    // Incomplete request left from previous read
+    char *in;
+    unsigned int in_len;
+    // Responses batched during read cycle
+    char *out;
+    unsigned int out_len;
+    unsigned int out_sent;
+    unsigned int out_size;
+    // Request trace id, 0 if connection is not sampled
+    uint32_t trace_id;
+    // OpenSSL session, NULL for plain connections and once kTLS took both directions
+    SSL *tls;
+    // HTTP/2 session, NULL for HTTP/1.1
+    struct H2_SESSION *h2;
+} connection_t;
+
+// HTTP/2 stream receiving request body, waiting for CGI output or for flow control windows to
+// send its body
+struct H2_STREAM {
+    uint32_t id;
+    int32_t window;
+    // Response is not there yet
+    int pending;
+    char *body;
+    unsigned int body_len;
+    unsigned int body_sent;
+    // HTTP/1.1 request head followed by body received so far, NULL once END_STREAM arrived.
+    // Buffer of RECV_BUFFER_SIZE is borrowed from the worker pool
+    char *request;
+    unsigned int request_len;
+    unsigned int head_len;
+    // Content-Length of request, -1 if it has none
+    int64_t declared;
+    struct H2_STREAM *next;
+};
+
+struct H2_SESSION {
+    struct HPACK decoder;
+    struct HPACK encoder;
+    // Bytes of client connection preface still expected
+    int preface;
+    uint32_t last_stream;
+    // Connection send window, settings of peer
+    int32_t window;
+    int32_t initial_window;
+    uint32_t max_frame;
+    // Received DATA not yet returned with WINDOW_UPDATE
+    uint32_t consumed;
+    unsigned int streams_count;
+    struct H2_STREAM *streams;
+    // Header block collected from HEADERS and CONTINUATION frames
+    uint32_t block_stream;
+    uint8_t block_flags;
+    uint8_t *block;
+    unsigned int block_len;
+    // GOAWAY was sent or received, connection is closed when streams are done
+    int goaway;
+};
+
+// Response rendered before workers start, only Connection header is added per request
+struct PRELOADED {
+    char *headers;
+    unsigned int headers_len;
+    char *body;
+    unsigned int body_len;
 };
+
+// Request waiting for CGI output or upstream response, its phases and log record are completed with the response
+typedef struct cgi_waiter_s {
+    int fd;
+    // HTTP/2 stream of request, 0 for HTTP/1.1
+    uint32_t stream;
+    int has_record;
+    phases_t phases;
+    char path[ACCESS_LOG_PATH_SIZE];
+    struct ACCESS_LOG_RECORD record;
+    struct cgi_waiter_s *next;
+} cgi_waiter_t;
+
+// Concurrency limits of a worker or of one route, counters are per worker
+struct CGI_LIMITS {
+    // 0 is unlimited
+    unsigned int max_running;
+    unsigned int max_queued;
+    // Higher starts first with CGI_ORDER_PRIORITY
+    int priority;
+    unsigned int running;
+    unsigned int queued;
+};
+
+// CGI process shared by identical requests of a worker
+typedef struct cgi_job_s {
+    int state;
+    struct CGI_LIMITS *limits;
+    pid_t pid;
+    // Read end of stdout pipe, -1 until started
+    int fd;
+    char *command;
+    // Environment of the first request, freed once the process is started
+    char **env;
+    char *content_type;
+    unsigned int ttl;
+    // Cache key, empty if the request is not cacheable and can't be shared
+    char key[CACHE_KEY_SIZE];
+    int key_len;
+    // Fill of the key is claimed in shared cache
+    int claimed;
+    // CLOCK_MONOTONIC microseconds
+    uint64_t started;
+    uint64_t deadline;
+    char out[CGI_BUFFER_SIZE];
+    int out_len;
+    cgi_waiter_t *waiters;
+    struct cgi_job_s *next;
+} cgi_job_t;
+
+// Request passed to upstream server, response is relayed to the client as it arrives
+typedef struct proxy_s {
+    int state;
+    // Client request, its fd is -1 once the client is gone
+    cgi_waiter_t waiter;
+    struct UPSTREAM *upstream;
+    // Server of current attempt and server that failed the first one
+    struct UPSTREAM_SERVER *server;
+    struct UPSTREAM_SERVER *failed;
+    // Connection to server, -1 until started
+    int fd;
+    // Connection was idle in pool, server may have closed it meanwhile
+    int reused;
+    // Connection is watched for EPOLLOUT
+    int writing;
+    // Idle connection turned out closed, next attempt connects
+    int fresh;
+    int retried;
+    // Request may be sent again after failure, as GET
+    int idempotent;
+    char *request;
+    unsigned int request_len;
+    unsigned int request_sent;
+    unsigned int head_len;
+    int status;
+    // Body bytes left or PROXY_BODY_CHUNKED or PROXY_BODY_CLOSE
+    int64_t body_left;
+    struct UPSTREAM_CHUNKED chunked;
+    // Connection may be reused after response
+    int keepalive;
+    // Reads from server wait for client output
+    int paused;
+    // Pipe for splice(), -1 if body goes through the connection output
+    int pipe[2];
+    unsigned int pipe_len;
+    // Response of HTTP/2 stream is collected whole, h2_respond() frames it
+    char *body;
+    unsigned int body_len;
+    unsigned int body_size;
+    // Body bytes relayed to client
+    uint64_t bytes;
+    // CLOCK_MONOTONIC microseconds
+    uint64_t deadline;
+    struct proxy_s *next;
+    // Response head collected until the empty line
+    char head[PROXY_HEADER_SIZE];
+} proxy_t;
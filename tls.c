@@ -0,0 +1,140 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <errno.h>
+#include <string.h>
+#include <openssl/err.h>
+#include "tls.h"
+
+static const unsigned char tls_alpn_h2[] = "\x02h2\x08http/1.1";
+static const unsigned char tls_alpn_http11[] = "\x08http/1.1";
+
+// Pick the first of our protocols offered by client, handshake goes on without ALPN otherwise
+static int tls_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg) {
+    struct TLS *tls = arg;
+    const unsigned char *protos = tls->http2 ? tls_alpn_h2 : tls_alpn_http11;
+    unsigned int protos_len = tls->http2 ? sizeof(tls_alpn_h2) - 1 : sizeof(tls_alpn_http11) - 1;
+    unsigned char *selected;
+    if(SSL_select_next_proto(&selected, outlen, protos, protos_len, in, inlen) != OPENSSL_NPN_NEGOTIATED) {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+    *out = selected;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+int tls_init(struct TLS *tls, const char *cert, const char *key) {
+    memset(tls, 0, sizeof(struct TLS));
+    tls->ctx = SSL_CTX_new(TLS_server_method());
+    if(tls->ctx == NULL) {
+        return TLS_CTX_ERROR;
+    }
+    SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION);
+    // Clients closing without close_notify read as orderly close, as plain connections do
+    SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    // Output batch is sent in parts and may be reallocated between retries
+    SSL_CTX_set_mode(tls->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    // Session cache of a worker is useless to others, resumption relies on stateless tickets
+    SSL_CTX_set_session_cache_mode(tls->ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_num_tickets(tls->ctx, 1);
+    SSL_CTX_set_alpn_select_cb(tls->ctx, tls_alpn, tls);
+
+    if(SSL_CTX_use_certificate_chain_file(tls->ctx, cert) != 1) {
+        SSL_CTX_free(tls->ctx);
+        tls->ctx = NULL;
+        return TLS_CERT_ERROR;
+    }
+    if(SSL_CTX_use_PrivateKey_file(tls->ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(tls->ctx) != 1) {
+        SSL_CTX_free(tls->ctx);
+        tls->ctx = NULL;
+        return TLS_KEY_ERROR;
+    }
+    return TLS_OK;
+}
+
+SSL *tls_new(struct TLS *tls, int fd) {
+    SSL *ssl = SSL_new(tls->ctx);
+    if(ssl == NULL) {
+        return NULL;
+    }
+    if(SSL_set_fd(ssl, fd) != 1) {
+        SSL_free(ssl);
+        return NULL;
+    }
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+int tls_handshake(SSL *ssl) {
+    ERR_clear_error();
+    int ret = SSL_do_handshake(ssl);
+    if(ret == 1) {
+        return TLS_OK;
+    }
+    switch(SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            return TLS_WANT_READ;
+        case SSL_ERROR_WANT_WRITE:
+            return TLS_WANT_WRITE;
+    }
+    return TLS_ERROR;
+}
+
+int tls_offload(SSL *ssl) {
+    int offload = 0;
+    if(BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+        offload |= TLS_KTLS_SEND;
+    }
+    if(BIO_get_ktls_recv(SSL_get_rbio(ssl)) && !SSL_has_pending(ssl)) {
+        offload |= TLS_KTLS_RECV;
+    }
+    return offload;
+}
+
+// Map result of SSL_read() or SSL_write() to socket call conventions
+static int tls_result(SSL *ssl, int ret) {
+    switch(SSL_get_error(ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if(errno == EAGAIN || errno == 0) {
+                errno = ECONNRESET;
+            }
+            return -1;
+    }
+    errno = EPROTO;
+    return -1;
+}
+
+int tls_read(SSL *ssl, char *buffer, int size) {
+    ERR_clear_error();
+    int ret = SSL_read(ssl, buffer, size);
+    return ret > 0 ? ret : tls_result(ssl, ret);
+}
+
+int tls_write(SSL *ssl, const char *data, int len) {
+    ERR_clear_error();
+    int ret = SSL_write(ssl, data, len);
+    return ret > 0 ? ret : tls_result(ssl, ret);
+}
+
+int tls_pending(SSL *ssl) {
+    return SSL_pending(ssl) > 0;
+}
+
+int tls_h2(SSL *ssl) {
+    const unsigned char *proto;
+    unsigned int len;
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+int tls_resumed(SSL *ssl) {
+    return SSL_session_reused(ssl);
+}
+
+void tls_free(SSL *ssl) {
+    SSL_free(ssl);
+}
@@ -0,0 +1,67 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _TLS_H
+#define _TLS_H
+
+#include <openssl/ssl.h>
+
+// TLS termination with OpenSSL. Handshakes run in user space, then the record layer is handed
+// to the kernel (kTLS) where it is supported, so the connection is used as a plain socket.
+// Directions the kernel can't take stay with OpenSSL
+#define TLS_OK            0
+#define TLS_WANT_READ     1
+#define TLS_WANT_WRITE    2
+#define TLS_ERROR        -1
+#define TLS_CTX_ERROR    -2
+#define TLS_CERT_ERROR   -3
+#define TLS_KEY_ERROR    -4
+
+// Directions offloaded to the kernel
+#define TLS_KTLS_SEND  0x01
+#define TLS_KTLS_RECV  0x02
+
+struct TLS {
+    SSL_CTX *ctx;
+    // Offer h2 before http/1.1 in ALPN
+    int http2;
+};
+
+// Create context with certificate chain and private key files. Session tickets are encrypted
+// with keys of the context, so workers forked after it resume sessions of each other
+// Return error code
+int tls_init(struct TLS *tls, const char *cert, const char *key);
+
+// Start server side of connection on socket 'fd'
+// Return new session or NULL
+SSL *tls_new(struct TLS *tls, int fd);
+
+// Continue handshake on non-blocking socket
+// Return TLS_OK when it is done, TLS_WANT_READ or TLS_WANT_WRITE to wait for socket, or TLS_ERROR
+int tls_handshake(SSL *ssl);
+
+// Check directions taken by the kernel after handshake, session may be freed when it's both
+// and nothing is left buffered in OpenSSL
+// Return TLS_KTLS_SEND and TLS_KTLS_RECV bits
+int tls_offload(SSL *ssl);
+
+// Read decrypted data like recv(), errno is EAGAIN when socket has no complete record
+// Return number of bytes, 0 on close_notify or -1
+int tls_read(SSL *ssl, char *buffer, int size);
+
+// Write data like send(), errno is EAGAIN when socket buffer is full
+// Return number of bytes or -1
+int tls_write(SSL *ssl, const char *data, int len);
+
+// Return 1 if decrypted data is buffered in OpenSSL, epoll doesn't report it
+int tls_pending(SSL *ssl);
+
+// Return 1 if client chose h2 in ALPN
+int tls_h2(SSL *ssl);
+
+// Return 1 if session was resumed from ticket
+int tls_resumed(SSL *ssl);
+
+// Free session, socket is not closed
+void tls_free(SSL *ssl);
+
+#endif
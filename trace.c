@@ -0,0 +1,106 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "trace.h"
+
+static uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int trace_open(const char *path) {
+    int fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if(fd < 0) {
+        return TRACE_FILE_ERROR;
+    }
+    if(lseek(fd, 0, SEEK_END) == 0 && write(fd, TRACE_MAGIC, TRACE_MAGIC_SIZE) != TRACE_MAGIC_SIZE) {
+        close(fd);
+        return TRACE_FILE_ERROR;
+    }
+    return fd;
+}
+
+int trace_start(struct TRACE *trace, int fd, unsigned int sample) {
+    trace->buffer = malloc(TRACE_BUFFER_SIZE);
+    if(trace->buffer == NULL) {
+        return TRACE_MALLOC_ERROR;
+    }
+    trace->fd = fd;
+    trace->sample = sample ? sample : 1;
+    trace->connections = 0;
+    trace->length = 0;
+    trace->flushed_ns = trace_now();
+    trace->dropped = 0;
+    trace->pid = getpid();
+    return TRACE_OK;
+}
+
+uint32_t trace_connection(struct TRACE *trace, uint16_t family) {
+    if(trace->buffer == NULL || ++trace->connections % trace->sample != 0) {
+        return 0;
+    }
+    // Id 0 means not traced
+    if(trace->connections == 0) {
+        ++trace->connections;
+    }
+    struct TRACE_RECORD rec = {.time_ns = trace_now(), .pid = trace->pid, .conn = trace->connections, .type = TRACE_OPEN, .family = family};
+    if(trace->length + sizeof(rec) > TRACE_BUFFER_SIZE) {
+        trace_flush(trace, 1);
+    }
+    memcpy(trace->buffer + trace->length, &rec, sizeof(rec));
+    trace->length += sizeof(rec);
+    return trace->connections;
+}
+
+void trace_write(struct TRACE *trace, uint32_t conn, uint16_t type, const void *data, unsigned int length) {
+    if(trace->buffer == NULL) {
+        return;
+    }
+    if(sizeof(struct TRACE_RECORD) + length > TRACE_BUFFER_SIZE) {
+        ++trace->dropped;
+        return;
+    }
+    if(trace->length + sizeof(struct TRACE_RECORD) + length > TRACE_BUFFER_SIZE) {
+        trace_flush(trace, 1);
+    }
+
+    struct TRACE_RECORD rec = {.time_ns = trace_now(), .pid = trace->pid, .conn = conn, .length = length, .type = type};
+    memcpy(trace->buffer + trace->length, &rec, sizeof(rec));
+    if(length) {
+        memcpy(trace->buffer + trace->length + sizeof(rec), data, length);
+    }
+    trace->length += sizeof(rec) + length;
+}
+
+void trace_flush(struct TRACE *trace, int force) {
+    if(trace->buffer == NULL || trace->length == 0) {
+        return;
+    }
+    uint64_t now = trace_now();
+    if(force == 0 && now - trace->flushed_ns < TRACE_FLUSH_MS * 1000000ull) {
+        return;
+    }
+
+    // One write per batch: with O_APPEND batches of different workers don't interleave
+    int wr;
+    do {
+        wr = write(trace->fd, trace->buffer, trace->length);
+    }while(wr < 0 && errno == EINTR);
+    if(wr != trace->length) {
+        ++trace->dropped;
+    }
+    trace->length = 0;
+    trace->flushed_ns = now;
+}
+
+void trace_stop(struct TRACE *trace) {
+    trace_flush(trace, 1);
+    free(trace->buffer);
+    trace->buffer = NULL;
+}
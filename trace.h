@@ -0,0 +1,69 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// File starts with magic, followed by records. Records of every worker are appended in
+// whole batches, so they are ordered per worker but interleaved between workers
+#define TRACE_MAGIC        "TNYTRC01"
+#define TRACE_MAGIC_SIZE   8
+#define TRACE_BUFFER_SIZE  (256 << 10)
+#define TRACE_FLUSH_MS     1000
+
+#define TRACE_OPEN   1
+#define TRACE_DATA   2
+#define TRACE_CLOSE  3
+
+#define TRACE_FILE_ERROR    -1
+#define TRACE_MALLOC_ERROR  -2
+#define TRACE_OK             0
+
+// Record header, 'length' bytes of received data follow TRACE_DATA records
+struct TRACE_RECORD {
+    // CLOCK_MONOTONIC, comparable between workers
+    uint64_t time_ns;
+    uint32_t pid;
+    uint32_t conn;
+    uint32_t length;
+    uint16_t type;
+    // Address family of TRACE_OPEN
+    uint16_t family;
+};
+
+// Per worker capture buffer, written from the event loop
+struct TRACE {
+    int fd;
+    unsigned int sample;
+    uint32_t connections;
+    char *buffer;
+    unsigned int length;
+    uint64_t flushed_ns;
+    uint64_t dropped;
+    pid_t pid;
+};
+
+// Open trace file for appending, write magic into a new file
+// Return file descriptor or error code
+int trace_open(const char *path);
+
+// Allocate buffer of worker writing to 'fd', trace every 'sample' connection
+// Return error code
+int trace_start(struct TRACE *trace, int fd, unsigned int sample);
+
+// Count new connection and write its TRACE_OPEN record if it is sampled
+// Return connection id, 0 if connection is not traced
+uint32_t trace_connection(struct TRACE *trace, uint16_t family);
+
+// Append record of traced connection 'conn', flushes buffer when it is full
+void trace_write(struct TRACE *trace, uint32_t conn, uint16_t type, const void *data, unsigned int length);
+
+// Write buffered records if they are older than TRACE_FLUSH_MS or 'force' is set
+void trace_flush(struct TRACE *trace, int force);
+
+// Flush records and free buffer
+void trace_stop(struct TRACE *trace);
+
+#endif
@@ -0,0 +1,221 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "listener.h"
+#include "upstream.h"
+
+// States of chunked body parser
+#define CHUNK_SIZE         0
+#define CHUNK_EXTENSION    1
+#define CHUNK_DATA         2
+#define CHUNK_DATA_CR      3
+#define CHUNK_DATA_LF      4
+#define CHUNK_TRAILER      5
+#define CHUNK_TRAILER_LINE 6
+#define CHUNK_LAST_LF      7
+
+int upstream_add(struct UPSTREAM *upstream, const char *address) {
+    if(upstream->count == UPSTREAM_MAX_SERVERS) {
+        return UPSTREAM_FULL_ERROR;
+    }
+    struct UPSTREAM_SERVER *server = &upstream->servers[upstream->count];
+    memset(server, 0, sizeof(struct UPSTREAM_SERVER));
+    if(listener_resolve(address, &server->addr, &server->addr_len) != LISTENER_OK) {
+        return UPSTREAM_ADDRESS_ERROR;
+    }
+    ++upstream->count;
+    return UPSTREAM_OK;
+}
+
+struct UPSTREAM_SERVER *upstream_pick(struct UPSTREAM *upstream, const struct UPSTREAM_SERVER *skip, uint64_t now) {
+    struct UPSTREAM_SERVER *pick = NULL;
+    // Both start from round robin position, so least connections spreads ties too
+    for(unsigned int i = 0; i != upstream->count; ++i) {
+        struct UPSTREAM_SERVER *server = &upstream->servers[(upstream->next + i) % upstream->count];
+        if(server == skip || server->ejected > now) {
+            continue;
+        }
+        if(pick == NULL || (upstream->balance == UPSTREAM_LEAST_CONN && server->active < pick->active)) {
+            pick = server;
+        }
+        if(upstream->balance == UPSTREAM_ROUND_ROBIN) {
+            break;
+        }
+    }
+    if(upstream->count) {
+        upstream->next = (upstream->next + 1) % upstream->count;
+    }
+    return pick;
+}
+
+int upstream_fail(struct UPSTREAM_SERVER *server, const struct UPSTREAM_OPTIONS *opts, uint64_t now) {
+    if(opts->max_fails == 0) {
+        return 0;
+    }
+    // Probe after ejection failed
+    if(server->ejected) {
+        server->ejected = now + opts->fail_timeout_ms;
+        return 1;
+    }
+    if(server->fails == 0 || now - server->failed >= opts->fail_timeout_ms) {
+        server->fails = 0;
+        server->failed = now;
+    }
+    if(++server->fails >= opts->max_fails) {
+        server->ejected = now + opts->fail_timeout_ms;
+        server->fails = 0;
+        return 1;
+    }
+    return 0;
+}
+
+void upstream_success(struct UPSTREAM_SERVER *server) {
+    server->fails = 0;
+    server->ejected = 0;
+}
+
+int upstream_connect(struct UPSTREAM_SERVER *server) {
+    int fd = socket(server->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        return UPSTREAM_SOCKET_ERROR;
+    }
+    if(server->addr.ss_family != AF_UNIX) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if(connect(fd, (struct sockaddr *)&server->addr, server->addr_len) != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return UPSTREAM_SOCKET_ERROR;
+    }
+    return fd;
+}
+
+int upstream_idle_get(struct UPSTREAM_SERVER *server) {
+    // The most recently used one is the least likely to be closed by server
+    return server->idle_count ? server->idle[--server->idle_count] : -1;
+}
+
+int upstream_idle_put(struct UPSTREAM_SERVER *server, const struct UPSTREAM_OPTIONS *opts, int fd) {
+    unsigned int limit = opts->keepalive < UPSTREAM_MAX_IDLE ? opts->keepalive : UPSTREAM_MAX_IDLE;
+    if(limit == 0) {
+        return fd;
+    }
+    int oldest = -1;
+    if(server->idle_count == limit) {
+        oldest = server->idle[0];
+        memmove(server->idle, server->idle + 1, (limit - 1) * sizeof(int));
+        --server->idle_count;
+    }
+    server->idle[server->idle_count++] = fd;
+    return oldest;
+}
+
+int upstream_idle_remove(struct UPSTREAM *upstream, int fd) {
+    for(unsigned int i = 0; i != upstream->count; ++i) {
+        struct UPSTREAM_SERVER *server = &upstream->servers[i];
+        for(unsigned int j = 0; j != server->idle_count; ++j) {
+            if(server->idle[j] == fd) {
+                memmove(server->idle + j, server->idle + j + 1, (server->idle_count - j - 1) * sizeof(int));
+                --server->idle_count;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int upstream_hex(char c) {
+    if(c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+int upstream_chunked(struct UPSTREAM_CHUNKED *chunked, char *data, unsigned int len, unsigned int *decoded) {
+    unsigned int i = 0;
+    unsigned int out = 0;
+    while(i != len && chunked->state != UPSTREAM_CHUNKED_DONE) {
+        char c = data[i];
+        switch(chunked->state) {
+            case CHUNK_SIZE:
+                if(upstream_hex(c) >= 0) {
+                    if(chunked->left >> 59) {
+                        return UPSTREAM_CHUNKED_ERROR;
+                    }
+                    chunked->left = chunked->left << 4 | upstream_hex(c);
+                }
+                else if(c == ';' || c == ' ' || c == '\t' || c == '\r') {
+                    chunked->state = CHUNK_EXTENSION;
+                }
+                else if(c == '\n') {
+                    chunked->state = chunked->left ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                else {
+                    return UPSTREAM_CHUNKED_ERROR;
+                }
+                ++i;
+                break;
+            case CHUNK_EXTENSION:
+                if(c == '\n') {
+                    chunked->state = chunked->left ? CHUNK_DATA : CHUNK_TRAILER;
+                }
+                ++i;
+                break;
+            case CHUNK_DATA: {
+                unsigned int n = len - i < chunked->left ? len - i : chunked->left;
+                if(decoded) {
+                    memmove(data + out, data + i, n);
+                    out += n;
+                }
+                i += n;
+                chunked->left -= n;
+                if(chunked->left == 0) {
+                    chunked->state = CHUNK_DATA_CR;
+                }
+                break;
+            }
+            case CHUNK_DATA_CR:
+                if(c != '\r' && c != '\n') {
+                    return UPSTREAM_CHUNKED_ERROR;
+                }
+                chunked->state = c == '\r' ? CHUNK_DATA_LF : CHUNK_SIZE;
+                ++i;
+                break;
+            case CHUNK_DATA_LF:
+                if(c != '\n') {
+                    return UPSTREAM_CHUNKED_ERROR;
+                }
+                chunked->state = CHUNK_SIZE;
+                ++i;
+                break;
+            case CHUNK_TRAILER:
+                // Empty line ends trailer fields
+                chunked->state = c == '\r' ? CHUNK_LAST_LF : c == '\n' ? UPSTREAM_CHUNKED_DONE : CHUNK_TRAILER_LINE;
+                ++i;
+                break;
+            case CHUNK_TRAILER_LINE:
+                if(c == '\n') {
+                    chunked->state = CHUNK_TRAILER;
+                }
+                ++i;
+                break;
+            case CHUNK_LAST_LF:
+                if(c != '\n') {
+                    return UPSTREAM_CHUNKED_ERROR;
+                }
+                chunked->state = UPSTREAM_CHUNKED_DONE;
+                ++i;
+                break;
+        }
+    }
+    if(decoded) {
+        *decoded = out;
+    }
+    return i;
+}
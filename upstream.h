@@ -0,0 +1,108 @@
+// Copyright (C) 2024 Aleksei Rogov <alekzzzr@gmail.com>. All rights reserved.
+
+#ifndef _UPSTREAM_H
+#define _UPSTREAM_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+// Upstream servers of a proxy route. Every worker balances its own requests, keeps its own
+// idle keep-alive connections and ejects servers that failed max_fails times within
+// fail_timeout until it passes, then the next request probes the server again
+#define UPSTREAM_MAX_SERVERS  32
+#define UPSTREAM_MAX_IDLE     64
+
+#define UPSTREAM_ROUND_ROBIN  0
+#define UPSTREAM_LEAST_CONN   1
+
+#define UPSTREAM_DEFAULT_KEEPALIVE        16
+#define UPSTREAM_DEFAULT_MAX_FAILS        3
+#define UPSTREAM_DEFAULT_FAIL_TIMEOUT_MS  10000
+#define UPSTREAM_DEFAULT_CONNECT_MS       1000
+#define UPSTREAM_DEFAULT_TIMEOUT_MS       30000
+
+#define UPSTREAM_CHUNKED_DONE  -1
+
+#define UPSTREAM_ADDRESS_ERROR  -1
+#define UPSTREAM_FULL_ERROR     -2
+#define UPSTREAM_SOCKET_ERROR   -3
+#define UPSTREAM_CHUNKED_ERROR  -4
+#define UPSTREAM_OK              0
+
+struct UPSTREAM_SERVER {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    // Requests of the worker in flight
+    unsigned int active;
+    // Failures since 'failed', CLOCK_MONOTONIC milliseconds
+    unsigned int fails;
+    uint64_t failed;
+    // Server is skipped until this time, 0 once it answered again
+    uint64_t ejected;
+    // Idle keep-alive connections, the most recently used last
+    int idle[UPSTREAM_MAX_IDLE];
+    unsigned int idle_count;
+};
+
+struct UPSTREAM {
+    struct UPSTREAM_SERVER servers[UPSTREAM_MAX_SERVERS];
+    unsigned int count;
+    int balance;
+    // Round robin position
+    unsigned int next;
+};
+
+// Limits shared by all proxy routes
+struct UPSTREAM_OPTIONS {
+    // Idle connections kept per server, 0 closes every connection after response
+    unsigned int keepalive;
+    unsigned int max_fails;
+    unsigned int fail_timeout_ms;
+    unsigned int connect_ms;
+    unsigned int timeout_ms;
+};
+
+// Chunked body followed while it's passed through
+struct UPSTREAM_CHUNKED {
+    int state;
+    uint64_t left;
+};
+
+// Add server with address in listener format: "ipv4:port", "[ipv6]:port" or "unix:/path"
+// Return error code
+int upstream_add(struct UPSTREAM *upstream, const char *address);
+
+// Choose server for a request, 'skip' is the one that just failed it. 'now' is CLOCK_MONOTONIC
+// milliseconds
+// Return server or NULL if all of them are ejected
+struct UPSTREAM_SERVER *upstream_pick(struct UPSTREAM *upstream, const struct UPSTREAM_SERVER *skip, uint64_t now);
+
+// Count failed request, server is ejected when failures reach the limit or its probe failed
+// Return 1 if server was ejected
+int upstream_fail(struct UPSTREAM_SERVER *server, const struct UPSTREAM_OPTIONS *opts, uint64_t now);
+
+// Forget failures after successful response
+void upstream_success(struct UPSTREAM_SERVER *server);
+
+// Start non-blocking connect to server
+// Return socket or UPSTREAM_SOCKET_ERROR
+int upstream_connect(struct UPSTREAM_SERVER *server);
+
+// Take idle connection of server
+// Return socket or -1 if there is none
+int upstream_idle_get(struct UPSTREAM_SERVER *server);
+
+// Keep connection for the next request, the oldest one is returned when the pool is full
+// Return socket to close or -1
+int upstream_idle_put(struct UPSTREAM_SERVER *server, const struct UPSTREAM_OPTIONS *opts, int fd);
+
+// Forget idle connection closed by server
+// Return 1 if it was idle connection of one of the servers
+int upstream_idle_remove(struct UPSTREAM *upstream, int fd);
+
+// Follow chunked body in 'data', state is UPSTREAM_CHUNKED_DONE after its end. With 'decoded'
+// chunk data is moved to the start of 'data' and its length is stored there
+// Return number of bytes of 'data' that belong to the body or UPSTREAM_CHUNKED_ERROR
+int upstream_chunked(struct UPSTREAM_CHUNKED *chunked, char *data, unsigned int len, unsigned int *decoded);
+
+#endif